@@ -1,5 +1,7 @@
 #include "Allocator.hh"
 
+#include <string.h>
+
 using namespace std;
 
 namespace sharedstructures {
@@ -11,6 +13,39 @@ shared_ptr<Pool> Allocator::get_pool() const {
   return this->pool;
 }
 
+uint64_t Allocator::relocate(uint64_t offset, uint64_t limit) {
+  return offset;
+}
+
+size_t Allocator::truncate() {
+  return this->pool->size();
+}
+
+void Allocator::clone_to(const string& new_name) const {
+  {
+    auto g = this->lock(true);
+    this->pool->clone_to(new_name);
+  }
+
+  // the clone was made while we held the lock, so it's locked in the clone too
+  Pool clone(new_name, 0, this->pool->is_file());
+  memset(clone.at<uint8_t>(this->lock_offset()), 0,
+      sizeof(ProcessReadWriteLock));
+}
+
+shared_ptr<Pool> Allocator::private_view() const {
+  shared_ptr<Pool> view;
+  {
+    auto g = this->lock(false);
+    view = this->pool->private_view();
+  }
+
+  // the view was made while we held the lock, so it's locked in the view too
+  memset(view->at<uint8_t>(this->lock_offset()), 0,
+      sizeof(ProcessReadWriteLock));
+  return view;
+}
+
 void Allocator::repair() { }
 
 } // namespace sharedstructures
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <string>
 
 #include "Pool.hh"
 #include "ProcessLock.hh"
@@ -30,7 +31,6 @@ public:
   //   of pointers.
   // - allocate_object_ptr and free_object_ptr deal with PoolPointer instances,
   //   but otherwise behave like allocate_object/free_object.
-  // TODO: support shrinking the pool by truncating unused space at the end
 
   virtual uint64_t allocate(size_t size) = 0;
 
@@ -63,6 +63,24 @@ public:
   virtual size_t block_size(uint64_t offset) const = 0;
 
 
+  // compaction functions.
+  // these let structures move their blocks toward the beginning of the pool,
+  // so the free space at the end can be truncated; see Compactor.hh. both must
+  // be called with the pool locked for writing. the default implementations
+  // never move any blocks and never shrink the pool.
+
+  // moves the block at offset into free space that ends at or before limit,
+  // copies its contents there, frees the old block, and returns the new offset.
+  // returns offset unchanged if the block already ends at or before limit, or
+  // if there's no free space before limit that's large enough. never expands
+  // the pool, so pointers into the pool aren't invalidated.
+  virtual uint64_t relocate(uint64_t offset, uint64_t limit);
+
+  // shrinks the pool to the end of the last allocated block (rounded up to a
+  // multiple of the page size) and returns the pool's new size.
+  virtual size_t truncate();
+
+
   // base object functions.
   // the base object is a single pointer stored in the pool's header. this can
   // be used to keep track of the main data structure that a pool contains, so
@@ -86,6 +104,24 @@ public:
 
   virtual ProcessReadWriteLockGuard lock(bool writing) const = 0;
   virtual bool is_locked(bool writing) const = 0;
+  // returns the offset of the ProcessReadWriteLock used by lock(). this is
+  // needed when copying a locked pool, so the lock can be cleared in the copy.
+  virtual uint64_t lock_offset() const = 0;
+
+
+  // copies the pool to a new pool with the given name (see Pool::clone_to).
+  // the pool is locked for writing during the copy, so the clone is a
+  // consistent point-in-time copy that can be opened with the same kind of
+  // allocator, independently of this pool. where the filesystem supports
+  // reflinks, the copy takes about the same time for any pool size.
+  void clone_to(const std::string& new_name) const;
+
+  // opens a private copy-on-write view of the pool (see Pool::private_view).
+  // the pool is locked for reading while the view is created, so the view
+  // starts from a consistent state (except for changes that structures make
+  // under the read lock, like Log appends). open the view with the same kind of
+  // allocator as this pool; locking it never affects other processes.
+  std::shared_ptr<Pool> private_view() const;
 
 
   // for debugging
@@ -99,4 +135,21 @@ protected:
   virtual void repair();
 };
 
+
+// interface for structures whose blocks can be moved by a Compactor. the
+// structure walks its own blocks, passes each one that extends past the limit
+// to Allocator::relocate, and updates the single pointer that refers to it.
+class Relocatable {
+public:
+  virtual ~Relocatable() = default;
+
+  // relocates the structure's blocks that extend past limit, visiting at most
+  // *max_blocks blocks and decrementing *max_blocks for each one. each call
+  // continues from where the previous call stopped. returns true when the
+  // whole structure has been visited (the next call starts over), or false if
+  // it stopped because *max_blocks reached zero. called with the pool locked
+  // for writing; the structure's contents don't change.
+  virtual bool relocate_blocks(uint64_t limit, size_t* max_blocks) = 0;
+};
+
 } // namespace sharedstructures
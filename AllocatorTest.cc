@@ -199,6 +199,56 @@ void run_lock_test(const string& allocator_type) {
   expect_eq(0, WEXITSTATUS(exit_status));
 }
 
+void run_clone_test(const string& allocator_type, bool file) {
+  printf("-- [%s] clone (%s)\n", allocator_type.c_str(),
+      file ? "file" : "shared memory");
+
+  Pool::delete_pool("test-pool-clone", file);
+  Pool::delete_pool("test-pool-clone-source", file);
+  shared_ptr<Pool> pool(new Pool("test-pool-clone-source", 0, file));
+  auto alloc = create_allocator(pool, allocator_type);
+
+  uint64_t off;
+  {
+    auto g = alloc->lock(true);
+    off = alloc->allocate(1024 * 64);
+    memset(pool->at<char>(off), 'a', 1024 * 64);
+    alloc->set_base_object_offset(off);
+  }
+  alloc->clone_to("test-pool-clone");
+
+  // the clone doesn't change when the source does, and it isn't locked
+  {
+    auto g = alloc->lock(true);
+    memset(pool->at<char>(off), 'b', 1024 * 64);
+  }
+  {
+    shared_ptr<Pool> clone_pool(new Pool("test-pool-clone", 0, file));
+    auto clone_alloc = create_allocator(clone_pool, allocator_type);
+    expect_eq(pool->size(), clone_pool->size());
+    expect_eq(false, clone_alloc->is_locked(false));
+    expect_eq(false, clone_alloc->is_locked(true));
+
+    auto g = clone_alloc->lock(false);
+    expect_eq(off, clone_alloc->base_object_offset());
+    expect_eq(1024 * 64, clone_alloc->block_size(off));
+    const char* data = clone_pool->at<char>(off);
+    for (size_t x = 0; x < 1024 * 64; x++) {
+      expect_eq('a', data[x]);
+    }
+    clone_alloc->verify();
+  }
+
+  // cloning to an existing pool fails
+  try {
+    alloc->clone_to("test-pool-clone");
+    expect(false);
+  } catch (const cannot_open_file& e) { }
+
+  Pool::delete_pool("test-pool-clone", file);
+  Pool::delete_pool("test-pool-clone-source", file);
+}
+
 void run_crash_test(const string& allocator_type) {
   printf("-- [%s] crash\n", allocator_type.c_str());
 
@@ -294,6 +344,8 @@ int main(int argc, char* argv[]) {
       run_smart_pointer_test(allocator_type);
       run_expansion_boundary_test(allocator_type);
       run_lock_test(allocator_type);
+      run_clone_test(allocator_type, true);
+      run_clone_test(allocator_type, false);
       run_crash_test(allocator_type);
     }
     printf("all tests passed\n");
@@ -0,0 +1,783 @@
+#include "ColumnTable.hh"
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+// scans process this many rows at a time, producing one bit per row
+static const size_t BLOCK_ROWS = 64;
+
+// the columns are reallocated with at least this many rows when they fill up
+static const size_t MIN_CAPACITY = 1024;
+
+static inline size_t value_size_for_type(ColumnTable::ColumnType type) {
+  return (type == ColumnTable::ColumnType::String) ? sizeof(uint32_t) :
+      sizeof(uint64_t);
+}
+
+
+template <typename T>
+static inline bool compare_values(T a, ColumnTable::Comparison comparison,
+    T b) {
+  switch (comparison) {
+    case ColumnTable::Comparison::Equal:
+      return a == b;
+    case ColumnTable::Comparison::NotEqual:
+      return a != b;
+    case ColumnTable::Comparison::Less:
+      return a < b;
+    case ColumnTable::Comparison::LessOrEqual:
+      return a <= b;
+    case ColumnTable::Comparison::Greater:
+      return a > b;
+    case ColumnTable::Comparison::GreaterOrEqual:
+      return a >= b;
+  }
+  throw invalid_argument("unknown comparison");
+}
+
+#ifdef __SSE2__
+// SSE2 has no 64-bit integer comparisons (they were added in SSE4.1 and
+// SSE4.2), so we build them from 32-bit comparisons. these return all 1s in
+// each 64-bit lane where the condition is true.
+static inline __m128i cmpeq_epi64(__m128i a, __m128i b) {
+  __m128i eq = _mm_cmpeq_epi32(a, b);
+  return _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+static inline __m128i cmpgt_epi64(__m128i a, __m128i b) {
+  // the high halves are compared as signed values and the low halves as
+  // unsigned values (by flipping their sign bits first). a > b if its high
+  // half is greater, or if the high halves are equal and its low half is
+  // greater.
+  const __m128i low_sign_bits = _mm_set_epi32(0, 0x80000000, 0, 0x80000000);
+  a = _mm_xor_si128(a, low_sign_bits);
+  b = _mm_xor_si128(b, low_sign_bits);
+  __m128i gt = _mm_cmpgt_epi32(a, b);
+  __m128i eq = _mm_cmpeq_epi32(a, b);
+  __m128i gt_low = _mm_shuffle_epi32(gt, _MM_SHUFFLE(2, 2, 0, 0));
+  __m128i gt_high = _mm_shuffle_epi32(gt, _MM_SHUFFLE(3, 3, 1, 1));
+  __m128i eq_high = _mm_shuffle_epi32(eq, _MM_SHUFFLE(3, 3, 1, 1));
+  return _mm_or_si128(gt_high, _mm_and_si128(eq_high, gt_low));
+}
+
+static inline __m128i compare_epi64(__m128i a,
+    ColumnTable::Comparison comparison, __m128i b) {
+  const __m128i ones = _mm_set1_epi32(-1);
+  switch (comparison) {
+    case ColumnTable::Comparison::Equal:
+      return cmpeq_epi64(a, b);
+    case ColumnTable::Comparison::NotEqual:
+      return _mm_xor_si128(cmpeq_epi64(a, b), ones);
+    case ColumnTable::Comparison::Less:
+      return cmpgt_epi64(b, a);
+    case ColumnTable::Comparison::LessOrEqual:
+      return _mm_xor_si128(cmpgt_epi64(a, b), ones);
+    case ColumnTable::Comparison::Greater:
+      return cmpgt_epi64(a, b);
+    case ColumnTable::Comparison::GreaterOrEqual:
+      return _mm_xor_si128(cmpgt_epi64(b, a), ones);
+  }
+  throw invalid_argument("unknown comparison");
+}
+
+static inline __m128d compare_pd(__m128d a, ColumnTable::Comparison comparison,
+    __m128d b) {
+  switch (comparison) {
+    case ColumnTable::Comparison::Equal:
+      return _mm_cmpeq_pd(a, b);
+    case ColumnTable::Comparison::NotEqual:
+      return _mm_cmpneq_pd(a, b);
+    case ColumnTable::Comparison::Less:
+      return _mm_cmplt_pd(a, b);
+    case ColumnTable::Comparison::LessOrEqual:
+      return _mm_cmple_pd(a, b);
+    case ColumnTable::Comparison::Greater:
+      return _mm_cmpgt_pd(a, b);
+    case ColumnTable::Comparison::GreaterOrEqual:
+      return _mm_cmpge_pd(a, b);
+  }
+  throw invalid_argument("unknown comparison");
+}
+#endif
+
+// each of these compares up to 64 values against a constant and returns a
+// bitmask with bit x set if values[x] satisfies the comparison
+static uint64_t compare_int_block(const int64_t* values, size_t count,
+    ColumnTable::Comparison comparison, int64_t value) {
+  uint64_t ret = 0;
+  size_t x = 0;
+#ifdef __SSE2__
+  __m128i v = _mm_set1_epi64x(value);
+  for (; x + 2 <= count; x += 2) {
+    __m128i m = compare_epi64(_mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(values + x)), comparison, v);
+    ret |= static_cast<uint64_t>(_mm_movemask_pd(_mm_castsi128_pd(m))) << x;
+  }
+#endif
+  for (; x < count; x++) {
+    ret |= static_cast<uint64_t>(compare_values(values[x], comparison,
+        value)) << x;
+  }
+  return ret;
+}
+
+static uint64_t compare_double_block(const double* values, size_t count,
+    ColumnTable::Comparison comparison, double value) {
+  uint64_t ret = 0;
+  size_t x = 0;
+#ifdef __SSE2__
+  __m128d v = _mm_set1_pd(value);
+  for (; x + 2 <= count; x += 2) {
+    __m128d m = compare_pd(_mm_loadu_pd(values + x), comparison, v);
+    ret |= static_cast<uint64_t>(_mm_movemask_pd(m)) << x;
+  }
+#endif
+  for (; x < count; x++) {
+    ret |= static_cast<uint64_t>(compare_values(values[x], comparison,
+        value)) << x;
+  }
+  return ret;
+}
+
+static uint64_t equal_id_block(const uint32_t* values, size_t count,
+    uint32_t value) {
+  uint64_t ret = 0;
+  size_t x = 0;
+#ifdef __SSE2__
+  __m128i v = _mm_set1_epi32(value);
+  for (; x + 4 <= count; x += 4) {
+    __m128i m = _mm_cmpeq_epi32(_mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(values + x)), v);
+    ret |= static_cast<uint64_t>(_mm_movemask_ps(_mm_castsi128_ps(m))) << x;
+  }
+#endif
+  for (; x < count; x++) {
+    ret |= static_cast<uint64_t>(values[x] == value) << x;
+  }
+  return ret;
+}
+
+
+// these accumulate the sum, min and max of a block in which every row matched
+// the predicates. blocks with only some matching rows are accumulated one row
+// at a time instead.
+static void aggregate_int_block(const int64_t* values, size_t count,
+    int64_t* sum, int64_t* min_value, int64_t* max_value) {
+  size_t x = 0;
+#ifdef __SSE2__
+  if (count >= 2) {
+    __m128i s = _mm_setzero_si128();
+    __m128i mn = _mm_set1_epi64x(*min_value);
+    __m128i mx = _mm_set1_epi64x(*max_value);
+    for (; x + 2 <= count; x += 2) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + x));
+      s = _mm_add_epi64(s, v);
+      __m128i lt = cmpgt_epi64(mn, v);
+      mn = _mm_or_si128(_mm_and_si128(lt, v), _mm_andnot_si128(lt, mn));
+      __m128i gt = cmpgt_epi64(v, mx);
+      mx = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, mx));
+    }
+    int64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), s);
+    *sum += lanes[0] + lanes[1];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), mn);
+    *min_value = min(lanes[0], lanes[1]);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), mx);
+    *max_value = max(lanes[0], lanes[1]);
+  }
+#endif
+  for (; x < count; x++) {
+    *sum += values[x];
+    *min_value = min(*min_value, values[x]);
+    *max_value = max(*max_value, values[x]);
+  }
+}
+
+static void aggregate_double_block(const double* values, size_t count,
+    double* sum, double* min_value, double* max_value) {
+  size_t x = 0;
+#ifdef __SSE2__
+  if (count >= 2) {
+    __m128d s = _mm_setzero_pd();
+    __m128d mn = _mm_set1_pd(*min_value);
+    __m128d mx = _mm_set1_pd(*max_value);
+    for (; x + 2 <= count; x += 2) {
+      __m128d v = _mm_loadu_pd(values + x);
+      s = _mm_add_pd(s, v);
+      mn = _mm_min_pd(mn, v);
+      mx = _mm_max_pd(mx, v);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, s);
+    *sum += lanes[0] + lanes[1];
+    _mm_storeu_pd(lanes, mn);
+    *min_value = min(lanes[0], lanes[1]);
+    _mm_storeu_pd(lanes, mx);
+    *max_value = max(lanes[0], lanes[1]);
+  }
+#endif
+  for (; x < count; x++) {
+    *sum += values[x];
+    *min_value = min(*min_value, values[x]);
+    *max_value = max(*max_value, values[x]);
+  }
+}
+
+
+ColumnTable::Value::Value(int64_t i) : type(ColumnType::Int), as_int(i),
+    as_double(0.0) { }
+ColumnTable::Value::Value(double d) : type(ColumnType::Double), as_int(0),
+    as_double(d) { }
+ColumnTable::Value::Value(const char* s) : type(ColumnType::String),
+    as_int(0), as_double(0.0), as_string(s) { }
+ColumnTable::Value::Value(const string& s) : type(ColumnType::String),
+    as_int(0), as_double(0.0), as_string(s) { }
+
+bool ColumnTable::Value::operator==(const Value& other) const {
+  if (this->type != other.type) {
+    return false;
+  }
+  switch (this->type) {
+    case ColumnType::Int:
+      return this->as_int == other.as_int;
+    case ColumnType::Double:
+      return this->as_double == other.as_double;
+    case ColumnType::String:
+      return this->as_string == other.as_string;
+  }
+  return false;
+}
+
+bool ColumnTable::Value::operator!=(const Value& other) const {
+  return !this->operator==(other);
+}
+
+string ColumnTable::Value::str() const {
+  switch (this->type) {
+    case ColumnType::Int:
+      return string_printf("<Int:%" PRId64 ">", this->as_int);
+    case ColumnType::Double:
+      return string_printf("<Double:%lf>", this->as_double);
+    case ColumnType::String:
+      return string_printf("<String:%s>", this->as_string.c_str());
+  }
+  return "<UnknownType>";
+}
+
+ColumnTable::Predicate::Predicate(size_t column_index, Comparison comparison,
+    const Value& value) : column_index(column_index), comparison(comparison),
+    value(value) { }
+
+ColumnTable::Aggregate::Aggregate(ColumnType type) : count(0),
+    sum((type == ColumnType::Int) ? Value((int64_t)0) : Value(0.0)),
+    min(sum), max(sum) { }
+
+
+ColumnTable::ColumnTable(shared_ptr<Allocator> allocator,
+    const vector<ColumnDefinition>& schema, uint8_t dictionary_bits) :
+    allocator(allocator) {
+  {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->create_table_base(schema, dictionary_bits);
+  }
+  this->open_dictionary();
+}
+
+ColumnTable::ColumnTable(shared_ptr<Allocator> allocator, uint64_t base_offset,
+    const vector<ColumnDefinition>& schema, uint8_t dictionary_bits) :
+    allocator(allocator), base_offset(base_offset) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->create_table_base(schema, dictionary_bits);
+      this->allocator->set_base_object_offset(this->base_offset);
+    }
+  }
+  this->open_dictionary();
+}
+
+
+shared_ptr<Allocator> ColumnTable::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t ColumnTable::base() const {
+  return this->base_offset;
+}
+
+
+vector<ColumnTable::ColumnDefinition> ColumnTable::schema() const {
+  auto g = this->allocator->lock(false);
+  auto p = this->allocator->get_pool();
+  const ColumnTableBase* base = p->at<ColumnTableBase>(this->base_offset);
+
+  vector<ColumnDefinition> ret;
+  for (size_t x = 0; x < base->column_count; x++) {
+    const ColumnInfo& column = base->columns[x];
+    ret.emplace_back(ColumnDefinition({
+        string(p->at<char>(column.name_offset),
+            this->allocator->block_size(column.name_offset)),
+        static_cast<ColumnType>(column.type)}));
+  }
+  return ret;
+}
+
+size_t ColumnTable::column_index(const string& name) const {
+  auto g = this->allocator->lock(false);
+  auto p = this->allocator->get_pool();
+  const ColumnTableBase* base = p->at<ColumnTableBase>(this->base_offset);
+
+  for (size_t x = 0; x < base->column_count; x++) {
+    uint64_t name_offset = base->columns[x].name_offset;
+    if ((this->allocator->block_size(name_offset) == name.size()) &&
+        !memcmp(p->at<char>(name_offset), name.data(), name.size())) {
+      return x;
+    }
+  }
+  throw out_of_range(name);
+}
+
+
+size_t ColumnTable::append(const vector<Value>& row) {
+  {
+    auto g = this->allocator->lock(false);
+    if (row.size() != this->column_count()) {
+      throw invalid_argument("row has the wrong number of values");
+    }
+    for (size_t x = 0; x < row.size(); x++) {
+      this->check_value_type(x, row[x]);
+    }
+  }
+
+  // intern the strings before locking the pool for writing. the dictionary is
+  // in the same pool, and the write lock isn't reentrant
+  vector<uint32_t> string_ids(row.size(), 0);
+  for (size_t x = 0; x < row.size(); x++) {
+    if (row[x].type == ColumnType::String) {
+      string_ids[x] = this->dictionary->intern(row[x].as_string);
+    }
+  }
+
+  auto g = this->allocator->lock(true);
+  auto p = this->allocator->get_pool();
+  ColumnTableBase* base = p->at<ColumnTableBase>(this->base_offset);
+
+  // if the columns are full, move them all to larger arrays
+  if (base->row_count == base->capacity) {
+    uint64_t new_capacity = max<uint64_t>(MIN_CAPACITY, base->capacity * 2);
+    for (size_t x = 0; x < base->column_count; x++) {
+      size_t value_size = value_size_for_type(
+          static_cast<ColumnType>(base->columns[x].type));
+      uint64_t new_data_offset = this->allocator->allocate(
+          new_capacity * value_size);
+
+      // allocate can remap the pool, so look up the base again
+      base = p->at<ColumnTableBase>(this->base_offset);
+      uint64_t old_data_offset = base->columns[x].data_offset;
+      if (old_data_offset) {
+        memcpy(p->at<uint8_t>(new_data_offset), p->at<uint8_t>(old_data_offset),
+            base->row_count * value_size);
+      }
+      base->columns[x].data_offset = new_data_offset;
+      if (old_data_offset) {
+        this->allocator->free(old_data_offset);
+      }
+    }
+    base->capacity = new_capacity;
+  }
+
+  size_t row_index = base->row_count;
+  for (size_t x = 0; x < row.size(); x++) {
+    this->write_value(row_index, x, row[x], string_ids[x]);
+  }
+  base->row_count++;
+  return row_index;
+}
+
+void ColumnTable::update(size_t row_index, size_t column_index,
+    const Value& value) {
+  {
+    auto g = this->allocator->lock(false);
+    if (row_index >= this->size()) {
+      throw out_of_range("row index out of range");
+    }
+    this->check_value_type(column_index, value);
+  }
+
+  uint32_t string_id = 0;
+  if (value.type == ColumnType::String) {
+    string_id = this->dictionary->intern(value.as_string);
+  }
+
+  // rows can't be deleted, so the row still exists
+  auto g = this->allocator->lock(true);
+  this->write_value(row_index, column_index, value, string_id);
+}
+
+
+ColumnTable::Value ColumnTable::at(size_t row_index,
+    size_t column_index) const {
+  auto g = this->allocator->lock(false);
+  if (row_index >= this->size()) {
+    throw out_of_range("row index out of range");
+  }
+  if (column_index >= this->column_count()) {
+    throw out_of_range("column index out of range");
+  }
+  return this->read_value(row_index, column_index);
+}
+
+vector<ColumnTable::Value> ColumnTable::row(size_t row_index) const {
+  auto g = this->allocator->lock(false);
+  if (row_index >= this->size()) {
+    throw out_of_range("row index out of range");
+  }
+
+  vector<Value> ret;
+  size_t column_count = this->column_count();
+  for (size_t x = 0; x < column_count; x++) {
+    ret.emplace_back(this->read_value(row_index, x));
+  }
+  return ret;
+}
+
+
+// resolves the dictionary IDs for string predicates before the pool is locked,
+// so the scan doesn't have to look up any strings. the result is -1 for strings
+// that aren't in the dictionary (and so can't be in any row).
+static vector<int64_t> string_ids_for_predicates(
+    const vector<ColumnTable::Predicate>& predicates,
+    const shared_ptr<InternTable>& dictionary) {
+  vector<int64_t> ret(predicates.size(), -1);
+  for (size_t x = 0; x < predicates.size(); x++) {
+    const auto& predicate = predicates[x];
+    if (predicate.value.type != ColumnTable::ColumnType::String) {
+      continue;
+    }
+    if ((predicate.comparison != ColumnTable::Comparison::Equal) &&
+        (predicate.comparison != ColumnTable::Comparison::NotEqual)) {
+      throw invalid_argument(
+          "string columns only support equal and not-equal comparisons");
+    }
+    if (dictionary && dictionary->exists(predicate.value.as_string)) {
+      ret[x] = dictionary->id_for(predicate.value.as_string);
+    }
+  }
+  return ret;
+}
+
+vector<uint64_t> ColumnTable::filter(
+    const vector<Predicate>& predicates) const {
+  vector<int64_t> string_ids = string_ids_for_predicates(predicates,
+      this->dictionary);
+
+  auto g = this->allocator->lock(false);
+  for (const auto& predicate : predicates) {
+    this->check_value_type(predicate.column_index, predicate.value);
+  }
+
+  vector<uint64_t> ret;
+  size_t row_count = this->size();
+  for (size_t start_row = 0; start_row < row_count; start_row += BLOCK_ROWS) {
+    uint64_t mask = this->match_block(predicates, string_ids, start_row,
+        min<size_t>(BLOCK_ROWS, row_count - start_row));
+    for (; mask; mask &= (mask - 1)) {
+      ret.emplace_back(start_row + __builtin_ctzll(mask));
+    }
+  }
+  return ret;
+}
+
+size_t ColumnTable::count(const vector<Predicate>& predicates) const {
+  vector<int64_t> string_ids = string_ids_for_predicates(predicates,
+      this->dictionary);
+
+  auto g = this->allocator->lock(false);
+  for (const auto& predicate : predicates) {
+    this->check_value_type(predicate.column_index, predicate.value);
+  }
+
+  size_t ret = 0;
+  size_t row_count = this->size();
+  for (size_t start_row = 0; start_row < row_count; start_row += BLOCK_ROWS) {
+    ret += __builtin_popcountll(this->match_block(predicates, string_ids,
+        start_row, min<size_t>(BLOCK_ROWS, row_count - start_row)));
+  }
+  return ret;
+}
+
+ColumnTable::Aggregate ColumnTable::aggregate(size_t column_index,
+    const vector<Predicate>& predicates) const {
+  vector<int64_t> string_ids = string_ids_for_predicates(predicates,
+      this->dictionary);
+
+  auto g = this->allocator->lock(false);
+  auto p = this->allocator->get_pool();
+  for (const auto& predicate : predicates) {
+    this->check_value_type(predicate.column_index, predicate.value);
+  }
+  if (column_index >= this->column_count()) {
+    throw out_of_range("column index out of range");
+  }
+
+  const ColumnTableBase* base = p->at<ColumnTableBase>(this->base_offset);
+  ColumnType type = static_cast<ColumnType>(base->columns[column_index].type);
+  if (type == ColumnType::String) {
+    throw invalid_argument("can\'t aggregate a string column");
+  }
+  uint64_t data_offset = base->columns[column_index].data_offset;
+  size_t row_count = base->row_count;
+
+  Aggregate ret(type);
+  int64_t int_sum = 0, int_min = INT64_MAX, int_max = INT64_MIN;
+  double double_sum = 0.0, double_min = HUGE_VAL, double_max = -HUGE_VAL;
+  for (size_t start_row = 0; start_row < row_count; start_row += BLOCK_ROWS) {
+    size_t num_rows = min<size_t>(BLOCK_ROWS, row_count - start_row);
+    uint64_t mask = this->match_block(predicates, string_ids, start_row,
+        num_rows);
+    uint64_t all_rows_mask = (num_rows == 64) ? 0xFFFFFFFFFFFFFFFF :
+        ((1ULL << num_rows) - 1);
+    ret.count += __builtin_popcountll(mask);
+
+    if (type == ColumnType::Int) {
+      const int64_t* values = p->at<int64_t>(data_offset) + start_row;
+      if (mask == all_rows_mask) {
+        aggregate_int_block(values, num_rows, &int_sum, &int_min, &int_max);
+      } else {
+        for (; mask; mask &= (mask - 1)) {
+          int64_t v = values[__builtin_ctzll(mask)];
+          int_sum += v;
+          int_min = min(int_min, v);
+          int_max = max(int_max, v);
+        }
+      }
+
+    } else {
+      const double* values = p->at<double>(data_offset) + start_row;
+      if (mask == all_rows_mask) {
+        aggregate_double_block(values, num_rows, &double_sum, &double_min,
+            &double_max);
+      } else {
+        for (; mask; mask &= (mask - 1)) {
+          double v = values[__builtin_ctzll(mask)];
+          double_sum += v;
+          double_min = min(double_min, v);
+          double_max = max(double_max, v);
+        }
+      }
+    }
+  }
+
+  if (ret.count) {
+    if (type == ColumnType::Int) {
+      ret.sum = Value(int_sum);
+      ret.min = Value(int_min);
+      ret.max = Value(int_max);
+    } else {
+      ret.sum = Value(double_sum);
+      ret.min = Value(double_min);
+      ret.max = Value(double_max);
+    }
+  }
+  return ret;
+}
+
+
+size_t ColumnTable::size() const {
+  return this->allocator->get_pool()->at<ColumnTableBase>(
+      this->base_offset)->row_count;
+}
+
+size_t ColumnTable::capacity() const {
+  return this->allocator->get_pool()->at<ColumnTableBase>(
+      this->base_offset)->capacity;
+}
+
+size_t ColumnTable::column_count() const {
+  return this->allocator->get_pool()->at<ColumnTableBase>(
+      this->base_offset)->column_count;
+}
+
+shared_ptr<InternTable> ColumnTable::get_dictionary() const {
+  return this->dictionary;
+}
+
+
+uint64_t ColumnTable::create_table_base(
+    const vector<ColumnDefinition>& schema, uint8_t dictionary_bits) {
+  if (schema.empty()) {
+    throw invalid_argument("schema must have at least one column");
+  }
+
+  auto p = this->allocator->get_pool();
+
+  bool has_string_columns = false;
+  for (const auto& column : schema) {
+    if ((column.type != ColumnType::Int) &&
+        (column.type != ColumnType::Double) &&
+        (column.type != ColumnType::String)) {
+      throw invalid_argument("unknown column type");
+    }
+    has_string_columns |= (column.type == ColumnType::String);
+  }
+
+  uint64_t dictionary_offset = 0;
+  if (has_string_columns) {
+    InternTable dictionary(this->allocator, dictionary_bits,
+        InternTable::PoolLocked());
+    dictionary_offset = dictionary.base();
+  }
+
+  uint64_t base_offset = this->allocator->allocate(sizeof(ColumnTableBase) +
+      schema.size() * sizeof(ColumnInfo));
+  for (size_t x = 0; x < schema.size(); x++) {
+    uint64_t name_offset = this->allocator->allocate(schema[x].name.size());
+    memcpy(p->at<char>(name_offset), schema[x].name.data(),
+        schema[x].name.size());
+
+    ColumnInfo& column = p->at<ColumnTableBase>(base_offset)->columns[x];
+    column.type = static_cast<uint8_t>(schema[x].type);
+    column.name_offset = name_offset;
+    column.data_offset = 0;
+  }
+
+  ColumnTableBase* base = p->at<ColumnTableBase>(base_offset);
+  base->row_count = 0;
+  base->capacity = 0;
+  base->column_count = schema.size();
+  base->dictionary_offset = dictionary_offset;
+  return base_offset;
+}
+
+void ColumnTable::open_dictionary() {
+  uint64_t dictionary_offset;
+  {
+    auto g = this->allocator->lock(false);
+    dictionary_offset = this->allocator->get_pool()->at<ColumnTableBase>(
+        this->base_offset)->dictionary_offset;
+  }
+  // opening an existing InternTable doesn't lock the pool
+  if (dictionary_offset) {
+    this->dictionary.reset(new InternTable(this->allocator, dictionary_offset,
+        0));
+  }
+}
+
+
+void ColumnTable::check_value_type(size_t column_index,
+    const Value& value) const {
+  if (column_index >= this->column_count()) {
+    throw out_of_range("column index out of range");
+  }
+  ColumnType type = static_cast<ColumnType>(
+      this->allocator->get_pool()->at<ColumnTableBase>(
+          this->base_offset)->columns[column_index].type);
+  if ((value.type != type) &&
+      !((type == ColumnType::Double) && (value.type == ColumnType::Int))) {
+    throw invalid_argument("value type doesn\'t match column type");
+  }
+}
+
+void ColumnTable::write_value(size_t row_index, size_t column_index,
+    const Value& value, uint32_t string_id) {
+  auto p = this->allocator->get_pool();
+  const ColumnInfo& column = p->at<ColumnTableBase>(
+      this->base_offset)->columns[column_index];
+  switch (static_cast<ColumnType>(column.type)) {
+    case ColumnType::Int:
+      p->at<int64_t>(column.data_offset)[row_index] = value.as_int;
+      break;
+    case ColumnType::Double:
+      p->at<double>(column.data_offset)[row_index] =
+          (value.type == ColumnType::Int) ? value.as_int : value.as_double;
+      break;
+    case ColumnType::String:
+      p->at<uint32_t>(column.data_offset)[row_index] = string_id;
+      break;
+  }
+}
+
+ColumnTable::Value ColumnTable::read_value(size_t row_index,
+    size_t column_index) const {
+  auto p = this->allocator->get_pool();
+  const ColumnInfo& column = p->at<ColumnTableBase>(
+      this->base_offset)->columns[column_index];
+  switch (static_cast<ColumnType>(column.type)) {
+    case ColumnType::Int:
+      return Value(p->at<int64_t>(column.data_offset)[row_index]);
+    case ColumnType::Double:
+      return Value(p->at<double>(column.data_offset)[row_index]);
+    case ColumnType::String:
+      return Value(this->dictionary->at(
+          p->at<uint32_t>(column.data_offset)[row_index]));
+  }
+  throw invalid_argument("column has unknown type");
+}
+
+uint64_t ColumnTable::match_block(const vector<Predicate>& predicates,
+    const vector<int64_t>& string_ids, size_t start_row,
+    size_t num_rows) const {
+  auto p = this->allocator->get_pool();
+  const ColumnTableBase* base = p->at<ColumnTableBase>(this->base_offset);
+
+  uint64_t mask = (num_rows == 64) ? 0xFFFFFFFFFFFFFFFF :
+      ((1ULL << num_rows) - 1);
+  for (size_t x = 0; (x < predicates.size()) && mask; x++) {
+    const Predicate& predicate = predicates[x];
+    const ColumnInfo& column = base->columns[predicate.column_index];
+
+    switch (static_cast<ColumnType>(column.type)) {
+      case ColumnType::Int:
+        mask &= compare_int_block(
+            p->at<int64_t>(column.data_offset) + start_row, num_rows,
+            predicate.comparison, predicate.value.as_int);
+        break;
+
+      case ColumnType::Double:
+        mask &= compare_double_block(
+            p->at<double>(column.data_offset) + start_row, num_rows,
+            predicate.comparison, (predicate.value.type == ColumnType::Int) ?
+                predicate.value.as_int : predicate.value.as_double);
+        break;
+
+      case ColumnType::String: {
+        bool equal = (predicate.comparison == Comparison::Equal);
+        if (string_ids[x] < 0) {
+          // the string isn't in any row
+          mask = equal ? 0 : mask;
+          break;
+        }
+        uint64_t matches = equal_id_block(
+            p->at<uint32_t>(column.data_offset) + start_row, num_rows,
+            string_ids[x]);
+        mask &= equal ? matches : ~matches;
+        break;
+      }
+    }
+  }
+  return mask;
+}
+
+} // namespace sharedstructures
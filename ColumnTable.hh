@@ -0,0 +1,182 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Allocator.hh"
+#include "InternTable.hh"
+
+namespace sharedstructures {
+
+
+// ColumnTable is a table of rows with a fixed schema, stored by column: each
+// column's values are in one contiguous array in the pool. Int and Double
+// columns hold 64-bit values; String columns are dictionary-encoded, so each
+// value is a 32-bit ID in an InternTable that belongs to the table.
+//
+// filter(), count() and aggregate() scan the columns directly, 64 rows at a
+// time, without constructing any per-row objects. on x86 they use SSE2 to
+// compare two (Int, Double) or four (String) values per instruction. scans
+// take the pool's read lock, so they run concurrently with each other; appends
+// and updates take the write lock.
+//
+// rows can't be deleted.
+
+class ColumnTable {
+public:
+  ColumnTable() = delete;
+  ColumnTable(const ColumnTable&) = delete;
+  ColumnTable(ColumnTable&&) = delete;
+
+  enum class ColumnType {
+    Int    = 0,
+    Double = 1,
+    String = 2,
+  };
+
+  struct ColumnDefinition {
+    std::string name;
+    ColumnType type;
+  };
+
+  // a single value in a row. the type must match the column's type, except
+  // that Int values may be used for Double columns.
+  struct Value {
+    ColumnType type;
+    int64_t as_int;
+    double as_double;
+    std::string as_string;
+
+    Value(int64_t i); // Int
+    Value(double d); // Double
+    Value(const char* s); // String
+    Value(const std::string& s); // String
+
+    bool operator==(const Value& other) const;
+    bool operator!=(const Value& other) const;
+
+    std::string str() const;
+  };
+
+  // create constructor - allocates a new empty table. string values are stored
+  // in an InternTable that can hold 2^dictionary_bits distinct strings (it's
+  // only created if the schema has any String columns).
+  ColumnTable(std::shared_ptr<Allocator> allocator,
+      const std::vector<ColumnDefinition>& schema, uint8_t dictionary_bits);
+  // (conditional) create constructor.
+  // opens an existing ColumnTable using the given allocator. if base_offset is
+  // 0, opens the ColumnTable at the allocator's base offset. if the allocator's
+  // base offset is also 0, creates a new ColumnTable and sets the allocator's
+  // base offset to the new table's base offset. schema and dictionary_bits are
+  // ignored if the table already exists.
+  ColumnTable(std::shared_ptr<Allocator> allocator, uint64_t base_offset,
+      const std::vector<ColumnDefinition>& schema, uint8_t dictionary_bits);
+  ~ColumnTable() = default;
+
+  // returns the allocator for this table
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this table
+  uint64_t base() const;
+
+  // returns the table's schema.
+  std::vector<ColumnDefinition> schema() const;
+  // returns the index of the named column. throws std::out_of_range if there's
+  // no such column.
+  size_t column_index(const std::string& name) const;
+
+  // appends a row and returns its index. the row must have a value for every
+  // column, in schema order. throws std::invalid_argument if any value has the
+  // wrong type, or std::runtime_error if the string dictionary is full.
+  size_t append(const std::vector<Value>& row);
+  // replaces one value in an existing row. throws std::out_of_range if the row
+  // or column doesn't exist.
+  void update(size_t row_index, size_t column_index, const Value& value);
+
+  // returns one value or a whole row. throws std::out_of_range if the row or
+  // column doesn't exist.
+  Value at(size_t row_index, size_t column_index) const;
+  std::vector<Value> row(size_t row_index) const;
+
+  enum class Comparison {
+    Equal          = 0,
+    NotEqual       = 1,
+    Less           = 2,
+    LessOrEqual    = 3,
+    Greater        = 4,
+    GreaterOrEqual = 5,
+  };
+
+  // a condition on one column. String columns only support Equal and
+  // NotEqual, since their values are stored as dictionary IDs.
+  struct Predicate {
+    size_t column_index;
+    Comparison comparison;
+    Value value;
+
+    Predicate(size_t column_index, Comparison comparison, const Value& value);
+  };
+
+  // returns the indexes of the rows that satisfy all of the given predicates,
+  // in increasing order. if no predicates are given, all rows match.
+  std::vector<uint64_t> filter(const std::vector<Predicate>& predicates) const;
+  // returns the number of rows that satisfy all of the given predicates.
+  size_t count(const std::vector<Predicate>& predicates) const;
+
+  // statistics over an Int or Double column for the rows that satisfy all of
+  // the given predicates. sum, min and max have the column's type; if no rows
+  // match, they're all zero.
+  struct Aggregate {
+    size_t count;
+    Value sum;
+    Value min;
+    Value max;
+
+    Aggregate(ColumnType type);
+  };
+  Aggregate aggregate(size_t column_index,
+      const std::vector<Predicate>& predicates) const;
+
+  // inspection methods.
+  size_t size() const; // row count
+  size_t capacity() const; // rows that fit before the columns are reallocated
+  size_t column_count() const;
+  std::shared_ptr<InternTable> get_dictionary() const; // NULL if no strings
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+  std::shared_ptr<InternTable> dictionary;
+
+  struct ColumnInfo {
+    uint8_t type;
+    uint8_t unused[7];
+    uint64_t name_offset; // the name's length is the allocated block's size
+    uint64_t data_offset; // capacity * (8 or 4) bytes
+  };
+
+  struct ColumnTableBase {
+    uint64_t row_count;
+    uint64_t capacity;
+    uint64_t column_count;
+    uint64_t dictionary_offset;
+    ColumnInfo columns[0];
+  };
+
+  uint64_t create_table_base(const std::vector<ColumnDefinition>& schema,
+      uint8_t dictionary_bits);
+  void open_dictionary();
+
+  // these must be called with the pool locked
+  void check_value_type(size_t column_index, const Value& value) const;
+  void write_value(size_t row_index, size_t column_index, const Value& value,
+      uint32_t string_id);
+  Value read_value(size_t row_index, size_t column_index) const;
+  uint64_t match_block(const std::vector<Predicate>& predicates,
+      const std::vector<int64_t>& string_ids, size_t start_row,
+      size_t num_rows) const;
+};
+
+} // namespace sharedstructures
@@ -0,0 +1,375 @@
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "ColumnTable.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+typedef ColumnTable::ColumnType ColumnType;
+typedef ColumnTable::Comparison Comparison;
+typedef ColumnTable::Predicate Predicate;
+typedef ColumnTable::Value Value;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+static const vector<ColumnTable::ColumnDefinition> test_schema({
+  {"id", ColumnType::Int},
+  {"price", ColumnType::Double},
+  {"color", ColumnType::String},
+});
+
+static const vector<string> colors({"red", "green", "blue", "cyan", "magenta"});
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-columns"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  ColumnTable table(alloc, 0, test_schema, 8);
+
+  expect_eq(0, table.size());
+  expect_eq(3, table.column_count());
+  expect_eq(1, table.column_index("price"));
+  try {
+    table.column_index("weight");
+    expect(false);
+  } catch (const out_of_range& e) { }
+  auto schema = table.schema();
+  expect_eq(3, schema.size());
+  for (size_t x = 0; x < schema.size(); x++) {
+    expect_eq(test_schema[x].name, schema[x].name);
+    expect(test_schema[x].type == schema[x].type);
+  }
+
+  expect_eq(0, table.append({(int64_t)7, 2.5, "red"}));
+  // Int values can be stored in Double columns
+  expect_eq(1, table.append({(int64_t)-3, (int64_t)4, "blue"}));
+  expect_eq(2, table.size());
+  expect_eq(2, table.get_dictionary()->size());
+
+  expect(Value((int64_t)7) == table.at(0, 0));
+  expect(Value(2.5) == table.at(0, 1));
+  expect(Value("red") == table.at(0, 2));
+  expect(Value(4.0) == table.at(1, 1));
+  auto row = table.row(1);
+  expect_eq(3, row.size());
+  expect(Value((int64_t)-3) == row[0]);
+  expect(Value("blue") == row[2]);
+
+  table.update(0, 2, "blue");
+  table.update(0, 0, (int64_t)8);
+  expect(Value("blue") == table.at(0, 2));
+  expect(Value((int64_t)8) == table.at(0, 0));
+  expect_eq(2, table.get_dictionary()->size());
+
+  // wrong types, wrong row sizes and out-of-range indexes are rejected
+  try {
+    table.append({"red", 2.5, "red"});
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    table.append({(int64_t)1, 2.5});
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    table.update(0, 0, 1.5);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    table.update(2, 0, (int64_t)1);
+    expect(false);
+  } catch (const out_of_range& e) { }
+  try {
+    table.at(0, 3);
+    expect(false);
+  } catch (const out_of_range& e) { }
+  try {
+    table.row(2);
+    expect(false);
+  } catch (const out_of_range& e) { }
+  expect_eq(2, table.size());
+
+  // another instance sees the same table
+  ColumnTable table2(alloc, table.base(), {}, 0);
+  expect_eq(2, table2.size());
+  expect(Value("blue") == table2.at(1, 2));
+  table2.append({(int64_t)0, 0.0, "green"});
+  expect_eq(3, table.size());
+  expect(Value("green") == table.at(2, 2));
+
+  // a table with no string columns doesn't have a dictionary
+  ColumnTable numbers(alloc, {{"n", ColumnType::Int}}, 8);
+  expect(!numbers.get_dictionary());
+  numbers.append({(int64_t)1});
+  expect_eq(1, numbers.size());
+}
+
+
+void run_scan_test(const string& allocator_type) {
+  printf("-- [%s] scans\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-columns"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  ColumnTable table(alloc, test_schema, 8);
+
+  // enough rows to grow the columns a few times, and to leave a partial block
+  // at the end
+  const size_t num_rows = 5000;
+  vector<int64_t> ids;
+  vector<double> prices;
+  vector<string> row_colors;
+  for (size_t x = 0; x < num_rows; x++) {
+    ids.emplace_back(((int64_t)(x * 7919) % 2001) - 1000);
+    prices.emplace_back((double)((x * 104729) % 1000) / 8.0);
+    row_colors.emplace_back(colors[(x * 31) % 4]);
+    expect_eq(x, table.append({ids.back(), prices.back(), row_colors.back()}));
+  }
+  expect_le(num_rows, table.capacity());
+
+  // every comparison on every type, checked against the obvious loop
+  vector<Comparison> comparisons({Comparison::Equal, Comparison::NotEqual,
+      Comparison::Less, Comparison::LessOrEqual, Comparison::Greater,
+      Comparison::GreaterOrEqual});
+  auto compare = [](auto a, Comparison c, auto b) -> bool {
+    switch (c) {
+      case Comparison::Equal:
+        return a == b;
+      case Comparison::NotEqual:
+        return a != b;
+      case Comparison::Less:
+        return a < b;
+      case Comparison::LessOrEqual:
+        return a <= b;
+      case Comparison::Greater:
+        return a > b;
+      case Comparison::GreaterOrEqual:
+        return a >= b;
+    }
+    return false;
+  };
+
+  vector<int64_t> int_constants({-1001, -1000, -3, 0, 17, 1000, 1001,
+      INT64_MIN, INT64_MAX});
+  for (Comparison c : comparisons) {
+    for (int64_t v : int_constants) {
+      vector<uint64_t> expected;
+      for (size_t x = 0; x < num_rows; x++) {
+        if (compare(ids[x], c, v)) {
+          expected.emplace_back(x);
+        }
+      }
+      expect_eq(expected, table.filter({Predicate(0, c, v)}));
+      expect_eq(expected.size(), table.count({Predicate(0, c, v)}));
+    }
+
+    for (double v : {-1.0, 0.0, 62.5, 63.0, 124.875, 200.0}) {
+      vector<uint64_t> expected;
+      for (size_t x = 0; x < num_rows; x++) {
+        if (compare(prices[x], c, v)) {
+          expected.emplace_back(x);
+        }
+      }
+      expect_eq(expected, table.filter({Predicate(1, c, v)}));
+    }
+  }
+
+  // string columns only support equality
+  for (const string& color : colors) {
+    vector<uint64_t> expected_eq, expected_ne;
+    for (size_t x = 0; x < num_rows; x++) {
+      (row_colors[x] == color ? expected_eq : expected_ne).emplace_back(x);
+    }
+    expect_eq(expected_eq, table.filter({Predicate(2, Comparison::Equal,
+        color)}));
+    expect_eq(expected_ne, table.filter({Predicate(2, Comparison::NotEqual,
+        color)}));
+  }
+  try {
+    table.filter({Predicate(2, Comparison::Less, "red")});
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    table.filter({Predicate(0, Comparison::Less, "red")});
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    table.count({Predicate(3, Comparison::Less, (int64_t)0)});
+    expect(false);
+  } catch (const out_of_range& e) { }
+
+  // multiple predicates are combined with AND; no predicates match everything
+  vector<Predicate> predicates({
+      Predicate(0, Comparison::GreaterOrEqual, (int64_t)-200),
+      Predicate(1, Comparison::Less, 80.0),
+      Predicate(2, Comparison::NotEqual, "green")});
+  vector<uint64_t> expected;
+  for (size_t x = 0; x < num_rows; x++) {
+    if ((ids[x] >= -200) && (prices[x] < 80.0) && (row_colors[x] != "green")) {
+      expected.emplace_back(x);
+    }
+  }
+  expect_eq(expected, table.filter(predicates));
+  expect_eq(num_rows, table.count({}));
+
+  // aggregates, with and without predicates
+  for (const auto& preds : {vector<Predicate>(), predicates}) {
+    vector<uint64_t> rows = table.filter(preds);
+    int64_t int_sum = 0, int_min = INT64_MAX, int_max = INT64_MIN;
+    double double_sum = 0.0, double_min = HUGE_VAL, double_max = -HUGE_VAL;
+    for (uint64_t x : rows) {
+      int_sum += ids[x];
+      int_min = min(int_min, ids[x]);
+      int_max = max(int_max, ids[x]);
+      double_sum += prices[x];
+      double_min = min(double_min, prices[x]);
+      double_max = max(double_max, prices[x]);
+    }
+
+    auto int_agg = table.aggregate(0, preds);
+    expect_eq(rows.size(), int_agg.count);
+    expect(Value(int_sum) == int_agg.sum);
+    expect(Value(int_min) == int_agg.min);
+    expect(Value(int_max) == int_agg.max);
+
+    auto double_agg = table.aggregate(1, preds);
+    expect_eq(rows.size(), double_agg.count);
+    expect(ColumnType::Double == double_agg.sum.type);
+    expect_lt(fabs(double_sum - double_agg.sum.as_double), 0.001);
+    expect(Value(double_min) == double_agg.min);
+    expect(Value(double_max) == double_agg.max);
+  }
+
+  // no matching rows
+  auto empty_agg = table.aggregate(0, {Predicate(2, Comparison::Equal,
+      "magenta")});
+  expect_eq(0, empty_agg.count);
+  expect(Value((int64_t)0) == empty_agg.sum);
+  try {
+    table.aggregate(2, {});
+    expect(false);
+  } catch (const invalid_argument& e) { }
+}
+
+
+void run_concurrent_append_test(const string& allocator_type) {
+  printf("-- [%s] concurrent appends\n", allocator_type.c_str());
+
+  uint64_t base_offset;
+  {
+    shared_ptr<Pool> pool(new Pool("test-columns"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    ColumnTable table(alloc, test_schema, 8);
+    base_offset = table.base();
+  }
+
+  const size_t num_children = 4;
+  const size_t num_rows = 1000;
+  unordered_set<pid_t> child_pids;
+  size_t child_index = 0;
+  while ((child_pids.size() < num_children) && !child_pids.count(0)) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      break;
+    } else {
+      child_pids.emplace(pid);
+      if (pid) {
+        child_index++;
+      }
+    }
+  }
+
+  if (child_pids.count(0)) {
+    // each child appends rows and scans the table concurrently with the others
+    shared_ptr<Pool> pool(new Pool("test-columns"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    ColumnTable table(alloc, base_offset, {}, 0);
+    for (size_t x = 0; x < num_rows; x++) {
+      table.append({(int64_t)child_index, (double)x, colors[child_index]});
+      if (x % 100 == 0) {
+        if (table.count({Predicate(0, Comparison::Equal,
+            (int64_t)child_index)}) != x + 1) {
+          _exit(1);
+        }
+      }
+    }
+    _exit(0);
+
+  } else {
+    int num_failures = 0;
+    int exit_status;
+    pid_t exited_pid;
+    while ((exited_pid = wait(&exit_status)) != -1) {
+      child_pids.erase(exited_pid);
+      if (!WIFEXITED(exit_status) || (WEXITSTATUS(exit_status) != 0)) {
+        printf("-- [%s]   child %d failed (%d)\n", allocator_type.c_str(),
+            exited_pid, exit_status);
+        num_failures++;
+      }
+    }
+    expect_eq(true, child_pids.empty());
+    expect_eq(0, num_failures);
+
+    shared_ptr<Pool> pool(new Pool("test-columns"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    ColumnTable table(alloc, base_offset, {}, 0);
+    expect_eq(num_children * num_rows, table.size());
+    for (size_t x = 0; x < num_children; x++) {
+      vector<Predicate> preds({Predicate(2, Comparison::Equal, colors[x])});
+      auto agg = table.aggregate(1, preds);
+      expect_eq(num_rows, agg.count);
+      expect(Value((double)(num_rows * (num_rows - 1) / 2)) == agg.sum);
+      expect_eq(num_rows, table.count({Predicate(0, Comparison::Equal,
+          (int64_t)x)}));
+    }
+  }
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      Pool::delete_pool("test-columns");
+      run_basic_test(allocator_type);
+      Pool::delete_pool("test-columns");
+      run_scan_test(allocator_type);
+      Pool::delete_pool("test-columns");
+      run_concurrent_append_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  Pool::delete_pool("test-columns");
+
+  return retcode;
+}
@@ -0,0 +1,69 @@
+#include "Compactor.hh"
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+Compactor::Compactor(shared_ptr<Allocator> allocator) : allocator(allocator),
+    limit(0), structure_index(0) { }
+
+shared_ptr<Allocator> Compactor::get_allocator() const {
+  return this->allocator;
+}
+
+void Compactor::add_structure(shared_ptr<Relocatable> structure) {
+  this->structures.emplace_back(structure);
+}
+
+bool Compactor::step(size_t max_blocks) {
+  if (!max_blocks) {
+    throw invalid_argument("max_blocks must be nonzero");
+  }
+
+  auto g = this->allocator->lock(true);
+  auto p = this->allocator->get_pool();
+
+  // start a new pass if needed. the limit leaves some room for fragmentation
+  // below it, since blocks can only be moved into spaces that fit them
+  if (!this->limit) {
+    size_t used_size = p->size() - this->allocator->bytes_free();
+    this->limit = (used_size + used_size / 16 + PAGE_SIZE - 1) &
+        (~(PAGE_SIZE - 1));
+    this->structure_index = 0;
+  }
+
+  if (this->limit < p->size()) {
+    while ((this->structure_index < this->structures.size()) && max_blocks) {
+      if (this->structures[this->structure_index]->relocate_blocks(
+          this->limit, &max_blocks)) {
+        this->structure_index++;
+      }
+    }
+    if (this->structure_index < this->structures.size()) {
+      return false;
+    }
+  }
+
+  this->allocator->truncate();
+  this->limit = 0;
+  return true;
+}
+
+size_t Compactor::compact(size_t max_blocks_per_step) {
+  size_t initial_size;
+  {
+    auto g = this->allocator->lock(false);
+    initial_size = this->allocator->get_pool()->size();
+  }
+
+  while (!this->step(max_blocks_per_step));
+
+  auto g = this->allocator->lock(false);
+  size_t final_size = this->allocator->get_pool()->size();
+  return (final_size < initial_size) ? (initial_size - final_size) : 0;
+}
+
+} // namespace sharedstructures
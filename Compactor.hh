@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "Allocator.hh"
+
+namespace sharedstructures {
+
+
+// Compactor shrinks a pool while other processes are using it. neither
+// allocator ever moves an allocated block by itself, so after many frees the
+// live blocks can be scattered across a pool that's much larger than they need.
+// the compactor picks a limit just above the pool's allocated size, asks each
+// registered structure to move its blocks that extend past the limit into free
+// space before it (see Relocatable), and then truncates the free space at the
+// end of the pool.
+//
+// the work is split into bounded steps: each step locks the pool for writing,
+// relocates at most a given number of blocks, and unlocks it, so other
+// processes are never blocked for long. structures can be modified between
+// steps; blocks they allocate past the limit in the meantime are moved on the
+// next pass. blocks that don't belong to a registered structure are never
+// moved, so the pool can only be truncated down to the end of the last of
+// them. currently only SimpleAllocator supports relocation; with other
+// allocators, compaction does nothing.
+//
+// the compactor's state is process-local. only one process should compact a
+// pool at a time, but any process can do it.
+
+class Compactor {
+public:
+  Compactor() = delete;
+  Compactor(const Compactor&) = delete;
+  Compactor(Compactor&&) = delete;
+  explicit Compactor(std::shared_ptr<Allocator> allocator);
+  ~Compactor() = default;
+
+  // returns the allocator for this compactor
+  std::shared_ptr<Allocator> get_allocator() const;
+
+  // registers a structure whose blocks can be moved. the structure must be in
+  // this compactor's pool. structures are visited in the order they're added.
+  void add_structure(std::shared_ptr<Relocatable> structure);
+
+  // runs one step of compaction, relocating at most max_blocks blocks. if this
+  // completes a pass over all the structures, truncates the pool and returns
+  // true; the next call starts a new pass.
+  bool step(size_t max_blocks = 1024);
+
+  // runs steps until a pass is complete, and returns the number of bytes by
+  // which the pool shrank.
+  size_t compact(size_t max_blocks_per_step = 1024);
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  std::vector<std::shared_ptr<Relocatable>> structures;
+
+  // 0 if no pass is in progress
+  uint64_t limit;
+  size_t structure_index;
+};
+
+} // namespace sharedstructures
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <map>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+#include <vector>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "Compactor.hh"
+#include "HashTable.hh"
+#include "PrefixTree.hh"
+#include "TestUtils.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+void verify_contents(const map<string, PrefixTree::LookupResult>& expected_tree,
+    const map<string, string>& expected_table, const PrefixTree& tree,
+    const HashTable& table) {
+  expect_eq(expected_tree.size(), tree.size());
+  expect_eq(expected_tree, tree_contents(tree));
+  for (const auto& it : expected_tree) {
+    expect_eq(it.second, tree.at(it.first));
+  }
+  expect_eq(expected_table.size(), table.size());
+  expect_eq(expected_table, table_contents(table));
+  for (const auto& it : expected_table) {
+    expect_eq(it.second, table.at(it.first));
+  }
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-compactor"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  shared_ptr<PrefixTree> tree(new PrefixTree(alloc));
+  // a small table, so most slots have indirect chains
+  shared_ptr<HashTable> table(new HashTable(alloc, (uint8_t)6));
+
+  // fill the pool, then erase the keys that were inserted first, so the live
+  // blocks are mostly at the end of the pool
+  map<string, PrefixTree::LookupResult> expected_tree;
+  map<string, string> expected_table;
+  string long_value(200, 'v');
+  for (size_t x = 0; x < 5000; x++) {
+    string key = string_printf("key%05zu", x);
+    tree->insert(key, long_value + key);
+    table->insert(key, long_value + key);
+  }
+  for (size_t x = 0; x < 5000; x++) {
+    string key = string_printf("key%05zu", x);
+    if (x < 4500) {
+      tree->erase(key);
+      table->erase(key);
+    } else {
+      expected_tree.emplace(key, long_value + key);
+      expected_table.emplace(key, long_value + key);
+    }
+  }
+  // some values that don't use buffers, or use small ones
+  tree->insert(string(""), (int64_t)-1);
+  expected_tree.emplace(string(""), (int64_t)-1);
+  tree->insert(string("double"), 2.5);
+  expected_tree.emplace(string("double"), 2.5);
+  tree->insert(string("long-int"), (int64_t)0x7FFFFFFFFFFFFFFF);
+  expected_tree.emplace(string("long-int"), (int64_t)0x7FFFFFFFFFFFFFFF);
+  tree->insert(string("empty-string"), string(""));
+  expected_tree.emplace(string("empty-string"), string(""));
+  table->insert(string(""), string("x"));
+  expected_table.emplace(string(""), string("x"));
+  verify_contents(expected_tree, expected_table, *tree, *table);
+
+  // open the structures again, as another process would, before compacting
+  shared_ptr<Pool> other_pool(new Pool("test-compactor"));
+  shared_ptr<Allocator> other_alloc = create_allocator(other_pool,
+      allocator_type);
+  PrefixTree other_tree(other_alloc, tree->base());
+  HashTable other_table(other_alloc, table->base(), 6);
+  verify_contents(expected_tree, expected_table, other_tree, other_table);
+
+  Compactor compactor(alloc);
+  compactor.add_structure(tree);
+  compactor.add_structure(table);
+
+  // modify the structures between steps. keys inserted during the pass are
+  // moved in a later pass if they're allocated past the limit
+  size_t initial_size = pool->size();
+  size_t steps = 0;
+  while (!compactor.step(100)) {
+    string key = string_printf("key%05zu", 4500 + steps);
+    tree->erase(key);
+    expected_tree.erase(key);
+    table->insert(key, string("changed"));
+    expected_table[key] = "changed";
+    tree->insert(string_printf("new%05zu", steps), (int64_t)steps);
+    expected_tree.emplace(string_printf("new%05zu", steps), (int64_t)steps);
+    steps++;
+  }
+  verify_contents(expected_tree, expected_table, *tree, *table);
+  compactor.compact(100);
+  verify_contents(expected_tree, expected_table, *tree, *table);
+
+  if (allocator_type == "simple") {
+    expect_lt(1, steps);
+    expect_lt(pool->size() * 4, initial_size);
+    // after compacting, only a little space is free
+    expect_lt(alloc->bytes_free() * 4, pool->size());
+  } else {
+    // the logarithmic allocator doesn't support relocation
+    expect_eq(initial_size, pool->size());
+  }
+
+  // the other instance remaps the pool and sees the moved blocks
+  verify_contents(expected_tree, expected_table, other_tree, other_table);
+  expect_eq(pool->size(), other_pool->size());
+
+  // the pool can grow again after being truncated
+  for (size_t x = 0; x < 1000; x++) {
+    string key = string_printf("more%05zu", x);
+    tree->insert(key, long_value);
+    expected_tree.emplace(key, long_value);
+  }
+  verify_contents(expected_tree, expected_table, other_tree, other_table);
+
+  // compacting a compacted pool doesn't reclaim anything
+  compactor.compact();
+  size_t compacted_size = pool->size();
+  expect_eq(0, compactor.compact());
+  expect_eq(compacted_size, pool->size());
+  verify_contents(expected_tree, expected_table, *tree, *table);
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      Pool::delete_pool("test-compactor");
+      run_basic_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  Pool::delete_pool("test-compactor");
+
+  return retcode;
+}
@@ -0,0 +1,219 @@
+#include "CountMinSketch.hh"
+
+#include <stdexcept>
+
+#include "Hash.hh"
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+// each row uses a different counter for each key. we derive the indexes from
+// two hashes (h1 + row * h2) rather than hashing the key once per row; this
+// gives the same error bounds as independent hashes.
+struct RowIndexes {
+  uint64_t h1;
+  uint64_t h2;
+  uint8_t shift;
+
+  RowIndexes(const void* k, size_t k_size, uint8_t bits) {
+    this->h1 = mix64(fnv1a64(k, k_size));
+    this->h2 = mix64(this->h1) | 1;
+    this->shift = 64 - bits;
+  }
+
+  uint64_t index_for_row(uint8_t row) const {
+    return (this->h1 + row * this->h2) >> this->shift;
+  }
+};
+
+
+CountMinSketch::CountMinSketch(shared_ptr<Allocator> allocator, uint8_t bits,
+    uint8_t depth) : allocator(allocator) {
+  auto g = this->allocator->lock(true);
+  this->base_offset = this->create_sketch_base(bits, depth);
+}
+
+CountMinSketch::CountMinSketch(shared_ptr<Allocator> allocator,
+    uint64_t base_offset, uint8_t bits, uint8_t depth) : allocator(allocator),
+    base_offset(base_offset) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->create_sketch_base(bits, depth);
+      this->allocator->set_base_object_offset(this->base_offset);
+    }
+  }
+}
+
+
+shared_ptr<Allocator> CountMinSketch::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t CountMinSketch::base() const {
+  return this->base_offset;
+}
+
+
+uint64_t CountMinSketch::add(const void* k, size_t k_size, uint64_t count) {
+  // we don't lock the pool, so it's not remapped for us if another process
+  // expanded it
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+
+  CountMinSketchBase* base = p->at<CountMinSketchBase>(this->base_offset);
+  auto* counters = this->counters();
+  RowIndexes indexes(k, k_size, base->bits);
+
+  uint64_t ret = UINT64_MAX;
+  for (uint8_t row = 0; row < base->depth; row++) {
+    uint64_t index = (static_cast<uint64_t>(row) << base->bits) +
+        indexes.index_for_row(row);
+    uint64_t value = counters[index].fetch_add(count,
+        memory_order_relaxed) + count;
+    if (value < ret) {
+      ret = value;
+    }
+  }
+  base->total.fetch_add(count, memory_order_relaxed);
+
+  return ret;
+}
+
+uint64_t CountMinSketch::add(const string& k, uint64_t count) {
+  return this->add(k.data(), k.size(), count);
+}
+
+
+uint64_t CountMinSketch::estimate(const void* k, size_t k_size) const {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+
+  const CountMinSketchBase* base = p->at<CountMinSketchBase>(
+      this->base_offset);
+  const auto* counters = this->counters();
+  RowIndexes indexes(k, k_size, base->bits);
+
+  uint64_t ret = UINT64_MAX;
+  for (uint8_t row = 0; row < base->depth; row++) {
+    uint64_t index = (static_cast<uint64_t>(row) << base->bits) +
+        indexes.index_for_row(row);
+    uint64_t value = counters[index].load(memory_order_relaxed);
+    if (value < ret) {
+      ret = value;
+    }
+  }
+  return ret;
+}
+
+uint64_t CountMinSketch::estimate(const string& k) const {
+  return this->estimate(k.data(), k.size());
+}
+
+
+void CountMinSketch::merge(const CountMinSketch& other) {
+  if ((other.bits() != this->bits()) || (other.depth() != this->depth())) {
+    throw invalid_argument(
+        "cannot merge sketches with different dimensions");
+  }
+
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  other.allocator->get_pool()->check_size_and_remap();
+
+  CountMinSketchBase* base = p->at<CountMinSketchBase>(this->base_offset);
+  auto* counters = this->counters();
+  const auto* other_counters = other.counters();
+
+  uint64_t counter_count = static_cast<uint64_t>(base->depth) << base->bits;
+  for (uint64_t x = 0; x < counter_count; x++) {
+    uint64_t value = other_counters[x].load(memory_order_relaxed);
+    if (value) {
+      counters[x].fetch_add(value, memory_order_relaxed);
+    }
+  }
+  base->total.fetch_add(other.total(), memory_order_relaxed);
+}
+
+
+void CountMinSketch::clear() {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+
+  CountMinSketchBase* base = p->at<CountMinSketchBase>(this->base_offset);
+  auto* counters = this->counters();
+  uint64_t counter_count = static_cast<uint64_t>(base->depth) << base->bits;
+  for (uint64_t x = 0; x < counter_count; x++) {
+    counters[x].store(0, memory_order_relaxed);
+  }
+  base->total = 0;
+}
+
+
+uint64_t CountMinSketch::total() const {
+  return this->allocator->get_pool()->at<CountMinSketchBase>(
+      this->base_offset)->total;
+}
+
+uint8_t CountMinSketch::bits() const {
+  return this->allocator->get_pool()->at<CountMinSketchBase>(
+      this->base_offset)->bits;
+}
+
+uint8_t CountMinSketch::depth() const {
+  return this->allocator->get_pool()->at<CountMinSketchBase>(
+      this->base_offset)->depth;
+}
+
+
+uint64_t CountMinSketch::create_sketch_base(uint8_t bits, uint8_t depth) {
+  if ((bits < 1) || (bits > 32)) {
+    throw invalid_argument("bits must be between 1 and 32");
+  }
+  if ((depth < 1) || (depth > 16)) {
+    throw invalid_argument("depth must be between 1 and 16");
+  }
+
+  auto p = this->allocator->get_pool();
+
+  uint64_t counter_count = static_cast<uint64_t>(depth) << bits;
+  uint64_t base_offset = this->allocator->allocate(sizeof(CountMinSketchBase));
+  uint64_t counters_offset = this->allocator->allocate(
+      counter_count * sizeof(uint64_t));
+
+  CountMinSketchBase* base = p->at<CountMinSketchBase>(base_offset);
+  base->bits = bits;
+  base->depth = depth;
+  base->total = 0;
+  base->counters_offset = counters_offset;
+
+  auto* counters = p->at<atomic<uint64_t>>(counters_offset);
+  for (uint64_t x = 0; x < counter_count; x++) {
+    counters[x] = 0;
+  }
+
+  return base_offset;
+}
+
+
+atomic<uint64_t>* CountMinSketch::counters() {
+  auto p = this->allocator->get_pool();
+  return p->at<atomic<uint64_t>>(
+      p->at<CountMinSketchBase>(this->base_offset)->counters_offset);
+}
+
+const atomic<uint64_t>* CountMinSketch::counters() const {
+  auto p = this->allocator->get_pool();
+  return p->at<atomic<uint64_t>>(
+      p->at<CountMinSketchBase>(this->base_offset)->counters_offset);
+}
+
+} // namespace sharedstructures
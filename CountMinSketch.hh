@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "Allocator.hh"
+
+namespace sharedstructures {
+
+
+// CountMinSketch estimates how many times each key has been added, using a
+// fixed amount of memory regardless of how many distinct keys there are. it's
+// a grid of depth rows of 2^bits counters; each key maps to one counter in each
+// row. estimates are never lower than the true count, and exceed it by at most
+// e * total() / 2^bits with probability 1 - e^-depth.
+//
+// adds and estimates don't take the pool lock; counters are updated with
+// atomic adds, so any number of processes can add keys concurrently.
+
+class CountMinSketch {
+public:
+  CountMinSketch() = delete;
+  CountMinSketch(const CountMinSketch&) = delete;
+  CountMinSketch(CountMinSketch&&) = delete;
+
+  // create constructor - allocates a new sketch with depth rows of 2^bits
+  // counters each (so it uses depth * 2^(bits + 3) bytes). bits must be between
+  // 1 and 32, and depth must be between 1 and 16.
+  CountMinSketch(std::shared_ptr<Allocator> allocator, uint8_t bits,
+      uint8_t depth);
+  // (conditional) create constructor.
+  // opens an existing CountMinSketch using the given allocator. if base_offset
+  // is 0, opens the CountMinSketch at the allocator's base offset. if the
+  // allocator's base offset is also 0, creates a new CountMinSketch and sets
+  // the allocator's base offset to the new sketch's base offset. bits and depth
+  // are ignored if the sketch already exists.
+  CountMinSketch(std::shared_ptr<Allocator> allocator, uint64_t base_offset,
+      uint8_t bits, uint8_t depth);
+  ~CountMinSketch() = default;
+
+  // returns the allocator for this sketch
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this sketch
+  uint64_t base() const;
+
+  // adds count occurrences of a key, returning the key's new estimated count.
+  uint64_t add(const void* k, size_t k_size, uint64_t count);
+  uint64_t add(const std::string& k, uint64_t count = 1);
+
+  // returns the estimated number of occurrences of a key.
+  uint64_t estimate(const void* k, size_t k_size) const;
+  uint64_t estimate(const std::string& k) const;
+
+  // adds all the counts from another sketch to this one. the two sketches must
+  // have the same dimensions, but they don't have to be in the same pool. this
+  // doesn't lock either pool.
+  void merge(const CountMinSketch& other);
+
+  // resets all counters to zero. this isn't atomic with respect to concurrent
+  // adds; adds that run during a clear() may be partially counted.
+  void clear();
+
+  // inspection methods.
+  uint64_t total() const; // sum of all counts added
+  uint8_t bits() const; // counters per row factor
+  uint8_t depth() const; // row count
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+
+  struct CountMinSketchBase {
+    uint8_t bits;
+    uint8_t depth;
+    uint8_t unused[6];
+    std::atomic<uint64_t> total;
+    uint64_t counters_offset;
+  };
+
+  uint64_t create_sketch_base(uint8_t bits, uint8_t depth);
+
+  std::atomic<uint64_t>* counters();
+  const std::atomic<uint64_t>* counters() const;
+};
+
+} // namespace sharedstructures
@@ -0,0 +1,217 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "CountMinSketch.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-cms"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  CountMinSketch cms(alloc, 0, 10, 4);
+
+  expect_eq(10, cms.bits());
+  expect_eq(4, cms.depth());
+  expect_eq(0, cms.total());
+  expect_eq(0, cms.estimate("key1"));
+
+  // with few keys, there are no collisions so the counts are exact
+  expect_eq(1, cms.add("key1"));
+  expect_eq(2, cms.add("key1"));
+  expect_eq(10, cms.add("key2", 10));
+  expect_eq(2, cms.estimate("key1"));
+  expect_eq(10, cms.estimate("key2"));
+  expect_eq(12, cms.total());
+
+  // with many keys, estimates are never too low, and are rarely much too high.
+  // with 1024 counters per row, the expected overestimate is at most about
+  // e * total / 1024
+  for (size_t x = 0; x < 1000; x++) {
+    cms.add(string_printf("key-%zu", x), x % 10 + 1);
+  }
+  size_t max_error = 2.72 * cms.total() / 1024;
+  size_t num_bad_estimates = 0;
+  for (size_t x = 0; x < 1000; x++) {
+    uint64_t estimate = cms.estimate(string_printf("key-%zu", x));
+    expect_le(x % 10 + 1, estimate);
+    num_bad_estimates += (estimate > x % 10 + 1 + max_error);
+  }
+  expect_gt(20, num_bad_estimates);
+
+  // opening the sketch again gives the same estimates
+  {
+    CountMinSketch cms2(alloc, cms.base(), 0, 0);
+    expect_eq(cms.total(), cms2.total());
+    expect_eq(cms.estimate("key2"), cms2.estimate("key2"));
+  }
+
+  cms.clear();
+  expect_eq(0, cms.total());
+  expect_eq(0, cms.estimate("key1"));
+  expect_eq(0, cms.estimate("key2"));
+}
+
+
+void run_merge_test(const string& allocator_type) {
+  printf("-- [%s] merge\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-cms"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  CountMinSketch cms1(alloc, 8, 4);
+  CountMinSketch cms2(alloc, 8, 4);
+  CountMinSketch cms3(alloc, 8, 3);
+
+  cms1.add("key1", 5);
+  cms1.add("key2", 3);
+  cms2.add("key1", 7);
+  cms2.add("key3", 1);
+
+  cms1.merge(cms2);
+  expect_eq(12, cms1.estimate("key1"));
+  expect_eq(3, cms1.estimate("key2"));
+  expect_eq(1, cms1.estimate("key3"));
+  expect_eq(16, cms1.total());
+  expect_eq(7, cms2.estimate("key1"));
+
+  try {
+    cms1.merge(cms3);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+}
+
+
+void run_invalid_parameters_test(const string& allocator_type) {
+  printf("-- [%s] invalid parameters\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-cms"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+
+  try {
+    CountMinSketch cms(alloc, 0, 4);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    CountMinSketch cms(alloc, 33, 4);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    CountMinSketch cms(alloc, 8, 0);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    CountMinSketch cms(alloc, 8, 17);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+}
+
+
+void run_concurrent_adds_test(const string& allocator_type) {
+  printf("-- [%s] concurrent adds\n", allocator_type.c_str());
+
+  uint64_t base_offset;
+  {
+    shared_ptr<Pool> pool(new Pool("test-cms"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    CountMinSketch cms(alloc, 0, 8, 4);
+    base_offset = cms.base();
+  }
+
+  unordered_set<pid_t> child_pids;
+  while ((child_pids.size() < 8) && !child_pids.count(0)) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      break;
+    } else {
+      child_pids.emplace(pid);
+    }
+  }
+
+  if (child_pids.count(0)) {
+    // all children increment the same keys, so no increments may be lost
+    shared_ptr<Pool> pool(new Pool("test-cms"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    CountMinSketch cms(alloc, base_offset, 0, 0);
+    for (size_t x = 0; x < 1000; x++) {
+      cms.add("key1");
+      cms.add("key2", 2);
+    }
+    _exit(0);
+
+  } else {
+    int num_failures = 0;
+    int exit_status;
+    pid_t exited_pid;
+    while ((exited_pid = wait(&exit_status)) != -1) {
+      child_pids.erase(exited_pid);
+      if (!WIFEXITED(exit_status) || (WEXITSTATUS(exit_status) != 0)) {
+        printf("-- [%s]   child %d failed (%d)\n", allocator_type.c_str(),
+            exited_pid, exit_status);
+        num_failures++;
+      }
+    }
+    expect_eq(true, child_pids.empty());
+    expect_eq(0, num_failures);
+
+    shared_ptr<Pool> pool(new Pool("test-cms"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    CountMinSketch cms(alloc, base_offset, 0, 0);
+    expect_eq(8000, cms.estimate("key1"));
+    expect_eq(16000, cms.estimate("key2"));
+    expect_eq(24000, cms.total());
+  }
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      Pool::delete_pool("test-cms");
+      run_basic_test(allocator_type);
+      Pool::delete_pool("test-cms");
+      run_merge_test(allocator_type);
+      Pool::delete_pool("test-cms");
+      run_invalid_parameters_test(allocator_type);
+      Pool::delete_pool("test-cms");
+      run_concurrent_adds_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  Pool::delete_pool("test-cms");
+
+  return retcode;
+}
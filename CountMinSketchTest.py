@@ -0,0 +1,119 @@
+from __future__ import unicode_literals
+
+import os
+import sys
+
+import sharedstructures
+
+
+def run_basic_test(allocator_type):
+  print('-- [%s] basic' % allocator_type)
+
+  cms = sharedstructures.CountMinSketch('test-cms', allocator_type, 0, 10, 4)
+  assert 10 == cms.bits()
+  assert 4 == cms.depth()
+  assert 0 == cms.total()
+  assert 0 == cms[b'key1']
+
+  assert 1 == cms.add(b'key1')
+  assert 2 == cms.add(b'key1')
+  assert 10 == cms.add(b'key2', 10)
+  assert 2 == cms[b'key1']
+  assert 10 == cms.estimate(b'key2')
+  assert 12 == cms.total()
+
+  for x in range(1000):
+    cms.add(b'key-%d' % x, x % 10 + 1)
+  for x in range(1000):
+    assert cms[b'key-%d' % x] >= x % 10 + 1
+
+  try:
+    cms['not-bytes']
+    assert False, 'cms[unicode] did not raise TypeError'
+  except TypeError:
+    pass
+
+  cms.clear()
+  assert 0 == cms.total()
+  assert 0 == cms[b'key1']
+
+
+def run_merge_test(allocator_type):
+  print('-- [%s] merge' % allocator_type)
+
+  cms1 = sharedstructures.CountMinSketch('test-cms', allocator_type, 0, 8, 4)
+  cms2 = sharedstructures.CountMinSketch('test-cms2', allocator_type, 0, 8, 4)
+  cms3 = sharedstructures.CountMinSketch('test-cms3', allocator_type, 0, 8, 3)
+
+  cms1.add(b'key1', 5)
+  cms2.add(b'key1', 7)
+  cms2.add(b'key2', 1)
+  cms1.merge(cms2)
+  assert 12 == cms1[b'key1']
+  assert 1 == cms1[b'key2']
+  assert 13 == cms1.total()
+
+  try:
+    cms1.merge(cms3)
+    assert False, 'merge() with different dimensions did not raise ValueError'
+  except ValueError:
+    pass
+
+
+def run_concurrent_adds_test(allocator_type):
+  print('-- [%s] concurrent adds' % allocator_type)
+
+  cms = sharedstructures.CountMinSketch('test-cms', allocator_type, 0, 8, 4)
+  del cms
+
+  child_pids = set()
+  while (len(child_pids) < 8) and (0 not in child_pids):
+    child_pids.add(os.fork())
+
+  if 0 in child_pids:
+    # child process: all children increment the same key
+    cms = sharedstructures.CountMinSketch('test-cms', allocator_type)
+    for x in range(1000):
+      cms.add(b'key1')
+    os._exit(0)
+
+  else:
+    num_failures = 0
+    while child_pids:
+      pid, exit_status = os.wait()
+      child_pids.remove(pid)
+      if not os.WIFEXITED(exit_status) or (os.WEXITSTATUS(exit_status) != 0):
+        print('-- [%s]   child %d failed (%d)' % (
+            allocator_type, pid, exit_status))
+        num_failures += 1
+    assert 0 == num_failures
+
+    cms = sharedstructures.CountMinSketch('test-cms', allocator_type)
+    assert 8000 == cms[b'key1']
+    assert 8000 == cms.total()
+
+
+def delete_pools():
+  sharedstructures.delete_pool('test-cms')
+  sharedstructures.delete_pool('test-cms2')
+  sharedstructures.delete_pool('test-cms3')
+
+
+def main():
+  try:
+    for allocator_type in ('simple', 'logarithmic'):
+      delete_pools()
+      run_basic_test(allocator_type)
+      delete_pools()
+      run_merge_test(allocator_type)
+      delete_pools()
+      run_concurrent_adds_test(allocator_type)
+    print('all tests passed')
+    return 0
+
+  finally:
+    delete_pools()
+
+
+if __name__ == '__main__':
+  sys.exit(main())
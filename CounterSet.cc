@@ -0,0 +1,206 @@
+#include "CounterSet.hh"
+
+#include <sched.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+CounterSet::CounterSet(shared_ptr<Allocator> allocator, size_t max_counters,
+    size_t stripe_count) : allocator(allocator) {
+  auto g = this->allocator->lock(true);
+  this->base_offset = this->create_counter_set_base(max_counters,
+      stripe_count);
+  this->open_name_index();
+}
+
+CounterSet::CounterSet(shared_ptr<Allocator> allocator, uint64_t base_offset,
+    size_t max_counters, size_t stripe_count) : allocator(allocator),
+    base_offset(base_offset) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->create_counter_set_base(max_counters,
+          stripe_count);
+      this->allocator->set_base_object_offset(this->base_offset);
+    }
+  }
+  this->open_name_index();
+}
+
+
+shared_ptr<Allocator> CounterSet::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t CounterSet::base() const {
+  return this->base_offset;
+}
+
+
+size_t CounterSet::index_for_name(const string& name, bool create) {
+  return this->names->index_for_name(name, create);
+}
+
+
+void CounterSet::incr(const string& name, int64_t delta) {
+  this->incr(this->index_for_name(name), delta);
+}
+
+void CounterSet::incr(size_t index, int64_t delta) {
+  // we don't lock the pool, so it's not remapped for us if another process
+  // expanded it
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  if (index >= p->at<CounterSetBase>(this->base_offset)->counter_count) {
+    throw out_of_range("counter index out of range");
+  }
+
+  // the counters are unsigned so overflow is well-defined; they're converted
+  // back to signed values when read
+  this->cell(this->current_stripe(), index)->fetch_add(delta,
+      memory_order_relaxed);
+}
+
+
+int64_t CounterSet::get(const string& name) const {
+  return this->get(const_cast<CounterSet*>(this)->index_for_name(name, false));
+}
+
+int64_t CounterSet::get(size_t index) const {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  if (index >= p->at<CounterSetBase>(this->base_offset)->counter_count) {
+    throw out_of_range("counter index out of range");
+  }
+  return this->sum(index, false);
+}
+
+
+map<string, int64_t> CounterSet::get_all() const {
+  auto names = this->names->all_names();
+  map<string, int64_t> ret;
+  for (size_t x = 0; x < names.size(); x++) {
+    ret.emplace(names[x], this->sum(x, false));
+  }
+  return ret;
+}
+
+map<string, int64_t> CounterSet::snapshot_and_reset() {
+  auto names = this->names->all_names();
+  map<string, int64_t> ret;
+  for (size_t x = 0; x < names.size(); x++) {
+    ret.emplace(names[x], this->sum(x, true));
+  }
+  return ret;
+}
+
+
+size_t CounterSet::size() const {
+  return this->allocator->get_pool()->at<CounterSetBase>(
+      this->base_offset)->counter_count;
+}
+
+size_t CounterSet::max_counters() const {
+  return this->allocator->get_pool()->at<CounterSetBase>(
+      this->base_offset)->max_counters;
+}
+
+size_t CounterSet::stripe_count() const {
+  return this->allocator->get_pool()->at<CounterSetBase>(
+      this->base_offset)->stripe_count;
+}
+
+
+void CounterSet::open_name_index() {
+  // the set may have been created by another process after we mapped the pool
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  const CounterSetBase* base = p->at<CounterSetBase>(this->base_offset);
+  this->names.reset(new NameIndex(this->allocator,
+      this->base_offset + offsetof(CounterSetBase, counter_count),
+      base->names_offset, base->max_counters, "counter set is full"));
+}
+
+uint64_t CounterSet::create_counter_set_base(size_t max_counters,
+    size_t stripe_count) {
+  if (max_counters == 0) {
+    throw invalid_argument("max_counters must be nonzero");
+  }
+  if (stripe_count == 0) {
+    long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+    stripe_count = (cpu_count > 0) ? cpu_count : 1;
+  }
+
+  auto p = this->allocator->get_pool();
+
+  uint64_t stripe_size = (max_counters * sizeof(uint64_t) + 63) & ~63;
+  uint64_t base_offset = this->allocator->allocate(sizeof(CounterSetBase));
+  uint64_t names_offset = this->allocator->allocate(
+      max_counters * sizeof(uint64_t));
+  uint64_t allocated_offset = this->allocator->allocate(
+      stripe_count * stripe_size + 56);
+
+  // the pool is always mapped at a page boundary, so aligning the offset also
+  // aligns the address
+  uint64_t stripes_offset = (allocated_offset + 63) & ~63;
+
+  CounterSetBase* base = p->at<CounterSetBase>(base_offset);
+  base->max_counters = max_counters;
+  base->stripe_count = stripe_count;
+  base->counter_count = 0;
+  base->names_offset = names_offset;
+  base->allocated_offset = allocated_offset;
+  base->stripes_offset = stripes_offset;
+  base->stripe_size = stripe_size;
+
+  memset(p->at<uint8_t>(names_offset), 0, max_counters * sizeof(uint64_t));
+  memset(p->at<uint8_t>(stripes_offset), 0, stripe_count * stripe_size);
+
+  return base_offset;
+}
+
+
+atomic<uint64_t>* CounterSet::cell(size_t stripe, size_t index) const {
+  auto p = this->allocator->get_pool();
+  const CounterSetBase* base = p->at<CounterSetBase>(this->base_offset);
+  return p->at<atomic<uint64_t>>(base->stripes_offset +
+      stripe * base->stripe_size + index * sizeof(uint64_t));
+}
+
+size_t CounterSet::current_stripe() const {
+  size_t stripe_count = this->stripe_count();
+#ifdef LINUX
+  int cpu = sched_getcpu();
+  if (cpu >= 0) {
+    return cpu % stripe_count;
+  }
+#endif
+  return getpid() % stripe_count;
+}
+
+int64_t CounterSet::sum(size_t index, bool reset) const {
+  size_t stripe_count = this->stripe_count();
+
+  uint64_t ret = 0;
+  for (size_t x = 0; x < stripe_count; x++) {
+    auto* c = this->cell(x, index);
+    ret += reset ? c->exchange(0, memory_order_relaxed) :
+        c->load(memory_order_relaxed);
+  }
+  return ret;
+}
+
+} // namespace sharedstructures
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "Allocator.hh"
+#include "NameIndex.hh"
+
+namespace sharedstructures {
+
+
+// CounterSet is a fixed-capacity set of named 64-bit counters, designed for
+// metrics that are incremented very frequently by many processes. each counter
+// is split into stripes; a process increments only the stripe for the CPU it's
+// running on (or, on systems where that isn't available, a stripe chosen by
+// its pid), and reads sum all the stripes. each stripe's counters are on their
+// own cache lines, so increments on different CPUs don't contend with each
+// other, and increments never take the pool lock.
+//
+// counters are created the first time they're referenced by name, which takes
+// the pool lock once per counter. counters can't be deleted. each process
+// caches the name -> index mapping, so after the first reference, incrementing
+// by name costs a hash lookup and a relaxed atomic add; incrementing by index
+// avoids the hash lookup too.
+
+class CounterSet {
+public:
+  CounterSet() = delete;
+  CounterSet(const CounterSet&) = delete;
+  CounterSet(CounterSet&&) = delete;
+
+  // create constructor - allocates a new counter set that can hold up to
+  // max_counters counters. if stripe_count is 0, uses one stripe per CPU.
+  CounterSet(std::shared_ptr<Allocator> allocator, size_t max_counters,
+      size_t stripe_count);
+  // (conditional) create constructor.
+  // opens an existing CounterSet using the given allocator. if base_offset is
+  // 0, opens the CounterSet at the allocator's base offset. if the allocator's
+  // base offset is also 0, creates a new CounterSet and sets the allocator's
+  // base offset to the new set's base offset. max_counters and stripe_count are
+  // ignored if the set already exists.
+  CounterSet(std::shared_ptr<Allocator> allocator, uint64_t base_offset,
+      size_t max_counters, size_t stripe_count);
+  ~CounterSet() = default;
+
+  // returns the allocator for this counter set
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this counter set
+  uint64_t base() const;
+
+  // returns the index of the named counter. if it doesn't exist, creates it if
+  // create is true, or throws std::out_of_range if not. throws
+  // std::runtime_error if the set is full.
+  size_t index_for_name(const std::string& name, bool create = true);
+
+  // adds delta to a counter. the counter is created if it doesn't exist.
+  void incr(const std::string& name, int64_t delta = 1);
+  void incr(size_t index, int64_t delta = 1);
+
+  // returns the current value of a counter. throws std::out_of_range if it
+  // doesn't exist. this isn't atomic with respect to concurrent increments;
+  // increments that run during the read may or may not be included.
+  int64_t get(const std::string& name) const;
+  int64_t get(size_t index) const;
+
+  // returns the values of all counters.
+  std::map<std::string, int64_t> get_all() const;
+
+  // returns the values of all counters and resets them to zero. each increment
+  // is included in exactly one snapshot, even if it runs concurrently with the
+  // snapshot.
+  std::map<std::string, int64_t> snapshot_and_reset();
+
+  // inspection methods.
+  size_t size() const; // counter count
+  size_t max_counters() const;
+  size_t stripe_count() const;
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+
+  // maps counter names to indexes; see NameIndex
+  std::unique_ptr<NameIndex> names;
+
+  struct CounterSetBase {
+    uint64_t max_counters;
+    uint64_t stripe_count;
+    // the number of counters that have names. this is incremented after the
+    // name is written, so readers can look up names without locking.
+    std::atomic<uint64_t> counter_count;
+    // array of max_counters offsets of name strings
+    uint64_t names_offset;
+    // the stripes must be aligned to cache lines, but the allocator only
+    // guarantees 8-byte alignment, so we allocate extra space and align the
+    // stripes within it
+    uint64_t allocated_offset;
+    uint64_t stripes_offset;
+    // bytes per stripe (max_counters * 8, rounded up to a cache line)
+    uint64_t stripe_size;
+  };
+
+  void open_name_index();
+  uint64_t create_counter_set_base(size_t max_counters, size_t stripe_count);
+
+  std::atomic<uint64_t>* cell(size_t stripe, size_t index) const;
+  size_t current_stripe() const;
+  int64_t sum(size_t index, bool reset) const;
+};
+
+} // namespace sharedstructures
@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "CounterSet.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-counters"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  CounterSet counters(alloc, 0, 4, 3);
+
+  expect_eq(0, counters.size());
+  expect_eq(4, counters.max_counters());
+  expect_eq(3, counters.stripe_count());
+
+  try {
+    counters.get("requests");
+    expect(false);
+  } catch (const out_of_range& e) { }
+  try {
+    counters.index_for_name("requests", false);
+    expect(false);
+  } catch (const out_of_range& e) { }
+
+  counters.incr("requests");
+  counters.incr("requests", 4);
+  counters.incr("errors", -2);
+  counters.incr("", 7);
+  expect_eq(3, counters.size());
+  expect_eq(5, counters.get("requests"));
+  expect_eq(-2, counters.get("errors"));
+  expect_eq(7, counters.get(""));
+
+  size_t errors_index = counters.index_for_name("errors");
+  expect_eq(1, errors_index);
+  counters.incr(errors_index, 3);
+  expect_eq(1, counters.get(errors_index));
+
+  try {
+    counters.incr(3);
+    expect(false);
+  } catch (const out_of_range& e) { }
+
+  // another instance sees the same counters at the same indexes
+  {
+    CounterSet counters2(alloc, counters.base(), 0, 0);
+    expect_eq(1, counters2.index_for_name("errors", false));
+    counters2.incr("requests", 10);
+    expect_eq(15, counters.get("requests"));
+  }
+
+  map<string, int64_t> expected({{"requests", 15}, {"errors", 1}, {"", 7}});
+  expect_eq(expected, counters.get_all());
+  expect_eq(expected, counters.snapshot_and_reset());
+
+  // after a reset, the counters still exist but are zero
+  expected = {{"requests", 0}, {"errors", 0}, {"", 0}};
+  expect_eq(expected, counters.get_all());
+
+  // the set can hold only 4 counters
+  counters.incr("latency");
+  try {
+    counters.incr("overflow");
+    expect(false);
+  } catch (const runtime_error& e) { }
+  expect_eq(4, counters.size());
+}
+
+
+void run_concurrent_incr_test(const string& allocator_type) {
+  printf("-- [%s] concurrent incr\n", allocator_type.c_str());
+
+  uint64_t base_offset;
+  {
+    shared_ptr<Pool> pool(new Pool("test-counters"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    CounterSet counters(alloc, 0, 16, 0);
+    base_offset = counters.base();
+  }
+
+  unordered_set<pid_t> child_pids;
+  while ((child_pids.size() < 8) && !child_pids.count(0)) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      break;
+    } else {
+      child_pids.emplace(pid);
+    }
+  }
+
+  if (child_pids.count(0)) {
+    // child process: all children create and increment the same counters
+    shared_ptr<Pool> pool(new Pool("test-counters"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    CounterSet counters(alloc, base_offset, 0, 0);
+    for (size_t x = 0; x < 10000; x++) {
+      counters.incr("hits");
+      counters.incr("bytes", 3);
+    }
+    _exit(0);
+
+  } else {
+    shared_ptr<Pool> pool(new Pool("test-counters"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    CounterSet counters(alloc, base_offset, 0, 0);
+
+    // take snapshots while the children are running. no increments may be lost
+    // or counted twice
+    int64_t hits = 0, bytes = 0;
+    for (size_t x = 0; x < 100; x++) {
+      auto snapshot = counters.snapshot_and_reset();
+      hits += snapshot["hits"];
+      bytes += snapshot["bytes"];
+      usleep(100);
+    }
+
+    int num_failures = 0;
+    int exit_status;
+    pid_t exited_pid;
+    while ((exited_pid = wait(&exit_status)) != -1) {
+      child_pids.erase(exited_pid);
+      if (!WIFEXITED(exit_status) || (WEXITSTATUS(exit_status) != 0)) {
+        printf("-- [%s]   child %d failed (%d)\n", allocator_type.c_str(),
+            exited_pid, exit_status);
+        num_failures++;
+      }
+    }
+    expect_eq(true, child_pids.empty());
+    expect_eq(0, num_failures);
+
+    auto snapshot = counters.snapshot_and_reset();
+    hits += snapshot["hits"];
+    bytes += snapshot["bytes"];
+    expect_eq(80000, hits);
+    expect_eq(240000, bytes);
+    expect_eq(2, counters.size());
+  }
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      Pool::delete_pool("test-counters");
+      run_basic_test(allocator_type);
+      Pool::delete_pool("test-counters");
+      run_concurrent_incr_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  Pool::delete_pool("test-counters");
+
+  return retcode;
+}
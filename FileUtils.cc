@@ -0,0 +1,85 @@
+#include "FileUtils.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+void pwrite_all(int fd, const void* data, size_t size, off_t offset,
+    const string& filename) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  while (size) {
+    ssize_t bytes_written = pwrite(fd, bytes, size, offset);
+    if (bytes_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw runtime_error("can\'t write to " + filename + ": " +
+          string_for_error(errno));
+    }
+    bytes += bytes_written;
+    size -= bytes_written;
+    offset += bytes_written;
+  }
+}
+
+bool pread_all(int fd, void* data, size_t size, off_t offset,
+    const string& filename) {
+  uint8_t* bytes = reinterpret_cast<uint8_t*>(data);
+  while (size) {
+    ssize_t bytes_read = pread(fd, bytes, size, offset);
+    if (bytes_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw runtime_error("can\'t read from " + filename + ": " +
+          string_for_error(errno));
+    }
+    if (bytes_read == 0) {
+      return false;
+    }
+    bytes += bytes_read;
+    size -= bytes_read;
+    offset += bytes_read;
+  }
+  return true;
+}
+
+
+void sync_file(int fd, const string& filename) {
+  if (fdatasync(fd)) {
+    throw runtime_error("can\'t sync " + filename + ": " +
+        string_for_error(errno));
+  }
+}
+
+void replace_file(const string& temp_filename, const string& filename) {
+  if (rename(temp_filename.c_str(), filename.c_str())) {
+    throw runtime_error("can\'t rename " + temp_filename + " to " + filename +
+        ": " + string_for_error(errno));
+  }
+
+  // renames aren't durable until the directory is synced
+  size_t slash_pos = filename.rfind('/');
+  string dirname = (slash_pos == string::npos) ? "." :
+      filename.substr(0, slash_pos + 1);
+  scoped_fd dir_fd = open(dirname.c_str(), O_RDONLY);
+  if (dir_fd == -1) {
+    throw cannot_open_file(dirname);
+  }
+  if (fsync(dir_fd)) {
+    throw runtime_error("can\'t sync " + dirname + ": " +
+        string_for_error(errno));
+  }
+}
+
+} // namespace sharedstructures
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+namespace sharedstructures {
+
+
+// file helpers for the structures that write data outside of pools (logs and
+// checkpoints). filename is only used in error messages. all of these throw
+// std::runtime_error on failure.
+
+// writes all of the given data at the given offset, retrying short writes.
+void pwrite_all(int fd, const void* data, size_t size, off_t offset,
+    const std::string& filename);
+// reads exactly size bytes at the given offset. returns false if the file ends
+// before that many bytes are read.
+bool pread_all(int fd, void* data, size_t size, off_t offset,
+    const std::string& filename);
+
+// calls fdatasync on the file.
+void sync_file(int fd, const std::string& filename);
+// renames temp_filename to filename, then syncs the directory containing it so
+// the rename is durable. the temporary file should already be synced.
+void replace_file(const std::string& temp_filename,
+    const std::string& filename);
+
+} // namespace sharedstructures
@@ -0,0 +1,206 @@
+#include "Filter.hh"
+
+#include <math.h>
+#include <stddef.h>
+
+#include <stdexcept>
+
+#include "Hash.hh"
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+// each block has 512 bits. the low bits of the mixed hash choose the block,
+// and the high 32 bits generate the probe sequence within the block by double
+// hashing. the step is odd, so the probes within a block are all distinct as
+// long as hash_count <= 512.
+struct ProbeSequence {
+  uint64_t block_index;
+  uint16_t start;
+  uint16_t step;
+
+  ProbeSequence(const void* k, size_t k_size, uint8_t bits) {
+    uint64_t h = mix64(fnv1a64(k, k_size));
+    this->block_index = h & ((1ULL << bits) - 1);
+    this->start = (h >> 32) & 0x1FF;
+    this->step = ((h >> 41) & 0x1FF) | 1;
+  }
+
+  uint16_t bit_for_probe(uint8_t probe) const {
+    return (this->start + probe * this->step) & 0x1FF;
+  }
+};
+
+
+Filter::Filter(shared_ptr<Allocator> allocator, uint8_t bits,
+    uint8_t hash_count) : allocator(allocator) {
+  auto g = this->allocator->lock(true);
+  this->base_offset = this->create_filter_base(bits, hash_count);
+}
+
+Filter::Filter(shared_ptr<Allocator> allocator, uint64_t base_offset,
+    uint8_t bits, uint8_t hash_count) : allocator(allocator),
+    base_offset(base_offset) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->create_filter_base(bits, hash_count);
+      this->allocator->set_base_object_offset(this->base_offset);
+    }
+  }
+}
+
+
+shared_ptr<Allocator> Filter::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t Filter::base() const {
+  return this->base_offset;
+}
+
+
+void Filter::insert(const void* k, size_t k_size) {
+  // we don't lock the pool, so it's not remapped for us if another process
+  // expanded it (e.g. when the filter shares a pool with other structures)
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  FilterBase* base = p->at<FilterBase>(this->base_offset);
+  ProbeSequence probes(k, k_size, base->bits);
+  Block* block = p->at<Block>(base->blocks_offset +
+      probes.block_index * sizeof(Block));
+
+  // set all the bits, noting whether any of them weren't already set. the
+  // ordering here doesn't matter; readers only need to see the bits by the time
+  // the caller publishes the key somewhere else, and that publication will
+  // provide the necessary ordering
+  bool set_new_bit = false;
+  for (uint8_t x = 0; x < base->hash_count; x++) {
+    uint16_t bit = probes.bit_for_probe(x);
+    uint64_t mask = 1ULL << (bit & 0x3F);
+    auto& word = block->words[bit >> 6];
+    if (!(word.load(memory_order_relaxed) & mask)) {
+      set_new_bit |= !(word.fetch_or(mask, memory_order_relaxed) & mask);
+    }
+  }
+
+  if (set_new_bit) {
+    base->item_count.fetch_add(1, memory_order_relaxed);
+  }
+}
+
+void Filter::insert(const string& k) {
+  this->insert(k.data(), k.size());
+}
+
+
+bool Filter::may_contain(const void* k, size_t k_size) const {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  const FilterBase* base = p->at<FilterBase>(this->base_offset);
+  ProbeSequence probes(k, k_size, base->bits);
+  const Block* block = p->at<Block>(base->blocks_offset +
+      probes.block_index * sizeof(Block));
+
+  for (uint8_t x = 0; x < base->hash_count; x++) {
+    uint16_t bit = probes.bit_for_probe(x);
+    if (!(block->words[bit >> 6].load(memory_order_relaxed) &
+        (1ULL << (bit & 0x3F)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Filter::may_contain(const string& k) const {
+  return this->may_contain(k.data(), k.size());
+}
+
+
+void Filter::clear() {
+  auto p = this->allocator->get_pool();
+  FilterBase* base = p->at<FilterBase>(this->base_offset);
+  Block* blocks = p->at<Block>(base->blocks_offset);
+
+  for (size_t x = 0; x < (1ULL << base->bits); x++) {
+    for (size_t y = 0; y < 8; y++) {
+      blocks[x].words[y].store(0, memory_order_relaxed);
+    }
+  }
+  base->item_count = 0;
+}
+
+
+size_t Filter::size() const {
+  return this->allocator->get_pool()->at<FilterBase>(
+      this->base_offset)->item_count;
+}
+
+uint8_t Filter::bits() const {
+  return this->allocator->get_pool()->at<FilterBase>(this->base_offset)->bits;
+}
+
+uint8_t Filter::hash_count() const {
+  return this->allocator->get_pool()->at<FilterBase>(
+      this->base_offset)->hash_count;
+}
+
+double Filter::false_positive_rate() const {
+  const FilterBase* base = this->allocator->get_pool()->at<FilterBase>(
+      this->base_offset);
+
+  // this is the standard bloom filter approximation, applied to a single block
+  // with the average number of keys per block. it underestimates the real rate
+  // slightly since keys aren't distributed perfectly evenly between blocks.
+  double keys_per_block = (double)base->item_count / (1ULL << base->bits);
+  return pow(1.0 - exp(-base->hash_count * keys_per_block / 512.0),
+      base->hash_count);
+}
+
+
+uint64_t Filter::create_filter_base(uint8_t bits, uint8_t hash_count) {
+  if (bits > 32) {
+    throw invalid_argument("bits must be <= 32");
+  }
+  if (hash_count < 1 || hash_count > 16) {
+    throw invalid_argument("hash_count must be between 1 and 16");
+  }
+
+  auto p = this->allocator->get_pool();
+
+  size_t blocks_size = (1ULL << bits) * sizeof(Block);
+  uint64_t base_offset = this->allocator->allocate(sizeof(FilterBase));
+  uint64_t allocated_offset = this->allocator->allocate(
+      blocks_size + sizeof(Block) - 8);
+
+  // the pool is always mapped at a page boundary, so aligning the offset also
+  // aligns the address
+  uint64_t blocks_offset = (allocated_offset + sizeof(Block) - 1) &
+      ~(sizeof(Block) - 1);
+
+  FilterBase* base = p->at<FilterBase>(base_offset);
+  base->bits = bits;
+  base->hash_count = hash_count;
+  base->item_count = 0;
+  base->allocated_offset = allocated_offset;
+  base->blocks_offset = blocks_offset;
+
+  Block* blocks = p->at<Block>(blocks_offset);
+  for (size_t x = 0; x < (1ULL << bits); x++) {
+    for (size_t y = 0; y < 8; y++) {
+      blocks[x].words[y] = 0;
+    }
+  }
+
+  return base_offset;
+}
+
+} // namespace sharedstructures
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "Allocator.hh"
+
+namespace sharedstructures {
+
+
+// Filter is a blocked bloom filter. each key maps to exactly one 64-byte block
+// (one cache line), and sets hash_count bits within that block, so inserts and
+// lookups each touch only one cache line. neither inserts nor lookups take the
+// pool lock - inserts are implemented as atomic ORs, so they can run
+// concurrently with each other and with lookups from any process.
+//
+// like all bloom filters, this can return false positives (may_contain returns
+// true for a key that was never inserted) but never false negatives. keys can't
+// be removed; the only way to reduce the false positive rate after many erases
+// is to clear the filter and reinsert the remaining keys.
+
+class Filter {
+public:
+  Filter() = delete;
+  Filter(const Filter&) = delete;
+  Filter(Filter&&) = delete;
+
+  // create constructor - allocates a new filter with 2^bits blocks (so it uses
+  // 2^(bits + 6) bytes), which sets hash_count bits for each key.
+  Filter(std::shared_ptr<Allocator> allocator, uint8_t bits,
+      uint8_t hash_count);
+  // (conditional) create constructor.
+  // opens an existing Filter using the given allocator. if base_offset is 0,
+  // opens the Filter at the allocator's base offset. if the allocator's base
+  // offset is also 0, creates a new Filter and sets the allocator's base offset
+  // to the new filter's base offset. bits and hash_count are ignored if the
+  // filter already exists.
+  Filter(std::shared_ptr<Allocator> allocator, uint64_t base_offset,
+      uint8_t bits, uint8_t hash_count);
+  ~Filter() = default;
+
+  // returns the allocator for this filter
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this filter
+  uint64_t base() const;
+
+  // adds a key to the filter. this doesn't lock the pool.
+  void insert(const void* k, size_t k_size);
+  void insert(const std::string& k);
+
+  // returns false if the key was definitely never inserted, or true if it may
+  // have been. this doesn't lock the pool.
+  bool may_contain(const void* k, size_t k_size) const;
+  bool may_contain(const std::string& k) const;
+
+  // clears all the bits in the filter. this isn't atomic with respect to
+  // concurrent inserts and lookups; lookups that run during a clear() may
+  // return false for keys that were inserted before the clear() began.
+  void clear();
+
+  // inspection methods.
+  // returns the approximate number of distinct keys inserted. keys whose bits
+  // were all already set when they were inserted aren't counted.
+  size_t size() const;
+  uint8_t bits() const; // block count factor
+  uint8_t hash_count() const; // bits set per key
+  // returns the expected false positive rate for the current size
+  double false_positive_rate() const;
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+
+  struct Block {
+    std::atomic<uint64_t> words[8];
+  };
+
+  struct FilterBase {
+    uint8_t bits;
+    uint8_t hash_count;
+    uint8_t unused[6];
+    // this is only incremented when an insert sets at least one new bit, so it
+    // doesn't become a contention point for repeated inserts of the same keys
+    std::atomic<uint64_t> item_count;
+    // the blocks must be aligned to cache lines, but the allocator only
+    // guarantees 8-byte alignment, so we allocate extra space and align the
+    // blocks within it
+    uint64_t allocated_offset;
+    uint64_t blocks_offset;
+  };
+
+  uint64_t create_filter_base(uint8_t bits, uint8_t hash_count);
+};
+
+} // namespace sharedstructures
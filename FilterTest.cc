@@ -0,0 +1,336 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "Filter.hh"
+#include "HashTable.hh"
+#include "PrefixTree.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-filter"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  Filter filter(alloc, 0, 8, 6);
+
+  expect_eq(0, filter.size());
+  expect_eq(8, filter.bits());
+  expect_eq(6, filter.hash_count());
+  expect_eq(0.0, filter.false_positive_rate());
+
+  // there must be no false negatives
+  for (size_t x = 0; x < 10000; x++) {
+    filter.insert(string_printf("key%zu", x));
+  }
+  for (size_t x = 0; x < 10000; x++) {
+    expect(filter.may_contain(string_printf("key%zu", x)));
+  }
+
+  // some inserts may have collided completely with previous keys, but there
+  // shouldn't be many of them
+  expect_le(9900, filter.size());
+  expect_ge(10000, filter.size());
+
+  // 10000 keys in 256 blocks with 6 hashes should give a false positive rate
+  // of about 0.25%. blocked filters do a bit worse than that in practice since
+  // some blocks get more keys than others, but it should be close
+  size_t false_positives = 0;
+  for (size_t x = 0; x < 10000; x++) {
+    false_positives += filter.may_contain(string_printf("missing%zu", x));
+  }
+  double expected_rate = filter.false_positive_rate();
+  expect_lt(0.002, expected_rate);
+  expect_gt(0.003, expected_rate);
+  expect_gt(expected_rate * 3 * 10000, false_positives);
+
+  // reinserting existing keys doesn't change the size
+  size_t size = filter.size();
+  filter.insert("key0");
+  expect_eq(size, filter.size());
+
+  // opening the filter again gives the same contents
+  {
+    Filter filter2(alloc, filter.base(), 0, 0);
+    expect_eq(8, filter2.bits());
+    expect_eq(6, filter2.hash_count());
+    expect_eq(size, filter2.size());
+    expect(filter2.may_contain("key1"));
+  }
+
+  filter.clear();
+  expect_eq(0, filter.size());
+  for (size_t x = 0; x < 10000; x++) {
+    expect(!filter.may_contain(string_printf("key%zu", x)));
+  }
+}
+
+
+void run_invalid_parameters_test(const string& allocator_type) {
+  printf("-- [%s] invalid parameters\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-filter"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+
+  try {
+    Filter filter(alloc, 4, 0);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    Filter filter(alloc, 4, 17);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    Filter filter(alloc, 33, 4);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+}
+
+
+void run_concurrent_inserts_test(const string& allocator_type) {
+  printf("-- [%s] concurrent inserts\n", allocator_type.c_str());
+
+  uint64_t base_offset;
+  {
+    shared_ptr<Pool> pool(new Pool("test-filter"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    Filter filter(alloc, 0, 6, 4);
+    base_offset = filter.base();
+  }
+
+  unordered_set<pid_t> child_pids;
+  size_t child_index = 0;
+  while ((child_pids.size() < 8) && !child_pids.count(0)) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      break;
+    } else {
+      child_pids.emplace(pid);
+      if (pid) {
+        child_index++;
+      }
+    }
+  }
+
+  if (child_pids.count(0)) {
+    // child process: insert a disjoint set of keys without locking
+    shared_ptr<Pool> pool(new Pool("test-filter"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    Filter filter(alloc, base_offset, 0, 0);
+    for (size_t x = 0; x < 1000; x++) {
+      filter.insert(string_printf("key%zu-%zu", child_index, x));
+    }
+    _exit(0);
+
+  } else {
+    int num_failures = 0;
+    int exit_status;
+    pid_t exited_pid;
+    while ((exited_pid = wait(&exit_status)) != -1) {
+      child_pids.erase(exited_pid);
+      if (!WIFEXITED(exit_status) || (WEXITSTATUS(exit_status) != 0)) {
+        printf("-- [%s]   child %d failed (%d)\n", allocator_type.c_str(),
+            exited_pid, exit_status);
+        num_failures++;
+      }
+    }
+    expect_eq(true, child_pids.empty());
+    expect_eq(0, num_failures);
+
+    // all bits set by all children must be visible (no lost updates)
+    shared_ptr<Pool> pool(new Pool("test-filter"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    Filter filter(alloc, base_offset, 0, 0);
+    for (size_t y = 0; y < 8; y++) {
+      for (size_t x = 0; x < 1000; x++) {
+        expect(filter.may_contain(string_printf("key%zu-%zu", y, x)));
+      }
+    }
+  }
+}
+
+
+void run_attached_prefix_tree_test(const string& allocator_type) {
+  printf("-- [%s] attached to prefix tree\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-filter"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  PrefixTree tree(alloc, 0);
+
+  // keys inserted before the filter is attached are found only if the filter
+  // is populated when attached
+  tree.insert("key1", 4, "value1", 6);
+  tree.insert("key2", 4, (int64_t)2);
+
+  shared_ptr<Filter> filter(new Filter(alloc, 6, 4));
+  tree.attach_filter(filter, true);
+  expect_eq(filter.get(), tree.get_filter().get());
+  expect(filter->may_contain("key1"));
+  expect(filter->may_contain("key2"));
+  expect_eq(PrefixTree::LookupResult("value1"), tree.at("key1"));
+  expect_eq(PrefixTree::LookupResult((int64_t)2), tree.at("key2"));
+
+  tree.insert("key3", 4, 3.0);
+  expect(filter->may_contain("key3"));
+  tree.incr("key4", 4, (int64_t)4);
+  expect(filter->may_contain("key4"));
+  tree.incr("key5", 4, 5.0);
+  expect(filter->may_contain("key5"));
+  tree.insert("key6", 4, true);
+  tree.insert("key7", 4);
+  expect(filter->may_contain("key6"));
+  expect(filter->may_contain("key7"));
+  expect_eq(7, tree.size());
+  expect_eq(PrefixTree::ResultValueType::Double, tree.type("key3"));
+  expect_eq(PrefixTree::LookupResult((int64_t)4), tree.at("key4"));
+  expect_eq(true, tree.exists("key7"));
+
+  // failed check-and-set inserts don't add the key to the filter
+  PrefixTree::CheckRequest check("key1", 4, "wrong-value", 11);
+  expect_eq(false, tree.insert("key8", 4, "value8", 6, &check));
+  expect_eq(false, filter->may_contain("key8"));
+
+  // the filter is recorded in the tree, so other PrefixTree objects can't
+  // write to it without attaching the same filter
+  {
+    PrefixTree unfiltered_tree(alloc, tree.base());
+    try {
+      unfiltered_tree.insert("key9", 4, "value9", 6);
+      expect(false);
+    } catch (const runtime_error& e) { }
+    shared_ptr<Filter> other_filter(new Filter(alloc, 6, 4));
+    try {
+      unfiltered_tree.attach_filter(other_filter);
+      expect(false);
+    } catch (const invalid_argument& e) { }
+    unfiltered_tree.attach_filter(filter);
+    unfiltered_tree.insert("key10", 5, "value10", 7);
+    expect(filter->may_contain("key10"));
+  }
+
+  // missing keys are rejected by the filter, so they're never looked up in the
+  // tree. we verify this by detaching the filter (which stops requiring it)
+  // and putting a key in the tree through a different PrefixTree object; the
+  // object that still has the filter attached doesn't see it
+  {
+    PrefixTree unfiltered_tree(alloc, tree.base());
+    unfiltered_tree.attach_filter(nullptr);
+    unfiltered_tree.insert("key9", 4, "value9", 6);
+  }
+  if (!filter->may_contain("key9")) {
+    expect_eq(false, tree.exists("key9"));
+    expect_eq(PrefixTree::ResultValueType::Missing, tree.type("key9"));
+    try {
+      tree.at("key9");
+      expect(false);
+    } catch (const out_of_range& e) { }
+  }
+
+  // erased keys stay in the filter, but the tree still reports them missing
+  tree.erase("key1", 4);
+  expect_eq(false, tree.exists("key1"));
+
+  // detaching the filter makes all keys visible again
+  tree.attach_filter(nullptr);
+  expect_eq(PrefixTree::LookupResult("value9"), tree.at("key9"));
+}
+
+
+void run_attached_hash_table_test(const string& allocator_type) {
+  printf("-- [%s] attached to hash table\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-filter"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  HashTable table(alloc, 0, 4);
+
+  table.insert("key1", 4, "value1", 6);
+
+  shared_ptr<Filter> filter(new Filter(alloc, 6, 4));
+  table.attach_filter(filter, true);
+  expect_eq(filter.get(), table.get_filter().get());
+  expect(filter->may_contain("key1"));
+  expect_eq("value1", table.at("key1"));
+
+  table.insert("key2", 4, "value2", 6);
+  expect(filter->may_contain("key2"));
+  table.incr("key3", 4, (int64_t)3);
+  expect(filter->may_contain("key3"));
+  table.incr("key4", 4, 4.0);
+  expect(filter->may_contain("key4"));
+  expect_eq(true, table.exists("key2"));
+  expect_eq(4, table.size());
+
+  HashTable::CheckRequest check("key1", 4, "wrong-value", 11);
+  expect_eq(false, table.insert("key5", 4, "value5", 6, &check));
+  expect_eq(false, filter->may_contain("key5"));
+
+  {
+    HashTable unfiltered_table(alloc, table.base(), 0);
+    unfiltered_table.insert("key6", 4, "value6", 6);
+  }
+  if (!filter->may_contain("key6")) {
+    expect_eq(false, table.exists("key6"));
+    try {
+      table.at("key6");
+      expect(false);
+    } catch (const out_of_range& e) { }
+  }
+
+  table.attach_filter(nullptr);
+  expect_eq("value6", table.at("key6"));
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      Pool::delete_pool("test-filter");
+      run_basic_test(allocator_type);
+      Pool::delete_pool("test-filter");
+      run_invalid_parameters_test(allocator_type);
+      Pool::delete_pool("test-filter");
+      run_concurrent_inserts_test(allocator_type);
+      Pool::delete_pool("test-filter");
+      run_attached_prefix_tree_test(allocator_type);
+      Pool::delete_pool("test-filter");
+      run_attached_hash_table_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  Pool::delete_pool("test-filter");
+
+  return retcode;
+}
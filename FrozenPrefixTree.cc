@@ -0,0 +1,506 @@
+#include "FrozenPrefixTree.hh"
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <vector>
+
+#include "SimpleAllocator.hh"
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+FrozenPrefixTree::FrozenPrefixTree(shared_ptr<Allocator> allocator,
+    const PrefixTree& source) : allocator(allocator) {
+  // PrefixTree iterates in key order, so keys with a common prefix are
+  // adjacent, and a key comes before all the keys it's a prefix of
+  vector<pair<string, PrefixTree::LookupResult>> items;
+  for (const auto& it : source) {
+    items.emplace_back(it);
+  }
+  if (items.size() >= 0xFFFFFFFF) {
+    throw invalid_argument("tree has too many keys to freeze");
+  }
+
+  // build the nodes in breadth-first order. each queue entry is a node that
+  // covers the range of items whose keys begin with the node's key; its
+  // children are appended to the queue together, so they get consecutive
+  // indexes. the node's edge continues for as long as all of its items' keys
+  // are the same, so there are no nodes with one child and no value
+  struct QueueEntry {
+    uint32_t parent;
+    size_t depth; // length of the parent's key
+    size_t items_begin;
+    size_t items_end;
+  };
+  vector<QueueEntry> queue;
+  queue.emplace_back(QueueEntry({0, 0, 0, items.size()}));
+  vector<Node> nodes;
+  vector<uint8_t> labels;
+  string edges;
+  vector<Value> values(items.size());
+  uint64_t strings_size = 0;
+  for (size_t node_index = 0; node_index < queue.size(); node_index++) {
+    QueueEntry entry = queue[node_index];
+    if (node_index >= 0xFFFFFFFF) {
+      throw invalid_argument("tree has too many nodes to freeze");
+    }
+
+    Node node;
+    node.parent = entry.parent;
+    node.value_index = 0;
+    node.edge_offset = edges.size();
+    node.edge_size = 0;
+    node.value_type = static_cast<uint8_t>(
+        PrefixTree::ResultValueType::Missing);
+    node.unused = 0;
+
+    // the root has no edge. for other nodes, the keys are sorted, so the
+    // prefix common to all of them is the prefix common to the first and last
+    size_t depth = entry.depth;
+    if (node_index) {
+      const string& first_key = items[entry.items_begin].first;
+      const string& last_key = items[entry.items_end - 1].first;
+      labels.emplace_back(first_key[depth]);
+      size_t edge_end = depth + 1;
+      while ((edge_end < first_key.size()) && (edge_end < last_key.size()) &&
+          (first_key[edge_end] == last_key[edge_end])) {
+        edge_end++;
+      }
+      if (edge_end - depth - 1 > 0xFFFFFFFF) {
+        throw invalid_argument("key is too long to freeze");
+      }
+      node.edge_size = edge_end - depth - 1;
+      edges.append(first_key, depth + 1, node.edge_size);
+      depth = edge_end;
+    } else {
+      labels.emplace_back(0);
+    }
+    if (edges.size() > 0xFFFFFFFF) {
+      throw invalid_argument("tree has too much key data to freeze");
+    }
+
+    size_t item_index = entry.items_begin;
+    if ((item_index < entry.items_end) &&
+        (items[item_index].first.size() == depth)) {
+      const auto& result = items[item_index].second;
+      Value& value = values[item_index];
+      value.data = 0;
+      value.size = 0;
+      value.node_index = node_index;
+      switch (result.type) {
+        case PrefixTree::ResultValueType::String:
+          if (result.as_string.size() > 0xFFFFFFFF) {
+            throw invalid_argument("value is too large to freeze");
+          }
+          value.data = strings_size;
+          value.size = result.as_string.size();
+          strings_size += result.as_string.size();
+          break;
+        case PrefixTree::ResultValueType::Int:
+          value.data = result.as_int;
+          break;
+        case PrefixTree::ResultValueType::Double:
+          memcpy(&value.data, &result.as_double, sizeof(double));
+          break;
+        case PrefixTree::ResultValueType::Bool:
+          value.data = result.as_bool;
+          break;
+        case PrefixTree::ResultValueType::Null:
+          break;
+        default:
+          throw logic_error("source tree returned an invalid value");
+      }
+      node.value_index = item_index;
+      node.value_type = static_cast<uint8_t>(result.type);
+      item_index++;
+    }
+
+    node.first_child = queue.size();
+    node.child_count = 0;
+    while (item_index < entry.items_end) {
+      char label = items[item_index].first[depth];
+      size_t child_end = item_index + 1;
+      while ((child_end < entry.items_end) &&
+          (items[child_end].first[depth] == label)) {
+        child_end++;
+      }
+      queue.emplace_back(QueueEntry({static_cast<uint32_t>(node_index), depth,
+          item_index, child_end}));
+      node.child_count++;
+      item_index = child_end;
+    }
+
+    nodes.emplace_back(node);
+  }
+
+  // lay out the tree in a single allocation
+  uint64_t labels_offset = sizeof(TreeBase) + nodes.size() * sizeof(Node);
+  uint64_t edges_offset = labels_offset + labels.size();
+  uint64_t values_offset = (edges_offset + edges.size() + 7) & (~7);
+  uint64_t strings_offset = values_offset + values.size() * sizeof(Value);
+  uint64_t total_size = strings_offset + strings_size;
+
+  auto g = this->allocator->lock(true);
+  this->base_offset = this->allocator->allocate(total_size);
+  auto p = this->allocator->get_pool();
+  uint8_t* data = p->at<uint8_t>(this->base_offset);
+
+  TreeBase* base = reinterpret_cast<TreeBase*>(data);
+  base->item_count = items.size();
+  base->node_count = nodes.size();
+  base->labels_offset = labels_offset;
+  base->edges_offset = edges_offset;
+  base->values_offset = values_offset;
+  base->strings_offset = strings_offset;
+  base->total_size = total_size;
+  memcpy(data + sizeof(TreeBase), nodes.data(), nodes.size() * sizeof(Node));
+  memcpy(data + labels_offset, labels.data(), labels.size());
+  memcpy(data + edges_offset, edges.data(), edges.size());
+  memcpy(data + values_offset, values.data(), values.size() * sizeof(Value));
+  for (size_t x = 0; x < items.size(); x++) {
+    if (items[x].second.type == PrefixTree::ResultValueType::String) {
+      memcpy(data + strings_offset + values[x].data,
+          items[x].second.as_string.data(), values[x].size);
+    }
+  }
+
+  if (!this->allocator->base_object_offset()) {
+    this->allocator->set_base_object_offset(this->base_offset);
+  }
+}
+
+FrozenPrefixTree::FrozenPrefixTree(shared_ptr<Allocator> allocator,
+    uint64_t base_offset) : allocator(allocator), base_offset(base_offset) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+  if (!this->base_offset) {
+    throw invalid_argument("pool does not contain a frozen tree");
+  }
+}
+
+
+shared_ptr<Allocator> FrozenPrefixTree::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t FrozenPrefixTree::base() const {
+  return this->base_offset;
+}
+
+
+bool FrozenPrefixTree::exists(const void* k, size_t k_size) const {
+  return this->type(k, k_size) != PrefixTree::ResultValueType::Missing;
+}
+
+bool FrozenPrefixTree::exists(const string& k) const {
+  return this->exists(k.data(), k.size());
+}
+
+PrefixTree::ResultValueType FrozenPrefixTree::type(const void* k,
+    size_t k_size) const {
+  int64_t node_index = this->find_node(k, k_size);
+  if (node_index < 0) {
+    return PrefixTree::ResultValueType::Missing;
+  }
+  const Node* nodes = reinterpret_cast<const Node*>(this->get_base() + 1);
+  return static_cast<PrefixTree::ResultValueType>(
+      nodes[node_index].value_type);
+}
+
+PrefixTree::ResultValueType FrozenPrefixTree::type(const string& k) const {
+  return this->type(k.data(), k.size());
+}
+
+PrefixTree::LookupResult FrozenPrefixTree::at(const void* k,
+    size_t k_size) const {
+  int64_t node_index = this->find_node(k, k_size);
+  if (node_index < 0) {
+    throw out_of_range(string(reinterpret_cast<const char*>(k), k_size));
+  }
+  const TreeBase* base = this->get_base();
+  const Node* node = reinterpret_cast<const Node*>(base + 1) + node_index;
+  if (node->value_type ==
+      static_cast<uint8_t>(PrefixTree::ResultValueType::Missing)) {
+    throw out_of_range(string(reinterpret_cast<const char*>(k), k_size));
+  }
+  return this->lookup_result_for_node(base, node);
+}
+
+PrefixTree::LookupResult FrozenPrefixTree::at(const string& k) const {
+  return this->at(k.data(), k.size());
+}
+
+pair<string, PrefixTree::LookupResult> FrozenPrefixTree::at_index(
+    size_t index) const {
+  const TreeBase* base = this->get_base();
+  if (index >= base->item_count) {
+    throw out_of_range("index out of range");
+  }
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(base);
+  const Node* nodes = reinterpret_cast<const Node*>(base + 1);
+  const uint8_t* labels = data + base->labels_offset;
+  const uint8_t* edges = data + base->edges_offset;
+  const Value* value = reinterpret_cast<const Value*>(
+      data + base->values_offset) + index;
+
+  // the key is the path from the root to the value's node. we build it
+  // backward, then reverse it
+  string key;
+  for (uint32_t node_index = value->node_index; node_index;
+       node_index = nodes[node_index].parent) {
+    const Node& node = nodes[node_index];
+    for (size_t x = node.edge_size; x > 0; x--) {
+      key.push_back(edges[node.edge_offset + x - 1]);
+    }
+    key.push_back(labels[node_index]);
+  }
+  reverse(key.begin(), key.end());
+
+  return make_pair(key, this->lookup_result_for_node(base,
+      &nodes[value->node_index]));
+}
+
+
+FrozenPrefixTreeIterator FrozenPrefixTree::begin() const {
+  return FrozenPrefixTreeIterator(this, 0);
+}
+
+FrozenPrefixTreeIterator FrozenPrefixTree::end() const {
+  return FrozenPrefixTreeIterator(this, this->size());
+}
+
+
+size_t FrozenPrefixTree::size() const {
+  return this->get_base()->item_count;
+}
+
+size_t FrozenPrefixTree::node_size() const {
+  return this->get_base()->node_count;
+}
+
+size_t FrozenPrefixTree::bytes() const {
+  return this->get_base()->total_size;
+}
+
+
+const FrozenPrefixTree::TreeBase* FrozenPrefixTree::get_base() const {
+  // the tree doesn't change, but the pool may have been expanded by another
+  // process (e.g. one that's building another tree in it)
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  return p->at<TreeBase>(this->base_offset);
+}
+
+int64_t FrozenPrefixTree::find_node(const void* k, size_t k_size) const {
+  const TreeBase* base = this->get_base();
+  const Node* nodes = reinterpret_cast<const Node*>(base + 1);
+  const uint8_t* labels = reinterpret_cast<const uint8_t*>(base) +
+      base->labels_offset;
+  const uint8_t* edges = reinterpret_cast<const uint8_t*>(base) +
+      base->edges_offset;
+
+  const uint8_t* key = reinterpret_cast<const uint8_t*>(k);
+  uint32_t node_index = 0;
+  size_t x = 0;
+  while (x < k_size) {
+    const Node& node = nodes[node_index];
+    if (node.child_count == 256) {
+      node_index = node.first_child + key[x];
+    } else {
+      const uint8_t* children_begin = labels + node.first_child;
+      const uint8_t* children_end = children_begin + node.child_count;
+      const uint8_t* child = lower_bound(children_begin, children_end, key[x]);
+      if ((child == children_end) || (*child != key[x])) {
+        return -1;
+      }
+      node_index = node.first_child + (child - children_begin);
+    }
+    x++;
+
+    // the rest of the child's edge must match too. if the key ends partway
+    // through it, there's no node for the key
+    const Node& child_node = nodes[node_index];
+    if ((child_node.edge_size > k_size - x) ||
+        memcmp(edges + child_node.edge_offset, key + x, child_node.edge_size)) {
+      return -1;
+    }
+    x += child_node.edge_size;
+  }
+  return node_index;
+}
+
+PrefixTree::LookupResult FrozenPrefixTree::lookup_result_for_node(
+    const TreeBase* base, const Node* node) const {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(base);
+  const Value* value = reinterpret_cast<const Value*>(
+      data + base->values_offset) + node->value_index;
+  switch (static_cast<PrefixTree::ResultValueType>(node->value_type)) {
+    case PrefixTree::ResultValueType::String:
+      return PrefixTree::LookupResult(
+          data + base->strings_offset + value->data, value->size);
+    case PrefixTree::ResultValueType::Int:
+      return PrefixTree::LookupResult(static_cast<int64_t>(value->data));
+    case PrefixTree::ResultValueType::Double: {
+      double d;
+      memcpy(&d, &value->data, sizeof(double));
+      return PrefixTree::LookupResult(d);
+    }
+    case PrefixTree::ResultValueType::Bool:
+      return PrefixTree::LookupResult(static_cast<bool>(value->data));
+    case PrefixTree::ResultValueType::Null:
+      return PrefixTree::LookupResult();
+    default:
+      throw logic_error("frozen tree contains an invalid value type");
+  }
+}
+
+
+FrozenPrefixTreeIterator::FrozenPrefixTreeIterator(
+    const FrozenPrefixTree* tree, size_t index) : tree(tree), index(index) {
+  this->load();
+}
+
+bool FrozenPrefixTreeIterator::operator==(
+    const FrozenPrefixTreeIterator& other) const {
+  return (this->tree == other.tree) && (this->index == other.index);
+}
+
+bool FrozenPrefixTreeIterator::operator!=(
+    const FrozenPrefixTreeIterator& other) const {
+  return !(this->operator==(other));
+}
+
+FrozenPrefixTreeIterator& FrozenPrefixTreeIterator::operator++() {
+  if (this->index >= this->tree->size()) {
+    throw invalid_argument("can\'t advance iterator beyond end position");
+  }
+  this->index++;
+  this->load();
+  return *this;
+}
+
+FrozenPrefixTreeIterator FrozenPrefixTreeIterator::operator++(int) {
+  FrozenPrefixTreeIterator ret = *this;
+  this->operator++();
+  return ret;
+}
+
+const pair<string, PrefixTree::LookupResult>&
+FrozenPrefixTreeIterator::operator*() const {
+  return this->current_result;
+}
+
+void FrozenPrefixTreeIterator::load() {
+  if (this->index < this->tree->size()) {
+    this->current_result = this->tree->at_index(this->index);
+  }
+}
+
+
+FrozenPrefixTreeHandle::FrozenPrefixTreeHandle(const string& name) :
+    name(name), current_generation(0) {
+  shared_ptr<Pool> pool(new Pool(this->name));
+  this->allocator.reset(new SimpleAllocator(pool));
+
+  {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->allocator->allocate(sizeof(atomic<uint64_t>));
+      this->allocator->get_pool()->at<atomic<uint64_t>>(
+          this->base_offset)->store(0);
+      this->allocator->set_base_object_offset(this->base_offset);
+    }
+  }
+}
+
+
+uint64_t FrozenPrefixTreeHandle::publish(const PrefixTree& source) {
+  // this only keeps other publishers out; readers never lock the handle
+  auto g = this->allocator->lock(true);
+  uint64_t generation = this->generation() + 1;
+
+  // a publisher may have crashed while building this generation before
+  string pool_name = this->pool_name_for_generation(generation);
+  Pool::delete_pool(pool_name);
+  {
+    shared_ptr<Pool> pool(new Pool(pool_name));
+    shared_ptr<Allocator> allocator(new SimpleAllocator(pool));
+    FrozenPrefixTree tree(allocator, source);
+  }
+
+  this->allocator->get_pool()->at<atomic<uint64_t>>(
+      this->base_offset)->store(generation);
+  if (generation > 1) {
+    Pool::delete_pool(this->pool_name_for_generation(generation - 1));
+  }
+  return generation;
+}
+
+shared_ptr<const FrozenPrefixTree> FrozenPrefixTreeHandle::current() {
+  uint64_t generation = this->generation();
+  if (generation == this->current_generation) {
+    return this->current_tree;
+  }
+
+  for (;;) {
+    try {
+      // don't create the pool if it doesn't exist; that means a newer
+      // generation was published after we read the generation number
+      shared_ptr<Pool> pool(new Pool(this->pool_name_for_generation(
+          generation), 0, true, false));
+      shared_ptr<Allocator> allocator(new SimpleAllocator(pool));
+      this->current_tree.reset(new FrozenPrefixTree(allocator, 0));
+      this->current_generation = generation;
+      return this->current_tree;
+
+    } catch (const cannot_open_file& e) {
+      uint64_t new_generation = this->generation();
+      if (new_generation == generation) {
+        throw;
+      }
+      generation = new_generation;
+    }
+  }
+}
+
+uint64_t FrozenPrefixTreeHandle::generation() const {
+  return this->allocator->get_pool()->at<atomic<uint64_t>>(
+      this->base_offset)->load();
+}
+
+
+void FrozenPrefixTreeHandle::delete_handle(const string& name) {
+  {
+    FrozenPrefixTreeHandle handle(name);
+    uint64_t generation = handle.generation();
+    if (generation) {
+      Pool::delete_pool(handle.pool_name_for_generation(generation));
+    }
+  }
+  Pool::delete_pool(name);
+}
+
+
+string FrozenPrefixTreeHandle::pool_name_for_generation(
+    uint64_t generation) const {
+  return string_printf("%s.%" PRIu64, this->name.c_str(), generation);
+}
+
+} // namespace sharedstructures
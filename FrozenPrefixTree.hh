@@ -0,0 +1,202 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "Allocator.hh"
+#include "PrefixTree.hh"
+
+namespace sharedstructures {
+
+
+class FrozenPrefixTreeIterator;
+
+// FrozenPrefixTree is an immutable, read-optimized copy of a PrefixTree. it's
+// built once from a PrefixTree and can't be modified afterward, which allows a
+// much more compact layout: the whole tree is a single allocation, with the
+// nodes stored contiguously in breadth-first order, so each node's children
+// are adjacent and are found by binary search over a packed array of their
+// first key bytes rather than a 256-slot range. chains of nodes with only one
+// child are collapsed into a single node whose edge holds all of their key
+// bytes. values are stored in key order in a separate array, and string values
+// are packed together after it.
+//
+// since the tree never changes, none of the read methods lock the pool. the
+// pool must not be modified while a FrozenPrefixTree is being built in it,
+// except by other lock-respecting allocations. the intended use is to build
+// each frozen tree in its own pool and switch readers to it with
+// FrozenPrefixTreeHandle (below).
+
+class FrozenPrefixTree {
+public:
+  FrozenPrefixTree() = delete;
+  FrozenPrefixTree(const FrozenPrefixTree&) = delete;
+  FrozenPrefixTree(FrozenPrefixTree&&) = delete;
+
+  // create constructor - builds a frozen copy of source in the given
+  // allocator's pool. if the allocator's base object offset is 0, sets it to
+  // the new tree's base offset. source may be modified by other processes
+  // during the copy, but then the copy isn't a consistent snapshot of it.
+  FrozenPrefixTree(std::shared_ptr<Allocator> allocator,
+      const PrefixTree& source);
+  // open constructor. if base_offset is 0, opens the tree at the allocator's
+  // base object offset.
+  FrozenPrefixTree(std::shared_ptr<Allocator> allocator, uint64_t base_offset);
+  ~FrozenPrefixTree() = default;
+
+  // returns the allocator for this tree
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this tree
+  uint64_t base() const;
+
+  // checks if a key exists.
+  bool exists(const void* k, size_t k_size) const;
+  bool exists(const std::string& k) const;
+
+  // returns the type of a key, or Missing if it doesn't exist.
+  PrefixTree::ResultValueType type(const void* k, size_t k_size) const;
+  PrefixTree::ResultValueType type(const std::string& k) const;
+
+  // returns the value of a key. throws std::out_of_range if the key is missing.
+  PrefixTree::LookupResult at(const void* k, size_t k_size) const;
+  PrefixTree::LookupResult at(const std::string& k) const;
+
+  // returns the key and value at the given position in key order (0 is the
+  // first key). throws std::out_of_range if index >= size().
+  std::pair<std::string, PrefixTree::LookupResult> at_index(
+      size_t index) const;
+
+  // these functions implement standard C++ iteration, in key order.
+  FrozenPrefixTreeIterator begin() const;
+  FrozenPrefixTreeIterator end() const;
+
+  // inspection methods.
+  size_t size() const; // key count
+  size_t node_size() const; // node count
+  size_t bytes() const; // size of the tree's allocation
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+
+  struct Node {
+    uint32_t first_child; // index of the first child; children are adjacent
+    uint32_t parent; // index of the parent (0 for the root)
+    uint32_t value_index; // index in the values array, if there's a value
+    // the key bytes that lead to this node from its parent, after the first
+    // one (which is in the labels array), are in the edge data at this offset
+    uint32_t edge_offset;
+    uint32_t edge_size;
+    uint16_t child_count;
+    uint8_t value_type; // a ResultValueType; Missing if there's no value
+    uint8_t unused;
+  };
+
+  struct Value {
+    // for Int, Double and Bool values, data is the value itself; for String
+    // values, it's the string's offset from the start of the string data
+    uint64_t data;
+    uint32_t size; // size of String values
+    uint32_t node_index; // node that this is the value of
+  };
+
+  // the base is followed by node_count Nodes, then node_count key bytes (the
+  // first byte of the edge that leads to each node from its parent), then the
+  // rest of the edges' key bytes, then item_count Values, then the string
+  // data. these offsets are relative to the base.
+  struct TreeBase {
+    uint64_t item_count;
+    uint64_t node_count;
+    uint64_t labels_offset;
+    uint64_t edges_offset;
+    uint64_t values_offset;
+    uint64_t strings_offset;
+    uint64_t total_size;
+  };
+
+  const TreeBase* get_base() const;
+  // returns the index of the node for the given key, or -1 if there isn't one
+  int64_t find_node(const void* k, size_t k_size) const;
+  PrefixTree::LookupResult lookup_result_for_node(const TreeBase* base,
+      const Node* node) const;
+};
+
+
+class FrozenPrefixTreeIterator {
+public:
+  FrozenPrefixTreeIterator() = delete;
+  FrozenPrefixTreeIterator(const FrozenPrefixTreeIterator& other) = default;
+  FrozenPrefixTreeIterator(FrozenPrefixTreeIterator&& other) = default;
+  FrozenPrefixTreeIterator(const FrozenPrefixTree* tree, size_t index);
+  ~FrozenPrefixTreeIterator() = default;
+
+  bool operator==(const FrozenPrefixTreeIterator& other) const;
+  bool operator!=(const FrozenPrefixTreeIterator& other) const;
+  FrozenPrefixTreeIterator& operator++();
+  FrozenPrefixTreeIterator operator++(int);
+  const std::pair<std::string, PrefixTree::LookupResult>& operator*() const;
+
+private:
+  const FrozenPrefixTree* tree;
+  size_t index;
+  std::pair<std::string, PrefixTree::LookupResult> current_result;
+
+  void load();
+};
+
+
+// FrozenPrefixTreeHandle names the current generation of a frozen tree that's
+// rebuilt periodically, so readers can move from one generation to the next
+// without pausing. each generation is a FrozenPrefixTree in its own pool,
+// named <name>.<generation>; the handle itself is a small pool named <name>
+// that holds the current generation number.
+//
+// publish() builds a new generation, then atomically makes it current and
+// deletes the previous generation's pool. readers call current(), which reads
+// the generation number without locking and only opens a pool when it has
+// changed. readers that still hold the previous generation keep using it
+// until they release it; deleting a pool only removes its name, so the memory
+// stays valid until every process has unmapped it.
+
+class FrozenPrefixTreeHandle {
+public:
+  FrozenPrefixTreeHandle() = delete;
+  FrozenPrefixTreeHandle(const FrozenPrefixTreeHandle&) = delete;
+  FrozenPrefixTreeHandle(FrozenPrefixTreeHandle&&) = delete;
+
+  // opens the handle with the given name, creating it if it doesn't exist.
+  explicit FrozenPrefixTreeHandle(const std::string& name);
+  ~FrozenPrefixTreeHandle() = default;
+
+  // builds a frozen copy of source as a new generation and makes it current.
+  // returns the new generation number. concurrent publish() calls are
+  // serialized.
+  uint64_t publish(const PrefixTree& source);
+
+  // returns the current generation's tree, or nullptr if nothing has been
+  // published yet. never locks.
+  std::shared_ptr<const FrozenPrefixTree> current();
+
+  // returns the current generation number (0 if nothing has been published)
+  uint64_t generation() const;
+
+  // deletes the handle and the current generation's pool. no process may use
+  // the handle while this is called.
+  static void delete_handle(const std::string& name);
+
+private:
+  std::string name;
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+
+  // the generation that current() last returned, and its tree
+  uint64_t current_generation;
+  std::shared_ptr<const FrozenPrefixTree> current_tree;
+
+  std::string pool_name_for_generation(uint64_t generation) const;
+};
+
+} // namespace sharedstructures
@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <map>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+#include <vector>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "FrozenPrefixTree.hh"
+#include "PrefixTree.hh"
+#include "TestUtils.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+map<string, PrefixTree::LookupResult> frozen_tree_contents(
+    const FrozenPrefixTree& tree) {
+  map<string, PrefixTree::LookupResult> ret;
+  for (const auto& it : tree) {
+    ret.emplace(it.first, it.second);
+  }
+  return ret;
+}
+
+bool pool_exists(const string& name) {
+  try {
+    Pool pool(name, 0, true, false);
+    return true;
+  } catch (const cannot_open_file& e) {
+    return false;
+  }
+}
+
+void delete_pools() {
+  Pool::delete_pool("test-frozen-source");
+  Pool::delete_pool("test-frozen");
+  Pool::delete_pool("test-frozen-sparse");
+  for (size_t x = 0; x < 10; x++) {
+    Pool::delete_pool(string_printf("test-frozen-handle.%zu", x));
+  }
+  Pool::delete_pool("test-frozen-handle");
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> source_pool(new Pool("test-frozen-source"));
+  shared_ptr<Allocator> source_alloc = create_allocator(source_pool,
+      allocator_type);
+  PrefixTree source(source_alloc);
+
+  // an empty tree can be frozen too
+  shared_ptr<Pool> pool(new Pool("test-frozen"));
+  shared_ptr<Allocator> alloc(new SimpleAllocator(pool));
+  {
+    FrozenPrefixTree empty(alloc, source);
+    expect_eq(0, empty.size());
+    expect_eq(1, empty.node_size());
+    expect_eq(false, empty.exists(string("")));
+    expect(empty.begin() == empty.end());
+  }
+
+  string long_key(1000, 'x');
+  string binary_key("\x00\xFF\x01\x80", 4);
+  source.insert(string(""), string("empty key"));
+  source.insert(string("a"), (int64_t)-1);
+  source.insert(string("ab"), 2.5);
+  source.insert(string("abc"), true);
+  source.insert(string("abd"), false);
+  source.insert(string("b"));
+  source.insert(string("string"), string("value"));
+  source.insert(string("empty-string"), string(""));
+  source.insert(long_key, long_key);
+  source.insert(binary_key, string("binary"));
+  for (size_t x = 0; x < 1000; x++) {
+    source.insert(string_printf("key%04zu", x), (int64_t)x);
+  }
+  // a node with all 256 children
+  for (size_t x = 0; x < 256; x++) {
+    source.insert(string("\x01", 1) + static_cast<char>(x), (int64_t)x);
+  }
+
+  FrozenPrefixTree frozen(alloc, source);
+  expect_eq(source.size(), frozen.size());
+  expect_eq(tree_contents(source), frozen_tree_contents(frozen));
+
+  expect_eq(PrefixTree::LookupResult("empty key"), frozen.at(string("")));
+  expect_eq(PrefixTree::LookupResult((int64_t)-1), frozen.at(string("a")));
+  expect_eq(PrefixTree::LookupResult(2.5), frozen.at(string("ab")));
+  expect_eq(PrefixTree::LookupResult(true), frozen.at(string("abc")));
+  expect_eq(PrefixTree::LookupResult(false), frozen.at(string("abd")));
+  expect_eq(PrefixTree::LookupResult(), frozen.at(string("b")));
+  expect_eq(PrefixTree::LookupResult("value"), frozen.at(string("string")));
+  expect_eq(PrefixTree::LookupResult(""), frozen.at(string("empty-string")));
+  expect_eq(PrefixTree::LookupResult(long_key), frozen.at(long_key));
+  expect_eq(PrefixTree::LookupResult("binary"), frozen.at(binary_key));
+  expect_eq(PrefixTree::LookupResult((int64_t)0x80),
+      frozen.at(string("\x01\x80", 2)));
+
+  expect_eq(PrefixTree::ResultValueType::Int, frozen.type(string("key0123")));
+  expect_eq(PrefixTree::ResultValueType::Null, frozen.type(string("b")));
+  expect_eq(true, frozen.exists(string("b")));
+
+  // prefixes of existing keys, and keys that diverge from existing keys,
+  // aren't present
+  for (const string& k : {string("k"), string("key"), string("key1"),
+      string("abe"), string("c"), string("aa"), string("key00000"),
+      string("\x01", 1)}) {
+    expect_eq(false, frozen.exists(k));
+    expect_eq(PrefixTree::ResultValueType::Missing, frozen.type(k));
+    try {
+      frozen.at(k);
+      expect(false);
+    } catch (const out_of_range& e) { }
+  }
+
+  // at_index returns items in key order
+  size_t index = 0;
+  for (const auto& it : source) {
+    auto frozen_item = frozen.at_index(index);
+    expect_eq(it.first, frozen_item.first);
+    expect_eq(it.second, frozen_item.second);
+    index++;
+  }
+  try {
+    frozen.at_index(frozen.size());
+    expect(false);
+  } catch (const out_of_range& e) { }
+
+  // when keys are sparse, the frozen copy is much smaller than the source,
+  // since it doesn't have empty slots in its nodes
+  {
+    shared_ptr<Pool> sparse_pool(new Pool("test-frozen-sparse"));
+    shared_ptr<Allocator> sparse_alloc = create_allocator(sparse_pool,
+        allocator_type);
+    PrefixTree sparse(sparse_alloc);
+    for (size_t x = 0; x < 1000; x++) {
+      sparse.insert(string_printf("%016zx", x * 0x9E3779B97F4A7C15),
+          (int64_t)x);
+    }
+    FrozenPrefixTree frozen_sparse(alloc, sparse);
+    expect_eq(tree_contents(sparse), frozen_tree_contents(frozen_sparse));
+    expect_lt(frozen_sparse.bytes() * 4, sparse.bytes_for_prefix(string("")));
+  }
+
+  // the frozen tree can be reopened, and isn't affected by later changes to
+  // the source
+  source.insert(string("new-key"), (int64_t)1);
+  source.erase(string("a"));
+  {
+    FrozenPrefixTree reopened(alloc, frozen.base());
+    expect_eq(frozen.size(), reopened.size());
+    expect_eq(frozen_tree_contents(frozen), frozen_tree_contents(reopened));
+    expect_eq(false, reopened.exists(string("new-key")));
+    expect_eq(true, reopened.exists(string("a")));
+  }
+}
+
+
+void run_handle_test(const string& allocator_type) {
+  printf("-- [%s] handle\n", allocator_type.c_str());
+
+  shared_ptr<Pool> source_pool(new Pool("test-frozen-source"));
+  shared_ptr<Allocator> source_alloc = create_allocator(source_pool,
+      allocator_type);
+  PrefixTree source(source_alloc);
+
+  FrozenPrefixTreeHandle handle("test-frozen-handle");
+  expect_eq(0, handle.generation());
+  expect(!handle.current());
+
+  source.insert(string("key"), (int64_t)1);
+  expect_eq(1, handle.publish(source));
+  auto gen1 = handle.current();
+  expect_eq(PrefixTree::LookupResult((int64_t)1), gen1->at(string("key")));
+  expect(gen1 == handle.current());
+
+  // another process sees the same generation
+  {
+    FrozenPrefixTreeHandle other_handle("test-frozen-handle");
+    expect_eq(1, other_handle.generation());
+    expect_eq(PrefixTree::LookupResult((int64_t)1),
+        other_handle.current()->at(string("key")));
+  }
+
+  // publishing a new generation deletes the old one's pool, but readers that
+  // still have it can keep using it
+  source.insert(string("key"), (int64_t)2);
+  source.insert(string("key2"), (int64_t)3);
+  expect_eq(2, handle.publish(source));
+  expect_eq(false, pool_exists("test-frozen-handle.1"));
+  expect_eq(true, pool_exists("test-frozen-handle.2"));
+  expect_eq(PrefixTree::LookupResult((int64_t)1), gen1->at(string("key")));
+  expect_eq(1, gen1->size());
+  auto gen2 = handle.current();
+  expect(gen1 != gen2);
+  expect_eq(tree_contents(source), frozen_tree_contents(*gen2));
+
+  // readers in other processes switch generations while the parent publishes
+  // new ones. every tree they see must be complete
+  source.clear();
+  source.insert(string("generation"), (int64_t)3);
+  for (size_t y = 0; y < 1000; y++) {
+    source.insert(string_printf("item%04zu", y), (int64_t)(y + 3));
+  }
+  expect_eq(3, handle.publish(source));
+
+  static const size_t num_children = 4;
+  static const size_t num_generations = 6;
+  vector<pid_t> child_pids;
+  for (size_t x = 0; x < num_children; x++) {
+    pid_t pid = fork();
+    if (!pid) {
+      int child_retcode = 0;
+      try {
+        FrozenPrefixTreeHandle child_handle("test-frozen-handle");
+        uint64_t last_generation = 0;
+        while (last_generation < num_generations + 2) {
+          auto tree = child_handle.current();
+          uint64_t generation = tree->at(string("generation")).as_int;
+          expect_le(last_generation, generation);
+          expect_eq(1001, tree->size());
+          for (size_t y = 0; y < 1000; y += 37) {
+            expect_eq(PrefixTree::LookupResult((int64_t)(y + generation)),
+                tree->at(string_printf("item%04zu", y)));
+          }
+          last_generation = generation;
+        }
+      } catch (const exception& e) {
+        printf("failure (child): %s\n", e.what());
+        child_retcode = 1;
+      }
+      _exit(child_retcode);
+    }
+    child_pids.emplace_back(pid);
+  }
+
+  for (size_t generation = 4; generation <= num_generations + 2;
+       generation++) {
+    source.insert(string("generation"), (int64_t)generation);
+    for (size_t y = 0; y < 1000; y++) {
+      source.insert(string_printf("item%04zu", y), (int64_t)(y + generation));
+    }
+    expect_eq(generation, handle.publish(source));
+    usleep(10000);
+  }
+
+  for (pid_t pid : child_pids) {
+    int exit_status;
+    expect_eq(pid, waitpid(pid, &exit_status, 0));
+    expect_eq(true, WIFEXITED(exit_status));
+    expect_eq(0, WEXITSTATUS(exit_status));
+  }
+
+  // only the current generation's pool remains
+  for (size_t generation = 1; generation < num_generations + 2;
+       generation++) {
+    expect_eq(false, pool_exists(string_printf("test-frozen-handle.%zu",
+        generation)));
+  }
+  FrozenPrefixTreeHandle::delete_handle("test-frozen-handle");
+  expect_eq(false, pool_exists(string_printf("test-frozen-handle.%zu",
+      num_generations + 2)));
+  expect_eq(false, pool_exists("test-frozen-handle"));
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      delete_pools();
+      run_basic_test(allocator_type);
+      delete_pools();
+      run_handle_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  delete_pools();
+
+  return retcode;
+}
@@ -0,0 +1,24 @@
+#include "Hash.hh"
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+uint64_t fnv1a64(const void* data, size_t size, uint64_t hash) {
+  const uint8_t *data_ptr = (const uint8_t*)data;
+  const uint8_t *end_ptr = data_ptr + size;
+
+  for (; data_ptr != end_ptr; data_ptr++) {
+    hash = (hash ^ (uint64_t)*data_ptr) * 0x00000100000001B3;
+  }
+  return hash;
+}
+
+uint64_t mix64(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+  return x ^ (x >> 31);
+}
+
+} // namespace sharedstructures
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace sharedstructures {
+
+
+// 64-bit FNV-1a hash. this is used by all the hashed structures in this
+// library, so it must never change - the results are stored in shared pools.
+uint64_t fnv1a64(const void* data, size_t size,
+    uint64_t hash = 0xCBF29CE484222325);
+
+// splitmix64's finalizer. fnv1a64's low bits are fine for picking a hash
+// bucket, but structures that need many independent bits from one key (e.g.
+// to pick several positions at once) should run the hash through this first.
+uint64_t mix64(uint64_t x);
+
+} // namespace sharedstructures
@@ -4,32 +4,26 @@
 #include <inttypes.h>
 #include <string.h>
 
-using namespace std;
-
-namespace sharedstructures {
+#include <atomic>
 
+#include "Hash.hh"
 
-static uint64_t fnv1a64(const void* data, size_t size,
-    uint64_t hash = 0xCBF29CE484222325) {
-
-  const uint8_t *data_ptr = (const uint8_t*)data;
-  const uint8_t *end_ptr = data_ptr + size;
+using namespace std;
 
-  for (; data_ptr != end_ptr; data_ptr++) {
-    hash = (hash ^ (uint64_t)*data_ptr) * 0x00000100000001B3;
-  }
-  return hash;
-}
+namespace sharedstructures {
 
 
 HashTable::HashTable(shared_ptr<Allocator> allocator, uint8_t bits) :
-    allocator(allocator) {
+    allocator(allocator), relocation_position(0), has_cache_offset(true),
+    eviction_enabled(true), applied_sequence_offset(0), applied_sequence(0) {
   auto g = this->allocator->lock(true);
   this->base_offset = this->create_hash_base(bits);
 }
 
 HashTable::HashTable(shared_ptr<Allocator> allocator, uint64_t base_offset,
-    uint8_t bits) : allocator(allocator), base_offset(base_offset) {
+    uint8_t bits) : allocator(allocator), base_offset(base_offset),
+    relocation_position(0), has_cache_offset(true), eviction_enabled(true),
+    applied_sequence_offset(0), applied_sequence(0) {
   if (!this->base_offset) {
     auto g = this->allocator->lock(false);
     this->base_offset = this->allocator->base_object_offset();
@@ -44,6 +38,10 @@ HashTable::HashTable(shared_ptr<Allocator> allocator, uint64_t base_offset,
       this->allocator->set_base_object_offset(this->base_offset);
     }
   }
+
+  auto g = this->allocator->lock(false);
+  this->has_cache_offset = (this->allocator->block_size(this->base_offset) >=
+      sizeof(HashTableBase));
 }
 
 
@@ -56,6 +54,37 @@ uint64_t HashTable::base() const {
 }
 
 
+void HashTable::attach_filter(shared_ptr<Filter> filter, bool populate) {
+  // add the existing keys before attaching the filter, so lookups never see a
+  // partially-populated filter
+  if (filter && populate) {
+    uint64_t slot_count = 1ULL << this->bits();
+    for (uint64_t x = 0; x < slot_count; x++) {
+      for (const auto& it : this->get_slot_contents(x)) {
+        filter->insert(it.first);
+      }
+    }
+  }
+  this->filter = filter;
+}
+
+shared_ptr<Filter> HashTable::get_filter() const {
+  return this->filter;
+}
+
+void HashTable::attach_write_ahead_log(shared_ptr<WriteAheadLog> log) {
+  if (log &&
+      (log->get_allocator()->get_pool() != this->allocator->get_pool())) {
+    throw invalid_argument("write-ahead log must be in the same pool");
+  }
+  this->write_ahead_log = log;
+}
+
+shared_ptr<WriteAheadLog> HashTable::get_write_ahead_log() const {
+  return this->write_ahead_log;
+}
+
+
 HashTable::CheckRequest::CheckRequest(const void* key, size_t key_size,
     const void* value, size_t value_size) : key(key), key_size(key_size),
     value(value), value_size(value_size),
@@ -85,12 +114,32 @@ bool HashTable::insert(const void* k, size_t k_size, const void* v,
     return false;
   }
 
+  // in cache mode, make room first, so the new pair can reuse evicted space.
+  // only the growth needs room, since overwriting a key frees its old pair.
+  // inserting doesn't set the slot's reference bit, so keys that are written
+  // but never read are evicted the first time the clock hand reaches them.
+  // this happens before the insert is logged, so the evictions' erase records
+  // precede it in the log (the key itself may be evicted and then reinserted)
+  size_t growth = this->cache_growth_for(k, k_size, hash, k_size + v_size,
+      true);
+  if (growth) {
+    this->evict_for(growth);
+  }
+
+  // the key must be in the filter before it's visible in the table
+  if (this->filter) {
+    this->filter->insert(k, k_size);
+  }
+  this->log_change(WriteAheadLog::Operation::Insert,
+      WriteAheadLog::ValueType::String, k, k_size, v, v_size);
+
   auto p = this->allocator->get_pool();
 
   // create the new key-value pair and copy the data in
   uint64_t new_kv_pair_offset = this->allocator->allocate(k_size + v_size);
   memcpy(p->at<void>(new_kv_pair_offset), k, k_size);
   memcpy(p->at<void>(new_kv_pair_offset + k_size), v, v_size);
+  this->add_cache_bytes(k_size + v_size);
 
   // get the slot pointer
   HashTableBase* table = p->at<HashTableBase>(this->base_offset);
@@ -114,6 +163,8 @@ bool HashTable::insert(const void* k, size_t k_size, const void* v,
     // replace it with the new one
     if ((slot->key_size == k_size) &&
         !memcmp(p->at<void>(slot->key_offset), k, k_size)) {
+      this->add_cache_bytes(
+          -(ssize_t)this->allocator->block_size(slot->key_offset));
       this->allocator->free(slot->key_offset);
       slot = p->at<Slot>(slot_offset); // may be invalidated
       slot->key_offset = new_kv_pair_offset;
@@ -149,6 +200,8 @@ bool HashTable::insert(const void* k, size_t k_size, const void* v,
     // if we found a match, just replace the buffer pointer on it
     if (walk_ret.second) {
       IndirectValue* indirect = p->at<IndirectValue>(walk_ret.second);
+      this->add_cache_bytes(
+          -(ssize_t)this->allocator->block_size(indirect->key_offset));
       this->allocator->free(indirect->key_offset);
       indirect = p->at<IndirectValue>(walk_ret.second);
       indirect->key_offset = new_kv_pair_offset;
@@ -194,7 +247,23 @@ int64_t HashTable::incr(const void* k, size_t k_size, int64_t delta) {
   uint64_t hash = fnv1a64(k, k_size);
 
   auto g = this->allocator->lock(true);
+
+  // in cache mode, make room if the key will be created. as in insert(), this
+  // happens before the incr is logged
+  size_t growth = this->cache_growth_for(k, k_size, hash,
+      k_size + sizeof(int64_t), false);
+  if (growth) {
+    this->evict_for(growth);
+    this->add_cache_bytes(growth);
+  }
+
+  if (this->filter) {
+    this->filter->insert(k, k_size);
+  }
+  this->log_change(WriteAheadLog::Operation::Incr,
+      WriteAheadLog::ValueType::Int, k, k_size, &delta, sizeof(delta));
   auto p = this->allocator->get_pool();
+  this->mark_referenced(hash);
 
   // get the slot pointer
   HashTableBase* table = p->at<HashTableBase>(this->base_offset);
@@ -326,7 +395,23 @@ double HashTable::incr(const void* k, size_t k_size, double delta) {
   uint64_t hash = fnv1a64(k, k_size);
 
   auto g = this->allocator->lock(true);
+
+  // in cache mode, make room if the key will be created. as in insert(), this
+  // happens before the incr is logged
+  size_t growth = this->cache_growth_for(k, k_size, hash,
+      k_size + sizeof(double), false);
+  if (growth) {
+    this->evict_for(growth);
+    this->add_cache_bytes(growth);
+  }
+
+  if (this->filter) {
+    this->filter->insert(k, k_size);
+  }
+  this->log_change(WriteAheadLog::Operation::Incr,
+      WriteAheadLog::ValueType::Double, k, k_size, &delta, sizeof(delta));
   auto p = this->allocator->get_pool();
+  this->mark_referenced(hash);
 
   // get the slot pointer
   HashTableBase* table = p->at<HashTableBase>(this->base_offset);
@@ -447,6 +532,14 @@ bool HashTable::erase(const void* k, size_t k_size, const CheckRequest* check) {
     return false;
   }
 
+  return this->erase_locked(k, k_size, hash);
+}
+
+bool HashTable::erase(const std::string& k, const CheckRequest* check) {
+  return this->erase(k.data(), k.size(), check);
+}
+
+bool HashTable::erase_locked(const void* k, size_t k_size, uint64_t hash) {
   auto p = this->allocator->get_pool();
 
   uint64_t deleted_offset = 0;
@@ -469,6 +562,8 @@ bool HashTable::erase(const void* k, size_t k_size, const CheckRequest* check) {
     if ((slot->key_size == k_size) &&
         !memcmp(p->at<void>(slot->key_offset), k, k_size)) {
       if (deleted_offset != slot->key_offset) {
+        this->add_cache_bytes(
+          -(ssize_t)this->allocator->block_size(slot->key_offset));
         this->allocator->free(slot->key_offset);
         deleted_offset = slot->key_offset;
         slot = p->at<Slot>(slot_offset);
@@ -493,9 +588,11 @@ bool HashTable::erase(const void* k, size_t k_size, const CheckRequest* check) {
         IndirectValue* prev = p->at<IndirectValue>(walk_ret.first);
         prev->next = indirect->next;
       } else {
-        slot->key_offset = indirect->next;
+        slot->key_offset = indirect->next | 1;
       }
       if (deleted_offset != indirect->key_offset) {
+        this->add_cache_bytes(
+            -(ssize_t)this->allocator->block_size(indirect->key_offset));
         this->allocator->free(indirect->key_offset);
         deleted_offset = indirect->key_offset;
       }
@@ -503,9 +600,9 @@ bool HashTable::erase(const void* k, size_t k_size, const CheckRequest* check) {
       slot = p->at<Slot>(slot_offset);
 
       // if there is now only one indirect value, convert it to a direct value
-      uint64_t indirect_offset = slot->key_offset;
+      uint64_t indirect_offset = slot->key_offset & (~1);
       indirect = p->at<IndirectValue>(indirect_offset);
-      if (slot->key_offset && !indirect->next) {
+      if (indirect_offset && !indirect->next) {
         slot->key_offset = indirect->key_offset;
         slot->key_size = indirect->key_size;
         this->allocator->free(indirect_offset);
@@ -516,16 +613,18 @@ bool HashTable::erase(const void* k, size_t k_size, const CheckRequest* check) {
     }
   }
 
+  if (deleted_offset) {
+    this->log_change(WriteAheadLog::Operation::Erase,
+        WriteAheadLog::ValueType::None, k, k_size);
+  }
   return (deleted_offset != 0);
 }
 
-bool HashTable::erase(const std::string& k, const CheckRequest* check) {
-  return this->erase(k.data(), k.size(), check);
-}
-
 
 void HashTable::clear() {
   auto g = this->allocator->lock(true);
+  this->log_change(WriteAheadLog::Operation::Clear,
+      WriteAheadLog::ValueType::None, NULL, 0);
   auto p = this->allocator->get_pool();
 
   HashTableBase* h = p->at<HashTableBase>(this->base_offset);
@@ -562,15 +661,107 @@ void HashTable::clear() {
 
   h = p->at<HashTableBase>(this->base_offset);
   h->item_count = 0;
+  CacheState* cache = this->cache_state();
+  if (cache) {
+    cache->bytes_used = 0;
+  }
+}
+
+
+void HashTable::set_cache_budget(size_t max_bytes) {
+  if (!this->has_cache_offset) {
+    if (!max_bytes) {
+      return;
+    }
+    throw runtime_error(
+        "table was created by an older version without cache mode support");
+  }
+
+  auto g = this->allocator->lock(true);
+  auto p = this->allocator->get_pool();
+
+  HashTableBase* table = p->at<HashTableBase>(this->base_offset);
+  if (!max_bytes) {
+    uint64_t cache_offset = table->cache_offset;
+    if (cache_offset) {
+      table->cache_offset = 0;
+      this->allocator->free(cache_offset);
+    }
+    return;
+  }
+
+  if (!table->cache_offset) {
+    uint64_t slot_count = 1ULL << table->bits;
+    uint64_t cache_offset = this->allocator->allocate(
+        sizeof(CacheState) + slot_count * sizeof(uint8_t));
+    table = p->at<HashTableBase>(this->base_offset); // may be invalidated
+    CacheState* cache = p->at<CacheState>(cache_offset);
+    cache->bytes_used = 0;
+    cache->clock_hand = 0;
+    cache->eviction_count = 0;
+
+    // count the keys and values that are already in the table
+    for (uint64_t x = 0; x < slot_count; x++) {
+      cache->referenced[x].store(0, memory_order_relaxed);
+      const Slot* slot = p->at<Slot>(table->slots_offset + x * sizeof(Slot));
+      if (!slot->key_offset) {
+        continue;
+      }
+      if (!(slot->key_offset & 1)) {
+        cache->bytes_used += this->allocator->block_size(slot->key_offset);
+        continue;
+      }
+      uint64_t indirect_offset = slot->key_offset & (~1);
+      while (indirect_offset) {
+        const IndirectValue* indirect = p->at<IndirectValue>(indirect_offset);
+        cache->bytes_used += this->allocator->block_size(indirect->key_offset);
+        indirect_offset = indirect->next;
+      }
+    }
+    table->cache_offset = cache_offset;
+  }
+
+  this->cache_state()->max_bytes = max_bytes;
+  this->evict_for(0);
+}
+
+size_t HashTable::cache_budget() const {
+  auto g = this->allocator->lock(false);
+  const CacheState* cache = this->cache_state();
+  return cache ? cache->max_bytes : 0;
+}
+
+size_t HashTable::cache_bytes() const {
+  auto g = this->allocator->lock(false);
+  const CacheState* cache = this->cache_state();
+  return cache ? cache->bytes_used : 0;
+}
+
+size_t HashTable::eviction_count() const {
+  auto g = this->allocator->lock(false);
+  const CacheState* cache = this->cache_state();
+  return cache ? cache->eviction_count : 0;
+}
+
+void HashTable::set_eviction_enabled(bool enabled) {
+  this->eviction_enabled = enabled;
 }
 
 
 bool HashTable::exists(const void* k, size_t k_size) const {
+  if (this->filter && !this->filter->may_contain(k, k_size)) {
+    return false;
+  }
+
   uint64_t hash = fnv1a64(k, k_size);
 
   auto g = this->allocator->lock(false);
   auto walk_ret = this->walk_tables(k, k_size, hash);
-  return (walk_ret.first != 0);
+  if (!walk_ret.first) {
+    return false;
+  }
+  this->mark_referenced(hash);
+  return true;
 }
 
 bool HashTable::exists(const std::string& k) const {
@@ -579,12 +770,17 @@ bool HashTable::exists(const std::string& k) const {
 
 
 string HashTable::at(const void* k, size_t k_size) const {
+  if (this->filter && !this->filter->may_contain(k, k_size)) {
+    throw out_of_range(string((char*)k, k_size));
+  }
+
   uint64_t hash = fnv1a64(k, k_size);
 
   {
     auto g = this->allocator->lock(false);
     auto walk_ret = this->walk_tables(k, k_size, hash);
     if (walk_ret.first) {
+      this->mark_referenced(hash);
       return string(this->allocator->get_pool()->at<char>(walk_ret.first),
           walk_ret.second);
     }
@@ -658,6 +854,60 @@ uint8_t HashTable::bits() const {
       this->base_offset)->bits;
 }
 
+bool HashTable::relocate_blocks(uint64_t limit, size_t* max_blocks) {
+  // relocation never resizes the pool, so pool pointers stay valid here
+  auto p = this->allocator->get_pool();
+  HashTableBase* table = p->at<HashTableBase>(this->base_offset);
+
+  uint64_t slot_count = 1ULL << table->bits;
+  for (; this->relocation_position <= slot_count;
+       this->relocation_position++) {
+    if (!*max_blocks) {
+      return false;
+    }
+    (*max_blocks)--;
+
+    if (this->relocation_position == 0) {
+      table->slots_offset = this->allocator->relocate(table->slots_offset,
+          limit);
+      if (this->has_cache_offset && table->cache_offset) {
+        table->cache_offset = this->allocator->relocate(table->cache_offset,
+            limit);
+      }
+      continue;
+    }
+
+    Slot* slot = p->at<Slot>(table->slots_offset +
+        (this->relocation_position - 1) * sizeof(Slot));
+    if (!slot->key_offset) {
+      continue;
+    }
+
+    // if the slot contains a direct value, only its buffer can move
+    if (!(slot->key_offset & 1)) {
+      slot->key_offset = this->allocator->relocate(slot->key_offset, limit);
+      continue;
+    }
+
+    // move each entry in the indirect chain, then the buffer it points to
+    uint64_t indirect_offset = this->allocator->relocate(
+        slot->key_offset & (~1), limit);
+    slot->key_offset = indirect_offset | 1;
+    while (indirect_offset) {
+      IndirectValue* indirect = p->at<IndirectValue>(indirect_offset);
+      indirect->key_offset = this->allocator->relocate(indirect->key_offset,
+          limit);
+      if (indirect->next) {
+        indirect->next = this->allocator->relocate(indirect->next, limit);
+      }
+      indirect_offset = indirect->next;
+    }
+  }
+
+  this->relocation_position = 0;
+  return true;
+}
+
 void HashTable::print(FILE* stream) const {
   auto g = this->allocator->lock(false);
   auto p = this->allocator->get_pool();
@@ -667,6 +917,12 @@ void HashTable::print(FILE* stream) const {
   const Slot* slots = p->at<Slot>(h->slots_offset);
   fprintf(stream, "Table: bits=%hhu, slots@%" PRIu64 "\n", h->bits,
       h->slots_offset);
+  const CacheState* cache = this->cache_state();
+  if (cache) {
+    fprintf(stream, "Cache: max_bytes=%" PRIu64 ", bytes_used=%" PRIu64
+        ", clock_hand=%" PRIu64 ", evictions=%" PRIu64 "\n", cache->max_bytes,
+        cache->bytes_used, cache->clock_hand, cache->eviction_count);
+  }
 
   for (size_t slot_id = 0; slot_id < (size_t)(1 << h->bits); slot_id++) {
     if (!slots[slot_id].key_offset) {
@@ -706,6 +962,7 @@ uint64_t HashTable::create_hash_base(uint8_t bits) {
   h->bits = bits;
   h->slots_offset = slots_offset;
   h->item_count = 0;
+  h->cache_offset = 0;
 
   Slot* slots = p->at<Slot>(slots_offset);
   for (size_t x = 0; x < (size_t)(1 << bits); x++) {
@@ -783,6 +1040,138 @@ pair<uint64_t, uint64_t> HashTable::walk_tables(const void* k, size_t k_size,
 }
 
 
+HashTable::CacheState* HashTable::cache_state() const {
+  if (!this->has_cache_offset) {
+    return NULL;
+  }
+  auto p = this->allocator->get_pool();
+  uint64_t cache_offset = p->at<HashTableBase>(this->base_offset)->cache_offset;
+  return cache_offset ? p->at<CacheState>(cache_offset) : NULL;
+}
+
+void HashTable::add_cache_bytes(ssize_t delta) {
+  CacheState* cache = this->cache_state();
+  if (cache) {
+    cache->bytes_used += delta;
+  }
+}
+
+static uint8_t reference_bit(uint64_t hash, uint8_t bits) {
+  // the slot index comes from the low bits of the hash, so the next few bits
+  // choose the key's reference bit within the slot
+  return 1 << ((hash >> bits) & 7);
+}
+
+void HashTable::mark_referenced(uint64_t hash) const {
+  // this is called with the pool locked for reading, so the bits are set with
+  // an atomic or. the bit is checked first so hits on hot keys don't keep
+  // dirtying the cache line
+  CacheState* cache = this->cache_state();
+  if (!cache) {
+    return;
+  }
+  uint8_t bits = this->allocator->get_pool()->at<HashTableBase>(
+      this->base_offset)->bits;
+  auto& referenced = cache->referenced[hash & ((1 << bits) - 1)];
+  uint8_t bit = reference_bit(hash, bits);
+  if (!(referenced.load(memory_order_relaxed) & bit)) {
+    referenced.fetch_or(bit, memory_order_relaxed);
+  }
+}
+
+size_t HashTable::cache_growth_for(const void* k, size_t k_size,
+    uint64_t hash, size_t new_bytes, bool replaces_pair) const {
+  if (!this->cache_state()) {
+    return 0;
+  }
+  auto walk_ret = this->walk_tables(k, k_size, hash);
+  if (!walk_ret.first) {
+    return new_bytes;
+  }
+  if (!replaces_pair) {
+    return 0;
+  }
+  // the existing pair is counted by its block size when it's freed
+  size_t old_bytes = k_size + walk_ret.second;
+  return (new_bytes > old_bytes) ? (new_bytes - old_bytes) : 0;
+}
+
+void HashTable::evict_for(size_t new_bytes) {
+  if (!this->eviction_enabled) {
+    return;
+  }
+  CacheState* cache = this->cache_state();
+  if (!cache || (cache->bytes_used + new_bytes <= cache->max_bytes)) {
+    return;
+  }
+
+  // evict down to a little below the budget, so the next few inserts don't
+  // each have to evict a key
+  uint64_t target = cache->max_bytes - cache->max_bytes / 32;
+  target = (new_bytes < target) ? (target - new_bytes) : 0;
+
+  // the hand clears the bits in each slot it passes, so within two turns it
+  // has evicted every key, and there's nothing else to evict
+  uint64_t slot_count = 1ULL << this->allocator->get_pool()->at<HashTableBase>(
+      this->base_offset)->bits;
+  for (uint64_t steps = 0; steps < 2 * slot_count; steps++) {
+    cache = this->cache_state(); // may be invalidated by evict_slot
+    if (cache->bytes_used <= target) {
+      break;
+    }
+    uint64_t slot_index = cache->clock_hand;
+    cache->clock_hand = (slot_index + 1) & (slot_count - 1);
+    this->evict_slot(slot_index);
+  }
+}
+
+void HashTable::evict_slot(uint64_t slot_index) {
+  auto p = this->allocator->get_pool();
+
+  const HashTableBase* table = p->at<HashTableBase>(this->base_offset);
+  uint8_t bits = table->bits;
+  const Slot* slot = p->at<Slot>(table->slots_offset +
+      slot_index * sizeof(Slot));
+  if (!slot->key_offset) {
+    return;
+  }
+
+  // collect the keys whose reference bits are clear, then clear the slot's
+  // bits. the keys are copied because erasing them frees their buffers
+  CacheState* cache = this->cache_state();
+  uint8_t referenced = cache->referenced[slot_index].load(
+      memory_order_relaxed);
+  cache->referenced[slot_index].store(0, memory_order_relaxed);
+
+  vector<pair<string, uint64_t>> victims;
+  auto check_key = [&](uint64_t key_offset, uint64_t key_size) {
+    string key(p->at<char>(key_offset), key_size);
+    uint64_t hash = fnv1a64(key.data(), key.size());
+    if (!(referenced & reference_bit(hash, bits))) {
+      victims.emplace_back(move(key), hash);
+    }
+  };
+  if (!(slot->key_offset & 1)) {
+    check_key(slot->key_offset, slot->key_size);
+  } else {
+    uint64_t indirect_offset = slot->key_offset & (~1);
+    while (indirect_offset) {
+      const IndirectValue* indirect = p->at<IndirectValue>(indirect_offset);
+      check_key(indirect->key_offset, indirect->key_size);
+      indirect_offset = indirect->next;
+    }
+  }
+
+  // erase_locked logs each eviction to the WriteAheadLog and updates the
+  // byte count
+  for (const auto& victim : victims) {
+    this->erase_locked(victim.first.data(), victim.first.size(),
+        victim.second);
+  }
+  this->cache_state()->eviction_count += victims.size();
+}
+
+
 bool HashTable::execute_check(const CheckRequest& check) const {
   auto walk_ret = this->walk_tables(check.key, check.key_size, check.key_hash);
 
@@ -799,6 +1188,22 @@ bool HashTable::execute_check(const CheckRequest& check) const {
 }
 
 
+void HashTable::log_change(WriteAheadLog::Operation op,
+    WriteAheadLog::ValueType value_type, const void* k, size_t k_size,
+    const void* v, size_t v_size) {
+  // this is called with the pool locked for writing, so records are appended
+  // in the same order as the changes are made
+  if (this->write_ahead_log) {
+    this->write_ahead_log->append(WriteAheadLog::StructureType::HashTable,
+        this->base_offset, op, value_type, k, k_size, v, v_size);
+  }
+  if (this->applied_sequence_offset) {
+    this->allocator->get_pool()->at<atomic<uint64_t>>(
+        this->applied_sequence_offset)->store(this->applied_sequence);
+  }
+}
+
+
 HashTableIterator::HashTableIterator(const HashTable* table,
     uint64_t slot_index) : table(table), slot_index(slot_index),
     result_index(0), slot_contents() {
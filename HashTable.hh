@@ -2,10 +2,13 @@
 
 #include <stdint.h>
 
+#include <atomic>
 #include <memory>
 #include <string>
 
 #include "Allocator.hh"
+#include "Filter.hh"
+#include "WriteAheadLog.hh"
 
 namespace sharedstructures {
 
@@ -13,7 +16,7 @@ namespace sharedstructures {
 class HashTableIterator;
 
 
-class HashTable {
+class HashTable : public Relocatable {
 public:
   HashTable() = delete;
   HashTable(const HashTable&) = delete;
@@ -36,6 +39,23 @@ public:
   // to open it again later.
   uint64_t base() const;
 
+  // attaches a Filter to this hash table. when a filter is attached, all keys
+  // inserted into the table are also added to the filter, and exists() and at()
+  // check the filter before locking the pool. the filter is process-local
+  // state, so every process that writes to the table must attach the same
+  // filter. if populate is true, all keys already in the table are added to
+  // the filter. pass nullptr to detach the filter.
+  void attach_filter(std::shared_ptr<Filter> filter, bool populate = false);
+  std::shared_ptr<Filter> get_filter() const;
+
+  // attaches a WriteAheadLog to this hash table. when a log is attached, every
+  // insert, incr, erase and clear appends a record to it while the pool is
+  // locked; call the log's commit() method afterward to make the changes
+  // durable. the log must be in the same pool as the table, and every process
+  // that writes to the table must attach it. pass nullptr to detach the log.
+  void attach_write_ahead_log(std::shared_ptr<WriteAheadLog> log);
+  std::shared_ptr<WriteAheadLog> get_write_ahead_log() const;
+
   // to do a conditional write, instantiate one of these and pass it to insert()
   // or erase(). don't modify the key or key_size members of one of these
   // objects after constructing it.
@@ -86,6 +106,36 @@ public:
   // deletes all the keys in the hash table.
   void clear();
 
+  // puts the table in cache mode with a budget of max_bytes for its keys and
+  // values, or takes it out of cache mode if max_bytes is 0. in cache mode, an
+  // insert (or an incr that creates a key) that would exceed the budget first
+  // evicts keys that haven't been used recently, using the CLOCK algorithm:
+  // each slot has 8 reference bits, and at(), exists() and incr() set the one
+  // chosen by the key's hash with a relaxed atomic or (so hits don't need the
+  // write lock). a clock hand sweeps the slots, evicting the keys whose bits
+  // are clear and then clearing the slot's bits. keys in the same slot that
+  // share a bit protect each other. insert() doesn't set the bit, so keys that
+  // are never read don't push out keys that are. eviction stops a little below
+  // the budget, so inserts evict in small batches instead of one key at a
+  // time. evicted keys are logged to the attached WriteAheadLog as erases. the
+  // budget doesn't include the slot array or collision chains. the setting is
+  // stored in the pool, so it applies to every process using the table.
+  void set_cache_budget(size_t max_bytes);
+  // returns the cache budget, or 0 if the table isn't in cache mode
+  size_t cache_budget() const;
+  // returns the number of bytes used by keys and values, or 0 if the table
+  // isn't in cache mode
+  size_t cache_bytes() const;
+  // returns the number of keys evicted since the table entered cache mode
+  size_t eviction_count() const;
+  // enables or disables eviction for this HashTable object only (it's enabled
+  // by default; the setting isn't stored in the pool). with eviction disabled,
+  // the table still counts bytes in cache mode, but inserts may exceed the
+  // budget. WriteAheadLog replay and Replica disable it, since the evictions
+  // that happened originally were logged as erases and are replayed from the
+  // log instead.
+  void set_eviction_enabled(bool enabled);
+
   // checks if a key exists.
   bool exists(const void* k, size_t k_size) const;
   bool exists(const std::string& k) const;
@@ -108,11 +158,30 @@ public:
   size_t size() const; // key count
   uint8_t bits() const; // hash bucket count factor
 
+  // moves the table's slot array, indirect values and key-value buffers that
+  // extend past limit, for a Compactor (see Relocatable). the slot array and
+  // each slot (with its whole indirect chain) count as one block toward
+  // *max_blocks. the table's base is never moved.
+  virtual bool relocate_blocks(uint64_t limit, size_t* max_blocks);
+
   void print(FILE* stream) const;
 
 private:
   std::shared_ptr<Allocator> allocator;
   uint64_t base_offset;
+  std::shared_ptr<Filter> filter;
+  std::shared_ptr<WriteAheadLog> write_ahead_log;
+  // relocate_blocks' position: 0 for the slot array, or slot index + 1
+  uint64_t relocation_position;
+  // false if the table was created by a version of this library that didn't
+  // support cache mode (its base block ends before cache_offset)
+  bool has_cache_offset;
+  bool eviction_enabled;
+  // set by WriteAheadLog::RecordApplier for a Replica: the offset of the
+  // follower's std::atomic<uint64_t> position, which log_change sets to
+  // applied_sequence so it advances along with the change (0 if unused)
+  uint64_t applied_sequence_offset;
+  uint64_t applied_sequence;
 
   // TODO: implement secondary tables (for rehashing)
 
@@ -136,6 +205,24 @@ private:
     uint8_t bits;
     uint64_t slots_offset;
     uint64_t item_count;
+    // fields after this point were added after the original format. tables
+    // created before they existed have a smaller base block, so they're only
+    // read if the base block is large enough to contain them (the base block's
+    // size is effectively the format version)
+
+    // CacheState, or 0 if the table isn't in cache mode
+    uint64_t cache_offset;
+  };
+
+  struct CacheState {
+    uint64_t max_bytes;
+    // bytes used by the keys and values in the table
+    uint64_t bytes_used;
+    uint64_t clock_hand;
+    uint64_t eviction_count;
+    // 8 reference bits per slot. readers set these without holding the write
+    // lock
+    std::atomic<uint8_t> referenced[0];
   };
 
   uint64_t create_hash_base(uint8_t bits);
@@ -144,10 +231,31 @@ private:
   std::pair<uint64_t, uint64_t> walk_tables(const void* k, size_t k_size,
       uint64_t hash) const;
 
+  // returns NULL if the table isn't in cache mode
+  CacheState* cache_state() const;
+  void add_cache_bytes(ssize_t delta);
+  bool erase_locked(const void* k, size_t k_size, uint64_t hash);
+  void mark_referenced(uint64_t hash) const;
+  // returns how many bytes writing a new_bytes-byte pair for a key adds to the
+  // cache: new_bytes if the key doesn't exist, or the growth over its current
+  // pair if it does and replaces_pair is true (incr changes values in place, so
+  // it passes false). returns 0 if the table isn't in cache mode
+  size_t cache_growth_for(const void* k, size_t k_size, uint64_t hash,
+      size_t new_bytes, bool replaces_pair) const;
+  // evicts keys until there's room for new_bytes more (if in cache mode)
+  void evict_for(size_t new_bytes);
+  void evict_slot(uint64_t slot_index);
+
   bool execute_check(const CheckRequest& check) const;
+  void log_change(WriteAheadLog::Operation op,
+      WriteAheadLog::ValueType value_type, const void* k, size_t k_size,
+      const void* v = NULL, size_t v_size = 0);
 
   std::pair<std::string, std::string> next_key_value_internal(
       const void* current, size_t size, bool return_value) const;
+
+  // for RecordApplier, which sets applied_sequence_offset
+  friend class WriteAheadLog;
 };
 
 
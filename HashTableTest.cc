@@ -7,6 +7,7 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <phosg/Strings.hh>
 #include <phosg/Time.hh>
 #include <phosg/UnitTest.hh>
 #include <string>
@@ -136,6 +137,21 @@ void run_collision_test(const string& allocator_type) {
     verify_state(expected, table);
   }
 
+  // erasing keys in the order they were inserted removes the first entry in
+  // each slot's indirect chain while the chain has several more entries
+  for (size_t x = 0; x < 20; x++) {
+    string key = string_printf("key%zu", x);
+    table.insert(key, "value");
+    expected.emplace(key, "value");
+  }
+  verify_state(expected, table);
+  for (size_t x = 0; x < 20; x++) {
+    string key = string_printf("key%zu", x);
+    expect_eq(true, table.erase(key));
+    expected.erase(key);
+    verify_state(expected, table);
+  }
+
   // the empty table should not leak any allocated memory
   expect_eq(initial_pool_allocated, alloc->bytes_allocated());
 }
@@ -310,6 +326,108 @@ void run_incr_test(const string& allocator_type) {
 }
 
 
+void run_cache_test(const string& allocator_type) {
+  printf("-- [%s] cache\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-table"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  HashTable table(alloc, 0, 8);
+  expect_eq(0, table.cache_budget());
+  expect_eq(0, table.cache_bytes());
+
+  // entering cache mode counts the keys that are already there, and evicts
+  // some of them if they don't fit
+  string value(92, 'v');
+  for (size_t x = 0; x < 100; x++) {
+    table.insert(string_printf("key%05zu", x), value);
+  }
+  table.set_cache_budget(5000);
+  expect_eq(5000, table.cache_budget());
+  expect_le(table.cache_bytes(), 5000);
+  expect_lt(0, table.eviction_count());
+  expect_eq(table.size() * 100, table.cache_bytes());
+
+  // keys that are read often stay in the cache, while new keys evict the
+  // keys that aren't read
+  for (size_t x = 0; x < 10; x++) {
+    string key = string_printf("hot%05zu", x);
+    table.insert(key, value);
+    expect_eq(value, table.at(key));
+  }
+  for (size_t x = 0; x < 2000; x++) {
+    table.insert(string_printf("cold%04zu", x), value);
+    for (size_t y = 0; y < 10; y++) {
+      expect_eq(value, table.at(string_printf("hot%05zu", y)));
+    }
+    expect_le(table.cache_bytes(), 5000);
+  }
+  expect_lt(1900, table.eviction_count());
+  expect_key_missing(table, "cold0000", 8);
+  expect_eq(true, table.exists("cold1999"));
+  expect_eq(table.size() * 100, table.cache_bytes());
+
+  // overwriting keys in a full cache with values that are no larger reuses
+  // their space, so nothing is evicted
+  for (size_t x = 0; table.cache_bytes() < 5000; x++) {
+    table.insert(string_printf("fill%04zu", x), value);
+  }
+  size_t full_evictions = table.eviction_count();
+  size_t full_size = table.size();
+  for (size_t x = 0; x < 10; x++) {
+    table.insert(string_printf("hot%05zu", x), string(92, 'w'));
+  }
+  expect_eq(full_evictions, table.eviction_count());
+  expect_eq(full_size, table.size());
+  expect_eq(string(92, 'w'), table.at("hot00000"));
+
+  // the cache state is shared with other instances
+  {
+    shared_ptr<Pool> other_pool(new Pool("test-table"));
+    shared_ptr<Allocator> other_alloc = create_allocator(other_pool,
+        allocator_type);
+    HashTable other_table(other_alloc, table.base(), 8);
+    expect_eq(5000, other_table.cache_budget());
+    size_t evictions = other_table.eviction_count();
+    other_table.insert(string("other000"), value);
+    expect_eq(value, table.at("other000"));
+    other_table.set_cache_budget(2000);
+    expect_le(table.cache_bytes(), 2000);
+    expect_lt(evictions, table.eviction_count());
+  }
+
+  // erases and clears are counted too
+  size_t bytes = table.cache_bytes();
+  string key = (*table.begin()).first;
+  expect_eq(true, table.erase(key));
+  expect_eq(bytes - 100, table.cache_bytes());
+  table.clear();
+  expect_eq(0, table.cache_bytes());
+
+  // an object with eviction disabled (as used for log replay) still counts
+  // bytes, but doesn't evict anything
+  table.set_eviction_enabled(false);
+  for (size_t x = 0; x < 100; x++) {
+    table.insert(string_printf("key%05zu", x), value);
+  }
+  expect_eq(100, table.size());
+  expect_eq(10000, table.cache_bytes());
+  table.set_eviction_enabled(true);
+  table.insert(string("key00100"), value);
+  expect_le(table.cache_bytes(), 2000);
+  expect_eq(table.size() * 100, table.cache_bytes());
+  table.clear();
+
+  // leaving cache mode stops evictions
+  table.set_cache_budget(0);
+  expect_eq(0, table.cache_budget());
+  for (size_t x = 0; x < 100; x++) {
+    table.insert(string_printf("key%05zu", x), value);
+  }
+  expect_eq(100, table.size());
+  alloc->verify();
+}
+
+
 void run_concurrent_readers_test(const string& allocator_type) {
   printf("-- [%s] concurrent readers\n", allocator_type.c_str());
 
@@ -379,6 +497,48 @@ void run_concurrent_readers_test(const string& allocator_type) {
 
 
 
+void run_old_format_test(const string& allocator_type) {
+  printf("-- [%s] old format\n", allocator_type.c_str());
+
+  // tables created before cache mode existed have a smaller base (bits,
+  // slots_offset and item_count), which may be followed by anything. they can
+  // still be used, but can't enter cache mode
+  shared_ptr<Pool> pool(new Pool("test-table"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  uint64_t base_offset;
+  {
+    auto g = alloc->lock(true);
+    // 4 slots of (key_offset, key_size)
+    uint64_t slots_offset = alloc->allocate(8 * sizeof(uint64_t));
+    memset(pool->at<void>(slots_offset), 0, 8 * sizeof(uint64_t));
+    base_offset = alloc->allocate(3 * sizeof(uint64_t));
+    uint64_t* base = pool->at<uint64_t>(base_offset);
+    base[0] = 2; // bits
+    base[1] = slots_offset;
+    base[2] = 0; // item_count
+    uint64_t next_offset = alloc->allocate(sizeof(uint64_t));
+    *pool->at<uint64_t>(next_offset) = 0xFFFFFFFFFFFFFFF8;
+  }
+
+  HashTable table(alloc, base_offset, 0);
+  expect_eq(2, table.bits());
+  expect_eq(0, table.cache_budget());
+  for (size_t x = 0; x < 10; x++) {
+    table.insert(string_printf("key%zu", x), string_printf("value%zu", x));
+  }
+  expect_eq(10, table.size());
+  expect_eq("value7", table.at("key7"));
+  expect_eq(0, table.cache_bytes());
+  table.set_cache_budget(0);
+  try {
+    table.set_cache_budget(1000);
+    expect(false);
+  } catch (const runtime_error& e) { }
+  expect_eq(10, table.size());
+  alloc->verify();
+}
+
+
 int main(int argc, char* argv[]) {
   int retcode = 0;
 
@@ -394,6 +554,10 @@ int main(int argc, char* argv[]) {
       Pool::delete_pool("test-table");
       run_incr_test(allocator_type);
       Pool::delete_pool("test-table");
+      run_cache_test(allocator_type);
+      Pool::delete_pool("test-table");
+      run_old_format_test(allocator_type);
+      Pool::delete_pool("test-table");
       run_concurrent_readers_test(allocator_type);
     }
     printf("all tests passed\n");
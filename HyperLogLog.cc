@@ -0,0 +1,276 @@
+#include "HyperLogLog.hh"
+
+#include <math.h>
+#include <string.h>
+
+#include <stdexcept>
+
+#include "Hash.hh"
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+HyperLogLog::HyperLogLog(shared_ptr<Allocator> allocator, uint8_t precision) :
+    allocator(allocator) {
+  auto g = this->allocator->lock(true);
+  this->base_offset = this->create_hll_base(precision);
+}
+
+HyperLogLog::HyperLogLog(shared_ptr<Allocator> allocator, uint64_t base_offset,
+    uint8_t precision) : allocator(allocator), base_offset(base_offset) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->create_hll_base(precision);
+      this->allocator->set_base_object_offset(this->base_offset);
+    }
+  }
+}
+
+
+shared_ptr<Allocator> HyperLogLog::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t HyperLogLog::base() const {
+  return this->base_offset;
+}
+
+
+bool HyperLogLog::insert(const void* k, size_t k_size) {
+  uint8_t precision = this->precision();
+
+  // the high bits of the hash choose the register; the register's value is the
+  // position of the first 1 bit in the remaining bits
+  uint64_t hash = mix64(fnv1a64(k, k_size));
+  uint32_t index = hash >> (64 - precision);
+  uint64_t remaining_bits = hash << precision;
+  uint8_t value = remaining_bits ? (__builtin_clzll(remaining_bits) + 1) :
+      (64 - precision + 1);
+
+  return this->update_register(index, value);
+}
+
+bool HyperLogLog::insert(const string& k) {
+  return this->insert(k.data(), k.size());
+}
+
+
+size_t HyperLogLog::count() const {
+  auto regs = this->registers();
+
+  double m = regs.size();
+  double alpha;
+  if (regs.size() == 16) {
+    alpha = 0.673;
+  } else if (regs.size() == 32) {
+    alpha = 0.697;
+  } else if (regs.size() == 64) {
+    alpha = 0.709;
+  } else {
+    alpha = 0.7213 / (1.0 + 1.079 / m);
+  }
+
+  double sum = 0.0;
+  size_t zero_count = 0;
+  for (uint8_t reg : regs) {
+    sum += ldexp(1.0, -(int)reg);
+    zero_count += (reg == 0);
+  }
+
+  // for small cardinalities the raw estimate is biased, but linear counting
+  // (based on the number of empty registers) is accurate. we use 64-bit hashes,
+  // so there's no correction needed for large cardinalities.
+  double estimate = alpha * m * m / sum;
+  if ((estimate <= 2.5 * m) && zero_count) {
+    estimate = m * log(m / zero_count);
+  }
+  return static_cast<size_t>(estimate + 0.5);
+}
+
+
+void HyperLogLog::merge(const HyperLogLog& other) {
+  if (other.precision() != this->precision()) {
+    throw invalid_argument("cannot merge sketches with different precisions");
+  }
+
+  auto other_regs = other.registers();
+  for (size_t x = 0; x < other_regs.size(); x++) {
+    if (other_regs[x]) {
+      this->update_register(x, other_regs[x]);
+    }
+  }
+}
+
+
+void HyperLogLog::clear() {
+  auto g = this->allocator->lock(true);
+  auto p = this->allocator->get_pool();
+  HyperLogLogBase* base = p->at<HyperLogLogBase>(this->base_offset);
+
+  if (base->dense_offset) {
+    memset(p->at<uint8_t>(base->dense_offset), 0, 1 << base->precision);
+  }
+  auto* entries = p->at<atomic<uint32_t>>(base->sparse_offset);
+  for (uint64_t x = 0; x < base->sparse_capacity; x++) {
+    entries[x] = 0;
+  }
+  base->sparse_count = 0;
+}
+
+
+uint8_t HyperLogLog::precision() const {
+  return this->allocator->get_pool()->at<HyperLogLogBase>(
+      this->base_offset)->precision;
+}
+
+bool HyperLogLog::is_dense() const {
+  return this->allocator->get_pool()->at<HyperLogLogBase>(
+      this->base_offset)->encoding == Encoding::Dense;
+}
+
+vector<uint8_t> HyperLogLog::registers() const {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  const HyperLogLogBase* base = p->at<HyperLogLogBase>(this->base_offset);
+  vector<uint8_t> ret(1 << base->precision, 0);
+
+  uint64_t dense_offset = base->dense_offset;
+  if (dense_offset) {
+    p->check_size_and_remap();
+    base = p->at<HyperLogLogBase>(this->base_offset);
+    const auto* regs = p->at<atomic<uint8_t>>(dense_offset);
+    for (size_t x = 0; x < ret.size(); x++) {
+      ret[x] = regs[x].load(memory_order_relaxed);
+    }
+  }
+
+  // the sparse entries are never moved into the dense registers; they're just
+  // frozen when the sketch becomes dense, so we always have to include them
+  uint64_t sparse_count = min<uint64_t>(base->sparse_count,
+      base->sparse_capacity);
+  const auto* entries = p->at<atomic<uint32_t>>(base->sparse_offset);
+  for (uint64_t x = 0; x < sparse_count; x++) {
+    uint32_t entry = entries[x];
+    uint8_t value = entry & 0x3F;
+    uint8_t& reg = ret[entry >> 6];
+    if (value > reg) {
+      reg = value;
+    }
+  }
+
+  return ret;
+}
+
+
+uint64_t HyperLogLog::create_hll_base(uint8_t precision) {
+  if ((precision < 4) || (precision > 18)) {
+    throw invalid_argument("precision must be between 4 and 18");
+  }
+
+  auto p = this->allocator->get_pool();
+
+  // the sparse array uses 4 bytes per entry, so this makes it 1/4 the size of
+  // the dense registers
+  uint64_t sparse_capacity = (1 << precision) / 16;
+
+  uint64_t base_offset = this->allocator->allocate(sizeof(HyperLogLogBase));
+  uint64_t sparse_offset = this->allocator->allocate(
+      sparse_capacity * sizeof(uint32_t));
+
+  HyperLogLogBase* base = p->at<HyperLogLogBase>(base_offset);
+  base->precision = precision;
+  base->encoding = Encoding::Sparse;
+  base->sparse_capacity = sparse_capacity;
+  base->sparse_count = 0;
+  base->sparse_offset = sparse_offset;
+  base->dense_offset = 0;
+
+  auto* entries = p->at<atomic<uint32_t>>(sparse_offset);
+  for (uint64_t x = 0; x < sparse_capacity; x++) {
+    entries[x] = 0;
+  }
+
+  return base_offset;
+}
+
+
+bool HyperLogLog::update_register(uint32_t index, uint8_t value) {
+  // we don't lock the pool here, so we have to remap it ourselves in case
+  // another process expanded it
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  HyperLogLogBase* base = p->at<HyperLogLogBase>(this->base_offset);
+  if (base->encoding == Encoding::Dense) {
+    return this->update_dense_register(index, value);
+  }
+
+  // if there's already an entry for this register that's at least as large,
+  // there's nothing to do. this keeps repeated keys from filling up the array
+  auto* entries = p->at<atomic<uint32_t>>(base->sparse_offset);
+  uint64_t sparse_count = min<uint64_t>(base->sparse_count,
+      base->sparse_capacity);
+  for (uint64_t x = 0; x < sparse_count; x++) {
+    uint32_t entry = entries[x].load(memory_order_relaxed);
+    if (((entry >> 6) == index) && ((entry & 0x3F) >= value)) {
+      return false;
+    }
+  }
+
+  // reserve an entry and write it. if another process switches the sketch to
+  // the dense encoding concurrently, that's fine - readers always include the
+  // sparse entries
+  uint64_t entry_index = base->sparse_count.fetch_add(1);
+  if (entry_index < base->sparse_capacity) {
+    entries[entry_index] = (index << 6) | value;
+    return true;
+  }
+
+  this->convert_to_dense();
+  return this->update_dense_register(index, value);
+}
+
+bool HyperLogLog::update_dense_register(uint32_t index, uint8_t value) {
+  // the dense registers may have been allocated by another process after we
+  // last remapped the pool, so remap before looking at them
+  auto p = this->allocator->get_pool();
+  uint64_t dense_offset = p->at<HyperLogLogBase>(
+      this->base_offset)->dense_offset;
+  p->check_size_and_remap();
+
+  auto* reg = p->at<atomic<uint8_t>>(dense_offset + index);
+  uint8_t existing = reg->load(memory_order_relaxed);
+  while (existing < value) {
+    if (reg->compare_exchange_weak(existing, value)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void HyperLogLog::convert_to_dense() {
+  auto g = this->allocator->lock(true);
+  auto p = this->allocator->get_pool();
+  if (p->at<HyperLogLogBase>(this->base_offset)->encoding == Encoding::Dense) {
+    return; // another process already did it
+  }
+
+  uint8_t precision = p->at<HyperLogLogBase>(this->base_offset)->precision;
+  uint64_t dense_offset = this->allocator->allocate(1 << precision);
+  memset(p->at<uint8_t>(dense_offset), 0, 1 << precision);
+
+  // the registers must be initialized before any process can see them
+  HyperLogLogBase* base = p->at<HyperLogLogBase>(this->base_offset);
+  base->dense_offset = dense_offset;
+  base->encoding = Encoding::Dense;
+}
+
+} // namespace sharedstructures
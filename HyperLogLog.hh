@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Allocator.hh"
+
+namespace sharedstructures {
+
+
+// HyperLogLog estimates the number of distinct keys added to it, using a fixed
+// amount of memory regardless of how many keys are added. the standard error
+// of the estimate is about 1.04 / sqrt(2^precision) (so about 0.8% with
+// precision 14, which uses 16KB when dense).
+//
+// adding keys and reading the estimate don't take the pool lock; registers are
+// updated with atomic compare-and-swap max operations, so any number of
+// processes can add keys concurrently.
+//
+// new sketches start with a sparse encoding, which stores (register, value)
+// pairs in a small array instead of storing every register. when the sparse
+// array fills up, the sketch switches to the dense encoding (one byte per
+// register); this is the only operation that takes the pool lock, and it
+// happens at most once in the sketch's lifetime. the sparse entries aren't
+// moved when this happens; readers combine them with the dense registers.
+
+class HyperLogLog {
+public:
+  HyperLogLog() = delete;
+  HyperLogLog(const HyperLogLog&) = delete;
+  HyperLogLog(HyperLogLog&&) = delete;
+
+  // create constructor - allocates a new sketch with 2^precision registers.
+  // precision must be between 4 and 18 inclusive.
+  HyperLogLog(std::shared_ptr<Allocator> allocator, uint8_t precision);
+  // (conditional) create constructor.
+  // opens an existing HyperLogLog using the given allocator. if base_offset is
+  // 0, opens the HyperLogLog at the allocator's base offset. if the allocator's
+  // base offset is also 0, creates a new HyperLogLog and sets the allocator's
+  // base offset to the new sketch's base offset. precision is ignored if the
+  // sketch already exists.
+  HyperLogLog(std::shared_ptr<Allocator> allocator, uint64_t base_offset,
+      uint8_t precision);
+  ~HyperLogLog() = default;
+
+  // returns the allocator for this sketch
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this sketch
+  uint64_t base() const;
+
+  // adds a key to the sketch. returns false if the key was definitely already
+  // accounted for (the estimate didn't change), or true if it may not have
+  // been.
+  bool insert(const void* k, size_t k_size);
+  bool insert(const std::string& k);
+
+  // returns the estimated number of distinct keys added to the sketch.
+  size_t count() const;
+
+  // adds all the keys from another sketch to this one. the two sketches must
+  // have the same precision, but they don't have to be in the same pool. this
+  // doesn't lock either pool (unless this sketch has to switch to the dense
+  // encoding), so the result may or may not include keys added to other
+  // concurrently with the merge.
+  void merge(const HyperLogLog& other);
+
+  // resets the sketch to empty. this isn't atomic with respect to concurrent
+  // inserts; keys added during a clear() may or may not be counted. the
+  // encoding doesn't change back to sparse.
+  void clear();
+
+  // inspection methods.
+  uint8_t precision() const;
+  bool is_dense() const;
+  // returns the value of every register (2^precision bytes), regardless of the
+  // encoding.
+  std::vector<uint8_t> registers() const;
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+
+  enum Encoding {
+    Sparse = 0,
+    Dense = 1,
+  };
+
+  struct HyperLogLogBase {
+    uint8_t precision;
+    std::atomic<uint8_t> encoding;
+    uint8_t unused[6];
+
+    // the sparse array contains uint32_ts of the form (index << 6) | value,
+    // where index is the register number and value is the register value. 0
+    // entries are unused (values are never 0). writers reserve entries by
+    // incrementing sparse_count, so it may be larger than sparse_capacity; this
+    // means the array is full.
+    uint64_t sparse_capacity;
+    std::atomic<uint64_t> sparse_count;
+    uint64_t sparse_offset;
+
+    // 0 until the sketch switches to the dense encoding
+    std::atomic<uint64_t> dense_offset;
+  };
+
+  uint64_t create_hll_base(uint8_t precision);
+
+  bool update_register(uint32_t index, uint8_t value);
+  bool update_dense_register(uint32_t index, uint8_t value);
+  void convert_to_dense();
+};
+
+} // namespace sharedstructures
@@ -0,0 +1,230 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "HyperLogLog.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+
+void expect_close(size_t expected, size_t actual, double tolerance) {
+  double error = ((double)actual - (double)expected) / expected;
+  if ((error > tolerance) || (error < -tolerance)) {
+    printf("expected %zu, got %zu (error %lf)\n", expected, actual, error);
+    expect(false);
+  }
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-hll"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  HyperLogLog hll(alloc, 0, 12);
+
+  expect_eq(12, hll.precision());
+  expect_eq(0, hll.count());
+  expect_eq(false, hll.is_dense());
+
+  // small cardinalities should be nearly exact, and should fit in the sparse
+  // encoding
+  for (size_t x = 0; x < 100; x++) {
+    hll.insert(string_printf("key%zu", x));
+  }
+  expect_close(100, hll.count(), 0.02);
+  expect_eq(false, hll.is_dense());
+
+  // repeated keys don't change the estimate or fill the sparse array
+  for (size_t y = 0; y < 10; y++) {
+    for (size_t x = 0; x < 100; x++) {
+      expect_eq(false, hll.insert(string_printf("key%zu", x)));
+    }
+  }
+  expect_close(100, hll.count(), 0.02);
+  expect_eq(false, hll.is_dense());
+
+  // larger cardinalities switch to the dense encoding. the standard error at
+  // precision 12 is about 1.6%, so 5% is comfortably within the bounds
+  for (size_t x = 100; x < 100000; x++) {
+    hll.insert(string_printf("key%zu", x));
+  }
+  expect_eq(true, hll.is_dense());
+  expect_close(100000, hll.count(), 0.05);
+
+  // opening the sketch again gives the same estimate
+  {
+    HyperLogLog hll2(alloc, hll.base(), 0);
+    expect_eq(hll.count(), hll2.count());
+  }
+
+  hll.clear();
+  expect_eq(0, hll.count());
+  hll.insert("key0");
+  expect_eq(1, hll.count());
+}
+
+
+void run_merge_test(const string& allocator_type) {
+  printf("-- [%s] merge\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-hll"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  HyperLogLog hll1(alloc, 12);
+  HyperLogLog hll2(alloc, 12);
+  HyperLogLog hll3(alloc, 10);
+
+  // the sets overlap by half, so the union has 30000 keys
+  for (size_t x = 0; x < 20000; x++) {
+    hll1.insert(string_printf("key%zu", x));
+    hll2.insert(string_printf("key%zu", x + 10000));
+  }
+  expect_close(20000, hll1.count(), 0.05);
+  expect_close(20000, hll2.count(), 0.05);
+
+  hll1.merge(hll2);
+  expect_close(30000, hll1.count(), 0.05);
+  expect_close(20000, hll2.count(), 0.05);
+
+  // merging a sparse sketch into a dense one and vice versa both work
+  HyperLogLog sparse(alloc, 12);
+  sparse.insert("key-sparse");
+  expect_eq(false, sparse.is_dense());
+  size_t count_before = hll1.count();
+  hll1.merge(sparse);
+  expect_le(count_before, hll1.count());
+  sparse.merge(hll1);
+  expect_eq(hll1.count(), sparse.count());
+
+  try {
+    hll1.merge(hll3);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+}
+
+
+void run_invalid_parameters_test(const string& allocator_type) {
+  printf("-- [%s] invalid parameters\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-hll"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+
+  try {
+    HyperLogLog hll(alloc, 3);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    HyperLogLog hll(alloc, 19);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+}
+
+
+void run_concurrent_inserts_test(const string& allocator_type) {
+  printf("-- [%s] concurrent inserts\n", allocator_type.c_str());
+
+  // the sketch starts out sparse, so the children race to convert it to dense
+  uint64_t base_offset;
+  {
+    shared_ptr<Pool> pool(new Pool("test-hll"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    HyperLogLog hll(alloc, 0, 12);
+    base_offset = hll.base();
+  }
+
+  unordered_set<pid_t> child_pids;
+  size_t child_index = 0;
+  while ((child_pids.size() < 8) && !child_pids.count(0)) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      break;
+    } else {
+      child_pids.emplace(pid);
+      if (pid) {
+        child_index++;
+      }
+    }
+  }
+
+  if (child_pids.count(0)) {
+    shared_ptr<Pool> pool(new Pool("test-hll"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    HyperLogLog hll(alloc, base_offset, 0);
+    for (size_t x = 0; x < 5000; x++) {
+      hll.insert(string_printf("key%zu-%zu", child_index, x));
+    }
+    _exit(0);
+
+  } else {
+    int num_failures = 0;
+    int exit_status;
+    pid_t exited_pid;
+    while ((exited_pid = wait(&exit_status)) != -1) {
+      child_pids.erase(exited_pid);
+      if (!WIFEXITED(exit_status) || (WEXITSTATUS(exit_status) != 0)) {
+        printf("-- [%s]   child %d failed (%d)\n", allocator_type.c_str(),
+            exited_pid, exit_status);
+        num_failures++;
+      }
+    }
+    expect_eq(true, child_pids.empty());
+    expect_eq(0, num_failures);
+
+    shared_ptr<Pool> pool(new Pool("test-hll"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    HyperLogLog hll(alloc, base_offset, 0);
+    expect_eq(true, hll.is_dense());
+    expect_close(40000, hll.count(), 0.05);
+  }
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      Pool::delete_pool("test-hll");
+      run_basic_test(allocator_type);
+      Pool::delete_pool("test-hll");
+      run_merge_test(allocator_type);
+      Pool::delete_pool("test-hll");
+      run_invalid_parameters_test(allocator_type);
+      Pool::delete_pool("test-hll");
+      run_concurrent_inserts_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  Pool::delete_pool("test-hll");
+
+  return retcode;
+}
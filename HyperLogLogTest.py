@@ -0,0 +1,126 @@
+from __future__ import unicode_literals
+
+import os
+import sys
+
+import sharedstructures
+
+
+def expect_close(expected, actual, tolerance):
+  error = float(actual - expected) / expected
+  assert abs(error) <= tolerance, 'expected %d, got %d' % (expected, actual)
+
+
+def run_basic_test(allocator_type):
+  print('-- [%s] basic' % allocator_type)
+
+  hll = sharedstructures.HyperLogLog('test-hll', allocator_type, 0, 12)
+  assert 12 == hll.precision()
+  assert 0 == hll.count()
+  assert 0 == len(hll)
+  assert not hll.is_dense()
+
+  for x in range(100):
+    hll.add(b'key%d' % x)
+  expect_close(100, hll.count(), 0.02)
+  assert not hll.add(b'key0')
+  assert not hll.is_dense()
+
+  for x in range(100, 50000):
+    hll.add(b'key%d' % x)
+  assert hll.is_dense()
+  expect_close(50000, len(hll), 0.05)
+
+  try:
+    hll.add('not-bytes')
+    assert False, 'add() with a unicode key did not raise TypeError'
+  except TypeError:
+    pass
+
+  hll.clear()
+  assert 0 == hll.count()
+
+
+def run_merge_test(allocator_type):
+  print('-- [%s] merge' % allocator_type)
+
+  hll1 = sharedstructures.HyperLogLog('test-hll', allocator_type, 0, 12)
+  hll2 = sharedstructures.HyperLogLog('test-hll2', allocator_type, 0, 12)
+  hll3 = sharedstructures.HyperLogLog('test-hll3', allocator_type, 0, 10)
+
+  for x in range(20000):
+    hll1.add(b'key%d' % x)
+    hll2.add(b'key%d' % (x + 10000))
+  hll1.merge(hll2)
+  expect_close(30000, hll1.count(), 0.05)
+
+  try:
+    hll1.merge(hll3)
+    assert False, 'merge() with different precisions did not raise ValueError'
+  except ValueError:
+    pass
+
+  try:
+    hll1.merge(None)
+    assert False, 'merge() with a non-HyperLogLog did not raise TypeError'
+  except TypeError:
+    pass
+
+
+def run_concurrent_inserts_test(allocator_type):
+  print('-- [%s] concurrent inserts' % allocator_type)
+
+  hll = sharedstructures.HyperLogLog('test-hll', allocator_type, 0, 12)
+  del hll
+
+  child_pids = set()
+  while (len(child_pids) < 8) and (0 not in child_pids):
+    child_pids.add(os.fork())
+
+  if 0 in child_pids:
+    # child process: add a disjoint set of keys
+    child_index = len(child_pids) - 1
+    hll = sharedstructures.HyperLogLog('test-hll', allocator_type)
+    for x in range(2000):
+      hll.add(b'key%d-%d' % (child_index, x))
+    os._exit(0)
+
+  else:
+    num_failures = 0
+    while child_pids:
+      pid, exit_status = os.wait()
+      child_pids.remove(pid)
+      if not os.WIFEXITED(exit_status) or (os.WEXITSTATUS(exit_status) != 0):
+        print('-- [%s]   child %d failed (%d)' % (
+            allocator_type, pid, exit_status))
+        num_failures += 1
+    assert 0 == num_failures
+
+    hll = sharedstructures.HyperLogLog('test-hll', allocator_type)
+    expect_close(16000, hll.count(), 0.05)
+
+
+def delete_pools():
+  sharedstructures.delete_pool('test-hll')
+  sharedstructures.delete_pool('test-hll2')
+  sharedstructures.delete_pool('test-hll3')
+
+
+def main():
+  try:
+    for allocator_type in ('simple', 'logarithmic'):
+      delete_pools()
+      run_basic_test(allocator_type)
+      delete_pools()
+      run_merge_test(allocator_type)
+      delete_pools()
+      run_concurrent_inserts_test(allocator_type)
+    print('all tests passed')
+    return 0
+
+  finally:
+    delete_pools()
+
+
+if __name__ == '__main__':
+  sys.exit(main())
@@ -0,0 +1,306 @@
+#include "IncrementalCheckpoint.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <stdexcept>
+
+#include "FileUtils.hh"
+#include "Hash.hh"
+#include "ProcessLock.hh"
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+static const uint64_t DELTA_SIGNATURE = 0x5353434B50544431; // 'SSCKPTD1'
+static const uint64_t HASHES_SIGNATURE = 0x5353434B50544831; // 'SSCKPTH1'
+
+// pages are written to delta files in batches of this many bytes
+static const size_t WRITE_BUFFER_SIZE = 1024 * 1024;
+
+
+static uint64_t hash_page(const uint8_t* data) {
+  // fnv1a64 processes one byte at a time, which is too slow for scanning an
+  // entire pool; this processes 8 bytes at a time instead
+  const uint64_t* words = reinterpret_cast<const uint64_t*>(data);
+  uint64_t hash = 0;
+  for (size_t x = 0; x < PAGE_SIZE / sizeof(uint64_t); x++) {
+    hash = mix64(hash ^ words[x]);
+  }
+  return hash;
+}
+
+
+IncrementalCheckpoint::IncrementalCheckpoint(shared_ptr<Allocator> allocator,
+    const string& prefix) : allocator(allocator), prefix(prefix), chain_id(0),
+    index(0), pages_written(0) {
+  this->load_hashes();
+}
+
+
+shared_ptr<Allocator> IncrementalCheckpoint::get_allocator() const {
+  return this->allocator;
+}
+
+const string& IncrementalCheckpoint::get_prefix() const {
+  return this->prefix;
+}
+
+
+size_t IncrementalCheckpoint::write(bool full) {
+  // the read lock keeps writers out, so the copy is consistent, but doesn't
+  // block readers while we scan the pool
+  auto g = this->allocator->lock(false);
+  return this->write_locked(full, {});
+}
+
+size_t IncrementalCheckpoint::write_locked(bool full,
+    const vector<pair<uint64_t, string>>& overrides) {
+  auto p = this->allocator->get_pool();
+  uint64_t pool_size = p->size();
+  size_t page_count = pool_size / PAGE_SIZE;
+
+  // the pool is locked while we copy it, but the checkpoint shouldn't be
+  // locked when it's restored
+  vector<pair<uint64_t, string>> all_overrides(overrides);
+  all_overrides.emplace_back(this->allocator->lock_offset(),
+      string(sizeof(ProcessReadWriteLock), '\0'));
+
+  full |= (this->chain_id == 0);
+  uint64_t chain_id = this->chain_id;
+  size_t index = this->index + 1;
+  if (full) {
+    chain_id = max<uint64_t>(now(), this->chain_id + 1);
+    index = 0;
+  }
+
+  string filename = this->filename_for_index(index);
+  string temp_filename = filename + ".tmp";
+  vector<uint64_t> new_page_hashes(page_count);
+  size_t pages_written = 0;
+  {
+    scoped_fd fd = open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+        0666);
+    if (fd == -1) {
+      throw cannot_open_file(temp_filename);
+    }
+
+    string write_buffer;
+    uint64_t write_offset = sizeof(FileHeader);
+    string page_buffer(PAGE_SIZE, '\0');
+    for (size_t page_index = 0; page_index < page_count; page_index++) {
+      uint64_t page_offset = page_index * PAGE_SIZE;
+      const uint8_t* page_data = p->at<uint8_t>(page_offset);
+
+      // if any overrides affect this page, apply them to a copy of it
+      bool copied = false;
+      for (const auto& it : all_overrides) {
+        uint64_t start = max<uint64_t>(it.first, page_offset);
+        uint64_t end = min<uint64_t>(it.first + it.second.size(),
+            page_offset + PAGE_SIZE);
+        if (start >= end) {
+          continue;
+        }
+        if (!copied) {
+          memcpy(&page_buffer[0], page_data, PAGE_SIZE);
+          page_data = reinterpret_cast<const uint8_t*>(page_buffer.data());
+          copied = true;
+        }
+        memcpy(&page_buffer[start - page_offset],
+            it.second.data() + (start - it.first), end - start);
+      }
+
+      uint64_t hash = hash_page(page_data);
+      new_page_hashes[page_index] = hash;
+      if (!full && (page_index < this->page_hashes.size()) &&
+          (this->page_hashes[page_index] == hash)) {
+        continue;
+      }
+
+      uint64_t page_index_data = page_index;
+      write_buffer.append(reinterpret_cast<const char*>(&page_index_data),
+          sizeof(uint64_t));
+      write_buffer.append(reinterpret_cast<const char*>(page_data), PAGE_SIZE);
+      pages_written++;
+      if (write_buffer.size() >= WRITE_BUFFER_SIZE) {
+        pwrite_all(fd, write_buffer.data(), write_buffer.size(), write_offset,
+            temp_filename);
+        write_offset += write_buffer.size();
+        write_buffer.clear();
+      }
+    }
+    pwrite_all(fd, write_buffer.data(), write_buffer.size(), write_offset,
+        temp_filename);
+
+    FileHeader header = {DELTA_SIGNATURE, chain_id, index, pool_size,
+        pages_written};
+    pwrite_all(fd, &header, sizeof(header), 0, temp_filename);
+    sync_file(fd, temp_filename);
+  }
+  replace_file(temp_filename, filename);
+
+  size_t prev_index = this->index;
+  this->chain_id = chain_id;
+  this->index = index;
+  this->pages_written = pages_written;
+  this->page_hashes.swap(new_page_hashes);
+  this->save_hashes(pool_size);
+
+  // the new snapshot replaces the entire previous chain. restore() ignores
+  // deltas from other chains, so it's safe if we crash before deleting them
+  if (full) {
+    for (size_t x = 1; x <= prev_index; x++) {
+      unlink(this->filename_for_index(x).c_str());
+    }
+  }
+
+  return index;
+}
+
+
+size_t IncrementalCheckpoint::restore(const string& prefix,
+    const string& pool_name) {
+  string temp_filename = pool_name + ".tmp";
+  scoped_fd out_fd = open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+      0666);
+  if (out_fd == -1) {
+    throw cannot_open_file(temp_filename);
+  }
+
+  // apply the snapshot, then the deltas in order until there's a missing one
+  // or one from a different chain
+  uint64_t chain_id = 0;
+  size_t index;
+  string data;
+  for (index = 0;; index++) {
+    string filename = prefix + "." + to_string(index);
+    scoped_fd in_fd = open(filename.c_str(), O_RDONLY);
+    if (in_fd == -1) {
+      if (index == 0) {
+        throw cannot_open_file(filename);
+      }
+      break;
+    }
+
+    FileHeader header;
+    if (!pread_all(in_fd, &header, sizeof(header), 0, filename) ||
+        (header.signature != DELTA_SIGNATURE) || (header.index != index)) {
+      throw runtime_error(filename + " is not a checkpoint");
+    }
+    if (index == 0) {
+      chain_id = header.chain_id;
+    } else if (header.chain_id != chain_id) {
+      break;
+    }
+
+    // a delta's pool is smaller than the last one's if the pool was truncated
+    // in between; ftruncate discards the pages past its end. the writer drops
+    // the hashes of those pages, so any that reappear later are written again
+    // in full by a later delta
+    if (ftruncate(out_fd, header.pool_size)) {
+      throw runtime_error("can\'t resize " + temp_filename + ": " +
+          string_for_error(errno));
+    }
+
+    size_t entry_size = sizeof(uint64_t) + PAGE_SIZE;
+    data.resize(entry_size);
+    for (size_t x = 0; x < header.page_count; x++) {
+      if (!pread_all(in_fd, &data[0], entry_size,
+          sizeof(FileHeader) + x * entry_size, filename)) {
+        throw runtime_error(filename + " is truncated");
+      }
+      uint64_t page_index = *reinterpret_cast<const uint64_t*>(data.data());
+      if ((page_index + 1) * PAGE_SIZE > header.pool_size) {
+        throw runtime_error(filename + " is corrupt");
+      }
+      pwrite_all(out_fd, data.data() + sizeof(uint64_t), PAGE_SIZE,
+          page_index * PAGE_SIZE, temp_filename);
+    }
+  }
+
+  sync_file(out_fd, temp_filename);
+  replace_file(temp_filename, pool_name);
+  return index;
+}
+
+
+size_t IncrementalCheckpoint::last_index() const {
+  return this->index;
+}
+
+size_t IncrementalCheckpoint::last_pages_written() const {
+  return this->pages_written;
+}
+
+
+string IncrementalCheckpoint::filename_for_index(size_t index) const {
+  return this->prefix + "." + to_string(index);
+}
+
+void IncrementalCheckpoint::load_hashes() {
+  string filename = this->prefix + ".hashes";
+  scoped_fd fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return; // no previous checkpoint; the next one will be a full snapshot
+  }
+
+  FileHeader header;
+  if (!pread_all(fd, &header, sizeof(header), 0, filename) ||
+      (header.signature != HASHES_SIGNATURE)) {
+    return;
+  }
+  vector<uint64_t> page_hashes(header.page_count);
+  if (!pread_all(fd, page_hashes.data(), page_hashes.size() * sizeof(uint64_t),
+      sizeof(header), filename)) {
+    return;
+  }
+
+  // the hashes are only usable if they describe the last file in the chain.
+  // if we crashed after writing a delta but before saving its hashes, these
+  // are older than the last delta; the next delta will overwrite it with all
+  // the changes since these hashes were saved, so this is still correct
+  string delta_filename = this->filename_for_index(header.index);
+  scoped_fd delta_fd = open(delta_filename.c_str(), O_RDONLY);
+  FileHeader delta_header;
+  if ((delta_fd == -1) ||
+      !pread_all(delta_fd, &delta_header, sizeof(delta_header), 0,
+          delta_filename) ||
+      (delta_header.signature != DELTA_SIGNATURE) ||
+      (delta_header.chain_id != header.chain_id)) {
+    return;
+  }
+
+  this->chain_id = header.chain_id;
+  this->index = header.index;
+  this->page_hashes.swap(page_hashes);
+}
+
+void IncrementalCheckpoint::save_hashes(uint64_t pool_size) {
+  string filename = this->prefix + ".hashes";
+  string temp_filename = filename + ".tmp";
+  {
+    scoped_fd fd = open(temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+        0666);
+    if (fd == -1) {
+      throw cannot_open_file(temp_filename);
+    }
+    FileHeader header = {HASHES_SIGNATURE, this->chain_id, this->index,
+        pool_size, this->page_hashes.size()};
+    pwrite_all(fd, &header, sizeof(header), 0, temp_filename);
+    pwrite_all(fd, this->page_hashes.data(),
+        this->page_hashes.size() * sizeof(uint64_t), sizeof(header),
+        temp_filename);
+    sync_file(fd, temp_filename);
+  }
+  replace_file(temp_filename, filename);
+}
+
+} // namespace sharedstructures
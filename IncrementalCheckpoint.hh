@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Allocator.hh"
+
+namespace sharedstructures {
+
+
+// IncrementalCheckpoint writes checkpoints of a pool as a chain of files: a
+// full snapshot (prefix.0) followed by deltas (prefix.1, prefix.2, ...), each
+// containing only the pages that changed since the previous checkpoint in the
+// chain. restore() rebuilds the pool from the snapshot and all of its deltas.
+//
+// changed pages are found by hashing every page and comparing the hashes to
+// those of the previous checkpoint, which are kept in prefix.hashes. this
+// finds every change no matter which process made it, without any write
+// tracking in the allocators or structures; the cost is a scan of the pool
+// in memory, which is much faster than writing it all to disk. (soft-dirty
+// page bits wouldn't work here, since they only track writes made through the
+// checkpointing process' own page tables.) a page that changes to different
+// contents with the same 64-bit hash would be missed, but this is extremely
+// unlikely.
+//
+// every file is written to a temporary name, synced and renamed into place, so
+// a crash while writing a checkpoint leaves the previous one intact. each
+// chain has a unique ID, so deltas left over from an older chain are never
+// applied to a newer snapshot.
+
+class IncrementalCheckpoint {
+public:
+  IncrementalCheckpoint() = delete;
+  IncrementalCheckpoint(const IncrementalCheckpoint&) = delete;
+  IncrementalCheckpoint(IncrementalCheckpoint&&) = delete;
+
+  // opens the checkpoint chain with the given filename prefix. if prefix.hashes
+  // exists and matches the last file in the chain, the next write() continues
+  // the chain; otherwise, it starts a new chain with a full snapshot.
+  IncrementalCheckpoint(std::shared_ptr<Allocator> allocator,
+      const std::string& prefix);
+  ~IncrementalCheckpoint() = default;
+
+  // returns the allocator for this checkpoint chain
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the filename prefix
+  const std::string& get_prefix() const;
+
+  // writes a checkpoint and returns its index in the chain (0 for a full
+  // snapshot). if full is true or there's no previous checkpoint to compare
+  // with, writes a full snapshot and deletes the previous chain's deltas. locks
+  // the pool for reading while scanning it.
+  size_t write(bool full = false);
+
+  // same as write(), but the caller must hold the pool's write lock. the given
+  // (offset, data) pairs replace the pool's contents at those offsets in the
+  // checkpoint (without modifying the pool).
+  size_t write_locked(bool full,
+      const std::vector<std::pair<uint64_t, std::string>>& overrides);
+
+  // rebuilds a file-backed pool from a checkpoint chain. no process may have
+  // the pool open while this is called. returns the number of files applied
+  // (1 for a snapshot with no deltas).
+  static size_t restore(const std::string& prefix,
+      const std::string& pool_name);
+
+  // inspection methods.
+  size_t last_index() const; // index of the last checkpoint written
+  size_t last_pages_written() const; // pages in the last checkpoint written
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  std::string prefix;
+
+  // state of the last checkpoint in the chain. chain_id is 0 if there's no
+  // chain to continue.
+  uint64_t chain_id;
+  size_t index;
+  size_t pages_written;
+  std::vector<uint64_t> page_hashes;
+
+  // each file begins with this header. in delta files, it's followed by
+  // page_count (page index, page data) pairs; in the hashes file, it's
+  // followed by page_count hashes (one for every page in the pool).
+  struct FileHeader {
+    uint64_t signature;
+    uint64_t chain_id;
+    uint64_t index;
+    uint64_t pool_size;
+    uint64_t page_count;
+  };
+
+  std::string filename_for_index(size_t index) const;
+  void load_hashes();
+  void save_hashes(uint64_t pool_size);
+};
+
+} // namespace sharedstructures
@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "HashTable.hh"
+#include "IncrementalCheckpoint.hh"
+#include "PrefixTree.hh"
+#include "WriteAheadLog.hh"
+#include "TestUtils.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+bool file_exists(const string& filename) {
+  return access(filename.c_str(), F_OK) == 0;
+}
+
+void delete_files() {
+  Pool::delete_pool("test-checkpoint");
+  Pool::delete_pool("test-checkpoint-restored");
+  for (size_t x = 0; x < 8; x++) {
+    unlink(string_printf("test-checkpoint.cp.%zu", x).c_str());
+  }
+  unlink("test-checkpoint.cp.hashes");
+  unlink("test-checkpoint.log");
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-checkpoint"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  PrefixTree tree(alloc);
+  for (size_t x = 0; x < 1000; x++) {
+    tree.insert(string_printf("key-%zu", x), string_printf("value-%zu", x));
+  }
+  expect_lt(4, pool->size() / PAGE_SIZE);
+
+  // the first checkpoint is a full snapshot
+  uint64_t tree_base = tree.base();
+  {
+    IncrementalCheckpoint cp(alloc, "test-checkpoint.cp");
+    expect_eq(0, cp.write());
+    expect_eq(0, cp.last_index());
+    expect_eq(pool->size() / PAGE_SIZE, cp.last_pages_written());
+    expect(file_exists("test-checkpoint.cp.0"));
+    expect(file_exists("test-checkpoint.cp.hashes"));
+
+    // a small change writes only the pages it touched
+    tree.insert(string("key-500"), string("modified"));
+    expect_eq(1, cp.write());
+    expect_le(1, cp.last_pages_written());
+    expect_ge(4, cp.last_pages_written());
+
+    // if nothing changed, the delta is empty
+    expect_eq(2, cp.write());
+    expect_eq(0, cp.last_pages_written());
+  }
+
+  // a new object continues the existing chain
+  {
+    IncrementalCheckpoint cp(alloc, "test-checkpoint.cp");
+    tree.insert(string("key-1000"), string("value-1000"));
+    expect_eq(3, cp.write());
+    expect_lt(0, cp.last_pages_written());
+  }
+
+  // the restored pool has the contents at the last checkpoint
+  auto contents = tree_contents(tree);
+  tree.insert(string("not-checkpointed"), string("value"));
+  expect_eq(4, IncrementalCheckpoint::restore("test-checkpoint.cp",
+      "test-checkpoint-restored"));
+  {
+    shared_ptr<Pool> restored_pool(new Pool("test-checkpoint-restored"));
+    shared_ptr<Allocator> restored_alloc = create_allocator(restored_pool,
+        allocator_type);
+    PrefixTree restored_tree(restored_alloc, tree_base);
+    expect_eq(contents, tree_contents(restored_tree));
+    expect_eq(PrefixTree::LookupResult("modified"), restored_tree.at("key-500"));
+    restored_alloc->verify();
+  }
+  Pool::delete_pool("test-checkpoint-restored");
+
+  // a full checkpoint starts a new chain and deletes the old deltas
+  {
+    IncrementalCheckpoint cp(alloc, "test-checkpoint.cp");
+    expect_eq(0, cp.write(true));
+    expect_eq(pool->size() / PAGE_SIZE, cp.last_pages_written());
+    expect(!file_exists("test-checkpoint.cp.1"));
+    expect(!file_exists("test-checkpoint.cp.3"));
+
+    // growing the pool writes the new pages
+    size_t old_page_count = pool->size() / PAGE_SIZE;
+    for (size_t x = 0; x < 5000; x++) {
+      tree.insert(string_printf("grow-%zu", x), string_printf("value-%zu", x));
+    }
+    size_t new_page_count = pool->size() / PAGE_SIZE;
+    expect_lt(old_page_count, new_page_count);
+    expect_eq(1, cp.write());
+    expect_le(new_page_count - old_page_count, cp.last_pages_written());
+  }
+
+  contents = tree_contents(tree);
+  expect_eq(2, IncrementalCheckpoint::restore("test-checkpoint.cp",
+      "test-checkpoint-restored"));
+  {
+    shared_ptr<Pool> restored_pool(new Pool("test-checkpoint-restored"));
+    shared_ptr<Allocator> restored_alloc = create_allocator(restored_pool,
+        allocator_type);
+    expect_eq(pool->size(), restored_pool->size());
+    PrefixTree restored_tree(restored_alloc, tree_base);
+    expect_eq(contents, tree_contents(restored_tree));
+  }
+  Pool::delete_pool("test-checkpoint-restored");
+
+  // a delta left over from an older chain isn't applied
+  {
+    IncrementalCheckpoint cp(alloc, "test-checkpoint.cp");
+    tree.insert(string("another-key"), string("value"));
+    expect_eq(2, cp.write());
+    expect_eq(0, cp.write(true));
+    expect(!file_exists("test-checkpoint.cp.2"));
+  }
+  expect_eq(0, rename("test-checkpoint.cp.0", "test-checkpoint.cp.saved"));
+  {
+    IncrementalCheckpoint cp(alloc, "test-checkpoint.cp");
+    tree.insert(string("another-key"), string("value2"));
+    expect_eq(0, cp.write());
+    tree.insert(string("another-key"), string("value3"));
+    expect_eq(1, cp.write());
+  }
+  expect_eq(0, rename("test-checkpoint.cp.saved", "test-checkpoint.cp.0"));
+  expect_eq(1, IncrementalCheckpoint::restore("test-checkpoint.cp",
+      "test-checkpoint-restored"));
+  {
+    shared_ptr<Pool> restored_pool(new Pool("test-checkpoint-restored"));
+    shared_ptr<Allocator> restored_alloc = create_allocator(restored_pool,
+        allocator_type);
+    PrefixTree restored_tree(restored_alloc, tree_base);
+    expect_eq(PrefixTree::LookupResult("value"), restored_tree.at("another-key"));
+  }
+  Pool::delete_pool("test-checkpoint-restored");
+}
+
+
+void run_write_ahead_log_test(const string& allocator_type) {
+  printf("-- [%s] write-ahead log\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-checkpoint"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  shared_ptr<WriteAheadLog> wal(new WriteAheadLog(alloc,
+      "test-checkpoint.log"));
+  PrefixTree tree(alloc);
+  HashTable table(alloc, 6);
+  tree.attach_write_ahead_log(wal);
+  table.attach_write_ahead_log(wal);
+
+  IncrementalCheckpoint cp(alloc, "test-checkpoint.cp");
+  for (size_t x = 0; x < 500; x++) {
+    tree.insert(string_printf("key-%zu", x), (int64_t)x);
+  }
+  wal->checkpoint(cp);
+  expect_eq(0, cp.last_index());
+  expect_eq(0, wal->log_size());
+
+  for (size_t x = 0; x < 100; x++) {
+    table.insert(string_printf("key-%zu", x), string_printf("value-%zu", x));
+  }
+  wal->checkpoint(cp);
+  expect_eq(1, cp.last_index());
+  expect_lt(0, cp.last_pages_written());
+  expect_eq(0, wal->log_size());
+
+  // changes after the last checkpoint are recovered from the log
+  uint64_t sequence_before = wal->next_sequence();
+  tree.insert(string("key-0"), string("modified"));
+  expect_eq(true, tree.erase("key-1"));
+  expect_eq(3, table.incr("counter", (int64_t)3));
+  wal->commit();
+
+  expect_eq(2, IncrementalCheckpoint::restore("test-checkpoint.cp",
+      "test-checkpoint-restored"));
+  shared_ptr<Pool> restored_pool(new Pool("test-checkpoint-restored"));
+  shared_ptr<Allocator> restored_alloc = create_allocator(restored_pool,
+      allocator_type);
+  WriteAheadLog restored_wal(restored_alloc, wal->base(),
+      "test-checkpoint.log");
+  PrefixTree restored_tree(restored_alloc, tree.base());
+  HashTable restored_table(restored_alloc, table.base(), 0);
+  expect_eq(500, restored_tree.size());
+  expect_eq(100, restored_table.size());
+  expect_eq(wal->next_sequence() - sequence_before, restored_wal.replay());
+  expect_eq(tree_contents(tree), tree_contents(restored_tree));
+  expect_eq(table_contents(table), table_contents(restored_table));
+}
+
+
+void run_truncation_test(const string& allocator_type) {
+  printf("-- [%s] truncation\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-checkpoint"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  PrefixTree tree(alloc);
+  for (size_t x = 0; x < 1000; x++) {
+    tree.insert(string_printf("key-%zu", x), string_printf("value-%zu", x));
+  }
+  uint64_t tree_base = tree.base();
+
+  // a large block at the end of the pool, filled with nonzero data
+  size_t block_size = 64 * PAGE_SIZE;
+  string block_data(block_size, 'x');
+  uint64_t block_offset;
+  {
+    auto g = alloc->lock(true);
+    block_offset = alloc->allocate(block_size);
+    memcpy(pool->at<char>(block_offset), block_data.data(), block_size);
+  }
+  size_t grown_size = pool->size();
+
+  IncrementalCheckpoint cp(alloc, "test-checkpoint.cp");
+  expect_eq(0, cp.write());
+
+  // freeing the block and truncating the pool makes the next delta's pool
+  // smaller than the last one's
+  {
+    auto g = alloc->lock(true);
+    alloc->free(block_offset);
+    alloc->truncate();
+  }
+  if (allocator_type == "simple") {
+    expect_lt(pool->size(), grown_size);
+  }
+  tree.insert(string("key-500"), string("modified"));
+  expect_eq(1, cp.write());
+
+  auto contents = tree_contents(tree);
+  expect_eq(2, IncrementalCheckpoint::restore("test-checkpoint.cp",
+      "test-checkpoint-restored"));
+  {
+    shared_ptr<Pool> restored_pool(new Pool("test-checkpoint-restored"));
+    shared_ptr<Allocator> restored_alloc = create_allocator(restored_pool,
+        allocator_type);
+    expect_eq(pool->size(), restored_pool->size());
+    PrefixTree restored_tree(restored_alloc, tree_base);
+    expect_eq(contents, tree_contents(restored_tree));
+    restored_alloc->verify();
+  }
+  Pool::delete_pool("test-checkpoint-restored");
+
+  // the pages past the truncation reappear with the same contents they had
+  // before it; they must be written again, since the restored pool's copies
+  // of them were discarded
+  {
+    auto g = alloc->lock(true);
+    block_offset = alloc->allocate(block_size);
+    memcpy(pool->at<char>(block_offset), block_data.data(), block_size);
+  }
+  expect_eq(2, cp.write());
+
+  contents = tree_contents(tree);
+  expect_eq(3, IncrementalCheckpoint::restore("test-checkpoint.cp",
+      "test-checkpoint-restored"));
+  {
+    shared_ptr<Pool> restored_pool(new Pool("test-checkpoint-restored"));
+    shared_ptr<Allocator> restored_alloc = create_allocator(restored_pool,
+        allocator_type);
+    expect_eq(pool->size(), restored_pool->size());
+    PrefixTree restored_tree(restored_alloc, tree_base);
+    expect_eq(contents, tree_contents(restored_tree));
+    expect_eq(block_data, string(restored_pool->at<char>(block_offset),
+        block_size));
+    restored_alloc->verify();
+  }
+  Pool::delete_pool("test-checkpoint-restored");
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      delete_files();
+      run_basic_test(allocator_type);
+      delete_files();
+      run_write_ahead_log_test(allocator_type);
+      delete_files();
+      run_truncation_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  delete_files();
+
+  return retcode;
+}
@@ -0,0 +1,239 @@
+#include "InternTable.hh"
+
+#include <stddef.h>
+#include <string.h>
+
+#include <stdexcept>
+
+#include "Hash.hh"
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+static inline uint64_t hash_for_string(const void* s, size_t size) {
+  // the low bits pick the starting slot and the high bits are stored in the
+  // slot, so they must be independent
+  return mix64(fnv1a64(s, size));
+}
+
+
+InternTable::InternTable(shared_ptr<Allocator> allocator, uint8_t bits) :
+    allocator(allocator) {
+  auto g = this->allocator->lock(true);
+  this->base_offset = this->create_table_base(bits);
+}
+
+InternTable::InternTable(shared_ptr<Allocator> allocator, uint8_t bits,
+    PoolLocked) : allocator(allocator) {
+  this->base_offset = this->create_table_base(bits);
+}
+
+InternTable::InternTable(shared_ptr<Allocator> allocator, uint64_t base_offset,
+    uint8_t bits) : allocator(allocator), base_offset(base_offset) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->create_table_base(bits);
+      this->allocator->set_base_object_offset(this->base_offset);
+    }
+  }
+}
+
+
+shared_ptr<Allocator> InternTable::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t InternTable::base() const {
+  return this->base_offset;
+}
+
+
+uint32_t InternTable::intern(const void* s, size_t size) {
+  uint64_t hash = hash_for_string(s, size);
+
+  // most calls are for strings that are already present, so try without the
+  // lock first
+  this->allocator->get_pool()->check_size_and_remap();
+  int64_t existing_id = this->find(s, size, hash);
+  if (existing_id >= 0) {
+    return existing_id;
+  }
+
+  auto g = this->allocator->lock(true);
+
+  // another process may have added the string since we checked
+  existing_id = this->find(s, size, hash);
+  if (existing_id >= 0) {
+    return existing_id;
+  }
+
+  auto p = this->allocator->get_pool();
+  uint64_t id;
+  {
+    InternTableBase* base = p->at<InternTableBase>(this->base_offset);
+    id = base->count.load(memory_order_relaxed);
+    if (id >= (1ULL << base->bits)) {
+      throw runtime_error("intern table is full");
+    }
+  }
+
+  // write the entry completely before publishing it. allocate can remap the
+  // pool, so we look up the base again afterward
+  uint64_t entry_offset = this->allocator->allocate(sizeof(Entry) + size);
+  Entry* entry = p->at<Entry>(entry_offset);
+  entry->size = size;
+  memcpy(entry->data, s, size);
+
+  // publish the entry in the id index first, then in the hash table. lock-free
+  // readers find IDs through the hash table, so by the time they can see the
+  // ID, its entry is visible too
+  InternTableBase* base = p->at<InternTableBase>(this->base_offset);
+  p->at<atomic<uint64_t>>(base->entries_offset)[id].store(entry_offset,
+      memory_order_release);
+
+  atomic<uint64_t>* slots = p->at<atomic<uint64_t>>(base->slots_offset);
+  uint64_t slot_mask = (2ULL << base->bits) - 1;
+  uint64_t slot_index = hash & slot_mask;
+  while (slots[slot_index].load(memory_order_relaxed)) {
+    slot_index = (slot_index + 1) & slot_mask;
+  }
+  slots[slot_index].store((hash & 0xFFFFFFFF00000000) | (id + 1),
+      memory_order_release);
+
+  base->count.store(id + 1, memory_order_release);
+  return id;
+}
+
+uint32_t InternTable::intern(const string& s) {
+  return this->intern(s.data(), s.size());
+}
+
+
+uint32_t InternTable::id_for(const void* s, size_t size) const {
+  this->allocator->get_pool()->check_size_and_remap();
+  int64_t id = this->find(s, size, hash_for_string(s, size));
+  if (id < 0) {
+    throw out_of_range(string((const char*)s, size));
+  }
+  return id;
+}
+
+uint32_t InternTable::id_for(const string& s) const {
+  return this->id_for(s.data(), s.size());
+}
+
+
+bool InternTable::exists(const void* s, size_t size) const {
+  this->allocator->get_pool()->check_size_and_remap();
+  return this->find(s, size, hash_for_string(s, size)) >= 0;
+}
+
+bool InternTable::exists(const string& s) const {
+  return this->exists(s.data(), s.size());
+}
+
+
+string InternTable::at(uint32_t id) const {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  const InternTableBase* base = p->at<InternTableBase>(this->base_offset);
+  if (id >= (1ULL << base->bits)) {
+    throw out_of_range("id out of range");
+  }
+
+  uint64_t entry_offset = p->at<atomic<uint64_t>>(
+      base->entries_offset)[id].load(memory_order_acquire);
+  if (!entry_offset) {
+    throw out_of_range("id out of range");
+  }
+  // the entry may have been allocated by another process after we remapped
+  // the pool above
+  p->check_size_and_remap();
+  const Entry* entry = p->at<Entry>(entry_offset);
+  return string(entry->data, entry->size);
+}
+
+
+size_t InternTable::size() const {
+  return this->allocator->get_pool()->at<InternTableBase>(
+      this->base_offset)->count.load(memory_order_acquire);
+}
+
+size_t InternTable::capacity() const {
+  return 1ULL << this->bits();
+}
+
+uint8_t InternTable::bits() const {
+  return this->allocator->get_pool()->at<InternTableBase>(
+      this->base_offset)->bits;
+}
+
+
+uint64_t InternTable::create_table_base(uint8_t bits) {
+  if (bits > 31) {
+    throw invalid_argument("bits must be <= 31");
+  }
+
+  auto p = this->allocator->get_pool();
+
+  uint64_t slots_size = (2ULL << bits) * sizeof(uint64_t);
+  uint64_t entries_size = (1ULL << bits) * sizeof(uint64_t);
+  uint64_t base_offset = this->allocator->allocate(sizeof(InternTableBase));
+  uint64_t slots_offset = this->allocator->allocate(slots_size);
+  uint64_t entries_offset = this->allocator->allocate(entries_size);
+
+  InternTableBase* base = p->at<InternTableBase>(base_offset);
+  base->bits = bits;
+  base->count = 0;
+  base->slots_offset = slots_offset;
+  base->entries_offset = entries_offset;
+  memset(p->at<uint8_t>(slots_offset), 0, slots_size);
+  memset(p->at<uint8_t>(entries_offset), 0, entries_size);
+
+  return base_offset;
+}
+
+
+int64_t InternTable::find(const void* s, size_t size, uint64_t hash) const {
+  auto p = this->allocator->get_pool();
+  const InternTableBase* base = p->at<InternTableBase>(this->base_offset);
+  uint64_t slots_offset = base->slots_offset;
+  uint64_t entries_offset = base->entries_offset;
+
+  // the table is never more than half full, so this always finds an empty
+  // slot eventually. the entries may have been allocated by another process
+  // after we last remapped the pool, so we remap before reading each one;
+  // this can move the mapping, so only offsets are kept across iterations
+  uint64_t slot_mask = (2ULL << base->bits) - 1;
+  for (uint64_t slot_index = hash & slot_mask; ;
+       slot_index = (slot_index + 1) & slot_mask) {
+    uint64_t slot = p->at<atomic<uint64_t>>(slots_offset)[slot_index].load(
+        memory_order_acquire);
+    if (!slot) {
+      return -1;
+    }
+    if ((slot ^ hash) & 0xFFFFFFFF00000000) {
+      continue;
+    }
+
+    uint64_t id = (slot & 0xFFFFFFFF) - 1;
+    uint64_t entry_offset = p->at<atomic<uint64_t>>(entries_offset)[id].load(
+        memory_order_relaxed);
+    p->check_size_and_remap();
+    const Entry* entry = p->at<Entry>(entry_offset);
+    if ((entry->size == size) && !memcmp(entry->data, s, size)) {
+      return id;
+    }
+  }
+}
+
+} // namespace sharedstructures
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "Allocator.hh"
+
+namespace sharedstructures {
+
+
+// InternTable maps strings to dense 32-bit IDs and back. each distinct string
+// is stored once; interning it again returns the same ID, and IDs are assigned
+// in increasing order starting at 0. strings can't be removed, so an ID remains
+// valid (and refers to the same string) for the lifetime of the table.
+//
+// the table has a fixed capacity, set when it's created. lookups in both
+// directions don't take the pool lock: strings are published with atomic
+// stores after they're completely written, and they're never moved or freed.
+// interning a new string takes the pool's write lock.
+//
+// an InternTable can be attached to a PrefixTree; see
+// PrefixTree::insert_interned.
+
+class InternTable {
+public:
+  InternTable() = delete;
+  InternTable(const InternTable&) = delete;
+  InternTable(InternTable&&) = delete;
+
+  // create constructor - allocates a new table that can hold up to 2^bits
+  // strings.
+  InternTable(std::shared_ptr<Allocator> allocator, uint8_t bits);
+  // (conditional) create constructor.
+  // opens an existing InternTable using the given allocator. if base_offset is
+  // 0, opens the InternTable at the allocator's base offset. if the allocator's
+  // base offset is also 0, creates a new InternTable and sets the allocator's
+  // base offset to the new table's base offset. bits is ignored if the table
+  // already exists.
+  InternTable(std::shared_ptr<Allocator> allocator, uint64_t base_offset,
+      uint8_t bits);
+  ~InternTable() = default;
+
+  // returns the allocator for this table
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this table
+  uint64_t base() const;
+
+  // returns the ID for a string, adding the string to the table if it isn't
+  // already present. this only locks the pool if the string is new. throws
+  // std::runtime_error if the string is new and the table is full.
+  uint32_t intern(const void* s, size_t size);
+  uint32_t intern(const std::string& s);
+
+  // returns the ID for a string. throws std::out_of_range if the string isn't
+  // in the table. this doesn't lock the pool.
+  uint32_t id_for(const void* s, size_t size) const;
+  uint32_t id_for(const std::string& s) const;
+
+  // checks if a string is in the table. this doesn't lock the pool.
+  bool exists(const void* s, size_t size) const;
+  bool exists(const std::string& s) const;
+
+  // returns the string for an ID. throws std::out_of_range if no string has
+  // that ID. this doesn't lock the pool.
+  std::string at(uint32_t id) const;
+
+  // inspection methods.
+  size_t size() const; // string count
+  size_t capacity() const; // maximum string count
+  uint8_t bits() const; // capacity factor
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+
+  // ColumnTable creates its string dictionary while it's already holding the
+  // pool's write lock, so it can't use the create constructor (the lock isn't
+  // reentrant). this constructor creates a new table without locking.
+  friend class ColumnTable;
+  struct PoolLocked { };
+  InternTable(std::shared_ptr<Allocator> allocator, uint8_t bits, PoolLocked);
+
+  struct InternTableBase {
+    uint8_t bits;
+    uint8_t unused[7];
+    std::atomic<uint64_t> count;
+    // open-addressed hash table with 2^(bits + 1) slots, so it's never more
+    // than half full. each nonzero slot contains the high 32 bits of the
+    // string's hash in its high 32 bits, and the string's ID + 1 in its low 32
+    // bits.
+    uint64_t slots_offset;
+    // 2^bits entry offsets, indexed by ID. an entry is an Entry structure
+    // followed by the string's contents.
+    uint64_t entries_offset;
+  };
+
+  struct Entry {
+    uint64_t size;
+    char data[0];
+  };
+
+  uint64_t create_table_base(uint8_t bits);
+
+  // returns the ID for a string, or -1 if it's not in the table. this doesn't
+  // lock the pool.
+  int64_t find(const void* s, size_t size, uint64_t hash) const;
+};
+
+} // namespace sharedstructures
@@ -0,0 +1,291 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "InternTable.hh"
+#include "PrefixTree.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-intern"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  InternTable table(alloc, 0, 10);
+
+  expect_eq(0, table.size());
+  expect_eq(10, table.bits());
+  expect_eq(1024, table.capacity());
+  expect_eq(false, table.exists("active"));
+
+  expect_eq(0, table.intern("active"));
+  expect_eq(1, table.intern("inactive"));
+  expect_eq(2, table.intern(""));
+  expect_eq(0, table.intern("active"));
+  expect_eq(3, table.intern(string("\0binary\0", 8)));
+  expect_eq(4, table.size());
+
+  expect_eq(true, table.exists("active"));
+  expect_eq(true, table.exists(""));
+  expect_eq(false, table.exists("deleted"));
+  expect_eq(1, table.id_for("inactive"));
+  expect_eq(3, table.id_for(string("\0binary\0", 8)));
+  try {
+    table.id_for("deleted");
+    expect(false);
+  } catch (const out_of_range& e) { }
+
+  expect_eq("active", table.at(0));
+  expect_eq("inactive", table.at(1));
+  expect_eq("", table.at(2));
+  expect_eq(string("\0binary\0", 8), table.at(3));
+  vector<uint32_t> missing_ids({4, 1023, 1024, 0xFFFFFFFF});
+  for (uint32_t id : missing_ids) {
+    try {
+      table.at(id);
+      expect(false);
+    } catch (const out_of_range& e) { }
+  }
+
+  // enough strings to force the pool to expand; all of the ids must be stable
+  for (size_t x = 0; x < 1000; x++) {
+    expect_eq(x + 4, table.intern(string_printf("category%zu-%s", x,
+        string(x, 'x').c_str())));
+  }
+  for (size_t x = 0; x < 1000; x++) {
+    string s = string_printf("category%zu-%s", x, string(x, 'x').c_str());
+    expect_eq(x + 4, table.id_for(s));
+    expect_eq(s, table.at(x + 4));
+  }
+
+  // opening the table again gives the same contents
+  {
+    InternTable table2(alloc, table.base(), 0);
+    expect_eq(10, table2.bits());
+    expect_eq(1004, table2.size());
+    expect_eq(1, table2.id_for("inactive"));
+    expect_eq(1004, table2.intern("deleted"));
+  }
+  expect_eq(1004, table.id_for("deleted"));
+}
+
+
+void run_full_table_test(const string& allocator_type) {
+  printf("-- [%s] full table\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-intern"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+
+  try {
+    InternTable table(alloc, 32);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+
+  InternTable table(alloc, 2);
+  for (size_t x = 0; x < 4; x++) {
+    expect_eq(x, table.intern(string_printf("value%zu", x)));
+  }
+  try {
+    table.intern("value4");
+    expect(false);
+  } catch (const runtime_error& e) { }
+
+  // existing strings can still be looked up
+  expect_eq(2, table.intern("value2"));
+  expect_eq(4, table.size());
+}
+
+
+void run_concurrent_intern_test(const string& allocator_type) {
+  printf("-- [%s] concurrent intern\n", allocator_type.c_str());
+
+  uint64_t base_offset;
+  {
+    shared_ptr<Pool> pool(new Pool("test-intern"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    InternTable table(alloc, 0, 12);
+    base_offset = table.base();
+  }
+
+  unordered_set<pid_t> child_pids;
+  size_t child_index = 0;
+  while ((child_pids.size() < 8) && !child_pids.count(0)) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      break;
+    } else {
+      child_pids.emplace(pid);
+      if (pid) {
+        child_index++;
+      }
+    }
+  }
+
+  if (child_pids.count(0)) {
+    // child process: intern a set of strings that overlaps with every other
+    // child's, and check that every id maps back to the right string
+    shared_ptr<Pool> pool(new Pool("test-intern"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    InternTable table(alloc, base_offset, 0);
+    for (size_t x = 0; x < 1000; x++) {
+      string s = string_printf("value%zu", (x * (child_index + 1)) % 1000);
+      uint32_t id = table.intern(s);
+      if (table.at(id) != s) {
+        _exit(1);
+      }
+    }
+    _exit(0);
+
+  } else {
+    int num_failures = 0;
+    int exit_status;
+    pid_t exited_pid;
+    while ((exited_pid = wait(&exit_status)) != -1) {
+      child_pids.erase(exited_pid);
+      if (!WIFEXITED(exit_status) || (WEXITSTATUS(exit_status) != 0)) {
+        printf("-- [%s]   child %d failed (%d)\n", allocator_type.c_str(),
+            exited_pid, exit_status);
+        num_failures++;
+      }
+    }
+    expect_eq(true, child_pids.empty());
+    expect_eq(0, num_failures);
+
+    // every string was interned exactly once, so the ids are dense
+    shared_ptr<Pool> pool(new Pool("test-intern"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    InternTable table(alloc, base_offset, 0);
+    expect_eq(1000, table.size());
+    vector<bool> seen(1000, false);
+    for (size_t x = 0; x < 1000; x++) {
+      uint32_t id = table.id_for(string_printf("value%zu", x));
+      expect_lt(id, 1000);
+      expect_eq(false, seen[id]);
+      seen[id] = true;
+    }
+  }
+}
+
+
+void run_attached_prefix_tree_test(const string& allocator_type) {
+  printf("-- [%s] attached to prefix tree\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-intern"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  PrefixTree tree(alloc, 0);
+
+  try {
+    tree.insert_interned("key", "value");
+    expect(false);
+  } catch (const logic_error& e) { }
+
+  // the table is in the same pool as the tree
+  shared_ptr<InternTable> table(new InternTable(alloc, 8));
+  tree.attach_intern_table(table);
+  expect_eq(table.get(), tree.get_intern_table().get());
+
+  for (size_t x = 0; x < 100; x++) {
+    tree.insert_interned(string_printf("key%zu", x),
+        string_printf("status-%zu", x % 3));
+  }
+  tree.insert(string("plain"), string("status-1"));
+  expect_eq(3, table->size());
+  expect_eq(101, tree.size());
+
+  expect_eq(PrefixTree::ResultValueType::String, tree.type("key4"));
+  expect_eq(PrefixTree::LookupResult("status-1"), tree.at("key4"));
+  expect_eq(PrefixTree::LookupResult("status-1"), tree.at("plain"));
+  auto kv = tree.next_key_value(string("key0"));
+  expect_eq("key1", kv.first);
+  expect_eq(PrefixTree::LookupResult("status-1"), kv.second);
+
+  // interned values are stored inline, so they use no more space than an int
+  tree.insert(string("key99"), (int64_t)7);
+  tree.insert_interned("key98", "status-0");
+  expect_eq(tree.bytes_for_prefix("key99"), tree.bytes_for_prefix("key98"));
+
+  // checks compare against the interned string
+  PrefixTree::CheckRequest good_check("key5", 4, "status-2", 8);
+  PrefixTree::CheckRequest bad_check("key5", 4, "status-0", 8);
+  expect_eq(false, tree.insert_interned("key5", "status-0", &bad_check));
+  expect_eq(true, tree.insert_interned("key5", "status-0", &good_check));
+  expect_eq(PrefixTree::LookupResult("status-0"), tree.at("key5"));
+
+  // overwriting and erasing interned values doesn't affect the table
+  tree.insert(string("key6"), string("not interned"));
+  expect_eq(PrefixTree::LookupResult("not interned"), tree.at("key6"));
+  expect_eq(true, tree.erase("key7"));
+  expect_eq(3, table->size());
+  expect_eq(100, tree.size());
+
+  // another tree object without the table attached can't read interned values
+  {
+    PrefixTree tree2(alloc, tree.base());
+    expect_eq(PrefixTree::LookupResult("not interned"), tree2.at("key6"));
+    try {
+      tree2.at("key4");
+      expect(false);
+    } catch (const runtime_error& e) { }
+
+    tree2.attach_intern_table(shared_ptr<InternTable>(
+        new InternTable(alloc, table->base(), 0)));
+    expect_eq(PrefixTree::LookupResult("status-1"), tree2.at("key4"));
+  }
+
+  tree.clear();
+  expect_eq(0, tree.size());
+  expect_eq(3, table->size());
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      Pool::delete_pool("test-intern");
+      run_basic_test(allocator_type);
+      Pool::delete_pool("test-intern");
+      run_full_table_test(allocator_type);
+      Pool::delete_pool("test-intern");
+      run_concurrent_intern_test(allocator_type);
+      Pool::delete_pool("test-intern");
+      run_attached_prefix_tree_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  Pool::delete_pool("test-intern");
+
+  return retcode;
+}
@@ -0,0 +1,406 @@
+#include "InvertedIndex.hh"
+
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+static const size_t BLOCK_SIZE = 128;
+
+
+static size_t encode_varint(uint8_t* out, uint32_t v) {
+  size_t size = 0;
+  while (v >= 0x80) {
+    out[size++] = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  out[size++] = v;
+  return size;
+}
+
+static uint32_t decode_varint(const uint8_t*& data) {
+  uint32_t ret = 0;
+  for (uint8_t shift = 0;; shift += 7) {
+    uint8_t b = *(data++);
+    ret |= static_cast<uint32_t>(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      return ret;
+    }
+  }
+}
+
+// returns the number of values in the sorted array that are less than target
+// (that is, the index where target is or would be)
+static size_t block_lower_bound(const uint32_t* values, size_t count,
+    uint32_t target) {
+  size_t x = 0;
+#ifdef __SSE2__
+  // compare 4 values at a time. SSE2 only has signed comparisons, so flip the
+  // sign bits first to get an unsigned comparison
+  const __m128i bias = _mm_set1_epi32(INT32_MIN);
+  __m128i t = _mm_xor_si128(_mm_set1_epi32(target), bias);
+  for (; x + 4 <= count; x += 4) {
+    __m128i v = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + x)), bias);
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(v, t)));
+    if (mask != 0xF) {
+      return x + __builtin_popcount(mask);
+    }
+  }
+#endif
+  for (; (x < count) && (values[x] < target); x++);
+  return x;
+}
+
+
+InvertedIndex::InvertedIndex(shared_ptr<Allocator> allocator) :
+    allocator(allocator) {
+  // PrefixTree's constructor locks the pool, so create the dictionary first
+  this->dictionary.reset(new PrefixTree(this->allocator));
+
+  auto g = this->allocator->lock(true);
+  this->base_offset = this->create_index_base(this->dictionary->base());
+}
+
+InvertedIndex::InvertedIndex(shared_ptr<Allocator> allocator,
+    uint64_t base_offset) : allocator(allocator), base_offset(base_offset) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+
+  if (!this->base_offset) {
+    unique_ptr<PrefixTree> new_dictionary(new PrefixTree(this->allocator));
+
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->create_index_base(new_dictionary->base());
+      this->allocator->set_base_object_offset(this->base_offset);
+      this->dictionary = move(new_dictionary);
+    } else {
+      // another process created the index first. an empty tree is a single
+      // allocation, so we can just free it
+      this->allocator->free(new_dictionary->base());
+    }
+  }
+
+  if (!this->dictionary.get()) {
+    uint64_t dictionary_offset;
+    {
+      auto g = this->allocator->lock(false);
+      dictionary_offset = this->allocator->get_pool()->at<InvertedIndexBase>(
+          this->base_offset)->dictionary_offset;
+    }
+    this->dictionary.reset(new PrefixTree(this->allocator, dictionary_offset));
+  }
+}
+
+
+shared_ptr<Allocator> InvertedIndex::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t InvertedIndex::base() const {
+  return this->base_offset;
+}
+
+
+bool InvertedIndex::add(const string& term, uint32_t doc_id) {
+  uint64_t list_offset = this->find_or_create_list(term);
+
+  auto g = this->allocator->lock(true);
+  auto p = this->allocator->get_pool();
+  PostingListHeader* h = p->at<PostingListHeader>(list_offset);
+  if (h->count) {
+    if (doc_id == h->last_doc_id) {
+      return false;
+    }
+    if (doc_id < h->last_doc_id) {
+      throw invalid_argument("document ids must be added in increasing order");
+    }
+  }
+
+  // the first posting in each block is stored as an absolute id, so blocks can
+  // be decoded independently
+  bool new_block = (h->count % BLOCK_SIZE) == 0;
+  uint8_t encoded[5];
+  size_t encoded_size = encode_varint(encoded,
+      new_block ? doc_id : (doc_id - h->last_doc_id));
+
+  // make room for the encoded posting and the new skip entry, if needed
+  size_t data_capacity = h->data_offset ?
+      this->allocator->block_size(h->data_offset) : 0;
+  if (h->data_size + encoded_size > data_capacity) {
+    size_t new_capacity = max<size_t>(data_capacity * 2, 16);
+    uint64_t new_offset = this->allocator->allocate(new_capacity);
+    h = p->at<PostingListHeader>(list_offset);
+    if (h->data_offset) {
+      memcpy(p->at<uint8_t>(new_offset), p->at<uint8_t>(h->data_offset),
+          h->data_size);
+      this->allocator->free(h->data_offset);
+    }
+    h->data_offset = new_offset;
+  }
+  if (new_block) {
+    size_t block_count = h->count / BLOCK_SIZE;
+    size_t skips_capacity = h->skips_offset ?
+        (this->allocator->block_size(h->skips_offset) / sizeof(SkipEntry)) : 0;
+    if (block_count == skips_capacity) {
+      size_t new_capacity = max<size_t>(skips_capacity * 2, 1);
+      uint64_t new_offset = this->allocator->allocate(
+          new_capacity * sizeof(SkipEntry));
+      h = p->at<PostingListHeader>(list_offset);
+      if (h->skips_offset) {
+        memcpy(p->at<uint8_t>(new_offset), p->at<uint8_t>(h->skips_offset),
+            block_count * sizeof(SkipEntry));
+        this->allocator->free(h->skips_offset);
+      }
+      h->skips_offset = new_offset;
+    }
+
+    SkipEntry* skip = p->at<SkipEntry>(h->skips_offset) + block_count;
+    skip->first_doc_id = doc_id;
+    skip->unused = 0;
+    skip->data_offset = h->data_size;
+  }
+
+  memcpy(p->at<uint8_t>(h->data_offset + h->data_size), encoded,
+      encoded_size);
+  h->data_size += encoded_size;
+  h->last_doc_id = doc_id;
+  h->count++;
+  p->at<InvertedIndexBase>(this->base_offset)->posting_count++;
+  return true;
+}
+
+
+vector<uint32_t> InvertedIndex::postings(const string& term) const {
+  vector<uint32_t> ret;
+  uint64_t list_offset = this->find_list(term);
+  if (!list_offset) {
+    return ret;
+  }
+
+  auto g = this->allocator->lock(false);
+  const PostingListHeader* h = this->allocator->get_pool()->at<PostingListHeader>(
+      list_offset);
+  ret.reserve(h->count);
+  size_t block_count = (h->count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (size_t x = 0; x < block_count; x++) {
+    this->decode_block(ret, h, x);
+  }
+  return ret;
+}
+
+vector<uint32_t> InvertedIndex::query(const vector<string>& terms) const {
+  vector<uint32_t> ret;
+  if (terms.empty()) {
+    return ret;
+  }
+
+  // look up all the terms before locking, since the dictionary locks the pool
+  vector<uint64_t> list_offsets;
+  for (const auto& term : terms) {
+    uint64_t list_offset = this->find_list(term);
+    if (!list_offset) {
+      return ret;
+    }
+    list_offsets.emplace_back(list_offset);
+  }
+
+  auto g = this->allocator->lock(false);
+  auto p = this->allocator->get_pool();
+
+  // intersect starting with the shortest list, so the candidate set is as
+  // small as possible from the beginning
+  sort(list_offsets.begin(), list_offsets.end(), [&](uint64_t a, uint64_t b) {
+    return p->at<PostingListHeader>(a)->count <
+        p->at<PostingListHeader>(b)->count;
+  });
+
+  const PostingListHeader* h = p->at<PostingListHeader>(list_offsets[0]);
+  ret.reserve(h->count);
+  size_t block_count = (h->count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (size_t x = 0; x < block_count; x++) {
+    this->decode_block(ret, h, x);
+  }
+
+  for (size_t x = 1; (x < list_offsets.size()) && !ret.empty(); x++) {
+    this->intersect_list(ret, p->at<PostingListHeader>(list_offsets[x]));
+  }
+  return ret;
+}
+
+
+size_t InvertedIndex::term_count() const {
+  return this->dictionary->size();
+}
+
+size_t InvertedIndex::posting_count() const {
+  return this->allocator->get_pool()->at<InvertedIndexBase>(
+      this->base_offset)->posting_count;
+}
+
+size_t InvertedIndex::posting_count(const string& term) const {
+  uint64_t list_offset = this->find_list(term);
+  if (!list_offset) {
+    return 0;
+  }
+  auto g = this->allocator->lock(false);
+  return this->allocator->get_pool()->at<PostingListHeader>(list_offset)->count;
+}
+
+size_t InvertedIndex::bytes_for_term(const string& term) const {
+  uint64_t list_offset = this->find_list(term);
+  if (!list_offset) {
+    return 0;
+  }
+
+  auto g = this->allocator->lock(false);
+  const PostingListHeader* h = this->allocator->get_pool()->at<PostingListHeader>(
+      list_offset);
+  size_t ret = sizeof(PostingListHeader);
+  if (h->data_offset) {
+    ret += this->allocator->block_size(h->data_offset);
+  }
+  if (h->skips_offset) {
+    ret += this->allocator->block_size(h->skips_offset);
+  }
+  return ret;
+}
+
+
+uint64_t InvertedIndex::create_index_base(uint64_t dictionary_offset) {
+  uint64_t base_offset = this->allocator->allocate(sizeof(InvertedIndexBase));
+  auto* base = this->allocator->get_pool()->at<InvertedIndexBase>(base_offset);
+  base->dictionary_offset = dictionary_offset;
+  base->posting_count = 0;
+  return base_offset;
+}
+
+
+uint64_t InvertedIndex::find_list(const string& term) const {
+  auto cache_it = this->list_offset_cache.find(term);
+  if (cache_it != this->list_offset_cache.end()) {
+    return cache_it->second;
+  }
+
+  uint64_t list_offset;
+  try {
+    list_offset = this->dictionary->at(term).as_int;
+  } catch (const out_of_range& e) {
+    return 0;
+  }
+  this->list_offset_cache.emplace(term, list_offset);
+  return list_offset;
+}
+
+uint64_t InvertedIndex::find_or_create_list(const string& term) {
+  uint64_t list_offset = this->find_list(term);
+  if (list_offset) {
+    return list_offset;
+  }
+
+  {
+    auto g = this->allocator->lock(true);
+    list_offset = this->allocator->allocate(sizeof(PostingListHeader));
+    memset(this->allocator->get_pool()->at<uint8_t>(list_offset), 0,
+        sizeof(PostingListHeader));
+  }
+
+  // add the term only if no other process added it since we checked
+  PrefixTree::CheckRequest check(term.data(), term.size(),
+      PrefixTree::ResultValueType::Missing);
+  if (this->dictionary->insert(term.data(), term.size(),
+      static_cast<int64_t>(list_offset), &check)) {
+    this->list_offset_cache.emplace(term, list_offset);
+    return list_offset;
+  }
+
+  {
+    auto g = this->allocator->lock(true);
+    this->allocator->free(list_offset);
+  }
+  return this->find_list(term);
+}
+
+
+void InvertedIndex::decode_block(vector<uint32_t>& out,
+    const PostingListHeader* h, size_t block_index) const {
+  auto p = this->allocator->get_pool();
+  const SkipEntry* skips = p->at<SkipEntry>(h->skips_offset);
+  const uint8_t* data = p->at<uint8_t>(h->data_offset) +
+      skips[block_index].data_offset;
+
+  size_t count = min<size_t>(BLOCK_SIZE, h->count - block_index * BLOCK_SIZE);
+  uint32_t doc_id = 0;
+  for (size_t x = 0; x < count; x++) {
+    doc_id += decode_varint(data);
+    out.emplace_back(doc_id);
+  }
+}
+
+void InvertedIndex::intersect_list(vector<uint32_t>& candidates,
+    const PostingListHeader* h) const {
+  auto p = this->allocator->get_pool();
+  const SkipEntry* skips = p->at<SkipEntry>(h->skips_offset);
+  size_t block_count = (h->count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  vector<uint32_t> block;
+  block.reserve(BLOCK_SIZE);
+  size_t block_index = 0;
+  ssize_t decoded_block_index = -1;
+
+  size_t write_index = 0;
+  for (uint32_t candidate : candidates) {
+    if (candidate < skips[0].first_doc_id) {
+      continue;
+    }
+    if (candidate > h->last_doc_id) {
+      break;
+    }
+
+    // gallop forward through the skip table to find the last block that
+    // starts at or before the candidate, then binary-search the range
+    size_t step = 1;
+    size_t high = block_index + 1;
+    while ((high < block_count) && (skips[high].first_doc_id <= candidate)) {
+      block_index = high;
+      high += step;
+      step *= 2;
+    }
+    high = min(high, block_count);
+    while (block_index + 1 < high) {
+      size_t mid = (block_index + high) / 2;
+      if (skips[mid].first_doc_id <= candidate) {
+        block_index = mid;
+      } else {
+        high = mid;
+      }
+    }
+
+    if (decoded_block_index != static_cast<ssize_t>(block_index)) {
+      block.clear();
+      this->decode_block(block, h, block_index);
+      decoded_block_index = block_index;
+    }
+
+    size_t pos = block_lower_bound(block.data(), block.size(), candidate);
+    if ((pos < block.size()) && (block[pos] == candidate)) {
+      candidates[write_index++] = candidate;
+    }
+  }
+  candidates.resize(write_index);
+}
+
+} // namespace sharedstructures
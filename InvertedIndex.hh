@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Allocator.hh"
+#include "PrefixTree.hh"
+
+namespace sharedstructures {
+
+
+// InvertedIndex maps terms to posting lists (sorted lists of 32-bit document
+// ids), so multiple processes can serve queries from one shared index. terms
+// are stored in a PrefixTree in the same pool; each term's value is the offset
+// of its posting list.
+//
+// posting lists are delta-encoded with varints and split into blocks of 128
+// postings. each block starts with an absolute document id and has an entry in
+// the list's skip table, so a query can jump to the block that may contain a
+// given document and decode only that block. multi-term queries intersect the
+// lists starting with the shortest one, galloping through the other lists'
+// skip tables.
+//
+// document ids must be added to each term's list in increasing order. terms
+// can't be removed. appends take the pool's write lock; queries take the read
+// lock, so they run concurrently with each other.
+
+class InvertedIndex {
+public:
+  InvertedIndex() = delete;
+  InvertedIndex(const InvertedIndex&) = delete;
+  InvertedIndex(InvertedIndex&&) = delete;
+
+  // create constructor - allocates a new empty index.
+  explicit InvertedIndex(std::shared_ptr<Allocator> allocator);
+  // (conditional) create constructor.
+  // opens an existing InvertedIndex using the given allocator. if base_offset
+  // is 0, opens the InvertedIndex at the allocator's base offset. if the
+  // allocator's base offset is also 0, creates a new InvertedIndex and sets the
+  // allocator's base offset to the new index's base offset.
+  InvertedIndex(std::shared_ptr<Allocator> allocator, uint64_t base_offset);
+  ~InvertedIndex() = default;
+
+  // returns the allocator for this index
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this index
+  uint64_t base() const;
+
+  // appends a document to a term's posting list, creating the term if needed.
+  // returns false if the document is already the last one in the list. throws
+  // std::invalid_argument if the document id is lower than the last one in the
+  // list.
+  bool add(const std::string& term, uint32_t doc_id);
+
+  // returns a term's posting list. returns an empty list if the term doesn't
+  // exist.
+  std::vector<uint32_t> postings(const std::string& term) const;
+
+  // returns the documents that contain all of the given terms, in increasing
+  // order.
+  std::vector<uint32_t> query(const std::vector<std::string>& terms) const;
+
+  // inspection methods.
+  size_t term_count() const;
+  size_t posting_count() const; // total over all terms
+  size_t posting_count(const std::string& term) const;
+  size_t bytes_for_term(const std::string& term) const;
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+  std::unique_ptr<PrefixTree> dictionary;
+
+  // term -> posting list offset cache for this process. terms are never
+  // deleted and posting list headers never move, so entries never become
+  // stale.
+  mutable std::unordered_map<std::string, uint64_t> list_offset_cache;
+
+  struct InvertedIndexBase {
+    uint64_t dictionary_offset;
+    uint64_t posting_count;
+  };
+
+  struct PostingListHeader {
+    uint64_t count;
+    uint32_t last_doc_id;
+    uint32_t unused;
+    uint64_t data_offset; // varint-encoded deltas
+    uint64_t data_size; // bytes used in the data buffer
+    uint64_t skips_offset; // SkipEntry array; one entry per block
+  };
+
+  struct SkipEntry {
+    uint32_t first_doc_id;
+    uint32_t unused;
+    uint64_t data_offset; // offset of the block within the data buffer
+  };
+
+  uint64_t create_index_base(uint64_t dictionary_offset);
+
+  // returns 0 if the term doesn't exist. these must not be called with the pool
+  // locked, since they call PrefixTree methods.
+  uint64_t find_list(const std::string& term) const;
+  uint64_t find_or_create_list(const std::string& term);
+
+  // these must be called with the pool locked
+  void decode_block(std::vector<uint32_t>& out,
+      const PostingListHeader* header, size_t block_index) const;
+  void intersect_list(std::vector<uint32_t>& candidates,
+      const PostingListHeader* header) const;
+};
+
+} // namespace sharedstructures
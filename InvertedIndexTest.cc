@@ -0,0 +1,239 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "InvertedIndex.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-index"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  InvertedIndex index(alloc, 0);
+
+  expect_eq(0, index.term_count());
+  expect_eq(0, index.posting_count());
+  expect_eq(vector<uint32_t>(), index.postings("apple"));
+  expect_eq(vector<uint32_t>(), index.query({"apple"}));
+
+  expect_eq(true, index.add("apple", 1));
+  expect_eq(true, index.add("apple", 3));
+  expect_eq(false, index.add("apple", 3));
+  expect_eq(true, index.add("apple", 4));
+  expect_eq(true, index.add("banana", 3));
+  expect_eq(true, index.add("banana", 4));
+  expect_eq(true, index.add("banana", 9));
+  expect_eq(true, index.add("cherry", 4));
+  expect_eq(true, index.add("", 0));
+  try {
+    index.add("apple", 2);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+
+  expect_eq(4, index.term_count());
+  expect_eq(8, index.posting_count());
+  expect_eq(3, index.posting_count("apple"));
+  expect_eq(0, index.posting_count("durian"));
+  expect_eq(vector<uint32_t>({1, 3, 4}), index.postings("apple"));
+  expect_eq(vector<uint32_t>({0}), index.postings(""));
+
+  expect_eq(vector<uint32_t>({3, 4}), index.query({"apple", "banana"}));
+  expect_eq(vector<uint32_t>({4}), index.query({"banana", "cherry", "apple"}));
+  expect_eq(vector<uint32_t>(), index.query({"apple", "durian"}));
+  expect_eq(vector<uint32_t>(), index.query({}));
+
+  // another instance sees the same index
+  {
+    InvertedIndex index2(alloc, index.base());
+    expect_eq(4, index2.term_count());
+    expect_eq(vector<uint32_t>({3, 4}), index2.query({"apple", "banana"}));
+    index2.add("cherry", 9);
+    expect_eq(vector<uint32_t>({4, 9}), index.query({"cherry", "banana"}));
+  }
+}
+
+
+void run_large_lists_test(const string& allocator_type) {
+  printf("-- [%s] large lists\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-index"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  InvertedIndex index(alloc);
+
+  // lists of very different lengths, spanning many blocks and using ids with
+  // multi-byte deltas
+  vector<uint32_t> multiples_of_3, multiples_of_7, sparse;
+  for (uint32_t x = 0; x < 100000; x += 3) {
+    index.add("three", x);
+    multiples_of_3.emplace_back(x);
+  }
+  for (uint32_t x = 0; x < 100000; x += 7) {
+    index.add("seven", x);
+    multiples_of_7.emplace_back(x);
+  }
+  for (uint64_t x = 0; x < 0x100000000; x += 0x1357911) {
+    index.add("sparse", x);
+    sparse.emplace_back(x);
+  }
+  for (uint32_t x = 0; x < 100000; x += 21 * 50) {
+    index.add("sparse", 0xFFF00000 + x);
+    sparse.emplace_back(0xFFF00000 + x);
+  }
+
+  expect_eq(multiples_of_3, index.postings("three"));
+  expect_eq(multiples_of_7, index.postings("seven"));
+
+  expect_eq(sparse, index.postings("sparse"));
+
+  // even with slack in the buffers, the list is smaller than an array of ids
+  expect_lt(index.bytes_for_term("three"),
+      multiples_of_3.size() * sizeof(uint32_t));
+
+  vector<uint32_t> expected;
+  set_intersection(multiples_of_3.begin(), multiples_of_3.end(),
+      multiples_of_7.begin(), multiples_of_7.end(), back_inserter(expected));
+  expect_eq(expected, index.query({"three", "seven"}));
+  expect_eq(expected, index.query({"seven", "three"}));
+
+  // ids that are multiples of 21 below 100000 aren't in the sparse list (it
+  // has 0xFFF00000 + x instead), so only 0 is in all three lists
+  expect_eq(vector<uint32_t>({0}), index.query({"three", "seven", "sparse"}));
+  for (uint32_t x = 0; x < 100000; x += 21 * 50) {
+    index.add("three-high", 0xFFF00000 + x);
+  }
+  expected.clear();
+  for (uint32_t x = 0; x < 100000; x += 21 * 50) {
+    expected.emplace_back(0xFFF00000 + x);
+  }
+  expect_eq(expected, index.query({"sparse", "three-high"}));
+}
+
+
+void run_concurrent_add_test(const string& allocator_type) {
+  printf("-- [%s] concurrent add\n", allocator_type.c_str());
+
+  uint64_t base_offset;
+  {
+    shared_ptr<Pool> pool(new Pool("test-index"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    InvertedIndex index(alloc, 0);
+    base_offset = index.base();
+  }
+
+  unordered_set<pid_t> child_pids;
+  size_t child_index = 0;
+  while ((child_pids.size() < 8) && !child_pids.count(0)) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      break;
+    }
+    child_pids.emplace(pid);
+    if (pid != 0) {
+      child_index++;
+    }
+  }
+
+  if (child_pids.count(0)) {
+    // each child builds its own terms, and all of them race to create a shared
+    // term with the same document
+    shared_ptr<Pool> pool(new Pool("test-index"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    InvertedIndex index(alloc, base_offset);
+    index.add("shared", 0);
+    for (uint32_t x = 0; x < 1000; x++) {
+      index.add(string_printf("child%zu-even", child_index), x * 2);
+      if (x % 3 == 0) {
+        index.add(string_printf("child%zu-three", child_index), x * 2);
+      }
+    }
+    _exit(0);
+
+  } else {
+    int num_failures = 0;
+    int exit_status;
+    pid_t exited_pid;
+    while ((exited_pid = wait(&exit_status)) != -1) {
+      child_pids.erase(exited_pid);
+      if (!WIFEXITED(exit_status) || (WEXITSTATUS(exit_status) != 0)) {
+        printf("-- [%s]   child %d failed (%d)\n", allocator_type.c_str(),
+            exited_pid, exit_status);
+        num_failures++;
+      }
+    }
+    expect_eq(true, child_pids.empty());
+    expect_eq(0, num_failures);
+
+    shared_ptr<Pool> pool(new Pool("test-index"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    InvertedIndex index(alloc, base_offset);
+    expect_eq(17, index.term_count());
+    expect_eq(vector<uint32_t>({0}), index.postings("shared"));
+
+    vector<uint32_t> expected;
+    for (uint32_t x = 0; x < 1000; x += 3) {
+      expected.emplace_back(x * 2);
+    }
+    for (size_t child = 0; child < 8; child++) {
+      expect_eq(1000, index.posting_count(string_printf("child%zu-even", child)));
+      expect_eq(vector<uint32_t>({0}), index.query({"shared",
+          string_printf("child%zu-even", child),
+          string_printf("child%zu-three", child)}));
+      expect_eq(expected, index.query({string_printf("child%zu-even", child),
+          string_printf("child%zu-three", child)}));
+    }
+  }
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      Pool::delete_pool("test-index");
+      run_basic_test(allocator_type);
+      Pool::delete_pool("test-index");
+      run_large_lists_test(allocator_type);
+      Pool::delete_pool("test-index");
+      run_concurrent_add_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  Pool::delete_pool("test-index");
+
+  return retcode;
+}
@@ -0,0 +1,448 @@
+#include "Log.hh"
+
+#include <stddef.h>
+#include <string.h>
+
+#include <phosg/Time.hh>
+#include <stdexcept>
+#include <unordered_set>
+
+#include "ProcessLock.hh"
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+static const uint64_t RECORD_COMMITTED = 0x01;
+static const uint64_t RECORD_END_OF_SEGMENT = 0x02;
+
+static inline uint64_t reserved_size_for_record(size_t size) {
+  return sizeof(uint64_t) + ((size + 7) & ~7);
+}
+
+
+Log::Log(shared_ptr<Allocator> allocator, size_t segment_size,
+    size_t max_cursors) : allocator(allocator) {
+  auto g = this->allocator->lock(true);
+  this->base_offset = this->create_log_base(segment_size, max_cursors);
+}
+
+Log::Log(shared_ptr<Allocator> allocator, uint64_t base_offset,
+    size_t segment_size, size_t max_cursors) : allocator(allocator),
+    base_offset(base_offset) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->create_log_base(segment_size, max_cursors);
+      this->allocator->set_base_object_offset(this->base_offset);
+    }
+  }
+}
+
+
+shared_ptr<Allocator> Log::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t Log::base() const {
+  return this->base_offset;
+}
+
+
+uint64_t Log::append(const void* data, size_t size) {
+  if (size > 0x00FFFFFFFFFFFFFF) {
+    throw invalid_argument("record is too large");
+  }
+
+  auto p = this->allocator->get_pool();
+  uint64_t record_size = reserved_size_for_record(size);
+  uint64_t record_position;
+
+  for (;;) {
+    uint64_t full_segment_offset;
+    uint64_t full_segment_start_position;
+    {
+      // the read lock only prevents the segment from being freed while we write
+      // to it; other writers can reserve space concurrently
+      auto g = this->allocator->lock(false);
+      LogBase* base = p->at<LogBase>(this->base_offset);
+      full_segment_offset = base->current_segment_offset.load(
+          memory_order_acquire);
+      Segment* segment = p->at<Segment>(full_segment_offset);
+      full_segment_start_position = segment->start_position;
+      uint64_t offset = segment->reserved.fetch_add(record_size);
+
+      if (offset + record_size <= segment->capacity) {
+        RecordHeader* header = reinterpret_cast<RecordHeader*>(
+            segment->data + offset);
+        memcpy(reinterpret_cast<uint8_t*>(header + 1), data, size);
+        header->size_and_flags.store((size << 8) | RECORD_COMMITTED,
+            memory_order_release);
+        record_position = segment->start_position + offset;
+        break;
+      }
+
+      // the record doesn't fit. if the reservation starts within the segment,
+      // then this is the only writer whose reservation crosses the end, so it
+      // marks the end of the segment for readers. (if there isn't room for a
+      // header, readers already know that the segment ends here.)
+      if (offset + sizeof(RecordHeader) <= segment->capacity) {
+        reinterpret_cast<RecordHeader*>(segment->data + offset)->
+            size_and_flags.store(RECORD_END_OF_SEGMENT, memory_order_release);
+      }
+    }
+
+    // create a new segment, unless another writer already did. the full
+    // segment may have been freed and its space reused for a newer segment
+    // since we released the lock, so we compare start positions (which are
+    // never reused) rather than offsets. we write our record at the beginning
+    // of the new segment before releasing the lock, so records larger than
+    // segment_size can't be starved by smaller ones
+    auto g = this->allocator->lock(true);
+    LogBase* base = p->at<LogBase>(this->base_offset);
+    uint64_t start_position;
+    {
+      Segment* current_segment = p->at<Segment>(
+          base->current_segment_offset.load(memory_order_relaxed));
+      if (current_segment->start_position != full_segment_start_position) {
+        continue;
+      }
+      start_position = current_segment->start_position +
+          current_segment->capacity;
+    }
+    uint64_t capacity = max<uint64_t>(base->segment_size, record_size);
+    uint64_t new_segment_offset = this->create_segment(start_position,
+        capacity);
+
+    // create_segment can remap the pool, so look up everything again
+    base = p->at<LogBase>(this->base_offset);
+    Segment* new_segment = p->at<Segment>(new_segment_offset);
+    new_segment->reserved = record_size;
+    RecordHeader* header = reinterpret_cast<RecordHeader*>(new_segment->data);
+    memcpy(reinterpret_cast<uint8_t*>(header + 1), data, size);
+    header->size_and_flags.store((size << 8) | RECORD_COMMITTED,
+        memory_order_release);
+
+    p->at<Segment>(full_segment_offset)->next_segment_offset.store(
+        new_segment_offset, memory_order_release);
+    base->current_segment_offset.store(new_segment_offset,
+        memory_order_release);
+    base->segment_count++;
+    this->truncate_locked();
+
+    record_position = start_position;
+    break;
+  }
+
+  // wake any waiting readers. a reader increments waiter_count before it
+  // sleeps, and the futex wait fails if append_count has changed since the
+  // reader last checked for records, so this can't miss a reader that's about
+  // to sleep
+  p->check_size_and_remap();
+  LogBase* base = p->at<LogBase>(this->base_offset);
+  base->append_count.fetch_add(1);
+  if (base->waiter_count.load()) {
+    futex_wake(&base->append_count, 0x7FFFFFFF);
+  }
+  return record_position;
+}
+
+uint64_t Log::append(const string& data) {
+  return this->append(data.data(), data.size());
+}
+
+
+size_t Log::open_cursor(bool from_start) {
+  auto g = this->allocator->lock(true);
+  auto p = this->allocator->get_pool();
+  LogBase* base = p->at<LogBase>(this->base_offset);
+
+  for (size_t x = 0; x < base->max_cursors; x++) {
+    Cursor* cursor = this->get_cursor(x);
+    if (cursor->in_use) {
+      continue;
+    }
+
+    if (from_start) {
+      cursor->segment_offset = base->first_segment_offset;
+      cursor->position = p->at<Segment>(
+          base->first_segment_offset)->start_position;
+    } else {
+      // if the current segment is full, this points the cursor at its end;
+      // the reader will move to the next segment when it's created
+      uint64_t segment_offset = base->current_segment_offset;
+      const Segment* segment = p->at<Segment>(segment_offset);
+      cursor->segment_offset = segment_offset;
+      cursor->position = segment->start_position +
+          min<uint64_t>(segment->reserved, segment->capacity);
+    }
+    cursor->in_use = 1;
+    return x;
+  }
+
+  throw runtime_error("all cursors are in use");
+}
+
+void Log::close_cursor(size_t cursor_index) {
+  auto g = this->allocator->lock(true);
+  Cursor* cursor = this->get_cursor(cursor_index);
+  if (!cursor->in_use) {
+    throw invalid_argument("cursor is not open");
+  }
+  cursor->in_use = 0;
+  this->truncate_locked();
+}
+
+uint64_t Log::cursor_position(size_t cursor_index) const {
+  this->allocator->get_pool()->check_size_and_remap();
+  return this->get_cursor(cursor_index)->position.load(memory_order_acquire);
+}
+
+
+bool Log::next(size_t cursor_index, Record* record, uint64_t timeout_usecs) {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  if (!this->get_cursor(cursor_index)->in_use) {
+    throw invalid_argument("cursor is not open");
+  }
+
+  uint64_t end_time = timeout_usecs ? (now() + timeout_usecs) : 0;
+  for (;;) {
+    // read the append count before checking for a record, so if a record is
+    // appended after the check, the futex wait below returns immediately
+    int32_t append_count = p->at<LogBase>(
+        this->base_offset)->append_count.load();
+    if (this->try_read(cursor_index, record)) {
+      return true;
+    }
+
+    uint64_t current_time = now();
+    if (current_time >= end_time) {
+      return false;
+    }
+    uint64_t remaining_usecs = end_time - current_time;
+    struct timespec timeout = {(time_t)(remaining_usecs / 1000000),
+        (long)((remaining_usecs % 1000000) * 1000)};
+
+    // try_read may have remapped the pool, so look up the base again
+    LogBase* base = p->at<LogBase>(this->base_offset);
+    base->waiter_count.fetch_add(1);
+    futex_wait(&base->append_count, append_count, &timeout);
+    base->waiter_count.fetch_sub(1);
+  }
+}
+
+void Log::advance(size_t cursor_index, const Record& record) {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  Cursor* cursor = this->get_cursor(cursor_index);
+  if (cursor->position.load(memory_order_relaxed) != record.position) {
+    throw invalid_argument("record is not at the cursor's position");
+  }
+  cursor->position.store(record.position +
+      reserved_size_for_record(record.size), memory_order_release);
+}
+
+bool Log::read(size_t cursor_index, string* data, uint64_t timeout_usecs) {
+  Record record;
+  if (!this->next(cursor_index, &record, timeout_usecs)) {
+    return false;
+  }
+  data->assign(reinterpret_cast<const char*>(record.data), record.size);
+  this->advance(cursor_index, record);
+  return true;
+}
+
+
+void Log::truncate() {
+  auto g = this->allocator->lock(true);
+  this->truncate_locked();
+}
+
+
+uint64_t Log::start_position() const {
+  auto g = this->allocator->lock(false);
+  auto p = this->allocator->get_pool();
+  const LogBase* base = p->at<LogBase>(this->base_offset);
+  return p->at<Segment>(base->first_segment_offset)->start_position;
+}
+
+uint64_t Log::end_position() const {
+  auto g = this->allocator->lock(false);
+  auto p = this->allocator->get_pool();
+  const LogBase* base = p->at<LogBase>(this->base_offset);
+  const Segment* segment = p->at<Segment>(base->current_segment_offset);
+  return segment->start_position +
+      min<uint64_t>(segment->reserved, segment->capacity);
+}
+
+size_t Log::segment_count() const {
+  auto g = this->allocator->lock(false);
+  return this->allocator->get_pool()->at<LogBase>(
+      this->base_offset)->segment_count;
+}
+
+size_t Log::cursor_count() const {
+  auto g = this->allocator->lock(false);
+  size_t count = 0;
+  for (size_t x = 0; x < this->max_cursors(); x++) {
+    count += (this->get_cursor(x)->in_use != 0);
+  }
+  return count;
+}
+
+size_t Log::max_cursors() const {
+  return this->allocator->get_pool()->at<LogBase>(
+      this->base_offset)->max_cursors;
+}
+
+size_t Log::segment_size() const {
+  return this->allocator->get_pool()->at<LogBase>(
+      this->base_offset)->segment_size;
+}
+
+
+uint64_t Log::create_log_base(size_t segment_size, size_t max_cursors) {
+  if (segment_size == 0) {
+    throw invalid_argument("segment_size must be nonzero");
+  }
+  if (max_cursors == 0) {
+    throw invalid_argument("max_cursors must be nonzero");
+  }
+  segment_size = (segment_size + 7) & ~7;
+
+  auto p = this->allocator->get_pool();
+
+  uint64_t base_offset = this->allocator->allocate(sizeof(LogBase));
+  uint64_t allocated_offset = this->allocator->allocate(
+      max_cursors * sizeof(Cursor) + sizeof(Cursor) - 8);
+  uint64_t segment_offset = this->create_segment(0, segment_size);
+
+  // the pool is always mapped at a page boundary, so aligning the offset also
+  // aligns the address
+  uint64_t cursors_offset = (allocated_offset + sizeof(Cursor) - 1) &
+      ~(sizeof(Cursor) - 1);
+  memset(p->at<uint8_t>(cursors_offset), 0, max_cursors * sizeof(Cursor));
+
+  LogBase* base = p->at<LogBase>(base_offset);
+  base->segment_size = segment_size;
+  base->max_cursors = max_cursors;
+  base->cursors_offset = cursors_offset;
+  base->segment_count = 1;
+  base->first_segment_offset = segment_offset;
+  base->current_segment_offset = segment_offset;
+  base->append_count = 0;
+  base->waiter_count = 0;
+
+  return base_offset;
+}
+
+
+uint64_t Log::create_segment(uint64_t start_position, uint64_t capacity) {
+  auto p = this->allocator->get_pool();
+  uint64_t segment_offset = this->allocator->allocate(
+      sizeof(Segment) + capacity);
+
+  // readers look at record headers before they're written, so the data must be
+  // zeroed
+  Segment* segment = p->at<Segment>(segment_offset);
+  segment->next_segment_offset = 0;
+  segment->start_position = start_position;
+  segment->capacity = capacity;
+  segment->reserved = 0;
+  memset(segment->data, 0, capacity);
+  return segment_offset;
+}
+
+void Log::truncate_locked() {
+  auto p = this->allocator->get_pool();
+  LogBase* base = p->at<LogBase>(this->base_offset);
+
+  // cursors only move forward, so we can free segments from the beginning of
+  // the list until we reach one that some cursor is reading. we look at the
+  // cursors' segments rather than their positions, since a cursor can be at
+  // the end of a segment without having moved to the next one yet
+  unordered_set<uint64_t> cursor_segment_offsets;
+  for (size_t x = 0; x < base->max_cursors; x++) {
+    const Cursor* cursor = this->get_cursor(x);
+    if (cursor->in_use) {
+      cursor_segment_offsets.emplace(cursor->segment_offset);
+    }
+  }
+
+  while ((base->first_segment_offset != base->current_segment_offset) &&
+         !cursor_segment_offsets.count(base->first_segment_offset)) {
+    uint64_t segment_offset = base->first_segment_offset;
+    base->first_segment_offset = p->at<Segment>(
+        segment_offset)->next_segment_offset;
+    base->segment_count--;
+    this->allocator->free(segment_offset);
+  }
+}
+
+
+bool Log::try_read(size_t cursor_index, Record* record) const {
+  auto p = this->allocator->get_pool();
+
+  for (;;) {
+    // the segment may have been allocated by another process after we last
+    // remapped the pool, so check for expansion after loading its offset and
+    // before reading it. (the segment can't be freed while the cursor refers to
+    // it, so we don't need to lock the pool.)
+    uint64_t segment_offset = this->get_cursor(
+        cursor_index)->segment_offset.load(memory_order_relaxed);
+    p->check_size_and_remap();
+    Cursor* cursor = this->get_cursor(cursor_index);
+    const Segment* segment = p->at<Segment>(segment_offset);
+    uint64_t position = cursor->position.load(memory_order_relaxed);
+    uint64_t offset = position - segment->start_position;
+
+    if (offset + sizeof(RecordHeader) <= segment->capacity) {
+      const RecordHeader* header = reinterpret_cast<const RecordHeader*>(
+          segment->data + offset);
+      uint64_t size_and_flags = header->size_and_flags.load(
+          memory_order_acquire);
+      if (!size_and_flags) {
+        return false; // not committed yet
+      }
+      if (size_and_flags & RECORD_COMMITTED) {
+        record->position = position;
+        record->data = header + 1;
+        record->size = size_and_flags >> 8;
+        return true;
+      }
+    }
+
+    // we're at the end of this segment. move to the next one if it exists;
+    // once the cursor refers to the next segment, this one can be freed
+    uint64_t next_segment_offset = segment->next_segment_offset.load(
+        memory_order_acquire);
+    if (!next_segment_offset) {
+      return false;
+    }
+    p->check_size_and_remap();
+    cursor = this->get_cursor(cursor_index);
+    cursor->segment_offset.store(next_segment_offset, memory_order_release);
+    cursor->position.store(p->at<Segment>(next_segment_offset)->start_position,
+        memory_order_release);
+  }
+}
+
+
+Log::Cursor* Log::get_cursor(size_t cursor_index) const {
+  auto p = this->allocator->get_pool();
+  const LogBase* base = p->at<LogBase>(this->base_offset);
+  if (cursor_index >= base->max_cursors) {
+    throw out_of_range("cursor index out of range");
+  }
+  return p->at<Cursor>(base->cursors_offset + cursor_index * sizeof(Cursor));
+}
+
+} // namespace sharedstructures
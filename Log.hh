@@ -0,0 +1,170 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "Allocator.hh"
+
+namespace sharedstructures {
+
+
+// Log is an append-only sequence of records that can be written and read by
+// multiple processes. records are stored in a linked list of segments. writers
+// reserve space in the current segment with an atomic add and then copy their
+// record in, so appends from different processes only contend on a single
+// counter (they hold the pool's read lock while doing so). a writer that finds
+// the current segment full takes the write lock and links a new segment.
+//
+// each record has a position, which is a 64-bit integer that increases with
+// each append. records are read through cursors, which are stored in the pool
+// so they persist across reader restarts. each cursor has a position, and its
+// owner reads and advances it independently of all other cursors; a cursor
+// should only be used by one reader at a time. readers don't take the pool
+// lock, and they can block until a record is available; waiting readers are
+// woken by a futex when a record is appended.
+//
+// segments that all open cursors have moved past are freed. this means that a
+// cursor that's never advanced or closed (e.g. if its reader crashes) prevents
+// the log from being truncated. if there are no open cursors, all segments
+// except the current one are freed.
+//
+// if a writer crashes between reserving space and committing its record, the
+// log is stuck at that record: readers will wait for it forever.
+
+class Log {
+public:
+  Log() = delete;
+  Log(const Log&) = delete;
+  Log(Log&&) = delete;
+
+  // create constructor - allocates a new empty log. new segments will have
+  // segment_size bytes of space for records (larger records get their own
+  // segments). max_cursors is the number of cursors that can be open at once.
+  Log(std::shared_ptr<Allocator> allocator, size_t segment_size,
+      size_t max_cursors);
+  // (conditional) create constructor.
+  // opens an existing Log using the given allocator. if base_offset is 0, opens
+  // the Log at the allocator's base offset. if the allocator's base offset is
+  // also 0, creates a new Log and sets the allocator's base offset to the new
+  // log's base offset. segment_size and max_cursors are ignored if the log
+  // already exists.
+  Log(std::shared_ptr<Allocator> allocator, uint64_t base_offset,
+      size_t segment_size, size_t max_cursors);
+  ~Log() = default;
+
+  // returns the allocator for this log
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this log
+  uint64_t base() const;
+
+  // appends a record to the log and wakes any waiting readers. returns the
+  // record's position.
+  uint64_t append(const void* data, size_t size);
+  uint64_t append(const std::string& data);
+
+  // opens a cursor. if from_start is true, the cursor starts at the oldest
+  // record still in the log; otherwise, it starts after the last record that
+  // was appended before this call. returns the cursor's index, which can be
+  // used from any process. throws std::runtime_error if max_cursors cursors
+  // are already open.
+  size_t open_cursor(bool from_start);
+  // closes a cursor, allowing the segments it was holding to be freed.
+  void close_cursor(size_t cursor_index);
+  // returns the position of the next record the cursor will return.
+  uint64_t cursor_position(size_t cursor_index) const;
+
+  // a record returned by next(). data points directly into the pool. it's valid
+  // until the record is consumed with advance(), or until the pool is remapped
+  // by this process (e.g. by a write to another structure in the same pool
+  // that expands it).
+  struct Record {
+    uint64_t position;
+    const void* data;
+    size_t size;
+  };
+
+  // gets the record at the cursor's position without consuming it. if no
+  // record is available, waits up to timeout_usecs microseconds for one to be
+  // appended (0 means don't wait). returns false if no record became
+  // available.
+  bool next(size_t cursor_index, Record* record, uint64_t timeout_usecs = 0);
+  // consumes a record returned by next(), moving the cursor past it.
+  void advance(size_t cursor_index, const Record& record);
+  // reads and consumes the next record, copying it into a string. returns
+  // false if no record became available within the timeout.
+  bool read(size_t cursor_index, std::string* data,
+      uint64_t timeout_usecs = 0);
+
+  // frees all segments that every open cursor has moved past. this is done
+  // automatically when a new segment is created and when a cursor is closed.
+  void truncate();
+
+  // inspection methods.
+  uint64_t start_position() const; // position of the oldest available record
+  uint64_t end_position() const; // position after the newest reservation
+  size_t segment_count() const;
+  size_t cursor_count() const; // open cursors
+  size_t max_cursors() const;
+  size_t segment_size() const;
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+
+  struct Segment {
+    std::atomic<uint64_t> next_segment_offset;
+    uint64_t start_position; // position of data[0]
+    uint64_t capacity;
+    // bytes reserved by writers. this can exceed capacity when the segment is
+    // full; writers whose reservations don't fit move on to the next segment
+    std::atomic<uint64_t> reserved;
+    uint8_t data[0];
+  };
+
+  // records are 8-byte aligned within segments and begin with this header. it's
+  // 0 until the record is committed.
+  struct RecordHeader {
+    std::atomic<uint64_t> size_and_flags; // (size << 8) | flags
+  };
+
+  struct Cursor {
+    std::atomic<uint64_t> in_use;
+    std::atomic<uint64_t> segment_offset;
+    std::atomic<uint64_t> position;
+    // readers update their cursors often, so keep them on separate cache lines
+    uint64_t unused[5];
+  };
+
+  struct LogBase {
+    uint64_t segment_size;
+    uint64_t max_cursors;
+    // the cursors must be aligned to cache lines, but the allocator only
+    // guarantees 8-byte alignment, so we allocate extra space and align the
+    // cursors within it
+    uint64_t cursors_offset;
+    uint64_t segment_count;
+    uint64_t first_segment_offset;
+    std::atomic<uint64_t> current_segment_offset;
+    // incremented after every commit; readers wait on this with futex_wait
+    std::atomic<int32_t> append_count;
+    std::atomic<int32_t> waiter_count;
+  };
+
+  uint64_t create_log_base(size_t segment_size, size_t max_cursors);
+
+  // these must be called with the pool locked for writing
+  uint64_t create_segment(uint64_t start_position, uint64_t capacity);
+  void truncate_locked();
+
+  // fills in record if there's a committed record at the cursor's position,
+  // moving the cursor to the next segment first if necessary. returns false if
+  // the record isn't available yet. doesn't lock the pool.
+  bool try_read(size_t cursor_index, Record* record) const;
+
+  Cursor* get_cursor(size_t cursor_index) const;
+};
+
+} // namespace sharedstructures
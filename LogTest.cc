@@ -0,0 +1,350 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "Log.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-log"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  Log log(alloc, 0, 4096, 4);
+
+  expect_eq(4096, log.segment_size());
+  expect_eq(4, log.max_cursors());
+  expect_eq(0, log.cursor_count());
+  expect_eq(1, log.segment_count());
+  expect_eq(0, log.start_position());
+  expect_eq(0, log.end_position());
+
+  size_t c1 = log.open_cursor(true);
+  expect_eq(1, log.cursor_count());
+  Log::Record record;
+  expect_eq(false, log.next(c1, &record));
+  string data;
+  expect_eq(false, log.read(c1, &data));
+
+  // positions are 8-byte aligned and include an 8-byte header
+  expect_eq(0, log.append("first"));
+  expect_eq(16, log.append(string()));
+  expect_eq(24, log.append("the third record"));
+  expect_eq(48, log.end_position());
+
+  // a cursor opened at the end doesn't see existing records
+  size_t c2 = log.open_cursor(false);
+  expect_eq(48, log.cursor_position(c2));
+  expect_eq(false, log.next(c2, &record));
+
+  // next() doesn't consume the record; advance() does
+  expect_eq(true, log.next(c1, &record));
+  expect_eq(0, record.position);
+  expect_eq("first", string((const char*)record.data, record.size));
+  expect_eq(true, log.next(c1, &record));
+  expect_eq(0, record.position);
+  log.advance(c1, record);
+  expect_eq(16, log.cursor_position(c1));
+  try {
+    log.advance(c1, record);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+
+  expect_eq(true, log.read(c1, &data));
+  expect_eq("", data);
+  expect_eq(true, log.read(c1, &data));
+  expect_eq("the third record", data);
+  expect_eq(false, log.read(c1, &data));
+
+  // another instance sees the same log and cursors
+  {
+    Log log2(alloc, log.base(), 0, 0);
+    expect_eq(2, log2.cursor_count());
+    log2.append("fourth");
+    expect_eq(true, log2.read(c2, &data));
+    expect_eq("fourth", data);
+  }
+  expect_eq(true, log.read(c1, &data));
+  expect_eq("fourth", data);
+
+  // cursors can be reused after they're closed
+  log.open_cursor(true);
+  log.open_cursor(true);
+  try {
+    log.open_cursor(true);
+    expect(false);
+  } catch (const runtime_error& e) { }
+  log.close_cursor(c2);
+  expect_eq(3, log.cursor_count());
+  expect_eq(c2, log.open_cursor(true));
+  try {
+    log.close_cursor(4);
+    expect(false);
+  } catch (const out_of_range& e) { }
+}
+
+
+void run_segments_test(const string& allocator_type) {
+  printf("-- [%s] segments\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-log"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  Log log(alloc, 256, 2);
+
+  size_t c1 = log.open_cursor(true);
+  size_t c2 = log.open_cursor(true);
+
+  // records of many sizes, including some larger than a segment
+  vector<string> records;
+  for (size_t x = 0; x < 200; x++) {
+    records.emplace_back(string_printf("record%zu-", x) +
+        string((x % 17 == 0) ? (x * 7) : (x % 40), 'a' + (x % 26)));
+    log.append(records.back());
+  }
+  expect_lt(10, log.segment_count());
+
+  // nothing can be freed until both cursors move past the first segment
+  size_t initial_segment_count = log.segment_count();
+  string data;
+  for (size_t x = 0; x < 200; x++) {
+    expect_eq(true, log.read(c1, &data));
+    expect_eq(records[x], data);
+  }
+  expect_eq(false, log.read(c1, &data));
+  log.truncate();
+  expect_eq(initial_segment_count, log.segment_count());
+  expect_eq(0, log.start_position());
+
+  for (size_t x = 0; x < 100; x++) {
+    expect_eq(true, log.read(c2, &data));
+    expect_eq(records[x], data);
+  }
+  log.truncate();
+  expect_lt(log.segment_count(), initial_segment_count);
+  expect_lt(0, log.start_position());
+  expect_le(log.start_position(), log.cursor_position(c2));
+
+  // a cursor opened now starts at the oldest remaining record
+  size_t c3;
+  try {
+    log.open_cursor(true);
+    expect(false);
+  } catch (const runtime_error& e) { }
+  log.close_cursor(c1);
+  c3 = log.open_cursor(true);
+  expect_eq(log.start_position(), log.cursor_position(c3));
+
+  // when the remaining cursors are closed, everything but the current segment
+  // is freed
+  log.close_cursor(c2);
+  log.close_cursor(c3);
+  expect_eq(1, log.segment_count());
+
+  // the log is still usable after truncation
+  c1 = log.open_cursor(false);
+  log.append("after truncation");
+  expect_eq(true, log.read(c1, &data));
+  expect_eq("after truncation", data);
+}
+
+
+void run_blocking_read_test(const string& allocator_type) {
+  printf("-- [%s] blocking read\n", allocator_type.c_str());
+
+  uint64_t base_offset;
+  size_t cursor_index;
+  {
+    shared_ptr<Pool> pool(new Pool("test-log"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    Log log(alloc, 0, 4096, 4);
+    base_offset = log.base();
+    cursor_index = log.open_cursor(false);
+  }
+
+  pid_t pid = fork();
+  if (!pid) {
+    // child: wait for records with a long timeout. if the wakeup doesn't work,
+    // this will take much longer than the parent expects
+    shared_ptr<Pool> pool(new Pool("test-log"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    Log log(alloc, base_offset, 0, 0);
+    for (size_t x = 0; x < 10; x++) {
+      string data;
+      if (!log.read(cursor_index, &data, 10000000)) {
+        _exit(1);
+      }
+      if (data != string_printf("record%zu", x)) {
+        _exit(2);
+      }
+    }
+    _exit(0);
+  }
+
+  shared_ptr<Pool> pool(new Pool("test-log"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  Log log(alloc, base_offset, 0, 0);
+
+  uint64_t start_time = now();
+  for (size_t x = 0; x < 10; x++) {
+    usleep(20000);
+    log.append(string_printf("record%zu", x));
+  }
+
+  int exit_status;
+  expect_eq(pid, waitpid(pid, &exit_status, 0));
+  expect_eq(true, WIFEXITED(exit_status));
+  expect_eq(0, WEXITSTATUS(exit_status));
+  expect_lt(now() - start_time, 2000000);
+
+  // a read with a short timeout gives up
+  start_time = now();
+  string data;
+  expect_eq(false, log.read(cursor_index, &data, 50000));
+  expect_le(50000, now() - start_time);
+}
+
+
+void run_concurrent_test(const string& allocator_type) {
+  printf("-- [%s] concurrent writers and readers\n", allocator_type.c_str());
+
+  uint64_t base_offset;
+  vector<size_t> cursor_indexes;
+  {
+    shared_ptr<Pool> pool(new Pool("test-log"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    Log log(alloc, 0, 1024, 4);
+    base_offset = log.base();
+    for (size_t x = 0; x < 4; x++) {
+      cursor_indexes.emplace_back(log.open_cursor(true));
+    }
+  }
+
+  // 4 writers each append 2000 records; 4 readers each read all of them
+  const size_t num_writers = 4;
+  const size_t num_records = 2000;
+  unordered_set<pid_t> child_pids;
+  size_t child_index = 0;
+  while ((child_pids.size() < 8) && !child_pids.count(0)) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      break;
+    } else {
+      child_pids.emplace(pid);
+      if (pid) {
+        child_index++;
+      }
+    }
+  }
+
+  if (child_pids.count(0)) {
+    shared_ptr<Pool> pool(new Pool("test-log"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    Log log(alloc, base_offset, 0, 0);
+
+    if (child_index < num_writers) {
+      for (size_t x = 0; x < num_records; x++) {
+        log.append(string_printf("%zu:%zu:", child_index, x) +
+            string(x % 100, 'x'));
+      }
+
+    } else {
+      // each writer's records must appear in order, and none may be missing
+      size_t cursor_index = cursor_indexes[child_index - num_writers];
+      vector<size_t> next_record(num_writers, 0);
+      for (size_t x = 0; x < num_writers * num_records; x++) {
+        Log::Record record;
+        if (!log.next(cursor_index, &record, 10000000)) {
+          _exit(1);
+        }
+        size_t writer_index, record_index;
+        if (sscanf((const char*)record.data, "%zu:%zu:", &writer_index,
+            &record_index) != 2) {
+          _exit(2);
+        }
+        if ((writer_index >= num_writers) ||
+            (record_index != next_record[writer_index])) {
+          _exit(3);
+        }
+        next_record[writer_index]++;
+        log.advance(cursor_index, record);
+      }
+    }
+    _exit(0);
+
+  } else {
+    int num_failures = 0;
+    int exit_status;
+    pid_t exited_pid;
+    while ((exited_pid = wait(&exit_status)) != -1) {
+      child_pids.erase(exited_pid);
+      if (!WIFEXITED(exit_status) || (WEXITSTATUS(exit_status) != 0)) {
+        printf("-- [%s]   child %d failed (%d)\n", allocator_type.c_str(),
+            exited_pid, exit_status);
+        num_failures++;
+      }
+    }
+    expect_eq(true, child_pids.empty());
+    expect_eq(0, num_failures);
+
+    // all readers are done, so all segments but the last can be freed
+    shared_ptr<Pool> pool(new Pool("test-log"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    Log log(alloc, base_offset, 0, 0);
+    log.truncate();
+    expect_le(log.segment_count(), 2);
+  }
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      Pool::delete_pool("test-log");
+      run_basic_test(allocator_type);
+      Pool::delete_pool("test-log");
+      run_segments_test(allocator_type);
+      Pool::delete_pool("test-log");
+      run_blocking_read_test(allocator_type);
+      Pool::delete_pool("test-log");
+      run_concurrent_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  Pool::delete_pool("test-log");
+
+  return retcode;
+}
@@ -466,6 +466,10 @@ bool LogarithmicAllocator::is_locked(bool writing) const {
   return this->pool->at<ProcessReadWriteLock>(offsetof(Data, data_lock))->is_locked(writing);
 }
 
+uint64_t LogarithmicAllocator::lock_offset() const {
+  return offsetof(Data, data_lock);
+}
+
 
 LogarithmicAllocator::Data* LogarithmicAllocator::data() {
   return this->pool->at<Data>(0);
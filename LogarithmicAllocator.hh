@@ -26,6 +26,7 @@ public:
 
   virtual ProcessReadWriteLockGuard lock(bool writing) const;
   virtual bool is_locked(bool writing) const;
+  virtual uint64_t lock_offset() const;
 
   // for debugging
   virtual void verify() const;
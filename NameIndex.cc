@@ -0,0 +1,101 @@
+#include "NameIndex.hh"
+
+#include <string.h>
+
+#include <atomic>
+#include <stdexcept>
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+NameIndex::NameIndex(shared_ptr<Allocator> allocator, uint64_t count_offset,
+    uint64_t names_offset, size_t max_names, const char* full_error) :
+    allocator(allocator), count_offset(count_offset),
+    names_offset(names_offset), max_names(max_names), full_error(full_error) {
+}
+
+
+size_t NameIndex::index_for_name(const string& name, bool create) {
+  auto cache_it = this->cache.find(name);
+  if (cache_it != this->cache.end()) {
+    return cache_it->second;
+  }
+
+  // names are written before the count is incremented, so we can search the
+  // existing names without locking
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  uint64_t count = p->at<atomic<uint64_t>>(this->count_offset)->load(
+      memory_order_acquire);
+  for (size_t x = 0; x < count; x++) {
+    if (this->name_for_index(x) == name) {
+      this->cache.emplace(name, x);
+      return x;
+    }
+  }
+
+  if (!create) {
+    throw out_of_range(name);
+  }
+
+  auto g = this->allocator->lock(true);
+
+  // another process may have created it since we searched
+  uint64_t locked_count = p->at<atomic<uint64_t>>(this->count_offset)->load(
+      memory_order_relaxed);
+  for (size_t x = count; x < locked_count; x++) {
+    if (this->name_for_index(x) == name) {
+      this->cache.emplace(name, x);
+      return x;
+    }
+  }
+
+  count = locked_count;
+  if (count >= this->max_names) {
+    throw runtime_error(this->full_error);
+  }
+
+  // empty names are stored with no allocated memory
+  uint64_t name_offset = 0;
+  if (!name.empty()) {
+    name_offset = this->allocator->allocate(name.size());
+    memcpy(p->at<char>(name_offset), name.data(), name.size());
+  }
+
+  p->at<uint64_t>(this->names_offset)[count] = name_offset;
+  p->at<atomic<uint64_t>>(this->count_offset)->store(count + 1,
+      memory_order_release);
+
+  this->cache.emplace(name, count);
+  return count;
+}
+
+vector<string> NameIndex::all_names() const {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  uint64_t count = p->at<atomic<uint64_t>>(this->count_offset)->load(
+      memory_order_acquire);
+
+  vector<string> ret;
+  for (size_t x = 0; x < count; x++) {
+    ret.emplace_back(this->name_for_index(x));
+  }
+  return ret;
+}
+
+string NameIndex::name_for_index(size_t index) const {
+  auto p = this->allocator->get_pool();
+  uint64_t name_offset = p->at<uint64_t>(this->names_offset)[index];
+  if (!name_offset) {
+    return "";
+  }
+  // the name may have been allocated by another process after we last
+  // remapped the pool
+  p->check_size_and_remap();
+  return string(p->at<char>(name_offset),
+      this->allocator->block_size(name_offset));
+}
+
+} // namespace sharedstructures
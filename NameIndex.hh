@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Allocator.hh"
+
+namespace sharedstructures {
+
+
+// NameIndex assigns dense indexes to names for structures that hold a
+// fixed-capacity array of named entries (CounterSet and TimeSeries). the
+// structure keeps an array of name offsets and an atomic count of the names
+// that have been written in its pool; a name is written before the count is
+// incremented, so names can be searched without locking. creating a name takes
+// the pool's write lock. names can't be deleted or renamed, so each process
+// caches the name -> index mapping and the cache never becomes stale.
+
+class NameIndex {
+public:
+  NameIndex() = delete;
+  NameIndex(const NameIndex&) = delete;
+  NameIndex(NameIndex&&) = delete;
+
+  // count_offset is the offset of the structure's std::atomic<uint64_t> name
+  // count, and names_offset is the offset of its array of max_names name
+  // offsets. full_error is the message of the std::runtime_error that
+  // index_for_name throws when the array is full.
+  NameIndex(std::shared_ptr<Allocator> allocator, uint64_t count_offset,
+      uint64_t names_offset, size_t max_names, const char* full_error);
+  ~NameIndex() = default;
+
+  // returns the index of a name. if it doesn't exist, creates it if create is
+  // true, or throws std::out_of_range if not. this only locks the pool if the
+  // name is created.
+  size_t index_for_name(const std::string& name, bool create);
+
+  // returns all the names, in index order. this doesn't lock the pool.
+  std::vector<std::string> all_names() const;
+
+  // returns the name for an index. the index must be less than a name count
+  // that was read from the pool. this doesn't lock the pool, but it may remap
+  // it, which invalidates pointers into it.
+  std::string name_for_index(size_t index) const;
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t count_offset;
+  uint64_t names_offset;
+  size_t max_names;
+  const char* full_error;
+
+  std::unordered_map<std::string, size_t> cache;
+};
+
+} // namespace sharedstructures
@@ -1,10 +1,18 @@
+#define __STDC_FORMAT_MACROS
 #include "Pool.hh"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#ifdef LINUX
+#include <linux/fs.h>
+#include <sys/sendfile.h>
+#endif
 
+#include <algorithm>
 #include <phosg/Strings.hh>
 
 using namespace std;
@@ -29,8 +37,8 @@ static int unlink_segment(const char* name, bool file) {
 }
 
 
-Pool::Pool(const string& name, size_t max_size, bool file) : name(name),
-    max_size(max_size) {
+Pool::Pool(const string& name, size_t max_size, bool file, bool create) :
+    name(name), max_size(max_size), private_mapping(false) {
 
   // on Linux, shared memory objects can be resized at any time just by calling
   // ftruncate again. but on OSX, ftruncate can be called only once for each
@@ -38,10 +46,13 @@ Pool::Pool(const string& name, size_t max_size, bool file) : name(name),
   if (MAP_HASSEMAPHORE) {
     file = true;
   }
+  this->file = file;
 
-  this->fd = open_segment(this->name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666,
-      file);
-  if (this->fd == -1 && errno == EEXIST) {
+  if (create) {
+    this->fd = open_segment(this->name.c_str(), O_RDWR | O_CREAT | O_EXCL,
+        0666, file);
+  }
+  if (!create || (this->fd == -1 && errno == EEXIST)) {
     this->fd = open_segment(this->name.c_str(), O_RDWR, 0666, file);
     if (this->fd == -1) {
       throw cannot_open_file(this->name);
@@ -84,6 +95,18 @@ Pool::Pool(const string& name, size_t max_size, bool file) : name(name),
   }
 }
 
+Pool::Pool(const Pool& source, int fd) : name(source.name), max_size(0),
+    file(source.file), private_mapping(true) {
+  this->fd = fd;
+  this->pool_size = fstat(this->fd).st_size;
+  this->data = (Data*)mmap(NULL, this->pool_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE, this->fd, 0);
+  if (this->data == MAP_FAILED) {
+    this->data = NULL;
+    throw bad_alloc();
+  }
+}
+
 Pool::~Pool() {
   if (this->data) {
     munmap(this->data, this->pool_size);
@@ -96,6 +119,10 @@ const string& Pool::get_name() const {
   return this->name;
 }
 
+bool Pool::is_file() const {
+  return this->file;
+}
+
 
 void Pool::expand(size_t new_size) {
   if (new_size < this->pool_size) {
@@ -118,10 +145,45 @@ void Pool::expand(size_t new_size) {
   this->check_size_and_remap(); // sets this->pool_size
 }
 
+void Pool::truncate(size_t new_size) {
+  new_size = (new_size + PAGE_SIZE - 1) & (~(PAGE_SIZE - 1));
+  if (new_size >= this->pool_size) {
+    return;
+  }
+
+  // shrink the size in the header before the underlying object, so other
+  // processes never map the pool beyond the end of the object
+  uint64_t old_size = this->data->size;
+  this->data->size = new_size;
+  if (ftruncate(this->fd, new_size)) {
+    this->data->size = old_size;
+    throw runtime_error("can\'t resize memory map: " + string_for_error(errno));
+  }
+
+  this->check_size_and_remap(); // sets this->pool_size
+}
+
 void Pool::check_size_and_remap() const {
   uint64_t new_pool_size = this->pool_size ? this->data->size.load() :
       fstat(this->fd).st_size;
   if (new_pool_size != this->pool_size) {
+    if (this->private_mapping) {
+      // unmapping a private view would discard the changes made through it,
+      // so resize the existing mapping instead (moving it if necessary)
+#ifdef LINUX
+      void* new_data = mremap(this->data, this->pool_size, new_pool_size,
+          MREMAP_MAYMOVE);
+      if (new_data == MAP_FAILED) {
+        throw runtime_error("mremap failed: " + string_for_error(errno));
+      }
+      this->data = (Data*)new_data;
+      this->pool_size = new_pool_size;
+      return;
+#else
+      throw runtime_error("private views can\'t be resized on this platform");
+#endif
+    }
+
     munmap(this->data, this->pool_size);
 
     // remap the pool with the new size
@@ -166,4 +228,141 @@ bool Pool::delete_pool(const std::string& name, bool file) {
   throw runtime_error("can\'t delete pool: " + string_for_error(errno));
 }
 
+static bool clone_data(int src_fd, int dst_fd, size_t size) {
+#ifdef LINUX
+  // a reflink copies no data at all; the new file shares the source's blocks
+  // until either of them is written. this only works for files on filesystems
+  // that support it (e.g. btrfs and xfs)
+  if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+    return true;
+  }
+
+  // copy_file_range copies within the kernel, and can use server-side copies
+  // or reflinks for part of the file on filesystems that support them. it
+  // fails immediately if the filesystem (or the kernel) doesn't support it;
+  // sendfile works for all files and shared memory objects
+  size_t offset = 0;
+  while (offset < size) {
+    ssize_t bytes_copied = copy_file_range(src_fd, NULL, dst_fd, NULL,
+        size - offset, 0);
+    if (bytes_copied <= 0) {
+      if ((bytes_copied < 0) && (errno == EINTR)) {
+        continue;
+      }
+      break;
+    }
+    offset += bytes_copied;
+  }
+  while (offset < size) {
+    ssize_t bytes_copied = sendfile(dst_fd, src_fd, NULL, size - offset);
+    if (bytes_copied <= 0) {
+      if ((bytes_copied < 0) && (errno == EINTR)) {
+        continue;
+      }
+      break;
+    }
+    offset += bytes_copied;
+  }
+  if (offset == size) {
+    return true;
+  }
+  // neither worked (or both failed partway through). the file offsets have
+  // advanced by the amount copied so far, so the read/write loop below
+  // continues where they left off
+#else
+  size_t offset = 0;
+#endif
+
+  string buffer(1024 * 1024, '\0');
+  while (offset < size) {
+    ssize_t bytes_read = read(src_fd, &buffer[0],
+        min<size_t>(buffer.size(), size - offset));
+    if (bytes_read <= 0) {
+      if ((bytes_read < 0) && (errno == EINTR)) {
+        continue;
+      }
+      return false;
+    }
+    for (ssize_t bytes_written = 0; bytes_written < bytes_read;) {
+      ssize_t ret = write(dst_fd, buffer.data() + bytes_written,
+          bytes_read - bytes_written);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      bytes_written += ret;
+    }
+    offset += bytes_read;
+  }
+  return true;
+}
+
+void Pool::clone_to(const string& new_name) const {
+  if (this->private_mapping) {
+    throw logic_error("can\'t clone a private view");
+  }
+
+  // the copy functions use (and advance) the file offset, so we need our own
+  // file description instead of this->fd
+  scoped_fd src_fd = open_segment(this->name.c_str(), O_RDONLY, 0, this->file);
+  if (src_fd == -1) {
+    throw cannot_open_file(this->name);
+  }
+  scoped_fd dst_fd = open_segment(new_name.c_str(),
+      O_RDWR | O_CREAT | O_EXCL, 0666, this->file);
+  if (dst_fd == -1) {
+    throw cannot_open_file(new_name);
+  }
+
+  // the pool's size is updated after its segment is resized, so the segment
+  // may be larger than size() if another process is expanding it; copy only
+  // the part that's in use
+  size_t size = this->size();
+  if (ftruncate(dst_fd, size) || !clone_data(src_fd, dst_fd, size)) {
+    int error = errno;
+    unlink_segment(new_name.c_str(), this->file);
+    throw runtime_error("can\'t clone pool: " + string_for_error(error));
+  }
+}
+
+shared_ptr<Pool> Pool::private_view() const {
+  if (this->private_mapping) {
+    throw logic_error("can\'t create a private view of a private view");
+  }
+
+  // the clone only needs a name until we open it
+  static atomic<uint64_t> next_view_id(0);
+  string view_name = string_printf("%s.view-%d-%" PRIu64, this->name.c_str(),
+      getpid(), next_view_id++);
+  this->clone_to(view_name);
+  int view_fd = open_segment(view_name.c_str(), O_RDWR, 0666, this->file);
+  unlink_segment(view_name.c_str(), this->file);
+  if (view_fd == -1) {
+    throw cannot_open_file(view_name);
+  }
+
+  // the private mapping means changes are never written back to the clone, so
+  // it only uses disk space (or memory, for shared memory objects) for the
+  // parts that weren't reflinked
+  return shared_ptr<Pool>(new Pool(*this, view_fd));
+}
+
+bool Pool::is_private_view() const {
+  return this->private_mapping;
+}
+
+bool Pool::shares_data_with(const Pool& other) const {
+  if (this == &other) {
+    return true;
+  }
+  // private views are backed by unlinked clones, so they never share an inode
+  // with another pool
+  struct stat this_st = fstat(this->fd);
+  struct stat other_st = fstat(other.fd);
+  return (this_st.st_dev == other_st.st_dev) &&
+      (this_st.st_ino == other_st.st_ino);
+}
+
 } // namespace sharedstructures
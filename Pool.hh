@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <memory>
 #include <phosg/Filesystem.hh>
 #include <string>
 #include <sys/mman.h>
@@ -41,16 +42,29 @@ public:
   //   multiple processes try to create the pool concurrently - try again.
   // - bad_alloc: the pool exists and isn't empty, but we can't map it into our
   //   address space. either it's too large or we're out of address space.
-  explicit Pool(const std::string& name, size_t max_size = 0, bool file = true);
+  // if create is false, the pool isn't created if it doesn't exist;
+  // cannot_open_file is thrown instead.
+  explicit Pool(const std::string& name, size_t max_size = 0, bool file = true,
+      bool create = true);
   ~Pool();
 
   const std::string& get_name() const;
+  // returns true if the pool is backed by a file, false if it's backed by a
+  // shared memory object
+  bool is_file() const;
 
 
   // expands the pool to the given size. if the given size is smaller than the
   // pool's size, does nothing.
   void expand(size_t new_size);
 
+  // shrinks the pool to the given size, rounded up to a multiple of the page
+  // size. if the given size isn't smaller than the pool's size, does nothing.
+  // the caller must make sure nothing in the pool is used beyond the new size
+  // (Allocator::truncate does this); other processes remap the pool the next
+  // time they lock it.
+  void truncate(size_t new_size);
+
   // checks for expansions by other processes. generally you shouldn't need to
   // call this manually; the allocator should do it for you when you lock the
   // pool.
@@ -185,13 +199,45 @@ public:
   // when all processes have closed it.
   static bool delete_pool(const std::string& name, bool file = true);
 
+  // copies the pool's current contents to a new pool with the given name,
+  // backed by the same kind of object as this pool. the copy is made in the
+  // kernel, so its data never passes through this process: it's a
+  // copy-on-write clone (FICLONE) if the filesystem supports it, and falls
+  // back to copy_file_range, then sendfile, then read/write. the new pool must
+  // not exist. this doesn't lock the pool, so the copy is inconsistent if
+  // another process changes the pool during the copy; use
+  // Allocator::clone_to() to get a consistent copy.
+  void clone_to(const std::string& new_name) const;
+
+  // opens a private copy-on-write view of the pool's current contents. the
+  // view is backed by an unlinked clone of the pool (see clone_to), mapped with
+  // MAP_PRIVATE, so changes made through it stay in this process' memory and
+  // are never visible to other processes or written to disk, and changes made
+  // to this pool afterward aren't visible in the view. the view can be used
+  // with an allocator and any structures, and can be expanded. like clone_to,
+  // this doesn't lock the pool; use Allocator::private_view() to get a
+  // consistent view. views can't be cloned or viewed again.
+  std::shared_ptr<Pool> private_view() const;
+  // returns true if this pool is a private view
+  bool is_private_view() const;
+  // returns true if this pool and other are backed by the same file or shared
+  // memory object, so they share their contents and locks. this is true if the
+  // same pool was opened more than once; it's false for a private view and its
+  // source, even though they have the same name.
+  bool shares_data_with(const Pool& other) const;
+
 private:
   struct Data {
     std::atomic<uint64_t> size;
   };
 
+  // private view constructor. takes ownership of fd.
+  Pool(const Pool& source, int fd);
+
   std::string name;
   size_t max_size;
+  bool file;
+  bool private_mapping;
 
   scoped_fd fd;
   mutable size_t pool_size;
@@ -7,23 +7,30 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+#include "Hash.hh"
 
 using namespace std;
 
 namespace sharedstructures {
 
 
-PrefixTree::PrefixTree(shared_ptr<Allocator> allocator) : allocator(allocator) {
+PrefixTree::PrefixTree(shared_ptr<Allocator> allocator) : allocator(allocator),
+    attachments_required(true), applied_sequence_offset(0),
+    applied_sequence(0) {
   auto g = this->allocator->lock(true);
-
-  // we can't use sizeof() here because the Node structure varies in size
-  this->base_offset = this->allocator->allocate_object<TreeBase>(
-      2 * sizeof(uint64_t) + Node::full_size());
+  this->base_offset = this->create_tree_base();
+  this->extension_slot_offset = this->base_offset +
+      offsetof(TreeBase, root) + Node::full_size();
 }
 
 PrefixTree::PrefixTree(shared_ptr<Allocator> allocator, uint64_t base_offset) :
-    allocator(allocator), base_offset(base_offset) {
+    allocator(allocator), base_offset(base_offset),
+    attachments_required(true), applied_sequence_offset(0),
+    applied_sequence(0) {
   if (!this->base_offset) {
     auto g = this->allocator->lock(false);
     this->base_offset = this->allocator->base_object_offset();
@@ -33,12 +40,21 @@ PrefixTree::PrefixTree(shared_ptr<Allocator> allocator, uint64_t base_offset) :
     auto g = this->allocator->lock(true);
     this->base_offset = this->allocator->base_object_offset();
     if (!this->base_offset) {
-      // we can't use sizeof() here because the Node structure varies in size
-      this->base_offset = this->allocator->allocate_object<TreeBase>(
-          2 * sizeof(uint64_t) + Node::full_size());
+      this->base_offset = this->create_tree_base();
       this->allocator->set_base_object_offset(this->base_offset);
     }
   }
+
+  // trees created by versions that didn't have extensions have smaller base
+  // blocks. this doesn't lock the pool, since this constructor can be called
+  // while it's locked (for the dedup index)
+  this->allocator->get_pool()->check_size_and_remap();
+  if (this->allocator->block_size(this->base_offset) >= tree_base_size()) {
+    this->extension_slot_offset = this->base_offset +
+        offsetof(TreeBase, root) + Node::full_size();
+  } else {
+    this->extension_slot_offset = 0;
+  }
 }
 
 
@@ -51,6 +67,123 @@ uint64_t PrefixTree::base() const {
 }
 
 
+void PrefixTree::attach_filter(shared_ptr<Filter> filter, bool populate) {
+  // add the existing keys before attaching the filter, so lookups never see a
+  // partially-populated filter
+  if (filter && populate) {
+    try {
+      for (string k = this->next_key(); ; k = this->next_key(k)) {
+        filter->insert(k);
+      }
+    } catch (const out_of_range& e) { }
+  }
+  this->record_attachment(offsetof(TreeExtension, filter_base),
+      filter ? filter->base() : 0, "filter");
+  this->filter = filter;
+}
+
+shared_ptr<Filter> PrefixTree::get_filter() const {
+  return this->filter;
+}
+
+void PrefixTree::attach_intern_table(shared_ptr<InternTable> table) {
+  this->record_attachment(offsetof(TreeExtension, intern_table_base),
+      table ? table->base() : 0, "intern table");
+  this->intern_table = table;
+}
+
+shared_ptr<InternTable> PrefixTree::get_intern_table() const {
+  return this->intern_table;
+}
+
+void PrefixTree::attach_watch_table(shared_ptr<WatchTable> table) {
+  this->record_attachment(offsetof(TreeExtension, watch_table_base),
+      table ? table->base() : 0, "watch table");
+  this->watch_table = table;
+}
+
+shared_ptr<WatchTable> PrefixTree::get_watch_table() const {
+  return this->watch_table;
+}
+
+void PrefixTree::attach_write_ahead_log(shared_ptr<WriteAheadLog> log) {
+  if (log &&
+      (log->get_allocator()->get_pool() != this->allocator->get_pool())) {
+    throw invalid_argument("write-ahead log must be in the same pool");
+  }
+  this->record_attachment(offsetof(TreeExtension, write_ahead_log_base),
+      log ? log->base() : 0, "write-ahead log");
+  this->write_ahead_log = log;
+}
+
+shared_ptr<WriteAheadLog> PrefixTree::get_write_ahead_log() const {
+  return this->write_ahead_log;
+}
+
+void PrefixTree::attach_expiry_index(shared_ptr<PrefixTree> index) {
+  if (index &&
+      (index->get_allocator()->get_pool() != this->allocator->get_pool())) {
+    throw invalid_argument("expiry index must be in the same pool");
+  }
+  if (index.get() == this) {
+    throw invalid_argument("a tree can\'t be its own expiry index");
+  }
+  this->record_attachment(offsetof(TreeExtension, expiry_index_base),
+      index ? index->base() : 0, "expiry index");
+  this->expiry_index = index;
+}
+
+shared_ptr<PrefixTree> PrefixTree::get_expiry_index() const {
+  return this->expiry_index;
+}
+
+void PrefixTree::attach_cold_tier(shared_ptr<PrefixTree> cold_tier) {
+  if (cold_tier && (cold_tier->get_allocator()->get_pool()->get_name() ==
+      this->allocator->get_pool()->get_name())) {
+    throw invalid_argument("cold tier must be in a different pool");
+  }
+  this->record_attachment(offsetof(TreeExtension, cold_tier_base),
+      cold_tier ? cold_tier->base() : 0, "cold tier");
+  this->cold_tier = cold_tier;
+}
+
+shared_ptr<PrefixTree> PrefixTree::get_cold_tier() const {
+  return this->cold_tier;
+}
+
+void PrefixTree::set_dedup_min_size(size_t min_size) {
+  auto g = this->allocator->lock(true);
+  auto p = this->allocator->get_pool();
+
+  // an old tree can't have shared values, so turning dedup off is a no-op
+  if (!min_size && !this->extension_slot_offset) {
+    return;
+  }
+
+  // the index is kept after dedup is disabled, since the values that are
+  // already shared still have entries in it
+  uint64_t extension_offset = this->writable_extension_offset();
+  if (min_size && !p->at<TreeExtension>(extension_offset)->dedup_index_offset) {
+    uint64_t index_offset = this->create_tree_base();
+    p->at<TreeExtension>(extension_offset)->dedup_index_offset = index_offset;
+  }
+  p->at<TreeExtension>(extension_offset)->dedup_min_size = min_size;
+}
+
+size_t PrefixTree::dedup_min_size() const {
+  auto g = this->allocator->lock(false);
+  return this->extension_field(offsetof(TreeExtension, dedup_min_size));
+}
+
+size_t PrefixTree::shared_value_count() const {
+  auto g = this->allocator->lock(false);
+  uint64_t index_offset = this->extension_field(
+      offsetof(TreeExtension, dedup_index_offset));
+  return index_offset ? this->allocator->get_pool()->at<TreeBase>(
+      index_offset)->item_count : 0;
+}
+
+
 PrefixTree::LookupResult::LookupResult(ResultValueType t) :
     type(t) {
   if (t != ResultValueType::Missing) {
@@ -126,17 +259,33 @@ PrefixTree::CheckRequest::CheckRequest() : key(NULL), key_size(0),
 bool PrefixTree::insert(const void* k, size_t k_size, const void* v,
     size_t v_size, const CheckRequest* check) {
   auto g = this->allocator->lock(true);
+  this->check_attachments();
 
   // if a check was given and it fails, do nothing
   if (check && !this->execute_check(*check)) {
     return false;
   }
 
+  this->add_to_filter(k, k_size);
+  this->notify_watchers(k, k_size);
+  this->log_change(WriteAheadLog::Operation::Insert,
+      WriteAheadLog::ValueType::String, k, k_size, v, v_size);
+
+  // keys in demoted prefixes are written to the cold tier. the check has
+  // already been done, so it isn't passed along
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->insert(k, k_size, v, v_size);
+  }
+
   auto p = this->allocator->get_pool();
 
-  // find and clear the slot offset for the key, creating it if necessary
+  // find and clear the slot offset for the key, creating it if necessary. if
+  // the value is shared, the reference is taken first, so overwriting a key
+  // with the same value doesn't free and recreate the shared buffer
   uint64_t value_slot_offset = this->traverse(k, k_size, true, false, true)
       .value_slot_offset;
+  uint64_t shared_offset = this->acquire_shared_value(v, v_size);
   this->clear_value_slot(value_slot_offset);
 
   // empty strings are stored with no allocated memory (but the type is String)
@@ -154,6 +303,12 @@ bool PrefixTree::insert(const void* k, size_t k_size, const void* v,
     }
     *p->at<uint64_t>(value_slot_offset) = value;
 
+  // long values may be shared with other keys
+  } else if (shared_offset) {
+    *p->at<uint64_t>(value_slot_offset) = (shared_offset << 8) |
+        ((uint64_t)ExtendedValueType::Shared << 3) |
+        (uint64_t)StoredValueType::Extended;
+
   // longer strings require a separate allocated block (and the String type)
   } else {
     uint64_t value_offset = this->allocator->allocate(v_size);
@@ -192,17 +347,43 @@ bool PrefixTree::insert(const void* k, size_t k_size, const struct iovec* iov,
   }
 
   auto g = this->allocator->lock(true);
+  this->check_attachments();
 
   // if a check was given and it fails, do nothing
   if (check && !this->execute_check(*check)) {
     return false;
   }
 
+  this->add_to_filter(k, k_size);
+  this->notify_watchers(k, k_size);
+  if (this->write_ahead_log) {
+    string v;
+    for (size_t x = 0; x < iov_count; x++) {
+      v.append(reinterpret_cast<const char*>(iov[x].iov_base), iov[x].iov_len);
+    }
+    this->log_change(WriteAheadLog::Operation::Insert,
+        WriteAheadLog::ValueType::String, k, k_size, v.data(), v.size());
+  }
+
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->insert(k, k_size, iov, iov_count);
+  }
+
   auto p = this->allocator->get_pool();
 
-  // find and clear the value slot for this key
+  // find and clear the value slot for this key. shared values have to be
+  // hashed and compared contiguously
   uint64_t value_slot_offset = this->traverse(k, k_size, true, false, true)
       .value_slot_offset;
+  uint64_t shared_offset = 0;
+  if (this->should_share_value(v_size)) {
+    string v;
+    for (size_t x = 0; x < iov_count; x++) {
+      v.append(reinterpret_cast<const char*>(iov[x].iov_base), iov[x].iov_len);
+    }
+    shared_offset = this->acquire_shared_value(v.data(), v.size());
+  }
   this->clear_value_slot(value_slot_offset);
 
   // empty strings are stored with no allocated memory (but the type is String)
@@ -222,6 +403,11 @@ bool PrefixTree::insert(const void* k, size_t k_size, const struct iovec* iov,
     }
     *p->at<uint64_t>(value_slot_offset) = value;
 
+  } else if (shared_offset) {
+    *p->at<uint64_t>(value_slot_offset) = (shared_offset << 8) |
+        ((uint64_t)ExtendedValueType::Shared << 3) |
+        (uint64_t)StoredValueType::Extended;
+
   // longer strings require a separate allocated block (and the String type)
   } else {
     uint64_t value_offset = this->allocator->allocate(v_size);
@@ -245,15 +431,75 @@ bool PrefixTree::insert(const string& k, const struct iovec* iov,
   return this->insert(k.data(), k.size(), iov, iov_count, check);
 }
 
+bool PrefixTree::insert_interned(const void* k, size_t k_size, const void* v,
+    size_t v_size, const CheckRequest* check) {
+  if (!this->intern_table) {
+    throw logic_error("no intern table is attached");
+  }
+
+  // intern the value before locking the tree. the table may be in the same pool
+  // and interning a new value takes the write lock, which isn't reentrant. if
+  // the check fails, the value stays in the table, which is harmless
+  uint64_t id = this->intern_table->intern(v, v_size);
+
+  auto g = this->allocator->lock(true);
+  this->check_attachments();
+
+  // if a check was given and it fails, do nothing
+  if (check && !this->execute_check(*check)) {
+    return false;
+  }
+
+  this->add_to_filter(k, k_size);
+  this->notify_watchers(k, k_size);
+  this->log_change(WriteAheadLog::Operation::Insert,
+      WriteAheadLog::ValueType::String, k, k_size, v, v_size);
+
+  // the cold tier doesn't have the intern table, so the value is stored there
+  // as a plain string
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->insert(k, k_size, v, v_size);
+  }
+
+  // find and clear the value slot for this key
+  uint64_t value_slot_offset = this->traverse(k, k_size, true, false, true)
+      .value_slot_offset;
+  this->clear_value_slot(value_slot_offset);
+
+  *this->allocator->get_pool()->at<uint64_t>(value_slot_offset) = (id << 8) |
+      ((uint64_t)ExtendedValueType::Interned << 3) |
+      (uint64_t)StoredValueType::Extended;
+
+  this->increment_item_count(1);
+  return true;
+}
+
+bool PrefixTree::insert_interned(const string& k, const string& v,
+    const CheckRequest* check) {
+  return this->insert_interned(k.data(), k.size(), v.data(), v.size(), check);
+}
+
 bool PrefixTree::insert(const void* k, size_t k_size, int64_t v,
     const CheckRequest* check) {
   auto g = this->allocator->lock(true);
+  this->check_attachments();
 
   // if a check was given and it fails, do nothing
   if (check && !this->execute_check(*check)) {
     return false;
   }
 
+  this->add_to_filter(k, k_size);
+  this->notify_watchers(k, k_size);
+  this->log_change(WriteAheadLog::Operation::Insert,
+      WriteAheadLog::ValueType::Int, k, k_size, &v, sizeof(v));
+
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->insert(k, k_size, v);
+  }
+
   auto p = this->allocator->get_pool();
 
   // find and clear the value slot for this key
@@ -287,12 +533,23 @@ bool PrefixTree::insert(const string& k, int64_t v, const CheckRequest* check) {
 bool PrefixTree::insert(const void* k, size_t k_size, double v,
     const CheckRequest* check) {
   auto g = this->allocator->lock(true);
+  this->check_attachments();
 
   // if a check was given and it fails, do nothing
   if (check && !this->execute_check(*check)) {
     return false;
   }
 
+  this->add_to_filter(k, k_size);
+  this->notify_watchers(k, k_size);
+  this->log_change(WriteAheadLog::Operation::Insert,
+      WriteAheadLog::ValueType::Double, k, k_size, &v, sizeof(v));
+
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->insert(k, k_size, v);
+  }
+
   auto p = this->allocator->get_pool();
 
   // find but don't clear the value slot for this key
@@ -345,12 +602,24 @@ bool PrefixTree::insert(const string& k, double v, const CheckRequest* check) {
 bool PrefixTree::insert(const void* k, size_t k_size, bool v,
     const CheckRequest* check) {
   auto g = this->allocator->lock(true);
+  this->check_attachments();
 
   // if a check was given and it fails, do nothing
   if (check && !this->execute_check(*check)) {
     return false;
   }
 
+  this->add_to_filter(k, k_size);
+  this->notify_watchers(k, k_size);
+  uint8_t v_byte = v;
+  this->log_change(WriteAheadLog::Operation::Insert,
+      WriteAheadLog::ValueType::Bool, k, k_size, &v_byte, sizeof(v_byte));
+
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->insert(k, k_size, v);
+  }
+
   // find and clear the value slot for this key
   uint64_t value_slot_offset = this->traverse(k, k_size, true, false, true)
       .value_slot_offset;
@@ -372,12 +641,23 @@ bool PrefixTree::insert(const string& k, bool v, const CheckRequest* check) {
 bool PrefixTree::insert(const void* k, size_t k_size,
     const CheckRequest* check) {
   auto g = this->allocator->lock(true);
+  this->check_attachments();
 
   // if a check was given and it fails, do nothing
   if (check && !this->execute_check(*check)) {
     return false;
   }
 
+  this->add_to_filter(k, k_size);
+  this->notify_watchers(k, k_size);
+  this->log_change(WriteAheadLog::Operation::Insert,
+      WriteAheadLog::ValueType::Null, k, k_size);
+
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->insert(k, k_size);
+  }
+
   // find and clear the value slot for this key
   uint64_t value_slot_offset = this->traverse(k, k_size, true, false, true)
       .value_slot_offset;
@@ -425,11 +705,21 @@ bool PrefixTree::insert(const string& k, const LookupResult& r,
 
 int64_t PrefixTree::incr(const void* k, size_t k_size, int64_t delta) {
   auto g = this->allocator->lock(true);
+  this->check_attachments();
+  this->add_to_filter(k, k_size);
+  this->notify_watchers(k, k_size);
+  this->log_change(WriteAheadLog::Operation::Incr,
+      WriteAheadLog::ValueType::Int, k, k_size, &delta, sizeof(delta));
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->incr(k, k_size, delta);
+  }
   auto p = this->allocator->get_pool();
 
-  // get or create the value slot
-  uint64_t value_slot_offset = this->traverse(k, k_size, true, false, true)
-      .value_slot_offset;
+  // get or create the value slot. if the key expires, we modify the value it
+  // wraps so it keeps its expiration
+  uint64_t value_slot_offset = this->unexpired_value_slot_offset(
+      this->traverse(k, k_size, true, false, true).value_slot_offset);
   uint64_t contents = *p->at<uint64_t>(value_slot_offset);
   StoredValueType type = this->type_for_contents(contents);
 
@@ -490,11 +780,20 @@ int64_t PrefixTree::incr(const string& k, int64_t delta) {
 
 double PrefixTree::incr(const void* k, size_t k_size, double delta) {
   auto g = this->allocator->lock(true);
+  this->check_attachments();
+  this->add_to_filter(k, k_size);
+  this->notify_watchers(k, k_size);
+  this->log_change(WriteAheadLog::Operation::Incr,
+      WriteAheadLog::ValueType::Double, k, k_size, &delta, sizeof(delta));
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->incr(k, k_size, delta);
+  }
   auto p = this->allocator->get_pool();
 
-  // get or create the value slot
-  uint64_t value_slot_offset = this->traverse(k, k_size, true, false, true)
-      .value_slot_offset;
+  // get or create the value slot (see the int64_t version of incr)
+  uint64_t value_slot_offset = this->unexpired_value_slot_offset(
+      this->traverse(k, k_size, true, false, true).value_slot_offset);
   uint64_t contents = *p->at<uint64_t>(value_slot_offset);
   StoredValueType type = this->type_for_contents(contents);
 
@@ -560,13 +859,23 @@ double PrefixTree::incr(const string& k, double delta) {
 bool PrefixTree::erase(const void* k, size_t k_size,
     const CheckRequest* check) {
   auto g = this->allocator->lock(true);
+  this->check_attachments();
 
   // if a check was given and it fails, do nothing
   if (check && !this->execute_check(*check)) {
     return false;
   }
 
-  auto p = this->allocator->get_pool();
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    if (!cold_tier->erase(k, k_size)) {
+      return false;
+    }
+    this->notify_watchers(k, k_size);
+    this->log_change(WriteAheadLog::Operation::Erase,
+        WriteAheadLog::ValueType::None, k, k_size);
+    return true;
+  }
 
   // find the value slot for this key, tracking the node path as we go
   auto t = this->traverse(k, k_size, true, true, false);
@@ -574,37 +883,22 @@ bool PrefixTree::erase(const void* k, size_t k_size,
     return false; // key already doesn't exist
   }
 
-  // delete the value
-  this->clear_value_slot(t.value_slot_offset);
-
-  // delete all empty nodes on the path, except the root, starting from the leaf
-  while (t.node_offsets.size() > 1) {
-    size_t num_nodes = t.node_offsets.size();
-    Node* parent_node = p->at<Node>(t.node_offsets[num_nodes - 2]);
-    Node* node = p->at<Node>(t.node_offsets.back());
-    if (node->has_children()) {
-      break;
-    }
-
-    // the node has no children, but may have a value. unlink this node from the
-    // parent and move its value to its slot in the parent
-    parent_node->children[node->parent_slot - parent_node->start] = node->value;
-
-    // delete the child node
-    bool node_had_value = node->value != 0;
-    this->allocator->free_object<Node>(t.node_offsets.back());
-    this->increment_node_count(-1);
-
-    // if the node had a value, we're done - the parent node is not empty since
-    // we just put the value there
-    if (node_had_value) {
-      break;
-    }
-
-    t.node_offsets.pop_back();
+  // an expired key is treated as missing, but it's still deleted (and the
+  // deletion logged) so its space is freed. watchers aren't notified, since
+  // the key was already invisible
+  bool expired = !this->unexpired_contents(
+      *this->allocator->get_pool()->at<uint64_t>(t.value_slot_offset));
+  if (!expired) {
+    this->notify_watchers(k, k_size);
   }
+  this->log_change(WriteAheadLog::Operation::Erase,
+      WriteAheadLog::ValueType::None, k, k_size);
 
-  return true;
+  // delete the value, then all empty nodes on the path
+  this->clear_value_slot(t.value_slot_offset);
+  this->delete_empty_nodes(t.node_offsets);
+
+  return !expired;
 }
 
 bool PrefixTree::erase(const string& key, const CheckRequest* check) {
@@ -614,127 +908,630 @@ bool PrefixTree::erase(const string& key, const CheckRequest* check) {
 
 void PrefixTree::clear() {
   auto g = this->allocator->lock(true);
+  this->check_attachments();
+  this->log_change(WriteAheadLog::Operation::Clear,
+      WriteAheadLog::ValueType::None, NULL, 0);
+  if (this->cold_prefix_count()) {
+    this->required_cold_tier()->clear();
+  }
   this->clear_node(this->base_offset + offsetof(TreeBase, root));
+  if (this->expiry_index) {
+    this->expiry_index->clear_node(
+        this->expiry_index->base_offset + offsetof(TreeBase, root));
+  }
+  if (this->watch_table) {
+    this->watch_table->notify_all();
+  }
 }
 
 
-bool PrefixTree::exists(const void* k, size_t k_size) {
-  auto g = this->allocator->lock(false);
-  return this->traverse(k, k_size, true, false).value_slot_offset != 0;
-}
-
-bool PrefixTree::exists(const string& key) {
-  return this->exists(key.data(), key.size());
-}
-
-
-PrefixTree::ResultValueType PrefixTree::type(const void* k,
-    size_t k_size) const {
-  auto g = this->allocator->lock(false);
+bool PrefixTree::set_expiration(const void* k, size_t k_size,
+    uint64_t expiration) {
+  auto g = this->allocator->lock(true);
+  this->check_attachments();
   auto p = this->allocator->get_pool();
 
-  // find the value slot for this key
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    if (!cold_tier->set_expiration(k, k_size, expiration)) {
+      return false;
+    }
+    this->log_change(WriteAheadLog::Operation::SetExpiration,
+        WriteAheadLog::ValueType::Int, k, k_size, &expiration,
+        sizeof(expiration));
+    return true;
+  }
+
   uint64_t value_slot_offset = this->traverse(k, k_size, true, false)
       .value_slot_offset;
-
-  if (!value_slot_offset) {
-    return ResultValueType::Missing;
+  if (!value_slot_offset ||
+      !this->unexpired_contents(*p->at<uint64_t>(value_slot_offset))) {
+    return false;
   }
+  this->log_change(WriteAheadLog::Operation::SetExpiration,
+      WriteAheadLog::ValueType::Int, k, k_size, &expiration,
+      sizeof(expiration));
 
-  // convert the StoredValueType into a ResultValueType
   uint64_t contents = *p->at<uint64_t>(value_slot_offset);
-  switch (this->type_for_contents(contents)) {
-    case StoredValueType::SubNode:
-      return ResultValueType::Missing;
-
-    case StoredValueType::String:
-    case StoredValueType::ShortString:
-      return ResultValueType::String;
-
-    case StoredValueType::Int:
-    case StoredValueType::LongInt:
-      return ResultValueType::Int;
+  if (this->is_expiring_contents(contents)) {
+    // the key already expires; drop its index entry, then either update the
+    // time or unwrap the value
+    uint64_t wrapper_offset = contents >> 8;
+    this->remove_expiry_index_entry(this->expiry_index_entry(
+        p->at<ExpiringValue>(wrapper_offset)->expiration, k, k_size));
+    if (!expiration) {
+      *p->at<uint64_t>(value_slot_offset) =
+          p->at<ExpiringValue>(wrapper_offset)->contents;
+      this->allocator->free(wrapper_offset);
+      return true;
+    }
+    p->at<ExpiringValue>(wrapper_offset)->expiration = expiration;
 
-    case StoredValueType::Double:
-      return ResultValueType::Double;
+  } else if (expiration) {
+    // wrap the value. the slot is changed after the wrapper is written, so
+    // the value is never missing
+    uint64_t wrapper_offset = this->allocator->allocate_object
+        <ExpiringValue, uint64_t, uint64_t>(expiration, contents);
+    *p->at<uint64_t>(value_slot_offset) = (wrapper_offset << 8) |
+        ((uint64_t)ExtendedValueType::Expiring << 3) |
+        (uint64_t)StoredValueType::Extended;
 
-    case StoredValueType::Trivial:
-      if (this->value_for_contents(contents) == (2 << 3)) {
-        return ResultValueType::Null;
-      }
-      return ResultValueType::Bool;
+  } else {
+    return true; // the key already doesn't expire
   }
-  throw invalid_argument("unknown stored value type");
-}
 
-PrefixTree::ResultValueType PrefixTree::type(const string& key) const {
-  return this->type(key.data(), key.size());
+  this->add_expiry_index_entry(this->expiry_index_entry(expiration, k,
+      k_size));
+  return true;
 }
 
+bool PrefixTree::set_expiration(const string& k, uint64_t expiration) {
+  return this->set_expiration(k.data(), k.size(), expiration);
+}
 
-PrefixTree::LookupResult PrefixTree::at(const void* k, size_t k_size) const {
+uint64_t PrefixTree::expiration(const void* k, size_t k_size) const {
   auto g = this->allocator->lock(false);
   auto p = this->allocator->get_pool();
 
-  // find the value slot for this key
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->expiration(k, k_size);
+  }
+
   uint64_t value_slot_offset = this->traverse(k, k_size, true, false)
       .value_slot_offset;
   if (!value_slot_offset) {
     throw out_of_range(string((const char*)k, k_size));
   }
-
-  // get the contents and convert them into something we can return
   uint64_t contents = *p->at<uint64_t>(value_slot_offset);
-  if (!contents) {
+  if (!this->unexpired_contents(contents)) {
     throw out_of_range(string((const char*)k, k_size));
   }
-  return this->lookup_result_for_contents(contents);
+  if (!this->is_expiring_contents(contents)) {
+    return 0;
+  }
+  return p->at<ExpiringValue>(contents >> 8)->expiration;
 }
 
-PrefixTree::LookupResult PrefixTree::at(const string& key) const {
-  return this->at(key.data(), key.size());
+uint64_t PrefixTree::expiration(const string& k) const {
+  return this->expiration(k.data(), k.size());
 }
 
+size_t PrefixTree::reclaim_expired(size_t max_entries, uint64_t now_usecs) {
+  if (!this->expiry_index) {
+    throw logic_error("no expiry index is attached");
+  }
+  if (!now_usecs) {
+    now_usecs = now();
+  }
 
-string PrefixTree::next_key(const void* current, size_t size) const {
-  return this->next_key_value_internal(current, size, false).first;
-}
+  auto g = this->allocator->lock(true);
+  this->check_attachments();
+  auto p = this->allocator->get_pool();
 
-string PrefixTree::next_key(const string& current) const {
-  return this->next_key_value_internal(current.data(), current.size(),
-      false).first;
-}
+  uint64_t index_root_offset = this->expiry_index->base_offset +
+      offsetof(TreeBase, root);
+  size_t keys_erased = 0;
+  for (; max_entries; max_entries--) {
+    // the first entry in the index is the next key to expire
+    string entry;
+    if (!this->expiry_index->first_key_in_subtree(index_root_offset, entry)) {
+      break;
+    }
+    if (entry.size() < sizeof(uint64_t)) {
+      throw runtime_error("expiry index contains an invalid entry");
+    }
+    uint64_t expiration = 0;
+    for (size_t x = 0; x < sizeof(uint64_t); x++) {
+      expiration = (expiration << 8) | (uint8_t)entry[x];
+    }
+    if (expiration > now_usecs) {
+      break;
+    }
+    this->remove_expiry_index_entry(entry);
+
+    // the key may have been erased, overwritten or given another expiration
+    // since this entry was added; if so, the entry is stale
+    const char* k = entry.data() + sizeof(uint64_t);
+    size_t k_size = entry.size() - sizeof(uint64_t);
+    auto t = this->traverse(k, k_size, true, true, false);
+    if (!t.value_slot_offset) {
+      continue;
+    }
+    uint64_t contents = *p->at<uint64_t>(t.value_slot_offset);
+    if (!this->is_expiring_contents(contents) ||
+        (p->at<ExpiringValue>(contents >> 8)->expiration != expiration)) {
+      continue;
+    }
 
-pair<string, PrefixTree::LookupResult> PrefixTree::next_key_value(
-    const void* current, size_t size) const {
-  return this->next_key_value_internal(current, size, true);
+    this->notify_watchers(k, k_size);
+    this->log_change(WriteAheadLog::Operation::Erase,
+        WriteAheadLog::ValueType::None, k, k_size);
+    this->clear_value_slot(t.value_slot_offset);
+    this->delete_empty_nodes(t.node_offsets);
+    keys_erased++;
+  }
+  return keys_erased;
 }
 
-pair<string, PrefixTree::LookupResult> PrefixTree::next_key_value(
-    const string& current) const {
-  return this->next_key_value_internal(current.data(), current.size(), true);
-}
 
-PrefixTreeIterator PrefixTree::begin() const {
-  return PrefixTreeIterator(this, NULL);
+static void check_prefixes_for_move(const void* a, size_t a_size,
+    const void* b, size_t b_size) {
+  if (!a_size || !b_size) {
+    throw invalid_argument("prefixes may not be empty");
+  }
+  if (!memcmp(a, b, min(a_size, b_size))) {
+    throw invalid_argument("one prefix may not be a prefix of the other");
+  }
 }
 
-PrefixTreeIterator PrefixTree::end() const {
-  return PrefixTreeIterator(this);
-}
+bool PrefixTree::move_prefix(const void* src, size_t src_size,
+    const void* dst, size_t dst_size) {
+  check_prefixes_for_move(src, src_size, dst, dst_size);
 
+  auto g = this->allocator->lock(true);
+  this->check_attachments();
+  auto p = this->allocator->get_pool();
 
-size_t PrefixTree::size() const {
-  auto g = this->allocator->lock(false);
-  return this->allocator->get_pool()->at<TreeBase>(
-      this->base_offset)->item_count;
-}
+  // the keys in the cold tier would keep their old names
+  if (this->cold_prefix_count()) {
+    throw logic_error("can\'t move prefixes in a tree with demoted prefixes");
+  }
 
-size_t PrefixTree::node_size() const {
-  auto g = this->allocator->lock(false);
-  return this->allocator->get_pool()->at<TreeBase>(
-      this->base_offset)->node_count;
-}
+  uint64_t src_slot_offset = this->prefix_slot_offset(src, src_size, false);
+  if (!src_slot_offset) {
+    return false;
+  }
+  uint64_t contents = *p->at<uint64_t>(src_slot_offset);
+
+  // the keys must be in the filter before they're visible under dst
+  if (this->filter) {
+    string prefix(reinterpret_cast<const char*>(dst), dst_size);
+    this->add_subtree_to_filter(prefix, contents);
+  }
+  this->log_change(WriteAheadLog::Operation::MovePrefix,
+      WriteAheadLog::ValueType::String, src, src_size, dst, dst_size);
+
+  // the index entries for expiring keys in the subtree are renamed along with
+  // the keys, or reclaim_expired would treat them as stale. the keys under dst
+  // that are replaced leave stale entries, which are skipped as usual
+  if (this->expiry_index) {
+    vector<string> old_entries, new_entries;
+    string prefix(reinterpret_cast<const char*>(src), src_size);
+    this->expiry_index_entries_for_subtree(prefix, contents, old_entries);
+    prefix.assign(reinterpret_cast<const char*>(dst), dst_size);
+    this->expiry_index_entries_for_subtree(prefix, contents, new_entries);
+    for (const auto& entry : old_entries) {
+      this->remove_expiry_index_entry(entry);
+    }
+    for (const auto& entry : new_entries) {
+      this->add_expiry_index_entry(entry);
+    }
+  }
+
+  // creating the path to dst can replace nodes on the path to src (if they're
+  // shared and need to be extended), so we have to find src's slot again
+  // afterward. the subtree itself doesn't move
+  uint64_t dst_slot_offset = this->prefix_slot_offset(dst, dst_size, true);
+  this->clear_value_slot(dst_slot_offset);
+  src_slot_offset = this->prefix_slot_offset(src, src_size, false);
+
+  *p->at<uint64_t>(src_slot_offset) = 0;
+  this->set_prefix_slot(dst_slot_offset,
+      reinterpret_cast<const uint8_t*>(dst)[dst_size - 1], contents);
+  this->delete_empty_nodes_for_prefix(src, src_size);
+
+  if (this->watch_table) {
+    this->watch_table->notify_all();
+  }
+  return true;
+}
+
+bool PrefixTree::move_prefix(const string& src, const string& dst) {
+  return this->move_prefix(src.data(), src.size(), dst.data(), dst.size());
+}
+
+bool PrefixTree::swap_prefixes(const void* a, size_t a_size, const void* b,
+    size_t b_size) {
+  check_prefixes_for_move(a, a_size, b, b_size);
+
+  auto g = this->allocator->lock(true);
+  this->check_attachments();
+  auto p = this->allocator->get_pool();
+
+  if (this->cold_prefix_count()) {
+    throw logic_error("can\'t move prefixes in a tree with demoted prefixes");
+  }
+
+  uint64_t a_slot_offset = this->prefix_slot_offset(a, a_size, false);
+  uint64_t b_slot_offset = this->prefix_slot_offset(b, b_size, false);
+  uint64_t a_contents = a_slot_offset ? *p->at<uint64_t>(a_slot_offset) : 0;
+  uint64_t b_contents = b_slot_offset ? *p->at<uint64_t>(b_slot_offset) : 0;
+  if (!a_contents && !b_contents) {
+    return false;
+  }
+
+  if (this->filter) {
+    string prefix(reinterpret_cast<const char*>(b), b_size);
+    this->add_subtree_to_filter(prefix, a_contents);
+    prefix.assign(reinterpret_cast<const char*>(a), a_size);
+    this->add_subtree_to_filter(prefix, b_contents);
+  }
+  this->log_change(WriteAheadLog::Operation::SwapPrefixes,
+      WriteAheadLog::ValueType::String, a, a_size, b, b_size);
+
+  // as in move_prefix, the expiry index entries move with the keys. all the
+  // old entries are removed first, since a key can have the same name and
+  // expiration before and after the swap
+  if (this->expiry_index) {
+    vector<string> old_entries, new_entries;
+    string a_prefix(reinterpret_cast<const char*>(a), a_size);
+    string b_prefix(reinterpret_cast<const char*>(b), b_size);
+    this->expiry_index_entries_for_subtree(a_prefix, a_contents, old_entries);
+    this->expiry_index_entries_for_subtree(b_prefix, b_contents, old_entries);
+    this->expiry_index_entries_for_subtree(b_prefix, a_contents, new_entries);
+    this->expiry_index_entries_for_subtree(a_prefix, b_contents, new_entries);
+    for (const auto& entry : old_entries) {
+      this->remove_expiry_index_entry(entry);
+    }
+    for (const auto& entry : new_entries) {
+      this->add_expiry_index_entry(entry);
+    }
+  }
+
+  // as in move_prefix, creating b's path can replace nodes on a's path, so we
+  // find a's slot again afterward. this doesn't create anything the second time
+  this->prefix_slot_offset(a, a_size, true);
+  b_slot_offset = this->prefix_slot_offset(b, b_size, true);
+  a_slot_offset = this->prefix_slot_offset(a, a_size, true);
+
+  this->set_prefix_slot(a_slot_offset,
+      reinterpret_cast<const uint8_t*>(a)[a_size - 1], b_contents);
+  this->set_prefix_slot(b_slot_offset,
+      reinterpret_cast<const uint8_t*>(b)[b_size - 1], a_contents);
+  if (!a_contents) {
+    this->delete_empty_nodes_for_prefix(a, a_size);
+  }
+  if (!b_contents) {
+    this->delete_empty_nodes_for_prefix(b, b_size);
+  }
+
+  if (this->watch_table) {
+    this->watch_table->notify_all();
+  }
+  return true;
+}
+
+bool PrefixTree::swap_prefixes(const string& a, const string& b) {
+  return this->swap_prefixes(a.data(), a.size(), b.data(), b.size());
+}
+
+
+size_t PrefixTree::demote_prefix(const void* prefix, size_t p_size) {
+  if (!p_size) {
+    throw invalid_argument("prefix may not be empty");
+  }
+  if (!this->cold_tier) {
+    throw logic_error("no cold tier is attached");
+  }
+
+  auto g = this->allocator->lock(true);
+  this->check_attachments();
+  auto p = this->allocator->get_pool();
+
+  if (this->cold_tier_for(prefix, p_size)) {
+    return 0; // the keys are already in the cold tier
+  }
+  uint64_t slot_offset = this->prefix_slot_offset(prefix, p_size, false);
+  if (!slot_offset) {
+    return 0;
+  }
+  uint64_t contents = *p->at<uint64_t>(slot_offset);
+  if (this->cold_prefix_count() && this->subtree_has_cold_prefixes(contents)) {
+    throw invalid_argument("prefix contains a demoted prefix");
+  }
+  // this throws for trees that can't record cold prefixes, so do it before
+  // changing anything
+  uint64_t extension_offset = this->writable_extension_offset();
+  this->log_change(WriteAheadLog::Operation::DemotePrefix,
+      WriteAheadLog::ValueType::None, prefix, p_size);
+
+  // copy the subtree into the cold tier and link it in there before replacing
+  // it here, so the keys are always in one tier or the other
+  // the expiry index entries for the subtree's expiring keys move to the cold
+  // tier's index (if it has one), so the cold tier can reclaim them
+  uint8_t slot = reinterpret_cast<const uint8_t*>(prefix)[p_size - 1];
+  PrefixTree* cold_tier = this->cold_tier.get();
+  vector<string> expiry_entries;
+  string prefix_str(reinterpret_cast<const char*>(prefix), p_size);
+  this->expiry_index_entries_for_subtree(prefix_str, contents, expiry_entries);
+  size_t item_count = 0, node_count = 0;
+  {
+    auto cold_g = cold_tier->allocator->lock(true);
+    uint64_t cold_contents = cold_tier->copy_contents_from(*this, contents,
+        slot, &item_count, &node_count);
+    uint64_t cold_slot_offset = cold_tier->prefix_slot_offset(prefix, p_size,
+        true);
+    cold_tier->clear_value_slot(cold_slot_offset);
+    cold_tier->set_prefix_slot(cold_slot_offset, slot, cold_contents);
+    cold_tier->increment_item_count(item_count);
+    cold_tier->increment_node_count(node_count);
+    for (const auto& entry : expiry_entries) {
+      cold_tier->add_expiry_index_entry(entry);
+    }
+  }
+  for (const auto& entry : expiry_entries) {
+    this->remove_expiry_index_entry(entry);
+  }
+
+  // clearing the subtree doesn't reallocate the node that contains its slot
+  this->clear_value_slot(slot_offset);
+  *p->at<uint64_t>(slot_offset) =
+      ((uint64_t)ExtendedValueType::ColdSubtree << 3) |
+      (uint64_t)StoredValueType::Extended;
+  p->at<TreeExtension>(extension_offset)->cold_prefix_count++;
+  return item_count;
+}
+
+size_t PrefixTree::demote_prefix(const string& prefix) {
+  return this->demote_prefix(prefix.data(), prefix.size());
+}
+
+size_t PrefixTree::promote_prefix(const void* prefix, size_t p_size) {
+  if (!p_size) {
+    throw invalid_argument("prefix may not be empty");
+  }
+
+  auto g = this->allocator->lock(true);
+  this->check_attachments();
+  auto p = this->allocator->get_pool();
+
+  uint64_t slot_offset = this->prefix_slot_offset(prefix, p_size, false);
+  if (!slot_offset ||
+      !this->is_cold_subtree_contents(*p->at<uint64_t>(slot_offset))) {
+    if (this->cold_tier_for(prefix, p_size)) {
+      throw invalid_argument("prefix is within a demoted prefix");
+    }
+    return 0;
+  }
+
+  // as in demote_prefix, the keys are linked in here before they're deleted
+  // from the cold tier. copying doesn't reallocate any existing nodes, so
+  // slot_offset stays valid
+  uint8_t slot = reinterpret_cast<const uint8_t*>(prefix)[p_size - 1];
+  PrefixTree* cold_tier = this->required_cold_tier();
+  this->log_change(WriteAheadLog::Operation::PromotePrefix,
+      WriteAheadLog::ValueType::None, prefix, p_size);
+  size_t item_count = 0, node_count = 0;
+  uint64_t contents = 0;
+  {
+    auto cold_g = cold_tier->allocator->lock(true);
+    uint64_t cold_slot_offset = cold_tier->prefix_slot_offset(prefix, p_size,
+        false);
+    vector<string> expiry_entries;
+    if (cold_slot_offset) {
+      uint64_t cold_contents =
+          *cold_tier->allocator->get_pool()->at<uint64_t>(cold_slot_offset);
+      string prefix_str(reinterpret_cast<const char*>(prefix), p_size);
+      cold_tier->expiry_index_entries_for_subtree(prefix_str, cold_contents,
+          expiry_entries);
+      contents = this->copy_contents_from(*cold_tier, cold_contents, slot,
+          &item_count, &node_count);
+    }
+    for (const auto& entry : expiry_entries) {
+      this->add_expiry_index_entry(entry);
+      cold_tier->remove_expiry_index_entry(entry);
+    }
+
+    this->set_prefix_slot(slot_offset, slot, contents);
+    this->increment_item_count(item_count);
+    this->increment_node_count(node_count);
+    p->at<TreeExtension>(
+        this->writable_extension_offset())->cold_prefix_count--;
+
+    if (cold_slot_offset) {
+      cold_tier->clear_value_slot(cold_slot_offset);
+      cold_tier->delete_empty_nodes_for_prefix(prefix, p_size);
+    }
+  }
+
+  if (!contents) {
+    this->delete_empty_nodes_for_prefix(prefix, p_size);
+  }
+  return item_count;
+}
+
+size_t PrefixTree::promote_prefix(const string& prefix) {
+  return this->promote_prefix(prefix.data(), prefix.size());
+}
+
+
+bool PrefixTree::exists(const void* k, size_t k_size) {
+  if (!this->may_contain(k, k_size)) {
+    return false;
+  }
+
+  auto g = this->allocator->lock(false);
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->exists(k, k_size);
+  }
+  uint64_t value_slot_offset = this->traverse(k, k_size, true, false)
+      .value_slot_offset;
+  return value_slot_offset && this->unexpired_contents(
+      *this->allocator->get_pool()->at<uint64_t>(value_slot_offset));
+}
+
+bool PrefixTree::exists(const string& key) {
+  return this->exists(key.data(), key.size());
+}
+
+
+PrefixTree::ResultValueType PrefixTree::type(const void* k,
+    size_t k_size) const {
+  if (!this->may_contain(k, k_size)) {
+    return ResultValueType::Missing;
+  }
+
+  auto g = this->allocator->lock(false);
+  auto p = this->allocator->get_pool();
+
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->type(k, k_size);
+  }
+
+  // find the value slot for this key
+  uint64_t value_slot_offset = this->traverse(k, k_size, true, false)
+      .value_slot_offset;
+
+  if (!value_slot_offset) {
+    return ResultValueType::Missing;
+  }
+
+  // convert the StoredValueType into a ResultValueType. expired keys are
+  // missing (their contents are 0, which is an empty SubNode slot)
+  uint64_t contents = this->unexpired_contents(
+      *p->at<uint64_t>(value_slot_offset));
+  switch (this->type_for_contents(contents)) {
+    case StoredValueType::SubNode:
+      return ResultValueType::Missing;
+
+    case StoredValueType::String:
+    case StoredValueType::ShortString:
+      return ResultValueType::String;
+
+    case StoredValueType::Int:
+    case StoredValueType::LongInt:
+      return ResultValueType::Int;
+
+    case StoredValueType::Double:
+      return ResultValueType::Double;
+
+    case StoredValueType::Trivial:
+      if (this->value_for_contents(contents) == (2 << 3)) {
+        return ResultValueType::Null;
+      }
+      return ResultValueType::Bool;
+
+    case StoredValueType::Extended:
+      switch (this->extended_type_for_contents(contents)) {
+        case ExtendedValueType::Interned:
+        case ExtendedValueType::Shared:
+          return ResultValueType::String;
+        case ExtendedValueType::Expiring:
+          break; // unexpired_contents() already unwrapped this
+        case ExtendedValueType::ColdSubtree:
+          break; // cold_tier_for() already found this
+      }
+      break;
+  }
+  throw invalid_argument("unknown stored value type");
+}
+
+PrefixTree::ResultValueType PrefixTree::type(const string& key) const {
+  return this->type(key.data(), key.size());
+}
+
+
+PrefixTree::LookupResult PrefixTree::at(const void* k, size_t k_size) const {
+  if (!this->may_contain(k, k_size)) {
+    throw out_of_range(string((const char*)k, k_size));
+  }
+
+  auto g = this->allocator->lock(false);
+  auto p = this->allocator->get_pool();
+
+  PrefixTree* cold_tier = this->cold_tier_for(k, k_size);
+  if (cold_tier) {
+    return cold_tier->at(k, k_size);
+  }
+
+  // find the value slot for this key
+  uint64_t value_slot_offset = this->traverse(k, k_size, true, false)
+      .value_slot_offset;
+  if (!value_slot_offset) {
+    throw out_of_range(string((const char*)k, k_size));
+  }
+
+  // get the contents and convert them into something we can return
+  uint64_t contents = this->unexpired_contents(
+      *p->at<uint64_t>(value_slot_offset));
+  if (!contents) {
+    throw out_of_range(string((const char*)k, k_size));
+  }
+  return this->lookup_result_for_contents(contents);
+}
+
+PrefixTree::LookupResult PrefixTree::at(const string& key) const {
+  return this->at(key.data(), key.size());
+}
+
+
+string PrefixTree::next_key(const void* current, size_t size) const {
+  return this->next_key_value_internal(current, size, false).first;
+}
+
+string PrefixTree::next_key(const string& current) const {
+  return this->next_key_value_internal(current.data(), current.size(),
+      false).first;
+}
+
+pair<string, PrefixTree::LookupResult> PrefixTree::next_key_value(
+    const void* current, size_t size) const {
+  return this->next_key_value_internal(current, size, true);
+}
+
+pair<string, PrefixTree::LookupResult> PrefixTree::next_key_value(
+    const string& current) const {
+  return this->next_key_value_internal(current.data(), current.size(), true);
+}
+
+PrefixTreeIterator PrefixTree::begin() const {
+  return PrefixTreeIterator(this, NULL);
+}
+
+PrefixTreeIterator PrefixTree::end() const {
+  return PrefixTreeIterator(this);
+}
+
+
+size_t PrefixTree::size() const {
+  auto g = this->allocator->lock(false);
+  const TreeBase* base = this->allocator->get_pool()->at<TreeBase>(
+      this->base_offset);
+  size_t ret = base->item_count;
+  if (this->cold_prefix_count()) {
+    ret += this->required_cold_tier()->size();
+  }
+  return ret;
+}
+
+size_t PrefixTree::node_size() const {
+  auto g = this->allocator->lock(false);
+  return this->allocator->get_pool()->at<TreeBase>(
+      this->base_offset)->node_count;
+}
 
 size_t PrefixTree::bytes_for_contents(uint64_t contents) const {
   auto p = this->allocator->get_pool();
@@ -758,14 +1555,37 @@ size_t PrefixTree::bytes_for_contents(uint64_t contents) const {
     }
 
     case StoredValueType::String: {
+      // empty strings have no allocated memory
       uint64_t data_offset = this->value_for_contents(contents);
+      if (!data_offset) {
+        return sizeof(uint64_t);
+      }
       return sizeof(uint64_t) + this->allocator->block_size(data_offset);
     }
 
+    case StoredValueType::Extended:
+      if (this->is_expiring_contents(contents)) {
+        // the wrapper contains the wrapped value's slot, which
+        // bytes_for_contents also counts, so the two cancel out
+        uint64_t wrapper_offset = contents >> 8;
+        return this->allocator->block_size(wrapper_offset) +
+            this->bytes_for_contents(
+            p->at<ExpiringValue>(wrapper_offset)->contents);
+      }
+      if (this->is_shared_contents(contents)) {
+        // each key that refers to a shared value is charged an equal part of
+        // it, so the parts add up to the whole block
+        uint64_t shared_offset = contents >> 8;
+        return sizeof(uint64_t) + this->allocator->block_size(shared_offset) /
+            p->at<SharedValue>(shared_offset)->refcount;
+      }
+      return sizeof(uint64_t);
+
     case StoredValueType::Int:
     case StoredValueType::Trivial:
     case StoredValueType::ShortString:
-      // these are stored only in the slot
+      // these are stored only in the slot (as are interned strings, which are
+      // shared, so we don't count them against any one key)
       return sizeof(uint64_t);
 
     case StoredValueType::LongInt:
@@ -844,6 +1664,287 @@ size_t PrefixTree::nodes_for_prefix(const void* prefix, size_t p_size) const {
 }
 
 
+uint64_t PrefixTree::rebuild_into(shared_ptr<Allocator> allocator) const {
+  if (allocator->get_pool()->get_name() ==
+      this->allocator->get_pool()->get_name()) {
+    throw invalid_argument("can\'t rebuild a tree into its own pool");
+  }
+
+  PrefixTree new_tree(allocator);
+  {
+    auto g = this->allocator->lock(false);
+    auto new_g = allocator->lock(true);
+    auto p = this->allocator->get_pool();
+    auto new_p = allocator->get_pool();
+
+    // the root node always has all 256 slots, so it's copied as-is. the new
+    // root's pointer is invalidated by each copy, since the copies allocate
+    size_t item_count = 0, node_count = 1;
+    const Node* root = p->at<Node>(this->base_offset + offsetof(TreeBase, root));
+    uint64_t new_root_offset = new_tree.base_offset + offsetof(TreeBase, root);
+    uint64_t value = new_tree.copy_contents_from(*this, root->value, 0,
+        &item_count, &node_count);
+    new_p->at<Node>(new_root_offset)->value = value;
+    for (uint16_t x = 0; x < 0x100; x++) {
+      uint64_t contents = new_tree.copy_contents_from(*this, root->children[x],
+          x, &item_count, &node_count);
+      new_p->at<Node>(new_root_offset)->children[x] = contents;
+    }
+
+    TreeBase* new_base = new_p->at<TreeBase>(new_tree.base_offset);
+    new_base->item_count = item_count;
+    new_base->node_count = node_count;
+
+    if (!allocator->base_object_offset()) {
+      allocator->set_base_object_offset(new_tree.base_offset);
+    }
+  }
+  return new_tree.base_offset;
+}
+
+size_t PrefixTree::compact_nodes() {
+  auto g = this->allocator->lock(true);
+  return this->compact_child_nodes(this->base_offset + offsetof(TreeBase, root));
+}
+
+bool PrefixTree::relocate_blocks(uint64_t limit, size_t* max_blocks) {
+  // the root node is part of the tree's base, so only its value and children
+  // can move. the extension and the empty key are the first position in each
+  // pass
+  uint64_t root_offset = this->base_offset + offsetof(TreeBase, root);
+  bool resuming = !this->relocation_cursor.empty();
+  if (!resuming) {
+    if (!*max_blocks) {
+      return false;
+    }
+    (*max_blocks)--;
+    if (this->extension_slot_offset) {
+      auto p = this->allocator->get_pool();
+      uint64_t extension_offset = *p->at<uint64_t>(this->extension_slot_offset);
+      if (extension_offset) {
+        extension_offset = this->allocator->relocate(extension_offset, limit);
+        *p->at<uint64_t>(this->extension_slot_offset) = extension_offset;
+      }
+    }
+    this->relocate_contents(root_offset + offsetof(Node, value), limit);
+  }
+
+  string key;
+  if (!this->relocate_subtree(root_offset, key, resuming, limit, max_blocks)) {
+    return false;
+  }
+  this->relocation_cursor.clear();
+  return true;
+}
+
+uint64_t PrefixTree::copy_contents_from(const PrefixTree& source,
+    uint64_t contents, uint8_t parent_slot, size_t* item_count,
+    size_t* node_count) {
+  if (!contents) {
+    return 0;
+  }
+
+  auto source_p = source.allocator->get_pool();
+  auto p = this->allocator->get_pool();
+  switch (this->type_for_contents(contents)) {
+    case StoredValueType::SubNode: {
+      // the source pool doesn't change during the copy, so this pointer stays
+      // valid
+      const Node* node = source_p->at<Node>(contents);
+      int16_t start = -1, end = -1;
+      for (uint16_t x = node->start; x <= node->end; x++) {
+        if (node->children[x - node->start]) {
+          if (start < 0) {
+            start = x;
+          }
+          end = x;
+        }
+      }
+
+      // a node with no children is replaced by its value (if any), as erase()
+      // would have done
+      if (start < 0) {
+        return this->copy_contents_from(source, node->value, 0, item_count,
+            node_count);
+      }
+
+      uint64_t new_node_offset = this->allocator->allocate_object
+          <Node, uint8_t, uint8_t, uint8_t, uint64_t>(
+          start, end, parent_slot, 0, Node::size_for_range(start, end));
+      (*node_count)++;
+
+      uint64_t value = this->copy_contents_from(source, node->value, 0,
+          item_count, node_count);
+      p->at<Node>(new_node_offset)->value = value;
+      for (uint16_t x = start; x <= end; x++) {
+        uint64_t child_contents = this->copy_contents_from(source,
+            node->children[x - node->start], x, item_count, node_count);
+        p->at<Node>(new_node_offset)->children[x - start] = child_contents;
+      }
+      return new_node_offset;
+    }
+
+    case StoredValueType::String:
+    case StoredValueType::LongInt:
+    case StoredValueType::Double: {
+      // these types all point to a buffer, which may be null (for empty
+      // strings and zero-valued doubles)
+      (*item_count)++;
+      uint64_t value_offset = this->value_for_contents(contents);
+      if (!value_offset) {
+        return contents;
+      }
+      size_t size = source.allocator->block_size(value_offset);
+      uint64_t new_value_offset = this->allocator->allocate(size);
+      memcpy(p->at<char>(new_value_offset), source_p->at<char>(value_offset),
+          size);
+      return new_value_offset | (contents & 7);
+    }
+
+    case StoredValueType::Int:
+    case StoredValueType::Trivial:
+    case StoredValueType::ShortString:
+      (*item_count)++;
+      return contents;
+
+    case StoredValueType::Extended: {
+      // demoted prefixes are copied as markers, so the copy uses the same cold
+      // tier
+      if (source.is_cold_subtree_contents(contents)) {
+        p->at<TreeExtension>(
+            this->writable_extension_offset())->cold_prefix_count++;
+        return contents;
+      }
+
+      // expiring values are copied with their expirations (even if they have
+      // already expired), but the copy's expirations aren't indexed here;
+      // demote_prefix and promote_prefix index them
+      if (source.is_expiring_contents(contents)) {
+        const ExpiringValue* wrapper = source_p->at<ExpiringValue>(
+            contents >> 8);
+        uint64_t new_contents = this->copy_contents_from(source,
+            wrapper->contents, 0, item_count, node_count);
+        uint64_t new_wrapper_offset = this->allocator->allocate_object
+            <ExpiringValue, uint64_t, uint64_t>(wrapper->expiration,
+            new_contents);
+        return (new_wrapper_offset << 8) | (contents & 0xFF);
+      }
+
+      // the destination doesn't have the source's intern table or dedup index,
+      // so interned and shared values become ordinary strings
+      (*item_count)++;
+      string value = source.lookup_result_for_contents(contents).as_string;
+      if (value.empty()) {
+        return (uint64_t)StoredValueType::String;
+      }
+      if (value.size() < 8) {
+        uint64_t new_contents = ((uint64_t)value.size() << 3) |
+            (uint64_t)StoredValueType::ShortString;
+        for (uint8_t x = 0, shift = 56; x < value.size(); x++, shift -= 8) {
+          new_contents |= ((uint64_t)(uint8_t)value[x]) << shift;
+        }
+        return new_contents;
+      }
+      uint64_t new_value_offset = this->allocator->allocate(value.size());
+      memcpy(p->at<char>(new_value_offset), value.data(), value.size());
+      return new_value_offset | (uint64_t)StoredValueType::String;
+    }
+
+    default:
+      throw out_of_range("unknown value type");
+  }
+}
+
+uint64_t PrefixTree::relocate_contents(uint64_t slot_offset, uint64_t limit) {
+  // relocation never resizes the pool, so pool pointers stay valid here
+  auto p = this->allocator->get_pool();
+  uint64_t* slot = p->at<uint64_t>(slot_offset);
+  uint64_t contents = *slot;
+
+  StoredValueType type = this->type_for_contents(contents);
+  uint64_t offset;
+  if (type == StoredValueType::SubNode) {
+    offset = contents;
+  } else if ((type == StoredValueType::String) ||
+             (type == StoredValueType::LongInt) ||
+             (type == StoredValueType::Double)) {
+    offset = this->value_for_contents(contents);
+  } else if (this->is_expiring_contents(contents)) {
+    // move the wrapper, then the value it wraps
+    uint64_t wrapper_offset = contents >> 8;
+    uint64_t new_wrapper_offset = this->allocator->relocate(wrapper_offset,
+        limit);
+    if (new_wrapper_offset != wrapper_offset) {
+      contents = (new_wrapper_offset << 8) | (contents & 0xFF);
+      *slot = contents;
+    }
+    this->relocate_contents(new_wrapper_offset +
+        offsetof(ExpiringValue, contents), limit);
+    return contents;
+  } else {
+    // the value is stored in the slot, or it's a shared value, which can't be
+    // moved because other slots (that we don't know about) refer to it
+    return contents;
+  }
+  if (!offset) {
+    return contents;
+  }
+
+  uint64_t new_offset = this->allocator->relocate(offset, limit);
+  if (new_offset != offset) {
+    contents = new_offset | (contents & 7);
+    *slot = contents;
+  }
+
+  // a node's value slot never contains a subnode, so this doesn't recur further
+  if (type == StoredValueType::SubNode) {
+    this->relocate_contents(new_offset + offsetof(Node, value), limit);
+  }
+  return contents;
+}
+
+bool PrefixTree::relocate_subtree(uint64_t node_offset, string& key,
+    bool resuming, uint64_t limit, size_t* max_blocks) {
+  auto p = this->allocator->get_pool();
+  const string& cursor = this->relocation_cursor;
+
+  // if resuming, the cursor is a key below this node; skip the slots before it
+  uint16_t start = resuming ? (uint8_t)cursor[key.size()] : 0;
+  const Node* node = p->at<Node>(node_offset);
+  for (uint16_t x = max<uint16_t>(start, node->start); x <= node->end; x++) {
+    uint64_t slot_offset = node_offset + offsetof(Node, children) +
+        (x - node->start) * sizeof(uint64_t);
+    uint64_t contents = *p->at<uint64_t>(slot_offset);
+    if (!contents) {
+      continue;
+    }
+
+    // the slot itself was visited in an earlier call if the cursor is below it
+    key.push_back(x);
+    bool resuming_child = resuming && (x == start) &&
+        (cursor.size() > key.size()) &&
+        (this->type_for_contents(contents) == StoredValueType::SubNode);
+    if (!resuming_child) {
+      if (!*max_blocks) {
+        this->relocation_cursor = key;
+        return false;
+      }
+      (*max_blocks)--;
+      contents = this->relocate_contents(slot_offset, limit);
+    }
+
+    if (this->type_for_contents(contents) == StoredValueType::SubNode) {
+      if (!this->relocate_subtree(contents, key, resuming_child, limit,
+          max_blocks)) {
+        return false;
+      }
+    }
+    key.pop_back();
+  }
+  return true;
+}
+
+
 static void print_indent(FILE* stream, uint64_t indent) {
   while (indent) {
     fputc(' ', stream);
@@ -908,27 +2009,127 @@ PrefixTree::Node::Node() : start(0x00), end(0xFF), parent_slot(0), value(0) {
   for (uint16_t x = 0; x < 0x100; x++) {
     this->children[x] = 0;
   }
-}
+}
+
+bool PrefixTree::Node::has_children() const {
+  for (size_t x = 0; x < (size_t)((uint16_t)this->end - (uint16_t)this->start + 1); x++) {
+    if (this->children[x]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t PrefixTree::Node::size_for_range(uint8_t start, uint8_t end) {
+  return sizeof(Node) + ((uint16_t)end - (uint16_t)start + 1) * sizeof(uint64_t);
+}
+
+size_t PrefixTree::Node::full_size() {
+  return sizeof(Node) + 0x100 * sizeof(uint64_t);
+}
+
+
+PrefixTree::ExpiringValue::ExpiringValue(uint64_t expiration,
+    uint64_t contents) : expiration(expiration), contents(contents) { }
+
+
+PrefixTree::TreeBase::TreeBase() : item_count(0), node_count(1), root() { }
+
+size_t PrefixTree::tree_base_size() {
+  // we can't use sizeof() here because the Node structure varies in size
+  return offsetof(TreeBase, root) + Node::full_size() + sizeof(uint64_t);
+}
+
+uint64_t PrefixTree::create_tree_base() {
+  uint64_t base_offset = this->allocator->allocate_object<TreeBase>(
+      tree_base_size());
+  *this->allocator->get_pool()->at<uint64_t>(
+      base_offset + tree_base_size() - sizeof(uint64_t)) = 0;
+  return base_offset;
+}
+
+uint64_t PrefixTree::extension_field(size_t field_offset) const {
+  if (!this->extension_slot_offset) {
+    return 0;
+  }
+  auto p = this->allocator->get_pool();
+  uint64_t extension_offset = *p->at<uint64_t>(this->extension_slot_offset);
+  if (!extension_offset || (field_offset >= sizeof(uint64_t) *
+      (p->at<TreeExtension>(extension_offset)->version + 1))) {
+    return 0;
+  }
+  return *p->at<uint64_t>(extension_offset + field_offset);
+}
+
+uint64_t PrefixTree::writable_extension_offset() {
+  if (!this->extension_slot_offset) {
+    throw runtime_error("tree was created by an older version; use "
+        "rebuild_into to convert it to the current format");
+  }
+
+  auto p = this->allocator->get_pool();
+  uint64_t extension_offset = *p->at<uint64_t>(this->extension_slot_offset);
+  uint64_t version = extension_offset ?
+      p->at<TreeExtension>(extension_offset)->version : 0;
+  if (version >= TREE_EXTENSION_VERSION) {
+    return extension_offset;
+  }
 
-bool PrefixTree::Node::has_children() const {
-  for (size_t x = 0; x < (size_t)((uint16_t)this->end - (uint16_t)this->start + 1); x++) {
-    if (this->children[x]) {
-      return true;
-    }
+  uint64_t new_extension_offset = this->allocator->allocate(
+      sizeof(TreeExtension));
+  memset(p->at<TreeExtension>(new_extension_offset), 0, sizeof(TreeExtension));
+  if (extension_offset) {
+    memcpy(p->at<uint64_t>(new_extension_offset) + 1,
+        p->at<uint64_t>(extension_offset) + 1, version * sizeof(uint64_t));
+    this->allocator->free(extension_offset);
   }
-  return false;
+  p->at<TreeExtension>(new_extension_offset)->version = TREE_EXTENSION_VERSION;
+  *p->at<uint64_t>(this->extension_slot_offset) = new_extension_offset;
+  return new_extension_offset;
 }
 
-size_t PrefixTree::Node::size_for_range(uint8_t start, uint8_t end) {
-  return sizeof(Node) + ((uint16_t)end - (uint16_t)start + 1) * sizeof(uint64_t);
-}
+void PrefixTree::record_attachment(size_t field_offset, uint64_t base,
+    const char* what) {
+  // old trees have nowhere to record attachments, so they stay process-local
+  if (!this->extension_slot_offset) {
+    return;
+  }
 
-size_t PrefixTree::Node::full_size() {
-  return sizeof(Node) + 0x100 * sizeof(uint64_t);
+  auto g = this->allocator->lock(true);
+  uint64_t recorded_base = this->extension_field(field_offset);
+  if (base && recorded_base && (base != recorded_base)) {
+    throw invalid_argument(string("a different ") + what +
+        " is attached to this tree");
+  }
+  if (base == recorded_base) {
+    return;
+  }
+  uint64_t extension_offset = this->writable_extension_offset();
+  *this->allocator->get_pool()->at<uint64_t>(extension_offset + field_offset) =
+      base;
 }
 
-
-PrefixTree::TreeBase::TreeBase() : item_count(0), node_count(1), root() { }
+void PrefixTree::check_attachments() const {
+  if (!this->attachments_required) {
+    return;
+  }
+  auto check = [&](size_t field_offset, uint64_t attached_base,
+      const char* what) {
+    uint64_t recorded_base = this->extension_field(field_offset);
+    if (recorded_base && (recorded_base != attached_base)) {
+      throw runtime_error(string("this tree\'s ") + what + " isn\'t attached");
+    }
+  };
+  check(offsetof(TreeExtension, filter_base),
+      this->filter ? this->filter->base() : 0, "filter");
+  check(offsetof(TreeExtension, watch_table_base),
+      this->watch_table ? this->watch_table->base() : 0, "watch table");
+  check(offsetof(TreeExtension, write_ahead_log_base),
+      this->write_ahead_log ? this->write_ahead_log->base() : 0,
+      "write-ahead log");
+  check(offsetof(TreeExtension, expiry_index_base),
+      this->expiry_index ? this->expiry_index->base() : 0, "expiry index");
+}
 
 
 void PrefixTree::increment_item_count(ssize_t delta) {
@@ -942,6 +2143,43 @@ void PrefixTree::increment_node_count(ssize_t delta) {
 }
 
 
+void PrefixTree::add_to_filter(const void* k, size_t k_size) {
+  // this must be called before the key becomes visible in the tree, so a
+  // concurrent lookup can't find the key missing from the filter but present
+  // in the tree
+  if (this->filter) {
+    this->filter->insert(k, k_size);
+  }
+}
+
+bool PrefixTree::may_contain(const void* k, size_t k_size) const {
+  return !this->filter || this->filter->may_contain(k, k_size);
+}
+
+void PrefixTree::notify_watchers(const void* k, size_t k_size) {
+  // this is called with the pool locked for writing, so watchers that wake up
+  // before the change is complete block on the lock until it is
+  if (this->watch_table) {
+    this->watch_table->notify(k, k_size);
+  }
+}
+
+void PrefixTree::log_change(WriteAheadLog::Operation op,
+    WriteAheadLog::ValueType value_type, const void* k, size_t k_size,
+    const void* v, size_t v_size) {
+  // this is called with the pool locked for writing, so records are appended
+  // in the same order as the changes are made
+  if (this->write_ahead_log) {
+    this->write_ahead_log->append(WriteAheadLog::StructureType::PrefixTree,
+        this->base_offset, op, value_type, k, k_size, v, v_size);
+  }
+  if (this->applied_sequence_offset) {
+    this->allocator->get_pool()->at<atomic<uint64_t>>(
+        this->applied_sequence_offset)->store(this->applied_sequence);
+  }
+}
+
+
 PrefixTree::Traversal PrefixTree::traverse(const void* k, size_t s,
     bool return_values_only, bool with_nodes, bool create) {
   if (!return_values_only && (s == 0)) {
@@ -1122,13 +2360,459 @@ PrefixTree::Traversal PrefixTree::traverse(const void* k, size_t s,
 }
 
 
+uint64_t PrefixTree::prefix_slot_offset(const void* prefix, size_t p_size,
+    bool create) {
+  auto t = this->traverse(prefix, p_size, true, true, create);
+  if (!t.value_slot_offset) {
+    return 0;
+  }
+
+  // if the prefix leads to a node, traverse() returns the node's value slot,
+  // but we want the slot in the parent node that refers to the node
+  uint64_t node_offset = t.node_offsets.back();
+  if (t.value_slot_offset == node_offset + offsetof(Node, value)) {
+    auto p = this->allocator->get_pool();
+    Node* parent_node = p->at<Node>(t.node_offsets[t.node_offsets.size() - 2]);
+    uint8_t slot = reinterpret_cast<const uint8_t*>(prefix)[p_size - 1];
+    return p->at(&parent_node->children[slot - parent_node->start]);
+  }
+
+  // if create is false, the slot may exist but be empty
+  if (!create && !*this->allocator->get_pool()->at<uint64_t>(
+      t.value_slot_offset)) {
+    return 0;
+  }
+  return t.value_slot_offset;
+}
+
+void PrefixTree::set_prefix_slot(uint64_t slot_offset, uint8_t slot,
+    uint64_t contents) {
+  auto p = this->allocator->get_pool();
+  if (contents &&
+      (this->type_for_contents(contents) == StoredValueType::SubNode)) {
+    p->at<Node>(contents)->parent_slot = slot;
+  }
+  *p->at<uint64_t>(slot_offset) = contents;
+}
+
+void PrefixTree::delete_empty_nodes(const vector<uint64_t>& node_offsets) {
+  auto p = this->allocator->get_pool();
+
+  for (size_t x = node_offsets.size() - 1; x > 0; x--) {
+    Node* parent_node = p->at<Node>(node_offsets[x - 1]);
+    Node* node = p->at<Node>(node_offsets[x]);
+    if (node->has_children()) {
+      // this node lost a child (or a child's subtree changed), so it may have
+      // many more slots than it needs now
+      this->shrink_node(node_offsets[x], node_offsets[x - 1], false);
+      break;
+    }
+
+    // the node has no children, but may have a value. unlink this node from the
+    // parent and move its value to its slot in the parent
+    parent_node->children[node->parent_slot - parent_node->start] = node->value;
+
+    // delete the child node
+    bool node_had_value = node->value != 0;
+    this->allocator->free_object<Node>(node_offsets[x]);
+    this->increment_node_count(-1);
+
+    // if the node had a value, we're done - the parent node is not empty since
+    // we just put the value there
+    if (node_had_value) {
+      break;
+    }
+  }
+}
+
+uint64_t PrefixTree::shrink_node(uint64_t node_offset,
+    uint64_t parent_node_offset, bool force) {
+  auto p = this->allocator->get_pool();
+
+  const Node* node = p->at<Node>(node_offset);
+  int16_t start = -1, end = -1;
+  for (uint16_t x = node->start; x <= node->end; x++) {
+    if (node->children[x - node->start]) {
+      if (start < 0) {
+        start = x;
+      }
+      end = x;
+    }
+  }
+
+  // nodes without children are deleted by delete_empty_nodes instead. traverse
+  // widens a node by one reallocation for each new slot outside its range, so
+  // unless forced, shrink only when at least as many slots are wasted as are
+  // used (and at least a cache line's worth), so nodes don't keep bouncing
+  // between sizes as keys come and go
+  if (start < 0) {
+    return node_offset;
+  }
+  size_t used_slots = end - start + 1;
+  size_t wasted_slots = node->end - node->start + 1 - used_slots;
+  if (!wasted_slots || (!force && ((wasted_slots < 8) ||
+      (wasted_slots < used_slots)))) {
+    return node_offset;
+  }
+
+  uint64_t new_node_offset = this->allocator->allocate_object
+      <Node, uint8_t, uint8_t, uint8_t, uint64_t>(
+      start, end, node->parent_slot, node->value,
+      Node::size_for_range(start, end));
+  node = p->at<Node>(node_offset); // may be invalidated by allocate()
+  Node* new_node = p->at<Node>(new_node_offset);
+  for (uint16_t x = start; x <= end; x++) {
+    new_node->children[x - start] = node->children[x - node->start];
+  }
+
+  // move the new node into place and delete the old node
+  Node* parent_node = p->at<Node>(parent_node_offset);
+  parent_node->children[new_node->parent_slot - parent_node->start] =
+      new_node_offset;
+  this->allocator->free_object<Node>(node_offset);
+  return new_node_offset;
+}
+
+size_t PrefixTree::compact_child_nodes(uint64_t node_offset) {
+  auto p = this->allocator->get_pool();
+
+  // shrinking a child reallocates it, which can remap the pool, so this node's
+  // pointer is looked up again for each slot
+  size_t count = 0;
+  uint16_t start = p->at<Node>(node_offset)->start;
+  uint16_t end = p->at<Node>(node_offset)->end;
+  for (uint16_t x = start; x <= end; x++) {
+    uint64_t contents = p->at<Node>(node_offset)->children[x - start];
+    if (!contents ||
+        (this->type_for_contents(contents) != StoredValueType::SubNode)) {
+      continue;
+    }
+    uint64_t new_contents = this->shrink_node(contents, node_offset, true);
+    if (new_contents != contents) {
+      count++;
+    }
+    count += this->compact_child_nodes(new_contents);
+  }
+  return count;
+}
+
+void PrefixTree::delete_empty_nodes_for_prefix(const void* prefix,
+    size_t p_size) {
+  // the prefix's slot is in the node for the prefix without its last byte
+  this->delete_empty_nodes(this->traverse(prefix, p_size - 1, true, true,
+      false).node_offsets);
+}
+
+void PrefixTree::add_subtree_to_filter(string& prefix, uint64_t contents) {
+  if (!contents) {
+    return;
+  }
+  if (this->type_for_contents(contents) != StoredValueType::SubNode) {
+    this->filter->insert(prefix);
+    return;
+  }
+
+  Node* node = this->allocator->get_pool()->at<Node>(contents);
+  if (node->value) {
+    this->filter->insert(prefix);
+  }
+  for (uint16_t x = node->start; x <= node->end; x++) {
+    prefix.push_back(x);
+    this->add_subtree_to_filter(prefix, node->children[x - node->start]);
+    prefix.pop_back();
+  }
+}
+
+
+string PrefixTree::expiry_index_entry(uint64_t expiration, const void* k,
+    size_t k_size) {
+  string ret;
+  ret.reserve(sizeof(uint64_t) + k_size);
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    ret.push_back((expiration >> shift) & 0xFF);
+  }
+  ret.append(reinterpret_cast<const char*>(k), k_size);
+  return ret;
+}
+
+void PrefixTree::add_expiry_index_entry(const string& entry) {
+  if (!this->expiry_index) {
+    return;
+  }
+
+  // entries have null values, like insert(k, k_size) would store
+  PrefixTree* index = this->expiry_index.get();
+  uint64_t value_slot_offset = index->traverse(entry.data(), entry.size(),
+      true, false, true).value_slot_offset;
+  uint64_t* slot = this->allocator->get_pool()->at<uint64_t>(
+      value_slot_offset);
+  if (!*slot) {
+    *slot = (2 << 3) | (uint64_t)StoredValueType::Trivial;
+    index->increment_item_count(1);
+  }
+}
+
+void PrefixTree::remove_expiry_index_entry(const string& entry) {
+  if (!this->expiry_index) {
+    return;
+  }
+
+  PrefixTree* index = this->expiry_index.get();
+  auto t = index->traverse(entry.data(), entry.size(), true, true, false);
+  if (t.value_slot_offset) {
+    index->clear_value_slot(t.value_slot_offset);
+    index->delete_empty_nodes(t.node_offsets);
+  }
+}
+
+void PrefixTree::expiry_index_entries_for_subtree(string& prefix,
+    uint64_t contents, vector<string>& entries) const {
+  if (!contents) {
+    return;
+  }
+  auto p = this->allocator->get_pool();
+  if (this->type_for_contents(contents) != StoredValueType::SubNode) {
+    if (this->is_expiring_contents(contents)) {
+      entries.emplace_back(this->expiry_index_entry(
+          p->at<ExpiringValue>(contents >> 8)->expiration, prefix.data(),
+          prefix.size()));
+    }
+    return;
+  }
+
+  const Node* node = p->at<Node>(contents);
+  this->expiry_index_entries_for_subtree(prefix, node->value, entries);
+  for (uint16_t x = node->start; x <= node->end; x++) {
+    prefix.push_back(x);
+    this->expiry_index_entries_for_subtree(prefix,
+        node->children[x - node->start], entries);
+    prefix.pop_back();
+  }
+}
+
+bool PrefixTree::first_key_in_subtree(uint64_t node_offset,
+    string& key) const {
+  const Node* node = this->allocator->get_pool()->at<Node>(node_offset);
+  if (node->value) {
+    return true;
+  }
+  for (uint16_t x = node->start; x <= node->end; x++) {
+    uint64_t contents = node->children[x - node->start];
+    if (!contents) {
+      continue;
+    }
+    key.push_back(x);
+    if ((this->type_for_contents(contents) != StoredValueType::SubNode) ||
+        this->first_key_in_subtree(contents, key)) {
+      return true;
+    }
+    key.pop_back();
+  }
+  return false;
+}
+
+
+uint64_t PrefixTree::unexpired_contents(uint64_t contents) const {
+  if (!this->is_expiring_contents(contents)) {
+    return contents;
+  }
+  const ExpiringValue* wrapper = this->allocator->get_pool()->at<ExpiringValue>(
+      contents >> 8);
+  return (wrapper->expiration > now()) ? wrapper->contents : 0;
+}
+
+uint64_t PrefixTree::unexpired_value_slot_offset(uint64_t slot_offset) {
+  uint64_t contents = *this->allocator->get_pool()->at<uint64_t>(slot_offset);
+  if (!this->is_expiring_contents(contents)) {
+    return slot_offset;
+  }
+  if (!this->unexpired_contents(contents)) {
+    this->clear_value_slot(slot_offset);
+    return slot_offset;
+  }
+  return (contents >> 8) + offsetof(ExpiringValue, contents);
+}
+
+
+static string dedup_index_entry(uint64_t hash) {
+  string ret;
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    ret.push_back((hash >> shift) & 0xFF);
+  }
+  return ret;
+}
+
+PrefixTree* PrefixTree::get_dedup_index() {
+  uint64_t index_offset = this->extension_field(
+      offsetof(TreeExtension, dedup_index_offset));
+  if (!index_offset) {
+    return NULL;
+  }
+  // opening an existing tree doesn't lock the pool
+  if (!this->dedup_index || (this->dedup_index->base_offset != index_offset)) {
+    this->dedup_index.reset(new PrefixTree(this->allocator, index_offset));
+  }
+  return this->dedup_index.get();
+}
+
+bool PrefixTree::should_share_value(size_t v_size) const {
+  uint64_t min_size = this->extension_field(
+      offsetof(TreeExtension, dedup_min_size));
+  return min_size && (v_size >= min_size) && (v_size >= 8);
+}
+
+uint64_t PrefixTree::acquire_shared_value(const void* v, size_t v_size) {
+  if (!this->should_share_value(v_size)) {
+    return 0;
+  }
+
+  auto p = this->allocator->get_pool();
+  PrefixTree* index = this->get_dedup_index();
+  uint64_t hash = fnv1a64(v, v_size);
+  string entry = dedup_index_entry(hash);
+  uint64_t value_slot_offset = index->traverse(entry.data(), entry.size(),
+      true, false, true).value_slot_offset;
+
+  uint64_t contents = *p->at<uint64_t>(value_slot_offset);
+  if (contents) {
+    uint64_t shared_offset = this->int_value_for_contents(contents);
+    SharedValue* shared = p->at<SharedValue>(shared_offset);
+    if ((this->allocator->block_size(shared_offset) - sizeof(SharedValue) !=
+         v_size) || memcmp(shared->data, v, v_size)) {
+      return 0;
+    }
+    shared->refcount++;
+    return shared_offset;
+  }
+
+  uint64_t shared_offset = this->allocator->allocate(
+      sizeof(SharedValue) + v_size);
+  SharedValue* shared = p->at<SharedValue>(shared_offset);
+  shared->refcount = 1;
+  shared->hash = hash;
+  memcpy(shared->data, v, v_size);
+  *p->at<uint64_t>(value_slot_offset) = (shared_offset << 3) |
+      (uint64_t)StoredValueType::Int;
+  index->increment_item_count(1);
+  return shared_offset;
+}
+
+void PrefixTree::release_shared_value(uint64_t shared_offset) {
+  auto p = this->allocator->get_pool();
+  SharedValue* shared = p->at<SharedValue>(shared_offset);
+  if (--shared->refcount) {
+    return;
+  }
+
+  // the index always exists if there are shared values
+  PrefixTree* index = this->get_dedup_index();
+  string entry = dedup_index_entry(shared->hash);
+  auto t = index->traverse(entry.data(), entry.size(), true, true, false);
+  if (t.value_slot_offset && (this->int_value_for_contents(
+      *p->at<uint64_t>(t.value_slot_offset)) == (int64_t)shared_offset)) {
+    index->clear_value_slot(t.value_slot_offset);
+    index->delete_empty_nodes(t.node_offsets);
+  }
+  this->allocator->free(shared_offset);
+}
+
+
+PrefixTree* PrefixTree::cold_tier_for(const void* k, size_t k_size) const {
+  if (!this->cold_prefix_count()) {
+    return NULL;
+  }
+
+  // a key is cold if the slot for the key or any of its prefixes is a marker
+  auto p = this->allocator->get_pool();
+  const uint8_t* k_data = reinterpret_cast<const uint8_t*>(k);
+  uint64_t node_offset = this->base_offset + offsetof(TreeBase, root);
+  for (size_t x = 0; x < k_size; x++) {
+    const Node* node = p->at<Node>(node_offset);
+    if ((k_data[x] < node->start) || (k_data[x] > node->end)) {
+      return NULL;
+    }
+    uint64_t contents = node->children[k_data[x] - node->start];
+    if (this->is_cold_subtree_contents(contents)) {
+      return this->required_cold_tier();
+    }
+    if (!contents ||
+        (this->type_for_contents(contents) != StoredValueType::SubNode)) {
+      return NULL;
+    }
+    node_offset = contents;
+  }
+  return NULL;
+}
+
+PrefixTree* PrefixTree::required_cold_tier() const {
+  if (!this->cold_tier) {
+    throw runtime_error(
+        "tree contains demoted prefixes but no cold tier is attached");
+  }
+  return this->cold_tier.get();
+}
+
+size_t PrefixTree::cold_prefix_count() const {
+  return this->extension_field(offsetof(TreeExtension, cold_prefix_count));
+}
+
+bool PrefixTree::subtree_has_cold_prefixes(uint64_t contents) const {
+  if (this->is_cold_subtree_contents(contents)) {
+    return true;
+  }
+  if (!contents ||
+      (this->type_for_contents(contents) != StoredValueType::SubNode)) {
+    return false;
+  }
+  const Node* node = this->allocator->get_pool()->at<Node>(contents);
+  for (uint16_t x = node->start; x <= node->end; x++) {
+    if (this->subtree_has_cold_prefixes(node->children[x - node->start])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool PrefixTree::next_cold_key_value(const string& prefix, const void* current,
+    size_t size, bool return_value, pair<string, LookupResult>& ret) const {
+  PrefixTree* cold_tier = this->required_cold_tier();
+
+  // the prefix itself may be a key
+  if (!current) {
+    try {
+      LookupResult value = cold_tier->at(prefix);
+      ret = make_pair(prefix, return_value ? value : LookupResult());
+      return true;
+    } catch (const out_of_range& e) { }
+    current = prefix.data();
+    size = prefix.size();
+  }
+
+  // the cold tier may contain other demoted prefixes after this one
+  try {
+    ret = cold_tier->next_key_value_internal(current, size, return_value);
+  } catch (const out_of_range& e) {
+    return false;
+  }
+  return !ret.first.compare(0, prefix.size(), prefix);
+}
+
+
 bool PrefixTree::execute_check(const CheckRequest& check) const {
   LookupResult existing_result(ResultValueType::Missing);
+  PrefixTree* cold_tier = this->cold_tier_for(check.key, check.key_size);
+  if (cold_tier) {
+    try {
+      existing_result = cold_tier->at(check.key, check.key_size);
+    } catch (const out_of_range& e) { }
+    return existing_result == check.value;
+  }
+
   uint64_t value_slot_offset =
       this->traverse(check.key, check.key_size, true, false).value_slot_offset;
   if (value_slot_offset) {
-    uint64_t contents = *this->allocator->get_pool()->at<uint64_t>(
-        value_slot_offset);
+    uint64_t contents = this->unexpired_contents(
+        *this->allocator->get_pool()->at<uint64_t>(value_slot_offset));
     if (contents) {
       existing_result = this->lookup_result_for_contents(contents);
     }
@@ -1150,13 +2834,30 @@ pair<string, PrefixTree::LookupResult> PrefixTree::next_key_value_internal(
   auto g = this->allocator->lock(false);
   auto p = this->allocator->get_pool();
 
+  // returns the key for a slot in the last node on the path (or the node's
+  // own value, if slot_id is negative)
+  auto key_for_slot = [&](int16_t slot_id) -> string {
+    string key;
+    key.reserve(node_offsets.size());
+    auto node_it = node_offsets.begin() + 1; // root node doesn't have a char
+    for (; node_it != node_offsets.end(); node_it++) {
+      key += (char)p->at<Node>(*node_it)->parent_slot;
+    }
+    if (slot_id >= 0) {
+      key += (char)slot_id;
+    }
+    return key;
+  };
+  pair<string, LookupResult> cold_ret;
+
   // if current is NULL, then we're just starting the iteration - check the root
   // node's value, then find the next nonempty slot if needed
   if (!current) {
-    Node* node = p->at<Node>(node_offset);
-    if (node->value) {
+    uint64_t value = this->unexpired_contents(
+        p->at<Node>(node_offset)->value);
+    if (value) {
       return make_pair("", return_value ?
-          this->lookup_result_for_contents(node->value) : LookupResult());
+          this->lookup_result_for_contents(value) : LookupResult());
     }
 
   // current is not NULL - we're continuing iteration, or starting with a prefix
@@ -1184,10 +2885,16 @@ pair<string, PrefixTree::LookupResult> PrefixTree::next_key_value_internal(
       }
 
       // if the slot contains a value instead of a subnode, we're done here;
-      // we'll start by examining the following slot
+      // we'll start by examining the following slot. but if it's a demoted
+      // prefix that current is in, the next key may be in the cold tier
       uint64_t next_node_offset = node->children[*k_data - node->start];
       if (this->type_for_contents(next_node_offset) !=
           StoredValueType::SubNode) {
+        if (this->is_cold_subtree_contents(next_node_offset) &&
+            this->next_cold_key_value(key_for_slot(*k_data), current, size,
+              return_value, cold_ret)) {
+          return cold_ret;
+        }
         slot_id = *k_data + 1;
         break;
       }
@@ -1201,14 +2908,15 @@ pair<string, PrefixTree::LookupResult> PrefixTree::next_key_value_internal(
 
   // we found the position in the tree that's immediately after the given key.
   // now find the next non-null value in the tree at or after that position.
+  // expired values are skipped, as if their slots were empty
   uint64_t value = 0;
   while (!node_offsets.empty()) {
     Node* node = p->at<Node>(node_offset);
 
     // check the node's value if we need to
     if (slot_id < 0) {
-      if (node->value) {
-        value = node->value;
+      value = this->unexpired_contents(node->value);
+      if (value) {
         break;
       }
       slot_id = node->start;
@@ -1235,11 +2943,24 @@ pair<string, PrefixTree::LookupResult> PrefixTree::next_key_value_internal(
       continue;
     }
 
-    // if the slot contains a value, we're done
+    // if the slot contains a value, we're done. if it's a demoted prefix, the
+    // next key is the first one in the cold tier under that prefix, if any
     StoredValueType type = this->type_for_contents(contents);
+    if (this->is_cold_subtree_contents(contents)) {
+      if (this->next_cold_key_value(key_for_slot(slot_id), NULL, 0,
+          return_value, cold_ret)) {
+        return cold_ret;
+      }
+      slot_id++;
+      continue;
+    }
     if (type != StoredValueType::SubNode) {
-      value = contents;
-      break;
+      value = this->unexpired_contents(contents);
+      if (value) {
+        break;
+      }
+      slot_id++;
+      continue;
     }
 
     // the slot contains a subnode, so move to it and check if it has a value
@@ -1254,18 +2975,8 @@ pair<string, PrefixTree::LookupResult> PrefixTree::next_key_value_internal(
   }
 
   // we did find a value - generate the key and return the key/value pair
-  string key;
-  key.reserve(node_offsets.size());
-  auto node_it = node_offsets.begin() + 1; // root node doesn't have a char
-  for (; node_it != node_offsets.end(); node_it++) {
-    key += (char)p->at<Node>(*node_it)->parent_slot;
-  }
-  if (slot_id >= 0) {
-    key += (char)slot_id;
-  }
-
-  return make_pair(key, return_value ? this->lookup_result_for_contents(value) :
-      LookupResult());
+  return make_pair(key_for_slot(slot_id), return_value ?
+      this->lookup_result_for_contents(value) : LookupResult());
 }
 
 
@@ -1320,6 +3031,29 @@ PrefixTree::LookupResult PrefixTree::lookup_result_for_contents(
       }
       return LookupResult(trivial_id ? true : false);
     }
+
+    case StoredValueType::Extended:
+      switch (this->extended_type_for_contents(contents)) {
+        case ExtendedValueType::Interned:
+          if (!this->intern_table) {
+            throw runtime_error(
+                "tree contains interned values but no intern table is attached");
+          }
+          return LookupResult(this->intern_table->at(contents >> 8));
+        case ExtendedValueType::Expiring:
+          return this->lookup_result_for_contents(
+              this->allocator->get_pool()->at<ExpiringValue>(
+              contents >> 8)->contents);
+        case ExtendedValueType::ColdSubtree:
+          throw logic_error("can\'t look up a demoted prefix\'s marker");
+        case ExtendedValueType::Shared: {
+          uint64_t shared_offset = contents >> 8;
+          return LookupResult(this->allocator->get_pool()->at<SharedValue>(
+              shared_offset)->data, this->allocator->block_size(
+              shared_offset) - sizeof(SharedValue));
+        }
+      }
+      break;
   }
   throw invalid_argument("slot has unknown type");
 }
@@ -1372,6 +3106,35 @@ void PrefixTree::clear_value_slot(uint64_t slot_offset) {
       break;
     }
 
+    case StoredValueType::Extended:
+      if (this->is_expiring_contents(contents)) {
+        // unlink the wrapper, then clear the wrapped value (which counts the
+        // item as removed) and free the wrapper
+        uint64_t wrapper_offset = contents >> 8;
+        *p->at<uint64_t>(slot_offset) = 0;
+        this->clear_value_slot(wrapper_offset +
+            offsetof(ExpiringValue, contents));
+        this->allocator->free(wrapper_offset);
+        break;
+      }
+      if (this->is_cold_subtree_contents(contents)) {
+        // the keys are in the cold tier, which the caller is responsible for
+        *p->at<uint64_t>(slot_offset) = 0;
+        p->at<TreeExtension>(
+            this->writable_extension_offset())->cold_prefix_count--;
+        break;
+      }
+      if (this->is_shared_contents(contents)) {
+        *p->at<uint64_t>(slot_offset) = 0;
+        this->release_shared_value(contents >> 8);
+        this->increment_item_count(-1);
+        break;
+      }
+      // interned values don't have allocated storage in this tree
+      *p->at<uint64_t>(slot_offset) = 0;
+      this->increment_item_count(-1);
+      break;
+
     case StoredValueType::Int:
     case StoredValueType::Trivial:
     case StoredValueType::ShortString:
@@ -1481,6 +3244,27 @@ string PrefixTree::get_structure_for_contents(uint64_t contents) const {
       }
       throw invalid_argument("slot has invalid trivial value");
     }
+
+    case StoredValueType::Extended:
+      switch (this->extended_type_for_contents(contents)) {
+        case ExtendedValueType::Interned:
+          return string_printf("n%" PRIu64, contents >> 8);
+        case ExtendedValueType::Expiring: {
+          const ExpiringValue* wrapper = p->at<ExpiringValue>(contents >> 8);
+          return string_printf("e%" PRIu64 ":", wrapper->expiration) +
+              this->get_structure_for_contents(wrapper->contents);
+        }
+        case ExtendedValueType::ColdSubtree:
+          return "c";
+        case ExtendedValueType::Shared: {
+          uint64_t shared_offset = contents >> 8;
+          return string_printf("h%" PRIu64 ":%zu",
+              p->at<SharedValue>(shared_offset)->refcount,
+              this->allocator->block_size(shared_offset) -
+                sizeof(SharedValue));
+        }
+      }
+      break;
   }
   throw invalid_argument("slot has unknown type");
 }
@@ -1502,6 +3286,28 @@ PrefixTree::StoredValueType PrefixTree::type_for_contents(uint64_t s) {
   return (StoredValueType)(s & 7);
 }
 
+PrefixTree::ExtendedValueType PrefixTree::extended_type_for_contents(
+    uint64_t s) {
+  return (ExtendedValueType)((s >> 3) & 0x1F);
+}
+
+bool PrefixTree::is_expiring_contents(uint64_t s) {
+  return (PrefixTree::type_for_contents(s) == StoredValueType::Extended) &&
+      (PrefixTree::extended_type_for_contents(s) ==
+       ExtendedValueType::Expiring);
+}
+
+bool PrefixTree::is_cold_subtree_contents(uint64_t s) {
+  return (PrefixTree::type_for_contents(s) == StoredValueType::Extended) &&
+      (PrefixTree::extended_type_for_contents(s) ==
+       ExtendedValueType::ColdSubtree);
+}
+
+bool PrefixTree::is_shared_contents(uint64_t s) {
+  return (PrefixTree::type_for_contents(s) == StoredValueType::Extended) &&
+      (PrefixTree::extended_type_for_contents(s) == ExtendedValueType::Shared);
+}
+
 
 PrefixTreeIterator::PrefixTreeIterator(const PrefixTree* tree) : tree(tree),
     complete(true) { }
@@ -8,13 +8,17 @@
 #include <utility>
 
 #include "Allocator.hh"
+#include "Filter.hh"
+#include "InternTable.hh"
+#include "WatchTable.hh"
+#include "WriteAheadLog.hh"
 
 namespace sharedstructures {
 
 
 class PrefixTreeIterator;
 
-class PrefixTree {
+class PrefixTree : public Relocatable {
 public:
   PrefixTree() = delete;
   PrefixTree(const PrefixTree&) = delete;
@@ -38,6 +42,98 @@ public:
   // returns the base offset for this prefix tree
   uint64_t base() const;
 
+  // the attach_* methods record the attached structure's base offset in the
+  // tree (except in trees created by versions that didn't record them), and
+  // attaching a different structure of the same kind throws
+  // std::invalid_argument. passing nullptr detaches the structure and clears
+  // the record, so it stops being required in all processes.
+
+  // attaches a Filter to this tree. when a filter is attached, all keys
+  // inserted into the tree are also added to the filter, and exists(), type()
+  // and at() check the filter before locking the pool, so lookups for missing
+  // keys usually don't have to lock or traverse the tree at all. writes
+  // through a PrefixTree object that doesn't have the recorded filter attached
+  // throw std::runtime_error instead of inserting keys that the filter would
+  // report as missing. if populate is true, all keys already in the tree are
+  // added to the filter. processes that still have a filter attached after
+  // another process detaches it keep checking it, so detach it everywhere.
+  void attach_filter(std::shared_ptr<Filter> filter, bool populate = false);
+  std::shared_ptr<Filter> get_filter() const;
+
+  // attaches an InternTable to this tree. values inserted with
+  // insert_interned() are added to the table, and only their IDs are stored in
+  // the tree, so repeated values don't each use a separate buffer. interned
+  // values are returned as String values by lookups, which throw
+  // std::runtime_error if no table is attached. attaching a table other than
+  // the recorded one is refused because the stored IDs would refer to the
+  // wrong strings. values inserted before the table is attached are
+  // unaffected.
+  void attach_intern_table(std::shared_ptr<InternTable> table);
+  std::shared_ptr<InternTable> get_intern_table() const;
+
+  // attaches a WatchTable to this tree. when a table is attached, every
+  // insert, incr and erase notifies it of the changed key (and clear,
+  // move_prefix and swap_prefixes notify all watchers), so other processes can
+  // call watch() on the table to block until keys under a prefix change,
+  // instead of polling the tree. notifications are sent while the pool is
+  // still locked, so a watcher that wakes up and reads the tree sees the
+  // change. writes through a PrefixTree object that doesn't have the recorded
+  // table attached throw std::runtime_error, so no change goes unnoticed.
+  void attach_watch_table(std::shared_ptr<WatchTable> table);
+  std::shared_ptr<WatchTable> get_watch_table() const;
+
+  // attaches a WriteAheadLog to this tree. when a log is attached, every
+  // insert, incr, erase, clear, move_prefix and swap_prefixes appends a record
+  // to it while the pool is locked; call the log's commit() method afterward
+  // to make the changes durable. the log must be in the same pool as the tree.
+  // writes through a PrefixTree object that doesn't have the recorded log
+  // attached throw std::runtime_error, since they couldn't be recovered.
+  // values inserted with insert_interned() are logged (and replayed) as plain
+  // strings.
+  void attach_write_ahead_log(std::shared_ptr<WriteAheadLog> log);
+  std::shared_ptr<WriteAheadLog> get_write_ahead_log() const;
+
+  // attaches a PrefixTree that indexes this tree's expiring keys by expiration
+  // time, so reclaim_expired() can find them without scanning this tree. the
+  // index must be in the same pool as this tree and must not be used for
+  // anything else; it's updated while this tree's pool is locked. writes
+  // through a PrefixTree object that doesn't have the recorded index attached
+  // throw std::runtime_error, since they would leave its entries stale.
+  // changes to the index aren't logged to an attached WriteAheadLog, so keys
+  // whose expirations are replayed from the log expire only lazily.
+  void attach_expiry_index(std::shared_ptr<PrefixTree> index);
+  std::shared_ptr<PrefixTree> get_expiry_index() const;
+
+  // attaches a PrefixTree in another pool as this tree's cold tier. the cold
+  // tier is meant to live in a file-backed pool on disk, while this tree stays
+  // in memory: demote_prefix() moves a subtree into the cold tier and leaves a
+  // marker in its place, and lookups, writes and iteration that reach a marker
+  // are forwarded to the cold tier, so callers don't need to know which tier
+  // holds a key. the cold tier's pool is locked while this tree's pool is
+  // locked (never the other way around), so the cold tier must not be used for
+  // anything else. accessing a demoted key without a cold tier attached throws
+  // std::runtime_error. the cold tier is in another pool, so it's recorded
+  // (and checked) only by its base offset.
+  void attach_cold_tier(std::shared_ptr<PrefixTree> cold_tier);
+  std::shared_ptr<PrefixTree> get_cold_tier() const;
+
+  // sets the size at which string values are deduplicated. while this is
+  // nonzero, each string value of at least min_size bytes (and at least 8) is
+  // stored once, in a reference-counted buffer shared by all the keys that
+  // have that value, instead of in a buffer of its own. erasing or overwriting
+  // a key releases its reference, and the buffer is freed with the last one.
+  // the setting and the index of shared values are stored in the pool, so all
+  // processes use them and readers don't need to do anything. pass 0 to stop
+  // sharing new values; values that are already shared stay shared. shared
+  // values are copied as ordinary strings by rebuild_into and demote_prefix,
+  // and aren't moved by relocate_blocks, since other keys may refer to them.
+  // throws runtime_error if the tree was created by a version that didn't
+  // support deduplication (rebuild_into converts it).
+  void set_dedup_min_size(size_t min_size);
+  size_t dedup_min_size() const;
+  // returns the number of distinct shared values in the tree
+  size_t shared_value_count() const;
+
   enum class ResultValueType {
     Missing = 0,
     String  = 1,
@@ -100,6 +196,13 @@ public:
   bool insert(const std::string& k, const struct iovec *iov, size_t iovcnt,
       const CheckRequest* check = NULL);
 
+  // inserts/overwrites a key with a string value, stored as an ID in the
+  // attached InternTable. throws std::logic_error if no table is attached.
+  bool insert_interned(const void* k, size_t k_size, const void* v,
+      size_t v_size, const CheckRequest* check = NULL);
+  bool insert_interned(const std::string& k, const std::string& v,
+      const CheckRequest* check = NULL);
+
   // inserts/overwrites a key with an integer value.
   bool insert(const void* k, size_t k_size, int64_t v,
       const CheckRequest* check = NULL);
@@ -134,13 +237,88 @@ public:
   double incr(const void* k, size_t k_size, double delta);
   double incr(const std::string& k, double delta);
 
-  // deletes a key.
+  // deletes a key. returns false if the key is missing or expired (an expired
+  // key is still deleted).
   bool erase(const void* k, size_t k_size, const CheckRequest* check = NULL);
   bool erase(const std::string& k, const CheckRequest* check = NULL);
 
-  // deletes all the keys in the prefix tree.
+  // deletes all the keys in the prefix tree (and all the entries in the
+  // attached expiry index, if any).
   void clear();
 
+  // sets the time at which a key expires, in microseconds since the epoch (as
+  // returned by phosg's now()), or makes it persistent again if expiration is
+  // 0. expired keys are treated as missing by lookups, checks, incr() and
+  // iteration, but still count toward size() until they're overwritten,
+  // erased or reclaimed. inserting a new value for a key removes its
+  // expiration; incr() keeps it. keys moved by move_prefix, swap_prefixes or
+  // demote_prefix keep their expirations, and their expiry index entries move
+  // with them. returns false if the key is missing or already expired.
+  bool set_expiration(const void* k, size_t k_size, uint64_t expiration);
+  bool set_expiration(const std::string& k, uint64_t expiration);
+
+  // returns the time at which a key expires, or 0 if it doesn't expire. throws
+  // std::out_of_range if the key is missing or expired.
+  uint64_t expiration(const void* k, size_t k_size) const;
+  uint64_t expiration(const std::string& k) const;
+
+  // erases keys that expired at or before now_usecs (or the current time, if
+  // now_usecs is 0) in expiration order, using the attached expiry index, and
+  // returns the number of keys erased. at most max_entries index entries are
+  // examined; entries for keys that were overwritten, erased or given a new
+  // expiration since are just dropped. so the time taken is proportional to
+  // the number of expired keys, not the size of the tree. erased keys are
+  // logged and watchers are notified as for erase(). throws std::logic_error
+  // if no expiry index is attached.
+  size_t reclaim_expired(size_t max_entries = 1024, uint64_t now_usecs = 0);
+
+  // moves all the keys that begin with src so they begin with dst instead,
+  // replacing all the keys that already begin with dst. this relinks the
+  // subtree rather than copying it, so it takes time proportional to the
+  // prefixes' lengths (plus the time to delete the keys being replaced) and
+  // other processes see the whole change at once. returns false (and doesn't
+  // delete anything) if no keys begin with src. neither prefix may be empty,
+  // and neither may be a prefix of the other; otherwise, throws
+  // invalid_argument.
+  // if a filter is attached, the moved keys are added to it, which takes time
+  // proportional to their number. similarly, if an expiry index is attached,
+  // the moved subtree is walked to move its keys' index entries, so the move
+  // takes time proportional to the subtree's size. all watchers are notified.
+  // throws logic_error if the tree has any demoted prefixes.
+  bool move_prefix(const void* src, size_t src_size, const void* dst,
+      size_t dst_size);
+  bool move_prefix(const std::string& src, const std::string& dst);
+
+  // exchanges the keys that begin with a and the keys that begin with b, in
+  // the same way as move_prefix. returns false if no keys begin with either
+  // prefix. the same restrictions and costs as for move_prefix apply; with an
+  // expiry index attached, both subtrees are walked.
+  bool swap_prefixes(const void* a, size_t a_size, const void* b,
+      size_t b_size);
+  bool swap_prefixes(const std::string& a, const std::string& b);
+
+  // moves all the keys that begin with prefix (including prefix itself) into
+  // the attached cold tier and returns the number of keys moved. the subtree
+  // is copied into the cold tier's pool, so this takes time proportional to
+  // its size, then replaced with a single marker slot, so the keys stay
+  // visible throughout. interned values are copied as plain strings. expiring
+  // keys keep their expirations, and their expiry index entries move to the
+  // cold tier's expiry index, so the cold tier's reclaim_expired() finds them.
+  // returns 0 if no keys begin with prefix or if prefix is already in a
+  // demoted prefix. prefix may not be empty and may not contain a demoted
+  // prefix (promote that one first); otherwise, throws invalid_argument.
+  // throws logic_error if no cold tier is attached, and runtime_error if the
+  // tree was created by a version that didn't support cold tiers
+  // (rebuild_into converts it).
+  size_t demote_prefix(const void* prefix, size_t p_size);
+  size_t demote_prefix(const std::string& prefix);
+
+  // moves the keys in a demoted prefix back into this tree and returns the
+  // number of keys moved. returns 0 (and does nothing) if prefix wasn't
+  // demoted; throws invalid_argument if it's within a longer demoted prefix.
+  size_t promote_prefix(const void* prefix, size_t p_size);
+  size_t promote_prefix(const std::string& prefix);
+
   // checks if a key exists.
   bool exists(const void* k, size_t k_size);
   bool exists(const std::string& k);
@@ -173,7 +351,7 @@ public:
   PrefixTreeIterator end() const;
 
   // inspection methods.
-  size_t size() const; // key count
+  size_t size() const; // key count (including keys in the cold tier)
   size_t node_size() const; // node count
   // bytes used by the subtree rooted at prefix
   size_t bytes_for_prefix(const void* prefix, size_t p_size) const;
@@ -182,6 +360,32 @@ public:
   size_t nodes_for_prefix(const void* prefix, size_t p_size) const;
   size_t nodes_for_prefix(const std::string& prefix) const;
 
+  // writes a compacted copy of this tree into another pool and returns the
+  // copy's base offset. nodes are allocated in depth-first order (so a fresh
+  // pool holds each subtree contiguously), each node's range covers only its
+  // nonempty slots, and empty nodes left over from erases are dropped. interned
+  // values are copied as plain strings (so the intern table must be attached).
+  // if the allocator's base object offset is 0, sets it to the copy's base
+  // offset. the tree is locked for reading during the copy, so it's a
+  // consistent snapshot. the destination pool must not be this tree's pool,
+  // and no other process may be using it; throws invalid_argument if it's this
+  // tree's pool.
+  uint64_t rebuild_into(std::shared_ptr<Allocator> allocator) const;
+
+  // reallocates every node whose range covers more slots than it needs, so
+  // each node's range spans only its nonempty slots, and returns the number of
+  // nodes reallocated. erase() already does this for the nodes it modifies, but
+  // only when enough slots would be recovered; this catches the rest. the tree
+  // is locked for writing during the whole pass.
+  size_t compact_nodes();
+
+  // moves the tree's nodes and value buffers that extend past limit, in key
+  // order, for a Compactor (see Relocatable). the position is kept as the next
+  // key to visit, so the tree can be modified between calls; keys inserted
+  // before that position during a pass are visited in the next pass. the tree's
+  // base (which contains the root node) is never moved.
+  virtual bool relocate_blocks(uint64_t limit, size_t* max_blocks);
+
   // prints the tree's structure to the given stream. the optional arguments are
   // used for recursive calls; external callers shouldn't need to pass them.
   // this method does not lock the tree; it's intended only for debugging. don't
@@ -198,6 +402,27 @@ public:
 private:
   std::shared_ptr<Allocator> allocator;
   uint64_t base_offset;
+  std::shared_ptr<Filter> filter;
+  std::shared_ptr<InternTable> intern_table;
+  std::shared_ptr<WatchTable> watch_table;
+  std::shared_ptr<WriteAheadLog> write_ahead_log;
+  std::shared_ptr<PrefixTree> expiry_index;
+  std::shared_ptr<PrefixTree> cold_tier;
+  // opened from the dedup index offset in the tree's base when first needed
+  std::shared_ptr<PrefixTree> dedup_index;
+  // offset of the extension offset that follows the root node, or 0 if the
+  // tree was created by a version that didn't have extensions
+  uint64_t extension_slot_offset;
+  // false for trees opened by WriteAheadLog::RecordApplier, which applies
+  // records without the structures that were attached when they were made
+  bool attachments_required;
+  // set by RecordApplier for a Replica: the offset of the follower's
+  // std::atomic<uint64_t> position, which log_change sets to applied_sequence
+  // so it advances along with the change (0 if unused)
+  uint64_t applied_sequence_offset;
+  uint64_t applied_sequence;
+  // the next key that relocate_blocks will visit
+  std::string relocation_cursor;
 
   // the tree's structure is a recursive set of Node objects. each Node has a
   // value slot as well as 1-256 child slots, depending on the range of subnodes
@@ -273,21 +498,129 @@ private:
     // the high 2 bits are unused.
     ShortString = 6,
 
+    // Extended is for values that don't fit any of the above types. the next 5
+    // bits above the type are an ExtendedValueType, which determines what the
+    // high 56 bits of the slot contents mean.
+    Extended    = 7,
+
     // StoredValueTypes can be up to 7 (this is a 3-bit field)
   };
 
+  enum class ExtendedValueType {
+    // Interned is a string stored in the attached InternTable. the high 56 bits
+    // of the slot contents are the string's ID.
+    Interned = 0,
+
+    // Expiring is a value with an expiration time. the high 56 bits of the
+    // slot contents are the offset of an ExpiringValue, which holds the time
+    // and the slot contents for the value itself (which are never a subnode or
+    // another Expiring value).
+    Expiring = 1,
+
+    // ColdSubtree marks a demoted prefix: the key that ends at this slot and
+    // all the keys that begin with it are in the attached cold tier. the high
+    // 56 bits of the slot contents are unused. this only appears in a node's
+    // child slots, never in its value slot.
+    ColdSubtree = 2,
+
+    // Shared is a deduplicated string. the high 56 bits of the slot contents
+    // are the offset of a SharedValue, which may be referred to by other slots
+    // too. the tree's dedup index maps the value's hash to the SharedValue.
+    Shared = 3,
+  };
+
+  struct SharedValue {
+    // number of slots that refer to this value
+    uint64_t refcount;
+    uint64_t hash;
+    // the value's size is the block size minus the size of this header
+    char data[0];
+  };
+
+  struct ExpiringValue {
+    uint64_t expiration;
+    uint64_t contents;
+
+    ExpiringValue(uint64_t expiration, uint64_t contents);
+  };
+
   struct TreeBase {
-    // note: if fields are added here, update the size in the constructor
+    // note: if fields are added here, update the size in tree_base_size. new
+    // per-tree state goes in TreeExtension instead
     uint64_t item_count;
     uint64_t node_count;
     Node root;
+    // the root node is followed by the offset of the tree's TreeExtension (0
+    // if it hasn't been allocated yet). this isn't present in trees created
+    // by versions that didn't have extensions; their base blocks end after
+    // the root node
 
     TreeBase();
   };
 
+  // per-tree state added after the original TreeBase format. it's allocated
+  // separately, so the root node stays at the offset that older versions
+  // expect. fields are only ever appended, and version is the number of fields
+  // after it that the block contains (so each field is annotated with the
+  // first version that has it); fields beyond that are treated as zero, and
+  // the block is reallocated with all the current fields the first time one of
+  // them is written.
+  struct TreeExtension {
+    uint64_t version;
+    // number of ColdSubtree markers in the tree (version 1)
+    uint64_t cold_prefix_count;
+    // base offset of the dedup index (a PrefixTree in the same pool), or 0 if
+    // values have never been deduplicated (version 3)
+    uint64_t dedup_index_offset;
+    // 0 if new values aren't being deduplicated (version 3)
+    uint64_t dedup_min_size;
+    // base offsets of the structures attached with the attach_* methods, or 0
+    // for each kind that isn't attached. these let a process detect that it
+    // hasn't attached the same structures as the others (version 9)
+    uint64_t filter_base;
+    uint64_t intern_table_base;
+    uint64_t watch_table_base;
+    uint64_t write_ahead_log_base;
+    uint64_t expiry_index_base;
+    uint64_t cold_tier_base;
+  };
+  static const uint64_t TREE_EXTENSION_VERSION = 9;
+
+  // returns the size of a new tree's base block
+  static size_t tree_base_size();
+  uint64_t create_tree_base();
+  // returns a field of the tree's extension, or 0 if the tree doesn't have an
+  // extension or the extension doesn't contain the field
+  uint64_t extension_field(size_t field_offset) const;
+  // returns the offset of the tree's extension, allocating it or adding the
+  // current version's fields to it if needed. this may allocate, so it
+  // invalidates pointers into the pool. throws std::runtime_error if the tree
+  // was created by a version that didn't have extensions
+  uint64_t writable_extension_offset();
+
+  // records an attached structure's base offset (or 0, when detaching) in the
+  // given field of the tree's extension. throws std::invalid_argument if a
+  // different structure is already recorded there. does nothing if the tree
+  // was created by a version that didn't have extensions. locks the pool.
+  void record_attachment(size_t field_offset, uint64_t base,
+      const char* what);
+  // throws std::runtime_error if a filter, watch table, write-ahead log or
+  // expiry index is recorded in the tree's extension but isn't attached to
+  // this object. called by all methods that change keys or values, with the
+  // pool locked for writing.
+  void check_attachments() const;
+
   void increment_item_count(ssize_t delta);
   void increment_node_count(ssize_t delta);
 
+  void add_to_filter(const void* k, size_t k_size);
+  bool may_contain(const void* k, size_t k_size) const;
+
+  void notify_watchers(const void* k, size_t k_size);
+  void log_change(WriteAheadLog::Operation op,
+      WriteAheadLog::ValueType value_type, const void* k, size_t k_size,
+      const void* v = NULL, size_t v_size = 0);
+
   struct Traversal {
     uint64_t value_slot_offset;
     std::vector<uint64_t> node_offsets;
@@ -298,6 +631,86 @@ private:
   Traversal traverse(const void* k, size_t s, bool return_values_only,
       bool with_nodes) const;
 
+  // returns the offset of the slot that refers to the subtree for a nonempty
+  // prefix (a subnode, a value, or nothing). if create is false, returns 0 if
+  // the slot is empty or doesn't exist.
+  uint64_t prefix_slot_offset(const void* prefix, size_t p_size, bool create);
+  // links a subtree into a slot, updating the subtree's root node if needed
+  void set_prefix_slot(uint64_t slot_offset, uint8_t slot, uint64_t contents);
+  // deletes the empty nodes on a path, except the root, starting from the leaf
+  void delete_empty_nodes(const std::vector<uint64_t>& node_offsets);
+  void delete_empty_nodes_for_prefix(const void* prefix, size_t p_size);
+  // reallocates a node with its range trimmed to its nonempty slots and links
+  // it into the parent node. if force is false, does this only if enough slots
+  // are empty. returns the node's new offset.
+  uint64_t shrink_node(uint64_t node_offset, uint64_t parent_node_offset,
+      bool force);
+  // shrinks all the nodes below a node; returns the number reallocated
+  size_t compact_child_nodes(uint64_t node_offset);
+  // copies a slot's contents from another tree, returning the new contents.
+  // counts the copied items and nodes.
+  uint64_t copy_contents_from(const PrefixTree& source, uint64_t contents,
+      uint8_t parent_slot, size_t* item_count, size_t* node_count);
+  // relocates the block referred to by a slot (and a moved node's value
+  // buffer), updating the slot. returns the slot's new contents.
+  uint64_t relocate_contents(uint64_t slot_offset, uint64_t limit);
+  // relocates the blocks in a node's subtree in key order, starting at the
+  // relocation cursor if resuming is true. returns false (and sets the cursor)
+  // if *max_blocks reaches zero first.
+  bool relocate_subtree(uint64_t node_offset, std::string& key, bool resuming,
+      uint64_t limit, size_t* max_blocks);
+  // adds all the keys in a subtree to the attached filter
+  void add_subtree_to_filter(std::string& prefix, uint64_t contents);
+
+  // expiry index entries are keyed by the big-endian expiration time followed
+  // by the key, so the first entry is the next key to expire. these modify the
+  // index without locking it, since it's in this tree's (locked) pool
+  static std::string expiry_index_entry(uint64_t expiration, const void* k,
+      size_t k_size);
+  void add_expiry_index_entry(const std::string& entry);
+  void remove_expiry_index_entry(const std::string& entry);
+  // appends the index entries for the expiring values in a subtree to entries,
+  // naming the keys as if the subtree were at prefix. subtrees that move to
+  // another prefix or tier use this to move their entries with them
+  void expiry_index_entries_for_subtree(std::string& prefix, uint64_t contents,
+      std::vector<std::string>& entries) const;
+  // appends the first key in a node's subtree to key; returns false if the
+  // subtree contains no values
+  bool first_key_in_subtree(uint64_t node_offset, std::string& key) const;
+
+  // returns a value slot's contents, replacing an Expiring value with the
+  // contents it wraps, or with 0 if it has expired
+  uint64_t unexpired_contents(uint64_t contents) const;
+  // returns the offset of the slot that holds a value's contents (the wrapped
+  // slot for an Expiring value), first clearing the value if it has expired
+  uint64_t unexpired_value_slot_offset(uint64_t slot_offset);
+
+  // returns the cold tier if a key is in a demoted prefix, or NULL if it's in
+  // this tree. this is fast if the tree has no demoted prefixes
+  PrefixTree* cold_tier_for(const void* k, size_t k_size) const;
+  // returns the attached cold tier; throws runtime_error if there isn't one
+  PrefixTree* required_cold_tier() const;
+  size_t cold_prefix_count() const;
+  // returns true if a subtree contains any ColdSubtree markers
+  bool subtree_has_cold_prefixes(uint64_t contents) const;
+  // dedup index entries are keyed by the value's big-endian hash, and their
+  // values are Ints holding the SharedValue's offset. these modify the index
+  // without locking it, like the expiry index functions
+  PrefixTree* get_dedup_index();
+  bool should_share_value(size_t v_size) const;
+  // returns the offset of a SharedValue holding the given value with a new
+  // reference, creating it if needed, or 0 if the value shouldn't be shared
+  // (or if a different shared value has the same hash)
+  uint64_t acquire_shared_value(const void* v, size_t v_size);
+  void release_shared_value(uint64_t shared_offset);
+
+  // finds the first key in the cold tier that begins with prefix and is after
+  // current (or at or after prefix, if current is NULL). returns false if
+  // there's no such key
+  bool next_cold_key_value(const std::string& prefix, const void* current,
+      size_t size, bool return_value,
+      std::pair<std::string, LookupResult>& ret) const;
+
   bool execute_check(const CheckRequest& check) const;
 
   std::pair<std::string, LookupResult> next_key_value_internal(
@@ -316,7 +729,15 @@ private:
   static int64_t int_value_for_contents(uint64_t s);
   static uint64_t value_for_contents(uint64_t s);
   static StoredValueType type_for_contents(uint64_t s);
+  static ExtendedValueType extended_type_for_contents(uint64_t s);
+  static bool is_expiring_contents(uint64_t s);
+  static bool is_cold_subtree_contents(uint64_t s);
+  static bool is_shared_contents(uint64_t s);
   static bool slot_has_child(uint64_t s);
+
+  // for RecordApplier, which sets attachments_required and
+  // applied_sequence_offset
+  friend class WriteAheadLog;
 };
 
 
@@ -3,10 +3,12 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <map>
 #include <phosg/Strings.hh>
 #include <phosg/Time.hh>
 #include <phosg/UnitTest.hh>
@@ -569,6 +571,91 @@ void run_reorganization_test(const string& allocator_type) {
   expect_eq(initial_pool_allocated, table->get_allocator()->bytes_allocated());
 }
 
+void run_node_shrink_test(const string& allocator_type) {
+  printf("-- [%s] node shrink\n", allocator_type.c_str());
+
+  auto table = get_or_create_tree("test-table", allocator_type);
+  size_t initial_pool_allocated = table->get_allocator()->bytes_allocated();
+
+  // a node with children at both ends of a wide range
+  unordered_map<string, LookupResult> expected_state;
+  for (const char* k : {"a0", "a1", "az"}) {
+    expect_eq(true, table->insert(k, strlen(k), k, strlen(k)));
+    expected_state.emplace(k, k);
+  }
+  verify_state(expected_state, table, 2,
+      "([00,FF]@00+#,"
+      "61:("
+      "  [30,7A]@61+#,"
+      "  30:s\"a0\","
+      "  31:s\"a1\","
+      "  7A:s\"az\"))");
+
+  // erasing the child at the end leaves most of the slots empty, so the node
+  // is reallocated with only the slots it needs
+  table->erase("az", 2);
+  expected_state.erase("az");
+  verify_state(expected_state, table, 2,
+      "([00,FF]@00+#,"
+      "61:("
+      "  [30,31]@61+#,"
+      "  30:s\"a0\","
+      "  31:s\"a1\"))");
+
+  // the node can be extended again afterward
+  expect_eq(true, table->insert("a", 1, "a", 1));
+  expected_state.emplace("a", "a");
+  expect_eq(true, table->insert("a5", 2, "a5", 2));
+  expected_state.emplace("a5", "a5");
+  verify_state(expected_state, table, 2,
+      "([00,FF]@00+#,"
+      "61:("
+      "  [30,35]@61+s\"a\","
+      "  30:s\"a0\","
+      "  31:s\"a1\","
+      "  35:s\"a5\"))");
+
+  // erasing a5 would save only a few slots, so erase doesn't reallocate the
+  // node, but compact_nodes does
+  table->erase("a5", 2);
+  expected_state.erase("a5");
+  verify_state(expected_state, table, 2,
+      "([00,FF]@00+#,"
+      "61:("
+      "  [30,35]@61+s\"a\","
+      "  30:s\"a0\","
+      "  31:s\"a1\"))");
+  expect_eq(1, table->compact_nodes());
+  verify_state(expected_state, table, 2,
+      "([00,FF]@00+#,"
+      "61:("
+      "  [30,31]@61+s\"a\","
+      "  30:s\"a0\","
+      "  31:s\"a1\"))");
+  expect_eq(0, table->compact_nodes());
+
+  // nodes deeper in the tree are shrunk too, and keep their values
+  for (const char* k : {"a0b", "a0bx", "a0b\xFF"}) {
+    expect_eq(true, table->insert(k, strlen(k), k, strlen(k)));
+    expected_state.emplace(k, k);
+  }
+  table->erase("a0b\xFF", 4);
+  expected_state.erase("a0b\xFF");
+  verify_state(expected_state, table, 4,
+      "([00,FF]@00+#,"
+      "61:("
+      "  [30,31]@61+s\"a\","
+      "  30:("
+      "    [62,62]@30+s\"a0\","
+      "    62:("
+      "      [78,78]@62+s\"a0b\","
+      "      78:s\"a0bx\")),"
+      "  31:s\"a1\"))");
+
+  table->clear();
+  expect_eq(initial_pool_allocated, table->get_allocator()->bytes_allocated());
+}
+
 void run_types_test(const string& allocator_type) {
   printf("-- [%s] types\n", allocator_type.c_str());
 
@@ -970,6 +1057,702 @@ void run_concurrent_writers_test(const string& allocator_type) {
 }
 
 
+void run_move_prefix_test(const string& allocator_type) {
+  printf("-- [%s] move prefix\n", allocator_type.c_str());
+
+  auto table = get_or_create_tree("test-table", allocator_type);
+  table->clear();
+  expect_eq(0, table->size());
+  expect_eq(1, table->node_size());
+
+  // a key stored directly in a slot in the root node (no subtree)
+  table->insert(string("a"), (int64_t)1);
+  expect_eq(true, table->move_prefix(string("a"), string("b")));
+  verify_state({{"b", LookupResult((int64_t)1)}}, table, 1);
+
+  // a subtree, replacing an existing one. the subtree's own key moves too,
+  // and the empty nodes left behind on the source path are deleted
+  table->insert(string("src"), string("value"));
+  table->insert(string("src1"), (int64_t)2);
+  table->insert(string("src12"), 3.0);
+  table->insert(string("srcx"), true);
+  table->insert(string("dst"), string("old value"));
+  table->insert(string("dst9"), (int64_t)9);
+  table->insert(string("dst99"), (int64_t)99);
+  expect_eq(true, table->move_prefix(string("src"), string("dst")));
+  unordered_map<string, LookupResult> expected({
+      {"b", LookupResult((int64_t)1)},
+      {"dst", LookupResult("value")},
+      {"dst1", LookupResult((int64_t)2)},
+      {"dst12", LookupResult(3.0)},
+      {"dstx", LookupResult(true)}});
+  verify_state(expected, table, 5);
+  expect_eq(table->node_size(), table->nodes_for_prefix(string("")));
+  expect_key_missing(table, "src", 3);
+  expect_key_missing(table, "dst9", 4);
+
+  // moving to a path that doesn't exist creates it
+  expect_eq(true, table->move_prefix(string("dst"), string("new/deep/dst")));
+  expected = {
+      {"b", LookupResult((int64_t)1)},
+      {"new/deep/dst", LookupResult("value")},
+      {"new/deep/dst1", LookupResult((int64_t)2)},
+      {"new/deep/dst12", LookupResult(3.0)},
+      {"new/deep/dstx", LookupResult(true)}};
+  verify_state(expected, table, 14);
+  expect_eq(table->node_size(), table->nodes_for_prefix(string("")));
+
+  // moving a missing prefix does nothing, even to the destination
+  expect_eq(false, table->move_prefix(string("missing"), string("b")));
+  verify_state(expected, table, 14);
+
+  // the prefixes can't overlap or be empty
+  for (const auto& it : vector<pair<string, string>>({{"new", "new/deep"},
+      {"new/deep", "new"}, {"b", "b"}, {"", "b"}, {"b", ""}})) {
+    try {
+      table->move_prefix(it.first, it.second);
+      expect(false);
+    } catch (const invalid_argument& e) { }
+    try {
+      table->swap_prefixes(it.first, it.second);
+      expect(false);
+    } catch (const invalid_argument& e) { }
+  }
+  verify_state(expected, table, 14);
+
+  // swapping generations, including when one side is empty
+  table->clear();
+  for (size_t x = 0; x < 100; x++) {
+    table->insert(string_printf("gen1/key%zu", x), (int64_t)x);
+    table->insert(string_printf("gen2/key%zu", x), (int64_t)(x + 100));
+  }
+  expect_eq(true, table->swap_prefixes(string("gen1/"), string("gen2/")));
+  expect_eq(200, table->size());
+  expect_eq(LookupResult((int64_t)150), table->at("gen1/key50"));
+  expect_eq(LookupResult((int64_t)50), table->at("gen2/key50"));
+  expect_eq(true, table->swap_prefixes(string("gen2/"), string("gen3/")));
+  expect_eq(200, table->size());
+  expect_key_missing(table, "gen2/key50", 10);
+  expect_eq(LookupResult((int64_t)50), table->at("gen3/key50"));
+  expect_eq(false, table->swap_prefixes(string("gen2/"), string("gen4/")));
+  expect_eq(table->node_size(), table->nodes_for_prefix(string("")));
+
+  // moved keys are added to the filter, so they can be found through it
+  shared_ptr<Filter> filter(new Filter(table->get_allocator(), 10, 4));
+  table->attach_filter(filter, true);
+  expect_eq(true, table->move_prefix(string("gen3/"), string("moved/")));
+  expect_eq(true, table->swap_prefixes(string("gen1/"), string("swapped/")));
+  for (size_t x = 0; x < 100; x++) {
+    expect_eq(LookupResult((int64_t)x),
+        table->at(string_printf("moved/key%zu", x)));
+    expect_eq(LookupResult((int64_t)(x + 100)),
+        table->at(string_printf("swapped/key%zu", x)));
+  }
+  table->attach_filter(nullptr);
+
+  table->get_allocator()->verify();
+}
+
+
+void run_expiry_test(const string& allocator_type) {
+  printf("-- [%s] expiry\n", allocator_type.c_str());
+
+  auto table = get_or_create_tree("test-table", allocator_type);
+  table->clear();
+  shared_ptr<PrefixTree> index(new PrefixTree(table->get_allocator()));
+  table->attach_expiry_index(index);
+  expect_eq(index, table->get_expiry_index());
+
+  // a tree can't index its own expirations
+  try {
+    table->attach_expiry_index(table);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+
+  uint64_t start_time = now();
+  uint64_t future = start_time + 3600000000;
+  expect_eq(false, table->set_expiration(string("missing"), future));
+
+  table->insert(string("a"), string("a value that isn\'t short"));
+  table->insert(string("ab"), (int64_t)5);
+  table->insert(string("abc"), 2.5);
+  table->insert(string("b"), true);
+  table->insert(string("c"), string("persistent"));
+  expect_eq(true, table->set_expiration(string("a"), future));
+  expect_eq(true, table->set_expiration(string("ab"), future + 1));
+  expect_eq(true, table->set_expiration(string("abc"), future + 2));
+  expect_eq(true, table->set_expiration(string("b"), future + 3));
+  expect_eq(future, table->expiration(string("a")));
+  expect_eq(0, table->expiration(string("c")));
+  expect_eq(4, index->size());
+  unordered_map<string, LookupResult> expected({
+      {"a", LookupResult("a value that isn\'t short")},
+      {"ab", LookupResult((int64_t)5)},
+      {"abc", LookupResult(2.5)},
+      {"b", LookupResult(true)},
+      {"c", LookupResult("persistent")}});
+  verify_state(expected, table, 3);
+
+  // incr modifies the wrapped value, so the key keeps its expiration
+  expect_eq(7, table->incr(string("ab"), (int64_t)2));
+  expect_eq(future + 1, table->expiration(string("ab")));
+  expected.at("ab") = LookupResult((int64_t)7);
+
+  // nothing is reclaimed before it expires
+  expect_eq(0, table->reclaim_expired());
+  expect_eq(0, table->reclaim_expired(1024, future - 1));
+  verify_state(expected, table, 3);
+
+  // an expired key is missing to lookups, checks and iteration, but counts
+  // toward the size until it's reclaimed
+  expect_eq(true, table->set_expiration(string("b"), start_time - 1));
+  expect_eq(false, table->exists(string("b")));
+  expect_eq(PrefixTree::ResultValueType::Missing, table->type(string("b")));
+  expect_key_missing(table, "b", 1);
+  try {
+    table->expiration(string("b"));
+    expect(false);
+  } catch (const out_of_range& e) { }
+  expect_eq(false, table->set_expiration(string("b"), future));
+  PrefixTree::CheckRequest check("b", 1, PrefixTree::ResultValueType::Missing);
+  expect_eq(true, table->insert(string("checked"), &check));
+  expect_eq(true, table->erase("checked"));
+  expect_eq(5, table->size());
+  size_t keys_iterated = 0;
+  for (const auto& it : *table) {
+    expect_ne("b", it.first);
+    keys_iterated++;
+  }
+  expect_eq(4, keys_iterated);
+
+  // erasing an expired key deletes it, but reports it as missing
+  table->insert(string("d"), (int64_t)4);
+  expect_eq(true, table->set_expiration(string("d"), start_time - 1));
+  expect_eq(6, table->size());
+  expect_eq(false, table->erase(string("d")));
+  expect_eq(5, table->size());
+
+  // incr replaces an expired key, and the new value doesn't expire
+  expect_eq(3, table->incr(string("b"), (int64_t)3));
+  expect_eq(0, table->expiration(string("b")));
+  expected.at("b") = LookupResult((int64_t)3);
+
+  // inserting a new value removes the expiration, as does setting it to 0
+  table->insert(string("abc"), 1.0);
+  expect_eq(0, table->expiration(string("abc")));
+  expected.at("abc") = LookupResult(1.0);
+  expect_eq(true, table->set_expiration(string("ab"), 0));
+  expect_eq(0, table->expiration(string("ab")));
+  verify_state(expected, table, 3);
+
+  // the index still has entries for b, d and abc, which are stale now. b's and
+  // d's are dropped without erasing anything
+  expect_eq(4, index->size());
+  expect_eq(0, table->reclaim_expired());
+  expect_eq(2, index->size());
+  expect_eq(1, table->reclaim_expired(1024, future + 10));
+  expect_eq(0, index->size());
+  expected.erase("a");
+  verify_state(expected, table, 3);
+
+  // reclaiming takes keys in expiration order, and stops after max_entries
+  for (size_t x = 0; x < 1000; x++) {
+    string key = string_printf("key%zu", x);
+    table->insert(key, (int64_t)x);
+    expect_eq(true, table->set_expiration(key, start_time - 2000 + x));
+    table->insert(string_printf("persistent%zu", x), (int64_t)x);
+  }
+  expect_eq(2004, table->size());
+  expect_eq(100, table->reclaim_expired(100));
+  expect_eq(1904, table->size());
+  expect_eq(900, index->size());
+  expect_key_missing(table, "key99", 5);
+  expect_eq(false, table->exists(string("key100")));
+  expect_eq(900, table->reclaim_expired());
+  expect_eq(1004, table->size());
+  expect_eq(0, index->size());
+  expect_eq(LookupResult((int64_t)999), table->at("persistent999"));
+
+  // moving or swapping prefixes renames the keys' index entries too, so the
+  // moved keys are still reclaimed when they expire
+  table->insert(string("m/x"), (int64_t)1);
+  table->insert(string("m/y"), (int64_t)2);
+  table->insert(string("n/x"), (int64_t)3);
+  expect_eq(true, table->set_expiration(string("m/x"), start_time - 1));
+  expect_eq(true, table->set_expiration(string("m/y"), future));
+  expect_eq(true, table->set_expiration(string("n/x"), start_time - 2));
+  expect_eq(true, table->move_prefix(string("m/"), string("o/")));
+  expect_eq(3, index->size());
+  expect_eq(true, table->swap_prefixes(string("n/"), string("o/")));
+  expect_eq(3, index->size());
+  expect_eq(future, table->expiration(string("n/y")));
+  expect_eq(1007, table->size());
+  expect_eq(2, table->reclaim_expired());
+  expect_eq(1005, table->size());
+  expect_eq(1, index->size());
+  expect_eq(false, table->exists(string("n/x")));
+  expect_eq(false, table->exists(string("o/x")));
+  expect_eq(LookupResult((int64_t)2), table->at("n/y"));
+  expect_eq(true, table->set_expiration(string("n/y"), 0));
+  expect_eq(0, index->size());
+
+  // clearing the tree clears the index too
+  expect_eq(true, table->set_expiration(string("c"), future));
+  expect_eq(1, index->size());
+  table->clear();
+  expect_eq(0, index->size());
+  expect_eq(1, index->node_size());
+
+  table->attach_expiry_index(nullptr);
+  try {
+    table->reclaim_expired();
+    expect(false);
+  } catch (const logic_error& e) { }
+
+  table->get_allocator()->verify();
+}
+
+
+void run_cold_tier_test(const string& allocator_type) {
+  printf("-- [%s] cold tier\n", allocator_type.c_str());
+
+  auto table = get_or_create_tree("test-table", allocator_type);
+  table->clear();
+  Pool::delete_pool("test-table-cold");
+  auto cold_tier = get_or_create_tree("test-table-cold", allocator_type);
+
+  // the cold tier must be in another pool
+  try {
+    table->attach_cold_tier(table);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    table->demote_prefix(string("user"));
+    expect(false);
+  } catch (const logic_error& e) { }
+  table->attach_cold_tier(cold_tier);
+  expect_eq(cold_tier, table->get_cold_tier());
+
+  map<string, LookupResult> expected({
+      {"a", LookupResult()},
+      {"user:1", LookupResult(true)},
+      {"user:1:age", LookupResult((int64_t)30)},
+      {"user:1:name", LookupResult("a name that isn\'t short")},
+      {"user:2:name", LookupResult("name")},
+      {"users", LookupResult(2.5)}});
+  for (const auto& it : expected) {
+    table->insert(it.first, it.second);
+  }
+  auto verify = [&]() {
+    expect_eq(expected.size(), table->size());
+    for (const auto& it : expected) {
+      expect_eq(it.second, table->at(it.first));
+    }
+    // iteration visits both tiers in key order
+    auto expected_it = expected.begin();
+    for (const auto& it : *table) {
+      expect_ne(expected_it, expected.end());
+      expect_eq(expected_it->first, it.first);
+      expect_eq(expected_it->second, it.second);
+      expected_it++;
+    }
+    expect_eq(expected_it, expected.end());
+  };
+
+  // demoting moves the keys but doesn't change what the tree contains
+  size_t hot_node_size = table->node_size();
+  expect_eq(3, table->demote_prefix(string("user:1")));
+  expect_eq(3, cold_tier->size());
+  expect_lt(table->node_size(), hot_node_size);
+  expect_eq(0, table->demote_prefix(string("user:1")));
+  expect_eq(0, table->demote_prefix(string("user:1:name")));
+  expect_eq(0, table->demote_prefix(string("missing")));
+  verify();
+  expect_eq(true, table->exists(string("user:1:age")));
+  expect_eq(false, table->exists(string("user:1:missing")));
+  expect_eq(PrefixTree::ResultValueType::Int, table->type(string("user:1:age")));
+  expect_key_missing(table, "user:1:missing", 14);
+  expect_eq("user:1:name", table->next_key(string("user:1:age")));
+  expect_eq("user:2:name", table->next_key(string("user:1:name")));
+  expect_eq("user:1", table->next_key(string("a")));
+
+  // writes to keys in the demoted prefix go to the cold tier
+  table->insert(string("user:1:email"), string("user@example.com"));
+  expected.emplace("user:1:email", "user@example.com");
+  expect_eq(31, table->incr(string("user:1:age"), (int64_t)1));
+  expected.at("user:1:age") = LookupResult((int64_t)31);
+  expect_eq(true, table->erase(string("user:1:name")));
+  expected.erase("user:1:name");
+  expect_eq(false, table->erase(string("user:1:name")));
+  PrefixTree::CheckRequest check("user:1:age", 10, (int64_t)30);
+  expect_eq(false, table->insert(string("a"), (int64_t)1, &check));
+  check.value = LookupResult((int64_t)31);
+  expect_eq(true, table->insert(string("user:1"), false, &check));
+  expected.at("user:1") = LookupResult(false);
+  uint64_t future = now() + 3600000000;
+  expect_eq(true, table->set_expiration(string("user:1:email"), future));
+  expect_eq(future, table->expiration(string("user:1:email")));
+  expect_eq(3, cold_tier->size());
+  verify();
+
+  // a prefix that contains a demoted prefix can't be demoted, and prefixes
+  // can't be moved at all
+  try {
+    table->demote_prefix(string("user"));
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  try {
+    table->move_prefix(string("users"), string("people"));
+    expect(false);
+  } catch (const logic_error& e) { }
+
+  // another process that doesn't attach the cold tier can still use the hot
+  // keys, but not the cold ones
+  {
+    auto other_table = get_or_create_tree("test-table", allocator_type);
+    expect_eq(LookupResult(2.5), other_table->at("users"));
+    try {
+      other_table->at("user:1:age");
+      expect(false);
+    } catch (const runtime_error& e) { }
+  }
+
+  // promoting moves the keys back
+  try {
+    table->promote_prefix(string("user:1:age"));
+    expect(false);
+  } catch (const invalid_argument& e) { }
+  expect_eq(0, table->promote_prefix(string("user:2")));
+  expect_eq(3, table->promote_prefix(string("user:1")));
+  expect_eq(0, cold_tier->size());
+  expect_eq(future, table->expiration(string("user:1:email")));
+  verify();
+  table->move_prefix(string("users"), string("people"));
+  expected.emplace("people", expected.at("users"));
+  expected.erase("users");
+  verify();
+
+  // demoting a key that has no subtree works too, and clearing the tree
+  // clears the cold tier
+  expect_eq(1, table->demote_prefix(string("a")));
+  expect_eq(1, table->demote_prefix(string("user:2")));
+  verify();
+  table->clear();
+  expect_eq(0, table->size());
+  expect_eq(0, cold_tier->size());
+  table->insert(string("user:1"), (int64_t)1);
+  expect_eq(LookupResult((int64_t)1), table->at("user:1"));
+  expect_eq(1, table->size());
+
+  // the index entries for expiring keys move between the tiers' expiry
+  // indexes along with the keys
+  shared_ptr<PrefixTree> index(new PrefixTree(table->get_allocator()));
+  shared_ptr<PrefixTree> cold_index(new PrefixTree(cold_tier->get_allocator()));
+  table->attach_expiry_index(index);
+  cold_tier->attach_expiry_index(cold_index);
+  table->insert(string("user:3:session"), (int64_t)5);
+  expect_eq(true, table->set_expiration(string("user:3:session"), now() - 1));
+  expect_eq(1, table->demote_prefix(string("user:3")));
+  expect_eq(0, index->size());
+  expect_eq(1, cold_index->size());
+  expect_eq(1, table->promote_prefix(string("user:3")));
+  expect_eq(1, index->size());
+  expect_eq(0, cold_index->size());
+  expect_eq(1, table->reclaim_expired());
+  expect_eq(false, table->exists(string("user:3:session")));
+  expect_eq(1, table->size());
+  table->attach_expiry_index(nullptr);
+  cold_tier->attach_expiry_index(nullptr);
+
+  table->attach_cold_tier(nullptr);
+  table->get_allocator()->verify();
+  cold_tier->get_allocator()->verify();
+}
+
+
+void run_dedup_test(const string& allocator_type) {
+  printf("-- [%s] dedup\n", allocator_type.c_str());
+
+  auto table = get_or_create_tree("test-table", allocator_type);
+  table->clear();
+  expect_eq(0, table->dedup_min_size());
+  expect_eq(0, table->shared_value_count());
+
+  string blob(1000, 'b');
+  string other_blob(1000, 'o');
+  table->insert(string("before"), blob);
+  size_t unshared_bytes = table->bytes_for_prefix(string("before"));
+
+  table->set_dedup_min_size(100);
+  expect_eq(100, table->dedup_min_size());
+
+  // identical values above the threshold share one buffer; small values and
+  // values inserted before dedup was enabled don't
+  size_t free_bytes = table->get_allocator()->bytes_free();
+  unordered_map<string, LookupResult> expected({{"before", LookupResult(blob)}});
+  for (size_t x = 0; x < 100; x++) {
+    string key = string_printf("key%zu", x);
+    table->insert(key, blob);
+    expected.emplace(key, LookupResult(blob));
+  }
+  table->insert(string("small"), string(99, 's'));
+  expected.emplace("small", LookupResult(string(99, 's')));
+  struct iovec iov[2];
+  iov[0].iov_base = const_cast<char*>(other_blob.data());
+  iov[0].iov_len = 500;
+  iov[1].iov_base = const_cast<char*>(other_blob.data() + 500);
+  iov[1].iov_len = 500;
+  table->insert(string("iovec"), iov, 2);
+  table->insert(string("other"), other_blob);
+  expected.emplace("iovec", LookupResult(other_blob));
+  expected.emplace("other", LookupResult(other_blob));
+  expect_eq(2, table->shared_value_count());
+  expect_lt(free_bytes - table->get_allocator()->bytes_free(), 20 * blob.size());
+  for (const auto& it : expected) {
+    expect_eq(it.second, table->at(it.first));
+  }
+  expect_eq(PrefixTree::ResultValueType::String, table->type(string("key0")));
+  expect_eq(expected.size(), table->size());
+
+  // each key is charged part of the shared buffer
+  expect_lt(table->bytes_for_prefix(string("key0")), unshared_bytes / 10);
+  expect_lt(table->bytes_for_prefix(string("key")), unshared_bytes * 2);
+
+  // checks compare the shared value
+  PrefixTree::CheckRequest check("key1", 4, blob.data(), blob.size());
+  expect_eq(true, table->insert(string("checked"), (int64_t)1, &check));
+  expected.emplace("checked", LookupResult((int64_t)1));
+
+  // overwriting or erasing a key releases its reference; the buffer is freed
+  // with the last one
+  for (size_t x = 0; x < 99; x++) {
+    expect_eq(true, table->erase(string_printf("key%zu", x)));
+    expected.erase(string_printf("key%zu", x));
+  }
+  expect_eq(2, table->shared_value_count());
+  table->insert(string("key99"), other_blob);
+  expected.at("key99") = LookupResult(other_blob);
+  expect_eq(1, table->shared_value_count());
+  table->insert(string("other"), other_blob);
+  expect_eq(1, table->shared_value_count());
+  expect_eq(LookupResult(other_blob), table->at("other"));
+
+  // expiring values can be shared too
+  expect_eq(true, table->set_expiration(string("other"), now() - 1));
+  expect_key_missing(table, "other", 5);
+  table->insert(string("other"), blob);
+  expected.at("other") = LookupResult(blob);
+  expect_eq(2, table->shared_value_count());
+
+  // another process sees the shared values and the setting
+  {
+    auto other_table = get_or_create_tree("test-table", allocator_type);
+    expect_eq(100, other_table->dedup_min_size());
+    expect_eq(LookupResult(other_blob), other_table->at("iovec"));
+    other_table->insert(string("from-other"), blob);
+    expected.emplace("from-other", LookupResult(blob));
+    expect_eq(2, other_table->shared_value_count());
+  }
+  for (const auto& it : expected) {
+    expect_eq(it.second, table->at(it.first));
+  }
+
+  // disabling dedup stops sharing new values, but shared values stay shared
+  table->set_dedup_min_size(0);
+  table->insert(string("unshared"), blob);
+  expected.emplace("unshared", LookupResult(blob));
+  expect_eq(2, table->shared_value_count());
+  expect_eq(expected.size(), table->size());
+  for (const auto& it : expected) {
+    expect_eq(it.second, table->at(it.first));
+  }
+
+  table->clear();
+  expect_eq(0, table->shared_value_count());
+  table->get_allocator()->verify();
+}
+
+
+void run_rebuild_test(const string& allocator_type) {
+  printf("-- [%s] rebuild\n", allocator_type.c_str());
+
+  auto table = get_or_create_tree("test-table", allocator_type);
+  table->clear();
+  shared_ptr<InternTable> intern_table(new InternTable(
+      table->get_allocator(), 6));
+  table->attach_intern_table(intern_table);
+
+  // churn the tree, so its nodes have ranges wider than they need
+  for (size_t x = 0; x < 2000; x++) {
+    table->insert(string_printf("key%zu", x), (int64_t)x);
+  }
+  for (size_t x = 0; x < 2000; x++) {
+    if (x % 10) {
+      table->erase(string_printf("key%zu", x));
+    }
+  }
+  table->insert(string("string"), string("a value that isn't short"));
+  table->insert(string("short"), string("abc"));
+  table->insert(string("empty"), string(""));
+  table->insert(string("long-int"), (int64_t)0x7FFFFFFFFFFFFFFF);
+  table->insert(string("double"), 2.5);
+  table->insert(string("zero"), 0.0);
+  table->insert(string("null"));
+  table->insert(string("true"), true);
+  table->insert_interned(string("interned"), string("interned value"));
+  table->insert_interned(string("interned-short"), string("iv"));
+
+  unordered_map<string, LookupResult> expected;
+  for (const auto& it : *table) {
+    expected.emplace(it.first, it.second);
+  }
+
+  // can't rebuild into the same pool
+  try {
+    table->rebuild_into(table->get_allocator());
+    expect(false);
+  } catch (const invalid_argument& e) { }
+
+  Pool::delete_pool("test-table-rebuilt");
+  {
+    shared_ptr<Pool> pool(new Pool("test-table-rebuilt"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    uint64_t base_offset = table->rebuild_into(alloc);
+    expect_eq(base_offset, alloc->base_object_offset());
+
+    // interned values are plain strings in the copy, so it works without the
+    // intern table
+    shared_ptr<PrefixTree> rebuilt(new PrefixTree(alloc, 0));
+    verify_state(expected, rebuilt, rebuilt->nodes_for_prefix(string("")));
+    expect_eq(LookupResult("interned value"), rebuilt->at("interned"));
+    // erase already trims nodes that have many empty slots, so the copy may
+    // not be much smaller, but it's never larger
+    expect_le(rebuilt->node_size(), table->node_size());
+    expect_le(rebuilt->bytes_for_prefix(string("")),
+        table->bytes_for_prefix(string("")));
+    alloc->verify();
+
+    // the copy is an ordinary tree
+    rebuilt->insert(string("key1"), string("new value"));
+    expect_eq(true, rebuilt->erase("key10"));
+    expect_eq(expected.size(), rebuilt->size());
+    expect_eq(rebuilt->node_size(), rebuilt->nodes_for_prefix(string("")));
+  }
+  Pool::delete_pool("test-table-rebuilt");
+
+  table->attach_intern_table(nullptr);
+}
+
+
+void run_private_view_test(const string& allocator_type) {
+  printf("-- [%s] private view\n", allocator_type.c_str());
+
+  auto table = get_or_create_tree("test-table", allocator_type);
+  table->clear();
+  for (size_t x = 0; x < 100; x++) {
+    table->insert(string_printf("key%zu", x), (int64_t)x);
+  }
+  size_t pool_size = table->get_allocator()->get_pool()->size();
+
+  shared_ptr<Pool> view = table->get_allocator()->private_view();
+  expect_eq(true, view->is_private_view());
+  shared_ptr<Allocator> view_alloc = create_allocator(view, allocator_type);
+  shared_ptr<PrefixTree> view_table(new PrefixTree(view_alloc, table->base()));
+  expect_eq(100, view_table->size());
+  expect_eq(LookupResult((int64_t)50), view_table->at("key50"));
+
+  // changes in the view (including expanding it) aren't visible in the pool
+  for (size_t x = 0; x < 20000; x++) {
+    view_table->insert(string_printf("view-key%zu", x), string(1024, 'v'));
+  }
+  expect_eq(true, view_table->erase("key50"));
+  expect_lt(pool_size, view->size());
+  expect_eq(20099, view_table->size());
+  expect_eq(LookupResult(string(1024, 'v')), view_table->at("view-key19999"));
+  expect_eq(100, table->size());
+  expect_eq(pool_size, table->get_allocator()->get_pool()->size());
+  expect_eq(LookupResult((int64_t)50), table->at("key50"));
+  expect_key_missing(table, "view-key0", 9);
+
+  // changes in the pool aren't visible in the view
+  table->insert(string("pool-key"), string("pool-value"));
+  expect_key_missing(view_table, "pool-key", 8);
+
+  view_alloc->verify();
+  table->get_allocator()->verify();
+}
+
+
+void run_old_format_test(const string& allocator_type) {
+  printf("-- [%s] old format\n", allocator_type.c_str());
+
+  // trees created before cold tiers and dedup existed have a smaller base
+  // (item_count, node_count and the root node). they can still be used, but
+  // can't demote prefixes or share values until they're rebuilt
+  shared_ptr<Pool> pool(new Pool("test-table"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  uint64_t base_offset;
+  {
+    auto g = alloc->lock(true);
+    // the root node has start, end and parent_slot (padded to 8 bytes), the
+    // value and 256 children
+    size_t base_size = 2 * sizeof(uint64_t) + 2 * sizeof(uint64_t) +
+        0x100 * sizeof(uint64_t);
+    base_offset = alloc->allocate(base_size);
+    memset(pool->at<void>(base_offset), 0, base_size);
+    uint64_t* base = pool->at<uint64_t>(base_offset);
+    base[1] = 1; // node_count
+    *pool->at<uint8_t>(base_offset + 2 * sizeof(uint64_t) + 1) = 0xFF; // end
+    uint64_t next_offset = alloc->allocate(sizeof(uint64_t));
+    *pool->at<uint64_t>(next_offset) = 0xFFFFFFFFFFFFFFF8;
+  }
+
+  shared_ptr<PrefixTree> table(new PrefixTree(alloc, base_offset));
+  unordered_map<string, LookupResult> expected;
+  for (size_t x = 0; x < 10; x++) {
+    string key = string_printf("user:%zu", x);
+    string value = string_printf("value%zu", x);
+    table->insert(key, value);
+    expected.emplace(key, LookupResult(value));
+  }
+  verify_state(expected, table, 6);
+  expect_eq(0, table->dedup_min_size());
+  expect_eq(0, table->shared_value_count());
+  table->set_dedup_min_size(0);
+  try {
+    table->set_dedup_min_size(100);
+    expect(false);
+  } catch (const runtime_error& e) { }
+
+  Pool::delete_pool("test-table-cold");
+  auto cold_tier = get_or_create_tree("test-table-cold", allocator_type);
+  table->attach_cold_tier(cold_tier);
+  try {
+    table->demote_prefix(string("user:1"));
+    expect(false);
+  } catch (const runtime_error& e) { }
+  verify_state(expected, table, 6);
+  expect_eq(0, cold_tier->size());
+  alloc->verify();
+
+  // the rebuilt tree is in the current format
+  Pool::delete_pool("test-table-rebuilt");
+  shared_ptr<Pool> rebuilt_pool(new Pool("test-table-rebuilt"));
+  shared_ptr<Allocator> rebuilt_alloc = create_allocator(rebuilt_pool,
+      allocator_type);
+  shared_ptr<PrefixTree> rebuilt(new PrefixTree(rebuilt_alloc,
+      table->rebuild_into(rebuilt_alloc)));
+  rebuilt->attach_cold_tier(cold_tier);
+  rebuilt->set_dedup_min_size(100);
+  expect_eq(100, rebuilt->dedup_min_size());
+  expect_eq(1, rebuilt->demote_prefix(string("user:1")));
+  expect_eq(expected.size(), rebuilt->size());
+  for (const auto& it : expected) {
+    expect_eq(it.second, rebuilt->at(it.first));
+  }
+}
+
+
 int main(int argc, char* argv[]) {
   int retcode = 0;
 
@@ -981,10 +1764,19 @@ int main(int argc, char* argv[]) {
       run_iovec_insert_test(allocator_type);
       run_conditional_writes_test(allocator_type);
       run_reorganization_test(allocator_type);
+      run_node_shrink_test(allocator_type);
       run_types_test(allocator_type);
       run_incr_test(allocator_type);
       run_concurrent_readers_test(allocator_type);
       run_concurrent_writers_test(allocator_type);
+      run_move_prefix_test(allocator_type);
+      run_expiry_test(allocator_type);
+      run_cold_tier_test(allocator_type);
+      run_dedup_test(allocator_type);
+      run_rebuild_test(allocator_type);
+      run_private_view_test(allocator_type);
+      Pool::delete_pool("test-table");
+      run_old_format_test(allocator_type);
     }
     printf("all tests passed\n");
 
@@ -993,6 +1785,8 @@ int main(int argc, char* argv[]) {
     retcode = 1;
   }
   Pool::delete_pool("test-table");
+  Pool::delete_pool("test-table-rebuilt");
+  Pool::delete_pool("test-table-cold");
 
   return retcode;
 }
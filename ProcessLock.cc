@@ -11,6 +11,7 @@
 
 #include <phosg/Process.hh>
 #include <phosg/Strings.hh>
+#include <phosg/Time.hh>
 
 using namespace std;
 
@@ -49,7 +50,7 @@ static const uint8_t PID_BITS = 18;
 static const uint8_t START_TIME_BITS = 32 - PID_BITS;
 static const uint8_t SPIN_LIMIT = 10;
 
-static int32_t this_process_token() {
+int32_t this_process_token() {
   return (this_process_start_time() << PID_BITS) | getpid_cached();
 }
 
@@ -65,7 +66,7 @@ static int32_t mask_start_time(int32_t start_time) {
   return start_time & ((1 << START_TIME_BITS) - 1);
 }
 
-static bool process_for_token_is_running(int32_t token) {
+bool process_for_token_is_running(int32_t token) {
   pid_t pid = pid_for_token(token);
   uint64_t start_time_token = start_time_for_token(token);
   uint64_t start_time = start_time_for_pid(pid);
@@ -77,7 +78,7 @@ static bool process_for_token_is_running(int32_t token) {
 
 #ifdef LINUX
 
-static bool futex_wait(atomic<int32_t>* lock, int32_t expected_value,
+bool futex_wait(atomic<int32_t>* lock, int32_t expected_value,
     const struct timespec* timeout) {
   if (syscall(SYS_futex, lock, FUTEX_WAIT, expected_value, timeout, NULL, 0) == -1) {
     if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
@@ -92,8 +93,8 @@ static bool futex_wait(atomic<int32_t>* lock, int32_t expected_value,
   return true;
 }
 
-static void futex_wake(atomic<int32_t>* lock, int32_t num_wakes) {
-  if (syscall(SYS_futex, lock, FUTEX_WAKE, 0, NULL, NULL, 0) == -1) {
+void futex_wake(atomic<int32_t>* lock, int32_t num_wakes) {
+  if (syscall(SYS_futex, lock, FUTEX_WAKE, num_wakes, NULL, NULL, 0) == -1) {
     throw runtime_error("futex_wake failed: " + string_for_error(errno));
   }
 }
@@ -148,6 +149,20 @@ static bool wait_for_reader_release(atomic<int32_t>* lock,
 
 #else // MACOSX
 
+bool futex_wait(atomic<int32_t>* lock, int32_t expected_value,
+    const struct timespec* timeout) {
+  // os x doesn't have futex, so we just yield and let the caller check the
+  // condition again. this is never a lost wakeup, since callers must always
+  // recheck their condition after this returns
+  if (lock->load() != expected_value) {
+    return true;
+  }
+  sched_yield();
+  return lock->load() != expected_value;
+}
+
+void futex_wake(atomic<int32_t>* lock, int32_t num_wakes) { }
+
 static bool acquire_process_lock(atomic<int32_t>* lock) {
   int32_t desired_value = this_process_token();
 
@@ -247,15 +262,28 @@ ProcessLockGuard::ProcessLockGuard(ProcessLockGuard&& other) :
 
 ProcessLockGuard::ProcessLockGuard(Pool* pool, uint64_t offset) : stolen(false),
     pool(pool), offset(offset) {
-  atomic<int32_t>* lock = this->pool->at<atomic<int32_t>>(this->offset);
-  this->stolen = acquire_process_lock(lock);
+  this->acquire();
 }
 
 ProcessLockGuard::~ProcessLockGuard() {
   if (!this->pool) {
     return;
   }
+  this->release();
+}
 
+size_t ProcessLockGuard::data_size() {
+  // everything must be 64-bit aligned, so even though we only use 32 bits, we
+  // claim to use 64
+  return sizeof(int64_t);
+}
+
+void ProcessLockGuard::acquire() {
+  atomic<int32_t>* lock = this->pool->at<atomic<int32_t>>(this->offset);
+  this->stolen = acquire_process_lock(lock);
+}
+
+void ProcessLockGuard::release() {
   try {
     atomic<int32_t>* lock = this->pool->at<atomic<int32_t>>(this->offset);
     release_process_lock(lock);
@@ -266,12 +294,6 @@ ProcessLockGuard::~ProcessLockGuard() {
   }
 }
 
-size_t ProcessLockGuard::data_size() {
-  // everything must be 64-bit aligned, so even though we only use 32 bits, we
-  // claim to use 64
-  return sizeof(int64_t);
-}
-
 
 
 ProcessReadWriteLockGuard::ProcessReadWriteLockGuard(
@@ -282,6 +304,17 @@ ProcessReadWriteLockGuard::ProcessReadWriteLockGuard(
 
 ProcessReadWriteLockGuard::ProcessReadWriteLockGuard(Pool* pool,
     uint64_t offset, bool writing) : stolen(false), pool(pool), offset(offset) {
+  this->acquire(writing);
+}
+
+ProcessReadWriteLockGuard::~ProcessReadWriteLockGuard() {
+  if (!this->pool) {
+    return;
+  }
+  this->release();
+}
+
+void ProcessReadWriteLockGuard::acquire(bool writing) {
   auto* data = this->pool->at<ProcessReadWriteLock>(this->offset);
 
   if (writing) {
@@ -317,11 +350,7 @@ ProcessReadWriteLockGuard::ProcessReadWriteLockGuard(Pool* pool,
   }
 }
 
-ProcessReadWriteLockGuard::~ProcessReadWriteLockGuard() {
-  if (!this->pool) {
-    return;
-  }
-
+void ProcessReadWriteLockGuard::release() {
   auto* data = this->pool->at<ProcessReadWriteLock>(this->offset);
   if (this->reader_slot < 0) {
     release_process_lock(&data->write_lock);
@@ -330,4 +359,320 @@ ProcessReadWriteLockGuard::~ProcessReadWriteLockGuard() {
   }
 }
 
+
+// waits on a futex for up to the given time, or forever if end_time is zero.
+// returns false if end_time has already passed or the wait timed out.
+static bool futex_wait_until(atomic<int32_t>* addr, int32_t expected_value,
+    uint64_t end_time) {
+  if (!end_time) {
+    return futex_wait(addr, expected_value, NULL);
+  }
+  uint64_t current_time = now();
+  if (current_time >= end_time) {
+    return false;
+  }
+  uint64_t remaining = end_time - current_time;
+  struct timespec timeout = {static_cast<time_t>(remaining / 1000000),
+      static_cast<long>((remaining % 1000000) * 1000)};
+  return futex_wait(addr, expected_value, &timeout);
+}
+
+static uint64_t end_time_for_timeout(uint64_t timeout_usecs) {
+  return timeout_usecs ? (now() + timeout_usecs) : 0;
+}
+
+
+
+bool ProcessCondition::wait(ProcessLockGuard& guard, uint64_t timeout_usecs) {
+  // the sequence number is read while the lock is held, so a notify that runs
+  // after we release the lock changes it, and the futex wait doesn't block
+  int32_t sequence = this->sequence.load();
+  this->waiter_count++;
+  bool was_stolen = guard.stolen;
+  guard.release();
+  bool ret = futex_wait_until(&this->sequence, sequence,
+      end_time_for_timeout(timeout_usecs));
+  this->waiter_count--;
+  guard.acquire();
+  guard.stolen |= was_stolen;
+  return ret;
+}
+
+bool ProcessCondition::wait(ProcessReadWriteLockGuard& guard,
+    uint64_t timeout_usecs) {
+  int32_t sequence = this->sequence.load();
+  this->waiter_count++;
+  bool was_stolen = guard.stolen;
+  bool writing = (guard.reader_slot < 0);
+  guard.release();
+  bool ret = futex_wait_until(&this->sequence, sequence,
+      end_time_for_timeout(timeout_usecs));
+  this->waiter_count--;
+  guard.acquire(writing);
+  guard.stolen |= was_stolen;
+  return ret;
+}
+
+void ProcessCondition::notify_one() {
+  this->sequence++;
+  if (this->waiter_count.load()) {
+    futex_wake(&this->sequence, 1);
+  }
+}
+
+void ProcessCondition::notify_all() {
+  this->sequence++;
+  if (this->waiter_count.load()) {
+    futex_wake(&this->sequence, 0x7FFFFFFF);
+  }
+}
+
+
+
+bool ProcessSemaphore::try_wait() {
+  int32_t current = this->count.load();
+  while (current > 0) {
+    if (this->count.compare_exchange_weak(current, current - 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ProcessSemaphore::wait(uint64_t timeout_usecs) {
+  uint64_t end_time = end_time_for_timeout(timeout_usecs);
+  while (!this->try_wait()) {
+    // waiter_count is incremented before the futex wait, so post either sees
+    // it and wakes us, or runs before the wait and changes the count (so the
+    // wait doesn't block)
+    this->waiter_count++;
+    futex_wait_until(&this->count, 0, end_time);
+    this->waiter_count--;
+    if (end_time && (now() >= end_time)) {
+      return this->try_wait();
+    }
+  }
+  return true;
+}
+
+void ProcessSemaphore::post(int32_t count) {
+  if (count <= 0) {
+    throw invalid_argument("count must be positive");
+  }
+  this->count += count;
+  if (this->waiter_count.load()) {
+    futex_wake(&this->count, count);
+  }
+}
+
+int32_t ProcessSemaphore::available() const {
+  return this->count.load();
+}
+
+size_t ProcessSemaphore::holder_count() const {
+  size_t ret = 0;
+  for (size_t x = 0; x < NUM_SEMAPHORE_SLOTS; x++) {
+    ret += (this->holder_tokens[x].load() != 0);
+  }
+  return ret;
+}
+
+
+
+ProcessSemaphoreGuard::ProcessSemaphoreGuard(ProcessSemaphoreGuard&& other) :
+    stolen(other.stolen), pool(other.pool), offset(other.offset),
+    holder_slot(other.holder_slot) {
+  other.pool = NULL;
+}
+
+ProcessSemaphoreGuard::ProcessSemaphoreGuard(Pool* pool, uint64_t offset) :
+    stolen(false), pool(pool), offset(offset), holder_slot(-1) {
+  auto* sem = this->pool->at<ProcessSemaphore>(this->offset);
+  int32_t token = this_process_token();
+
+  for (;;) {
+    if (sem->try_wait()) {
+      for (size_t x = 0; x < NUM_SEMAPHORE_SLOTS; x++) {
+        int32_t expected_token = 0;
+        if (sem->holder_tokens[x].compare_exchange_strong(expected_token,
+            token)) {
+          this->holder_slot = x;
+          break;
+        }
+      }
+      return;
+    }
+
+    // no permits are available. wait up to 1 second for one, then check if any
+    // of the holders have crashed. if one has, take over its permit (and its
+    // slot) instead of waiting for a new one
+    sem->waiter_count++;
+    bool woken = futex_wait_until(&sem->count, 0, now() + 1000000);
+    sem->waiter_count--;
+    if (woken) {
+      continue;
+    }
+    for (size_t x = 0; x < NUM_SEMAPHORE_SLOTS; x++) {
+      int32_t holder_token = sem->holder_tokens[x].load();
+      if (holder_token && !process_for_token_is_running(holder_token) &&
+          sem->holder_tokens[x].compare_exchange_strong(holder_token, token)) {
+        this->holder_slot = x;
+        this->stolen = true;
+        return;
+      }
+    }
+  }
+}
+
+ProcessSemaphoreGuard::~ProcessSemaphoreGuard() {
+  if (!this->pool) {
+    return;
+  }
+
+  // the slot is cleared before the permit is returned. if we crash in between,
+  // the permit is lost, but it can never be counted twice
+  auto* sem = this->pool->at<ProcessSemaphore>(this->offset);
+  if (this->holder_slot >= 0) {
+    sem->holder_tokens[this->holder_slot].store(0);
+  }
+  sem->post(1);
+}
+
+
+
+// the barrier's fields are only modified while holding its lock, except for
+// the generation (which is also read without the lock, to wait on it)
+
+static void complete_barrier_locked(ProcessBarrier* barrier) {
+  for (size_t x = 0; x < NUM_BARRIER_SLOTS; x++) {
+    barrier->participants[x].arrived = 0;
+  }
+  barrier->num_arrived = 0;
+  barrier->generation++;
+  futex_wake(&barrier->generation, 0x7FFFFFFF);
+}
+
+void ProcessBarrier::join() {
+  int32_t token = this_process_token();
+  acquire_process_lock(&this->lock);
+  for (size_t x = 0; x < NUM_BARRIER_SLOTS; x++) {
+    if (this->participants[x].token == 0) {
+      this->participants[x].token = token;
+      this->participants[x].arrived = 0;
+      this->num_participants++;
+      release_process_lock(&this->lock);
+      return;
+    }
+  }
+  release_process_lock(&this->lock);
+  throw runtime_error("barrier is full");
+}
+
+void ProcessBarrier::leave() {
+  int32_t token = this_process_token();
+  acquire_process_lock(&this->lock);
+  for (size_t x = 0; x < NUM_BARRIER_SLOTS; x++) {
+    if ((this->participants[x].token == token) &&
+        !this->participants[x].arrived) {
+      this->participants[x].token = 0;
+      this->num_participants--;
+
+      // the other participants may have been waiting only for us
+      if (this->num_arrived && (this->num_arrived >= this->num_participants)) {
+        complete_barrier_locked(this);
+      }
+      release_process_lock(&this->lock);
+      return;
+    }
+  }
+  release_process_lock(&this->lock);
+  throw logic_error("process is not a participant in this barrier");
+}
+
+bool ProcessBarrier::wait(uint64_t timeout_usecs) {
+  uint64_t end_time = end_time_for_timeout(timeout_usecs);
+  int32_t token = this_process_token();
+
+  acquire_process_lock(&this->lock);
+  ssize_t slot = -1;
+  for (size_t x = 0; x < NUM_BARRIER_SLOTS; x++) {
+    if ((this->participants[x].token == token) &&
+        !this->participants[x].arrived) {
+      slot = x;
+      break;
+    }
+  }
+  if (slot < 0) {
+    release_process_lock(&this->lock);
+    throw logic_error("process is not a participant in this barrier");
+  }
+
+  int32_t generation = this->generation.load();
+  this->participants[slot].arrived = 1;
+  this->num_arrived++;
+  if (this->num_arrived >= this->num_participants) {
+    complete_barrier_locked(this);
+    release_process_lock(&this->lock);
+    return true;
+  }
+  release_process_lock(&this->lock);
+
+  for (;;) {
+    // wait up to 1 second at a time, so we can check for crashed participants
+    uint64_t slice_end_time = now() + 1000000;
+    if (end_time && (end_time < slice_end_time)) {
+      slice_end_time = end_time;
+    }
+    futex_wait_until(&this->generation, generation, slice_end_time);
+    if (this->generation.load() != generation) {
+      return true;
+    }
+    if (now() < slice_end_time) {
+      continue; // interrupted or spurious wakeup
+    }
+
+    acquire_process_lock(&this->lock);
+    if (this->generation.load() != generation) {
+      release_process_lock(&this->lock);
+      return true;
+    }
+
+    // remove participants that crashed. if they had already arrived, their
+    // arrivals no longer count either
+    bool removed_any = false;
+    for (size_t x = 0; x < NUM_BARRIER_SLOTS; x++) {
+      int32_t participant_token = this->participants[x].token;
+      if (participant_token &&
+          !process_for_token_is_running(participant_token)) {
+        if (this->participants[x].arrived) {
+          this->num_arrived--;
+        }
+        this->participants[x].token = 0;
+        this->participants[x].arrived = 0;
+        this->num_participants--;
+        removed_any = true;
+      }
+    }
+    if (removed_any && (this->num_arrived >= this->num_participants)) {
+      complete_barrier_locked(this);
+      release_process_lock(&this->lock);
+      return true;
+    }
+
+    if (end_time && (now() >= end_time)) {
+      // withdraw our arrival. our slot can't have been reused, since we're
+      // still running
+      this->participants[slot].arrived = 0;
+      this->num_arrived--;
+      release_process_lock(&this->lock);
+      return false;
+    }
+    release_process_lock(&this->lock);
+  }
+}
+
+size_t ProcessBarrier::participant_count() const {
+  return this->num_participants;
+}
+
 } // namespace sharedstructures
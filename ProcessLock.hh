@@ -1,13 +1,41 @@
 #pragma once
 
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+
 #include "Pool.hh"
 
 // this must be an odd number so that the alignment will make sense below
 #define NUM_READER_SLOTS 65
 
+// these are chosen so that ProcessSemaphore and ProcessBarrier are 256 bytes
+#define NUM_SEMAPHORE_SLOTS 62
+#define NUM_BARRIER_SLOTS 30
+
 namespace sharedstructures {
 
 
+// blocks until another process calls futex_wake on the same address, or until
+// the timeout expires (timeout may be NULL to wait forever). returns
+// immediately if the value at the address isn't expected_value. returns false
+// if the wait timed out or was interrupted. the address must be in a shared
+// pool for this to work across processes. on os x, this only yields the CPU, so
+// callers must always recheck their condition after this returns.
+bool futex_wait(std::atomic<int32_t>* addr, int32_t expected_value,
+    const struct timespec* timeout);
+// wakes up to num_wakes processes waiting on the given address.
+void futex_wake(std::atomic<int32_t>* addr, int32_t num_wakes);
+
+// returns a token that identifies this process. tokens combine the pid with the
+// process' start time, so a token doesn't match a later process that reuses the
+// pid. structures record tokens so they can recover from crashed processes.
+int32_t this_process_token();
+// returns true if the process that the token identifies is still running.
+bool process_for_token_is_running(int32_t token);
+
+
 struct ProcessLock {
   std::atomic<int32_t> lock;
   int32_t __force_alignment__;
@@ -39,6 +67,11 @@ public:
 private:
   Pool* pool;
   uint64_t offset;
+
+  // ProcessCondition releases and reacquires the lock while waiting
+  friend struct ProcessCondition;
+  void acquire();
+  void release();
 };
 
 
@@ -58,6 +91,115 @@ private:
   Pool* pool;
   uint64_t offset;
   int32_t reader_slot; // -1 if writing
+
+  friend struct ProcessCondition;
+  void acquire(bool writing);
+  void release();
+};
+
+
+// ProcessCondition is a condition variable that can be used across processes.
+// like the lock structures above, it lives at an offset in a pool, and a
+// zero-initialized one is ready to use. waiting releases the given lock guard's
+// lock, blocks until the condition is notified, and reacquires the lock before
+// returning. if the lock is stolen from a crashed process when it's
+// reacquired, the guard's stolen flag is set.
+//
+// as with all condition variables, wakeups may be spurious, so callers should
+// always recheck what they're waiting for after wait returns. if the guard came
+// from Allocator::lock, another process may have expanded the pool while the
+// lock was released, so call the pool's check_size_and_remap after waiting (and
+// look up any pointers into the pool again).
+
+struct ProcessCondition {
+  std::atomic<int32_t> sequence;
+  std::atomic<int32_t> waiter_count;
+
+  // returns false if the wait timed out or was interrupted. a timeout of zero
+  // means to wait forever.
+  bool wait(ProcessLockGuard& guard, uint64_t timeout_usecs = 0);
+  bool wait(ProcessReadWriteLockGuard& guard, uint64_t timeout_usecs = 0);
+  void notify_one();
+  void notify_all();
+};
+
+
+// ProcessSemaphore is a counting semaphore that can be used across processes.
+// a zero-initialized one has no permits available; call post to add them.
+//
+// wait and post can be called by any process, in any order, so the semaphore
+// can't know which process holds a permit. ProcessSemaphoreGuard adds
+// ownership: it records the holding process' token (like ProcessLock does),
+// and if a holder crashes, a process waiting for a permit takes it over.
+
+struct ProcessSemaphore {
+  std::atomic<int32_t> count;
+  std::atomic<int32_t> waiter_count;
+  std::atomic<int32_t> holder_tokens[NUM_SEMAPHORE_SLOTS];
+
+  // takes a permit if one is available; doesn't block.
+  bool try_wait();
+  // takes a permit, blocking until one is available. returns false if the
+  // timeout expired first. a timeout of zero means to wait forever.
+  bool wait(uint64_t timeout_usecs = 0);
+  // returns permits to the semaphore, waking up waiters if needed.
+  void post(int32_t count = 1);
+
+  int32_t available() const;
+  size_t holder_count() const;
+};
+
+class ProcessSemaphoreGuard {
+public:
+  ProcessSemaphoreGuard() = delete;
+  ProcessSemaphoreGuard(const ProcessSemaphoreGuard&) = delete;
+  ProcessSemaphoreGuard(ProcessSemaphoreGuard&&);
+  ProcessSemaphoreGuard(Pool* pool, uint64_t offset);
+  ~ProcessSemaphoreGuard();
+
+  bool stolen; // true if the permit was taken over from a crashed process
+
+private:
+  Pool* pool;
+  uint64_t offset;
+  int32_t holder_slot; // -1 if all slots were in use (the permit isn't tracked)
+};
+
+
+// ProcessBarrier blocks processes until all of its participants have called
+// wait, then releases them all together; it can be reused immediately. a
+// process joins the barrier before waiting on it (a process can join more than
+// once, in which case it must wait once per join before the barrier releases).
+// since the barrier releases when all current participants have arrived,
+// participants should all join before any of them waits.
+//
+// participants are tracked by process token. if a participant crashes, the
+// processes waiting on the barrier notice within about a second and remove it,
+// so they don't wait forever for it.
+
+struct ProcessBarrier {
+  std::atomic<int32_t> lock;
+  std::atomic<int32_t> generation;
+  int32_t num_participants;
+  int32_t num_arrived;
+  struct {
+    int32_t token;
+    int32_t arrived;
+  } participants[NUM_BARRIER_SLOTS];
+
+  // adds or removes this process as a participant. join throws
+  // std::runtime_error if the barrier is full; leave throws std::logic_error
+  // if this process isn't a participant.
+  void join();
+  void leave();
+
+  // blocks until all participants have called wait. returns false if the
+  // timeout expired first, in which case this process' arrival is withdrawn.
+  // a timeout of zero means to wait forever. throws std::logic_error if this
+  // process hasn't joined.
+  bool wait(uint64_t timeout_usecs = 0);
+
+  size_t participant_count() const;
 };
 
 } // namespace sharedstructures
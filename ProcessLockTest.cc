@@ -333,6 +333,230 @@ void run_read_crash_test() {
 }
 
 
+void run_condition_test() {
+  printf("-- condition\n");
+
+  // 4 processes take turns incrementing a counter, each waiting until the
+  // counter says it's that process' turn
+  const size_t num_processes = 4;
+  const size_t num_rounds = 100;
+  unordered_set<pid_t> child_pids = fork_children(num_processes);
+
+  if (!child_pids.empty()) {
+    wait_for_children(child_pids);
+
+    auto pool = create_pool();
+    expect_eq(num_processes * num_rounds, *pool->at<int64_t>(0x210));
+
+    // a wait with no notify times out
+    ProcessLockGuard g(pool.get(), 0x200);
+    uint64_t start_time = now();
+    expect_eq(false, pool->at<ProcessCondition>(0x208)->wait(g, 50000));
+    expect_le(50000, now() - start_time);
+    expect_eq(true, pool->at<ProcessLock>(0x200)->is_locked());
+    return;
+  }
+
+  auto pool = create_pool();
+  auto* cond = pool->at<ProcessCondition>(0x208);
+  int64_t* counter = pool->at<int64_t>(0x210);
+  size_t process_index;
+  {
+    // the first process to get here gets index 0, etc.
+    ProcessLockGuard g(pool.get(), 0x200);
+    process_index = (*pool->at<int64_t>(0x218))++;
+  }
+
+  for (size_t x = 0; x < num_rounds; x++) {
+    ProcessLockGuard g(pool.get(), 0x200);
+    while (static_cast<size_t>(*counter % num_processes) != process_index) {
+      cond->wait(g, 5000000);
+    }
+    (*counter)++;
+    cond->notify_all();
+  }
+  _exit(0);
+}
+
+
+void run_semaphore_test() {
+  printf("-- semaphore\n");
+
+  auto pool = create_pool();
+  auto* sem = pool->at<ProcessSemaphore>(0x400);
+  expect_eq(0, sem->available());
+  expect_eq(false, sem->try_wait());
+  uint64_t start_time = now();
+  expect_eq(false, sem->wait(50000));
+  expect_le(50000, now() - start_time);
+  sem->post(2);
+  expect_eq(2, sem->available());
+
+  // 6 processes share 2 permits; no more than 2 may hold one at once
+  unordered_set<pid_t> child_pids = fork_children(6);
+
+  if (!child_pids.empty()) {
+    wait_for_children(child_pids);
+    expect_eq(2, sem->available());
+    expect_eq(0, sem->holder_count());
+    expect_eq(0, pool->at<atomic<int64_t>>(0x500)->load());
+    expect_le(pool->at<atomic<int64_t>>(0x508)->load(), 2);
+    return;
+  }
+
+  auto child_pool = create_pool();
+  auto* in_use = child_pool->at<atomic<int64_t>>(0x500);
+  auto* max_in_use = child_pool->at<atomic<int64_t>>(0x508);
+  for (size_t x = 0; x < 50; x++) {
+    ProcessSemaphoreGuard g(child_pool.get(), 0x400);
+    expect_eq(false, g.stolen);
+    int64_t current = ++(*in_use);
+    int64_t current_max = max_in_use->load();
+    while ((current > current_max) &&
+        !max_in_use->compare_exchange_weak(current_max, current));
+    usleep(1000);
+    (*in_use)--;
+  }
+  _exit(0);
+}
+
+
+void run_semaphore_crash_test() {
+  printf("-- semaphore crash\n");
+
+  auto pool = create_pool();
+  auto* sem = pool->at<ProcessSemaphore>(0x600);
+  sem->post(1);
+
+  // the child takes the only permit and dies without returning it
+  unordered_set<pid_t> child_pids = fork_children(1);
+  if (child_pids.empty()) {
+    auto child_pool = create_pool();
+    ProcessSemaphoreGuard g(child_pool.get(), 0x600);
+    _exit(0);
+  }
+
+  pid_t child_pid = *child_pids.begin();
+  while (start_time_for_pid(child_pid) != 0) {
+    sched_yield();
+  }
+  expect_eq(0, sem->available());
+  expect_eq(1, sem->holder_count());
+
+  {
+    ProcessSemaphoreGuard g(pool.get(), 0x600);
+    expect_eq(true, g.stolen);
+    expect_eq(1, sem->holder_count());
+  }
+  expect_eq(1, sem->available());
+  expect_eq(0, sem->holder_count());
+  wait_for_children(child_pids);
+}
+
+
+void run_barrier_test() {
+  printf("-- barrier\n");
+
+  // 4 processes each increment a counter for each round, then wait on the
+  // barrier; after the barrier, all of them must have incremented it
+  const size_t num_processes = 4;
+  const size_t num_rounds = 50;
+  auto pool = create_pool();
+  auto* barrier = pool->at<ProcessBarrier>(0x800);
+  auto* start_sem = pool->at<ProcessSemaphore>(0x900);
+
+  unordered_set<pid_t> child_pids = fork_children(num_processes);
+
+  if (!child_pids.empty()) {
+    // start the children when they've all joined
+    while (barrier->participant_count() < num_processes) {
+      usleep(1000);
+    }
+    start_sem->post(num_processes);
+    wait_for_children(child_pids);
+    expect_eq(0, barrier->participant_count());
+    return;
+  }
+
+  auto child_pool = create_pool();
+  barrier = child_pool->at<ProcessBarrier>(0x800);
+  barrier->join();
+  child_pool->at<ProcessSemaphore>(0x900)->wait();
+
+  auto* counters = child_pool->at<atomic<int32_t>>(0xA00);
+  for (size_t x = 0; x < num_rounds; x++) {
+    counters[x]++;
+    expect_eq(true, barrier->wait(10000000));
+    expect_eq(num_processes, counters[x].load());
+  }
+  barrier->leave();
+  _exit(0);
+}
+
+
+void run_barrier_crash_test() {
+  printf("-- barrier crash\n");
+
+  auto pool = create_pool();
+  auto* barrier = pool->at<ProcessBarrier>(0xC00);
+  auto* barrier2 = pool->at<ProcessBarrier>(0xD00);
+  barrier->join();
+  barrier2->join();
+  expect_eq(1, barrier->participant_count());
+
+  // the first child joins the first barrier and dies without arriving
+  unordered_set<pid_t> child_pids = fork_children(1);
+  if (child_pids.empty()) {
+    auto child_pool = create_pool();
+    child_pool->at<ProcessBarrier>(0xC00)->join();
+    _exit(0);
+  }
+  pid_t dead_pid = *child_pids.begin();
+  while (start_time_for_pid(dead_pid) != 0) {
+    sched_yield();
+  }
+  expect_eq(2, barrier->participant_count());
+
+  // the second child joins the second barrier and stays alive (but doesn't
+  // arrive) until we kill it
+  child_pids = fork_children(1);
+  if (child_pids.empty()) {
+    auto child_pool = create_pool();
+    child_pool->at<ProcessBarrier>(0xD00)->join();
+    sleep(10);
+    _exit(0);
+  }
+  pid_t live_pid = *child_pids.begin();
+  while (barrier2->participant_count() < 2) {
+    usleep(1000);
+  }
+
+  // the live child never arrives, so this times out
+  uint64_t start_time = now();
+  expect_eq(false, barrier2->wait(100000));
+  expect_le(100000, now() - start_time);
+  expect_eq(0, barrier2->num_arrived);
+
+  // the dead child is removed and the barrier releases
+  expect_eq(true, barrier->wait(10000000));
+  expect_eq(1, barrier->participant_count());
+
+  kill(live_pid, SIGKILL);
+  int exit_status;
+  while (wait(&exit_status) != -1);
+
+  try {
+    barrier->leave();
+    barrier->leave();
+    expect(false);
+  } catch (const logic_error& e) { }
+  try {
+    barrier->wait();
+    expect(false);
+  } catch (const logic_error& e) { }
+}
+
+
 int main(int argc, char* argv[]) {
   int retcode = 0;
   try {
@@ -346,6 +570,11 @@ int main(int argc, char* argv[]) {
     run_read_write_lock_test();
     run_write_crash_test();
     run_read_crash_test();
+    run_condition_test();
+    run_semaphore_test();
+    run_semaphore_crash_test();
+    run_barrier_test();
+    run_barrier_crash_test();
     printf("all tests passed\n");
 
     // only delete the pool if the tests pass; if they don't, we might want to
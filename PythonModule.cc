@@ -17,6 +17,9 @@
 #include "LogarithmicAllocator.hh"
 #include "HashTable.hh"
 #include "PrefixTree.hh"
+#include "HyperLogLog.hh"
+#include "CountMinSketch.hh"
+#include "RoaringBitmap.hh"
 
 using namespace std;
 
@@ -31,7 +34,8 @@ using LookupResult = sharedstructures::PrefixTree::LookupResult;
 static const char* sharedstructures_doc =
 "Dynamically-sized shared-memory data structure module.\n\
 \n\
-This module provides the HashTable and PrefixTree classes.";
+This module provides the HashTable, PrefixTree, HyperLogLog, CountMinSketch\n\
+and RoaringBitmap classes.";
 
 
 
@@ -204,7 +208,8 @@ static LookupResult sharedstructures_internal_get_result_for_python_object(
 
 
 
-// HashTable, HashTableIterator, PrefixTree and PrefixTreeIterator definitions
+// HashTable, HashTableIterator, PrefixTree, PrefixTreeIterator, HyperLogLog,
+// CountMinSketch and RoaringBitmap definitions
 
 static const char* sharedstructures_HashTable_doc =
 "Shared-memory hash table object.\n\
@@ -266,6 +271,67 @@ typedef struct {
   bool return_values;
 } sharedstructures_PrefixTreeIterator;
 
+static const char* sharedstructures_HyperLogLog_doc =
+"Shared-memory distinct-count estimator.\n\
+\n\
+sharedstructures.HyperLogLog(pool_name[, allocator_type[, base_offset[, precision]]])\n\
+\n\
+Arguments:\n\
+- pool_name: the name of the shared-memory pool to operate on.\n\
+- allocator_type: 'simple' (default) or 'logarithmic' (see README.md).\n\
+- base_offset: if given, opens a HyperLogLog at this offset within the pool. If\n\
+  not given, opens a HyperLogLog at the pool's base offset. If the pool's base\n\
+  offset is 0, creates a new HyperLogLog and sets the pool's base offset to the\n\
+  new HyperLogLog's offset.\n\
+- precision: if a new HyperLogLog is created, it will have 2^precision\n\
+  registers (default 14). The standard error of the estimate is about\n\
+  1.04 / sqrt(2^precision).";
+
+typedef struct {
+  PyObject_HEAD
+  shared_ptr<sharedstructures::HyperLogLog> hll;
+} sharedstructures_HyperLogLog;
+
+static const char* sharedstructures_CountMinSketch_doc =
+"Shared-memory frequency estimator.\n\
+\n\
+sharedstructures.CountMinSketch(pool_name[, allocator_type[, base_offset[, bits[, depth]]]])\n\
+\n\
+Arguments:\n\
+- pool_name: the name of the shared-memory pool to operate on.\n\
+- allocator_type: 'simple' (default) or 'logarithmic' (see README.md).\n\
+- base_offset: if given, opens a CountMinSketch at this offset within the pool.\n\
+  If not given, opens a CountMinSketch at the pool's base offset. If the pool's\n\
+  base offset is 0, creates a new CountMinSketch and sets the pool's base\n\
+  offset to the new CountMinSketch's offset.\n\
+- bits: if a new CountMinSketch is created, each row will have 2^bits counters\n\
+  (default 16 bits).\n\
+- depth: if a new CountMinSketch is created, it will have this many rows\n\
+  (default 4).";
+
+typedef struct {
+  PyObject_HEAD
+  shared_ptr<sharedstructures::CountMinSketch> cms;
+} sharedstructures_CountMinSketch;
+
+static const char* sharedstructures_RoaringBitmap_doc =
+"Shared-memory compressed set of 32-bit unsigned integers.\n\
+\n\
+sharedstructures.RoaringBitmap(pool_name[, allocator_type[, base_offset]])\n\
+\n\
+Arguments:\n\
+- pool_name: the name of the shared-memory pool to operate on.\n\
+- allocator_type: 'simple' (default) or 'logarithmic' (see README.md).\n\
+- base_offset: if given, opens a RoaringBitmap at this offset within the pool.\n\
+  If not given, opens a RoaringBitmap at the pool's base offset. If the pool's\n\
+  base offset is 0, creates a new RoaringBitmap and sets the pool's base\n\
+  offset to the new RoaringBitmap's offset.";
+
+typedef struct {
+  PyObject_HEAD
+  shared_ptr<sharedstructures::RoaringBitmap> bitmap;
+} sharedstructures_RoaringBitmap;
+
 
 
 
@@ -1736,6 +1802,882 @@ static PyTypeObject sharedstructures_PrefixTreeType = {
 
 
 
+// HyperLogLog object method definitions
+
+static PyObject* sharedstructures_HyperLogLog_New(PyTypeObject* type,
+    PyObject* args, PyObject* kwargs) {
+  sharedstructures_HyperLogLog* self = (sharedstructures_HyperLogLog*)PyType_GenericNew(
+      type, args, kwargs);
+  if (!self) {
+    return NULL;
+  }
+
+  // see comment in sharedstructures_HashTableIterator_New about const_cast
+  static const char* kwarg_names[] = {"pool_name", "allocator_type",
+      "base_offset", "precision", NULL};
+  static char** kwarg_names_arg = const_cast<char**>(kwarg_names);
+  const char* pool_name;
+  Py_ssize_t base_offset = 0;
+  uint8_t precision = 14;
+  const char* allocator_type = NULL;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|snb", kwarg_names_arg,
+      &pool_name, &allocator_type, &base_offset, &precision)) {
+    Py_DECREF(self);
+    return NULL;
+  }
+
+  // try to construct the pool before filling in the python object
+  try {
+    auto allocator = sharedstructures_internal_get_allocator(pool_name,
+        allocator_type);
+    new (&self->hll) shared_ptr<sharedstructures::HyperLogLog>(
+        new sharedstructures::HyperLogLog(allocator, base_offset, precision));
+
+  } catch (const exception& e) {
+    PyErr_Format(PyExc_RuntimeError, "failed to initialize hyperloglog: %s", e.what());
+    Py_DECREF(self);
+    return NULL;
+  }
+
+  return (PyObject*)self;
+}
+
+static void sharedstructures_HyperLogLog_Dealloc(PyObject* obj) {
+  sharedstructures_HyperLogLog* self = (sharedstructures_HyperLogLog*)obj;
+  self->hll.~shared_ptr();
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t sharedstructures_HyperLogLog_Len(PyObject* py_self) {
+  sharedstructures_HyperLogLog* self = (sharedstructures_HyperLogLog*)py_self;
+  return self->hll->count();
+}
+
+static PyObject* sharedstructures_HyperLogLog_Repr(PyObject* py_self) {
+  sharedstructures_HyperLogLog* self = (sharedstructures_HyperLogLog*)py_self;
+
+#ifdef IS_PY3K
+  return PyUnicode_FromFormat(
+      "<sharedstructures.HyperLogLog on %s:%p at %p>",
+      self->hll->get_allocator()->get_pool()->get_name().c_str(),
+      (const void*)self->hll->base(), py_self);
+#else
+  return PyBytes_FromFormat(
+      "<sharedstructures.HyperLogLog on %s:%p at %p>",
+      self->hll->get_allocator()->get_pool()->get_name().c_str(),
+      (const void*)self->hll->base(), py_self);
+#endif
+}
+
+static const char* sharedstructures_HyperLogLog_add_doc =
+"Adds a key to the sketch.\n\
+\n\
+HyperLogLog.add(key) -> bool\n\
+\n\
+Returns False if the key was definitely already counted, or True if it may\n\
+not have been.";
+
+static PyObject* sharedstructures_HyperLogLog_add(PyObject* py_self,
+    PyObject* args) {
+  sharedstructures_HyperLogLog* self = (sharedstructures_HyperLogLog*)py_self;
+
+  PyObject* key;
+  if (!PyArg_ParseTuple(args, "O", &key)) {
+    return NULL;
+  }
+  auto k = sharedstructures_internal_get_key(key);
+  if (!k.first) {
+    return NULL;
+  }
+
+  PyObject* ret = self->hll->insert(k.first, k.second) ? Py_True : Py_False;
+  Py_INCREF(ret);
+  return ret;
+}
+
+static const char* sharedstructures_HyperLogLog_count_doc =
+"Returns the estimated number of distinct keys added to the sketch.";
+
+static PyObject* sharedstructures_HyperLogLog_count(PyObject* py_self) {
+  sharedstructures_HyperLogLog* self = (sharedstructures_HyperLogLog*)py_self;
+#ifdef IS_PY3K
+  return PyLong_FromSize_t(self->hll->count());
+#else
+  return PyInt_FromSize_t(self->hll->count());
+#endif
+}
+
+static const char* sharedstructures_HyperLogLog_merge_doc =
+"Adds all the keys from another HyperLogLog to this one.\n\
+\n\
+HyperLogLog.merge(other)\n\
+\n\
+The sketches must have the same precision, but don't have to be in the same\n\
+pool.";
+
+static PyObject* sharedstructures_HyperLogLog_merge(PyObject* py_self,
+    PyObject* args);
+
+static const char* sharedstructures_HyperLogLog_clear_doc =
+"Resets the sketch to empty.";
+
+static PyObject* sharedstructures_HyperLogLog_clear(PyObject* py_self) {
+  sharedstructures_HyperLogLog* self = (sharedstructures_HyperLogLog*)py_self;
+
+  self->hll->clear();
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static const char* sharedstructures_HyperLogLog_precision_doc =
+"Returns the register count factor.";
+
+static PyObject* sharedstructures_HyperLogLog_precision(PyObject* py_self) {
+  sharedstructures_HyperLogLog* self = (sharedstructures_HyperLogLog*)py_self;
+#ifdef IS_PY3K
+  return PyLong_FromLong(self->hll->precision());
+#else
+  return PyInt_FromLong(self->hll->precision());
+#endif
+}
+
+static const char* sharedstructures_HyperLogLog_is_dense_doc =
+"Returns True if the sketch uses the dense encoding.";
+
+static PyObject* sharedstructures_HyperLogLog_is_dense(PyObject* py_self) {
+  sharedstructures_HyperLogLog* self = (sharedstructures_HyperLogLog*)py_self;
+  PyObject* ret = self->hll->is_dense() ? Py_True : Py_False;
+  Py_INCREF(ret);
+  return ret;
+}
+
+static PyMethodDef sharedstructures_HyperLogLog_methods[] = {
+  {"add", (PyCFunction)sharedstructures_HyperLogLog_add, METH_VARARGS,
+      sharedstructures_HyperLogLog_add_doc},
+  {"count", (PyCFunction)sharedstructures_HyperLogLog_count, METH_NOARGS,
+      sharedstructures_HyperLogLog_count_doc},
+  {"merge", (PyCFunction)sharedstructures_HyperLogLog_merge, METH_VARARGS,
+      sharedstructures_HyperLogLog_merge_doc},
+  {"clear", (PyCFunction)sharedstructures_HyperLogLog_clear, METH_NOARGS,
+      sharedstructures_HyperLogLog_clear_doc},
+  {"precision", (PyCFunction)sharedstructures_HyperLogLog_precision, METH_NOARGS,
+      sharedstructures_HyperLogLog_precision_doc},
+  {"is_dense", (PyCFunction)sharedstructures_HyperLogLog_is_dense, METH_NOARGS,
+      sharedstructures_HyperLogLog_is_dense_doc},
+  {NULL},
+};
+
+static PySequenceMethods sharedstructures_HyperLogLog_sequencemethods = {
+  sharedstructures_HyperLogLog_Len, // sq_length
+  0, // sq_concat
+  0, // sq_repeat
+  0, // sq_item
+  0, // sq_slice
+  0, // sq_ass_item
+  0, // sq_ass_slice
+  0, // sq_contains
+  0, // sq_inplace_concat
+  0, // sq_inplace_repeat
+};
+
+static PyTypeObject sharedstructures_HyperLogLogType = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   "sharedstructures.HyperLogLog",                  // tp_name
+   sizeof(sharedstructures_HyperLogLog),            // tp_basicsize
+   0,                                               // tp_itemsize
+   (destructor)sharedstructures_HyperLogLog_Dealloc, // tp_dealloc
+   0,                                               // tp_print
+   0,                                               // tp_getattr
+   0,                                               // tp_setattr
+   0,                                               // tp_compare
+   sharedstructures_HyperLogLog_Repr,               // tp_repr
+   0,                                               // tp_as_number
+   &sharedstructures_HyperLogLog_sequencemethods,   // tp_as_sequence
+   0,                                               // tp_as_mapping
+   0,                                               // tp_hash
+   0,                                               // tp_call
+   0,                                               // tp_str
+   0,                                               // tp_getattro
+   0,                                               // tp_setattro
+   0,                                               // tp_as_buffer
+   Py_TPFLAGS_DEFAULT,                              // tp_flag
+   sharedstructures_HyperLogLog_doc,                // tp_doc
+   0,                                               // tp_traverse
+   0,                                               // tp_clear
+   0,                                               // tp_richcompare
+   0,                                               // tp_weaklistoffset
+   0,                                               // tp_iter
+   0,                                               // tp_iternext
+   sharedstructures_HyperLogLog_methods,            // tp_methods
+   0,                                               // tp_members
+   0,                                               // tp_getset
+   0,                                               // tp_base
+   0,                                               // tp_dict
+   0,                                               // tp_descr_get
+   0,                                               // tp_descr_set
+   0,                                               // tp_dictoffset
+   0,                                               // tp_init
+   0,                                               // tp_alloc
+   sharedstructures_HyperLogLog_New,                // tp_new
+};
+
+// this is defined after the type object so it can check the argument's type
+static PyObject* sharedstructures_HyperLogLog_merge(PyObject* py_self,
+    PyObject* args) {
+  sharedstructures_HyperLogLog* self = (sharedstructures_HyperLogLog*)py_self;
+
+  sharedstructures_HyperLogLog* other;
+  if (!PyArg_ParseTuple(args, "O!", &sharedstructures_HyperLogLogType,
+      &other)) {
+    return NULL;
+  }
+
+  try {
+    self->hll->merge(*other->hll);
+  } catch (const invalid_argument& e) {
+    PyErr_SetString(PyExc_ValueError, e.what());
+    return NULL;
+  }
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+
+
+
+// CountMinSketch object method definitions
+
+static PyObject* sharedstructures_CountMinSketch_New(PyTypeObject* type,
+    PyObject* args, PyObject* kwargs) {
+  sharedstructures_CountMinSketch* self = (sharedstructures_CountMinSketch*)PyType_GenericNew(
+      type, args, kwargs);
+  if (!self) {
+    return NULL;
+  }
+
+  // see comment in sharedstructures_HashTableIterator_New about const_cast
+  static const char* kwarg_names[] = {"pool_name", "allocator_type",
+      "base_offset", "bits", "depth", NULL};
+  static char** kwarg_names_arg = const_cast<char**>(kwarg_names);
+  const char* pool_name;
+  Py_ssize_t base_offset = 0;
+  uint8_t bits = 16;
+  uint8_t depth = 4;
+  const char* allocator_type = NULL;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|snbb", kwarg_names_arg,
+      &pool_name, &allocator_type, &base_offset, &bits, &depth)) {
+    Py_DECREF(self);
+    return NULL;
+  }
+
+  // try to construct the pool before filling in the python object
+  try {
+    auto allocator = sharedstructures_internal_get_allocator(pool_name,
+        allocator_type);
+    new (&self->cms) shared_ptr<sharedstructures::CountMinSketch>(
+        new sharedstructures::CountMinSketch(allocator, base_offset, bits,
+          depth));
+
+  } catch (const exception& e) {
+    PyErr_Format(PyExc_RuntimeError, "failed to initialize count-min sketch: %s", e.what());
+    Py_DECREF(self);
+    return NULL;
+  }
+
+  return (PyObject*)self;
+}
+
+static void sharedstructures_CountMinSketch_Dealloc(PyObject* obj) {
+  sharedstructures_CountMinSketch* self = (sharedstructures_CountMinSketch*)obj;
+  self->cms.~shared_ptr();
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* sharedstructures_CountMinSketch_GetItem(PyObject* py_self,
+    PyObject* key) {
+  sharedstructures_CountMinSketch* self = (sharedstructures_CountMinSketch*)py_self;
+
+  auto k = sharedstructures_internal_get_key(key);
+  if (!k.first) {
+    return NULL;
+  }
+
+  return PyLong_FromUnsignedLongLong(self->cms->estimate(k.first, k.second));
+}
+
+static PyObject* sharedstructures_CountMinSketch_Repr(PyObject* py_self) {
+  sharedstructures_CountMinSketch* self = (sharedstructures_CountMinSketch*)py_self;
+
+#ifdef IS_PY3K
+  return PyUnicode_FromFormat(
+      "<sharedstructures.CountMinSketch on %s:%p at %p>",
+      self->cms->get_allocator()->get_pool()->get_name().c_str(),
+      (const void*)self->cms->base(), py_self);
+#else
+  return PyBytes_FromFormat(
+      "<sharedstructures.CountMinSketch on %s:%p at %p>",
+      self->cms->get_allocator()->get_pool()->get_name().c_str(),
+      (const void*)self->cms->base(), py_self);
+#endif
+}
+
+static const char* sharedstructures_CountMinSketch_add_doc =
+"Adds occurrences of a key.\n\
+\n\
+CountMinSketch.add(key[, count]) -> int\n\
+\n\
+count defaults to 1. Returns the key's new estimated count.";
+
+static PyObject* sharedstructures_CountMinSketch_add(PyObject* py_self,
+    PyObject* args) {
+  sharedstructures_CountMinSketch* self = (sharedstructures_CountMinSketch*)py_self;
+
+  PyObject* key;
+  unsigned long long count = 1;
+  if (!PyArg_ParseTuple(args, "O|K", &key, &count)) {
+    return NULL;
+  }
+  auto k = sharedstructures_internal_get_key(key);
+  if (!k.first) {
+    return NULL;
+  }
+
+  return PyLong_FromUnsignedLongLong(self->cms->add(k.first, k.second, count));
+}
+
+static const char* sharedstructures_CountMinSketch_estimate_doc =
+"Returns the estimated number of occurrences of a key.\n\
+\n\
+CountMinSketch.estimate(key) -> int\n\
+\n\
+The estimate is never less than the true count. sketch[key] does the same\n\
+thing.";
+
+static PyObject* sharedstructures_CountMinSketch_estimate(PyObject* py_self,
+    PyObject* args) {
+  PyObject* key;
+  if (!PyArg_ParseTuple(args, "O", &key)) {
+    return NULL;
+  }
+  return sharedstructures_CountMinSketch_GetItem(py_self, key);
+}
+
+static const char* sharedstructures_CountMinSketch_merge_doc =
+"Adds all the counts from another CountMinSketch to this one.\n\
+\n\
+CountMinSketch.merge(other)\n\
+\n\
+The sketches must have the same dimensions, but don't have to be in the same\n\
+pool.";
+
+static PyObject* sharedstructures_CountMinSketch_merge(PyObject* py_self,
+    PyObject* args);
+
+static const char* sharedstructures_CountMinSketch_clear_doc =
+"Resets all counts to zero.";
+
+static PyObject* sharedstructures_CountMinSketch_clear(PyObject* py_self) {
+  sharedstructures_CountMinSketch* self = (sharedstructures_CountMinSketch*)py_self;
+
+  self->cms->clear();
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static const char* sharedstructures_CountMinSketch_total_doc =
+"Returns the sum of all counts added to the sketch.";
+
+static PyObject* sharedstructures_CountMinSketch_total(PyObject* py_self) {
+  sharedstructures_CountMinSketch* self = (sharedstructures_CountMinSketch*)py_self;
+  return PyLong_FromUnsignedLongLong(self->cms->total());
+}
+
+static const char* sharedstructures_CountMinSketch_bits_doc =
+"Returns the counters per row factor.";
+
+static PyObject* sharedstructures_CountMinSketch_bits(PyObject* py_self) {
+  sharedstructures_CountMinSketch* self = (sharedstructures_CountMinSketch*)py_self;
+#ifdef IS_PY3K
+  return PyLong_FromLong(self->cms->bits());
+#else
+  return PyInt_FromLong(self->cms->bits());
+#endif
+}
+
+static const char* sharedstructures_CountMinSketch_depth_doc =
+"Returns the number of rows.";
+
+static PyObject* sharedstructures_CountMinSketch_depth(PyObject* py_self) {
+  sharedstructures_CountMinSketch* self = (sharedstructures_CountMinSketch*)py_self;
+#ifdef IS_PY3K
+  return PyLong_FromLong(self->cms->depth());
+#else
+  return PyInt_FromLong(self->cms->depth());
+#endif
+}
+
+static PyMethodDef sharedstructures_CountMinSketch_methods[] = {
+  {"add", (PyCFunction)sharedstructures_CountMinSketch_add, METH_VARARGS,
+      sharedstructures_CountMinSketch_add_doc},
+  {"estimate", (PyCFunction)sharedstructures_CountMinSketch_estimate, METH_VARARGS,
+      sharedstructures_CountMinSketch_estimate_doc},
+  {"merge", (PyCFunction)sharedstructures_CountMinSketch_merge, METH_VARARGS,
+      sharedstructures_CountMinSketch_merge_doc},
+  {"clear", (PyCFunction)sharedstructures_CountMinSketch_clear, METH_NOARGS,
+      sharedstructures_CountMinSketch_clear_doc},
+  {"total", (PyCFunction)sharedstructures_CountMinSketch_total, METH_NOARGS,
+      sharedstructures_CountMinSketch_total_doc},
+  {"bits", (PyCFunction)sharedstructures_CountMinSketch_bits, METH_NOARGS,
+      sharedstructures_CountMinSketch_bits_doc},
+  {"depth", (PyCFunction)sharedstructures_CountMinSketch_depth, METH_NOARGS,
+      sharedstructures_CountMinSketch_depth_doc},
+  {NULL},
+};
+
+static PyMappingMethods sharedstructures_CountMinSketch_mappingmethods = {
+  0,
+  sharedstructures_CountMinSketch_GetItem,
+  0,
+};
+
+static PyTypeObject sharedstructures_CountMinSketchType = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   "sharedstructures.CountMinSketch",               // tp_name
+   sizeof(sharedstructures_CountMinSketch),         // tp_basicsize
+   0,                                               // tp_itemsize
+   (destructor)sharedstructures_CountMinSketch_Dealloc, // tp_dealloc
+   0,                                               // tp_print
+   0,                                               // tp_getattr
+   0,                                               // tp_setattr
+   0,                                               // tp_compare
+   sharedstructures_CountMinSketch_Repr,            // tp_repr
+   0,                                               // tp_as_number
+   0,                                               // tp_as_sequence
+   &sharedstructures_CountMinSketch_mappingmethods, // tp_as_mapping
+   0,                                               // tp_hash
+   0,                                               // tp_call
+   0,                                               // tp_str
+   0,                                               // tp_getattro
+   0,                                               // tp_setattro
+   0,                                               // tp_as_buffer
+   Py_TPFLAGS_DEFAULT,                              // tp_flag
+   sharedstructures_CountMinSketch_doc,             // tp_doc
+   0,                                               // tp_traverse
+   0,                                               // tp_clear
+   0,                                               // tp_richcompare
+   0,                                               // tp_weaklistoffset
+   0,                                               // tp_iter
+   0,                                               // tp_iternext
+   sharedstructures_CountMinSketch_methods,         // tp_methods
+   0,                                               // tp_members
+   0,                                               // tp_getset
+   0,                                               // tp_base
+   0,                                               // tp_dict
+   0,                                               // tp_descr_get
+   0,                                               // tp_descr_set
+   0,                                               // tp_dictoffset
+   0,                                               // tp_init
+   0,                                               // tp_alloc
+   sharedstructures_CountMinSketch_New,             // tp_new
+};
+
+// this is defined after the type object so it can check the argument's type
+static PyObject* sharedstructures_CountMinSketch_merge(PyObject* py_self,
+    PyObject* args) {
+  sharedstructures_CountMinSketch* self = (sharedstructures_CountMinSketch*)py_self;
+
+  sharedstructures_CountMinSketch* other;
+  if (!PyArg_ParseTuple(args, "O!", &sharedstructures_CountMinSketchType,
+      &other)) {
+    return NULL;
+  }
+
+  try {
+    self->cms->merge(*other->cms);
+  } catch (const invalid_argument& e) {
+    PyErr_SetString(PyExc_ValueError, e.what());
+    return NULL;
+  }
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+
+
+
+// RoaringBitmap object method definitions
+
+static PyObject* sharedstructures_RoaringBitmap_New(PyTypeObject* type,
+    PyObject* args, PyObject* kwargs) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)PyType_GenericNew(
+      type, args, kwargs);
+  if (!self) {
+    return NULL;
+  }
+
+  // see comment in sharedstructures_HashTableIterator_New about const_cast
+  static const char* kwarg_names[] = {"pool_name", "allocator_type",
+      "base_offset", NULL};
+  static char** kwarg_names_arg = const_cast<char**>(kwarg_names);
+  const char* pool_name;
+  Py_ssize_t base_offset = 0;
+  const char* allocator_type = NULL;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|sn", kwarg_names_arg,
+      &pool_name, &allocator_type, &base_offset)) {
+    Py_DECREF(self);
+    return NULL;
+  }
+
+  // try to construct the pool before filling in the python object
+  try {
+    auto allocator = sharedstructures_internal_get_allocator(pool_name,
+        allocator_type);
+    new (&self->bitmap) shared_ptr<sharedstructures::RoaringBitmap>(
+        new sharedstructures::RoaringBitmap(allocator, base_offset));
+
+  } catch (const exception& e) {
+    PyErr_Format(PyExc_RuntimeError, "failed to initialize roaring bitmap: %s", e.what());
+    Py_DECREF(self);
+    return NULL;
+  }
+
+  return (PyObject*)self;
+}
+
+static void sharedstructures_RoaringBitmap_Dealloc(PyObject* obj) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)obj;
+  self->bitmap.~shared_ptr();
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// returns false (and sets a python exception) if the object isn't an integer
+// that fits in 32 bits
+static bool sharedstructures_internal_get_bitmap_value(PyObject* obj,
+    uint32_t* value) {
+  unsigned long long v = PyLong_AsUnsignedLongLong(obj);
+  if (PyErr_Occurred()) {
+    return false;
+  }
+  if (v > 0xFFFFFFFF) {
+    PyErr_SetString(PyExc_OverflowError, "value does not fit in 32 bits");
+    return false;
+  }
+  *value = v;
+  return true;
+}
+
+static PyObject* sharedstructures_internal_get_bitmap_values(
+    const vector<uint32_t>& values) {
+  PyObject* ret = PyList_New(values.size());
+  if (!ret) {
+    return NULL;
+  }
+  for (size_t x = 0; x < values.size(); x++) {
+    PyObject* item = PyLong_FromUnsignedLong(values[x]);
+    if (!item) {
+      Py_DECREF(ret);
+      return NULL;
+    }
+    PyList_SET_ITEM(ret, x, item);
+  }
+  return ret;
+}
+
+static bool sharedstructures_internal_get_bitmap_operation(const char* name,
+    sharedstructures::RoaringBitmap::Operation* op) {
+  if (!strcmp(name, "and")) {
+    *op = sharedstructures::RoaringBitmap::Operation::And;
+  } else if (!strcmp(name, "or")) {
+    *op = sharedstructures::RoaringBitmap::Operation::Or;
+  } else if (!strcmp(name, "andnot")) {
+    *op = sharedstructures::RoaringBitmap::Operation::AndNot;
+  } else {
+    PyErr_SetString(PyExc_ValueError,
+        "operation must be 'and', 'or', or 'andnot'");
+    return false;
+  }
+  return true;
+}
+
+static Py_ssize_t sharedstructures_RoaringBitmap_Len(PyObject* py_self) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)py_self;
+  return self->bitmap->size();
+}
+
+static int sharedstructures_RoaringBitmap_In(PyObject* py_self,
+    PyObject* value) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)py_self;
+
+  uint32_t v;
+  if (!sharedstructures_internal_get_bitmap_value(value, &v)) {
+    return -1;
+  }
+  return self->bitmap->contains(v);
+}
+
+static PyObject* sharedstructures_RoaringBitmap_Repr(PyObject* py_self) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)py_self;
+
+#ifdef IS_PY3K
+  return PyUnicode_FromFormat(
+      "<sharedstructures.RoaringBitmap on %s:%p at %p>",
+      self->bitmap->get_allocator()->get_pool()->get_name().c_str(),
+      (const void*)self->bitmap->base(), py_self);
+#else
+  return PyBytes_FromFormat(
+      "<sharedstructures.RoaringBitmap on %s:%p at %p>",
+      self->bitmap->get_allocator()->get_pool()->get_name().c_str(),
+      (const void*)self->bitmap->base(), py_self);
+#endif
+}
+
+static const char* sharedstructures_RoaringBitmap_add_doc =
+"Adds a value to the set.\n\
+\n\
+RoaringBitmap.add(value) -> bool\n\
+\n\
+Returns True if the value was added, or False if it was already present.";
+
+static PyObject* sharedstructures_RoaringBitmap_add(PyObject* py_self,
+    PyObject* args) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)py_self;
+
+  PyObject* value;
+  uint32_t v;
+  if (!PyArg_ParseTuple(args, "O", &value) ||
+      !sharedstructures_internal_get_bitmap_value(value, &v)) {
+    return NULL;
+  }
+
+  PyObject* ret = self->bitmap->add(v) ? Py_True : Py_False;
+  Py_INCREF(ret);
+  return ret;
+}
+
+static const char* sharedstructures_RoaringBitmap_remove_doc =
+"Removes a value from the set.\n\
+\n\
+RoaringBitmap.remove(value) -> bool\n\
+\n\
+Returns True if the value was removed, or False if it wasn't present.";
+
+static PyObject* sharedstructures_RoaringBitmap_remove(PyObject* py_self,
+    PyObject* args) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)py_self;
+
+  PyObject* value;
+  uint32_t v;
+  if (!PyArg_ParseTuple(args, "O", &value) ||
+      !sharedstructures_internal_get_bitmap_value(value, &v)) {
+    return NULL;
+  }
+
+  PyObject* ret = self->bitmap->remove(v) ? Py_True : Py_False;
+  Py_INCREF(ret);
+  return ret;
+}
+
+static const char* sharedstructures_RoaringBitmap_values_doc =
+"Returns a list of all values in the set, in increasing order.";
+
+static PyObject* sharedstructures_RoaringBitmap_values(PyObject* py_self) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)py_self;
+  return sharedstructures_internal_get_bitmap_values(self->bitmap->values());
+}
+
+static const char* sharedstructures_RoaringBitmap_clear_doc =
+"Removes all values from the set.";
+
+static PyObject* sharedstructures_RoaringBitmap_clear(PyObject* py_self) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)py_self;
+
+  self->bitmap->clear();
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static const char* sharedstructures_RoaringBitmap_run_optimize_doc =
+"Converts each container to its smallest encoding, including run encoding.";
+
+static PyObject* sharedstructures_RoaringBitmap_run_optimize(
+    PyObject* py_self) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)py_self;
+
+  self->bitmap->run_optimize();
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static const char* sharedstructures_RoaringBitmap_compute_doc =
+"Computes a set operation with another RoaringBitmap.\n\
+\n\
+RoaringBitmap.compute(other, op) -> list\n\
+\n\
+op must be 'and', 'or', or 'andnot'. Returns the values in (self op other) in\n\
+increasing order. The bitmaps don't have to be in the same pool.";
+
+static PyObject* sharedstructures_RoaringBitmap_compute(PyObject* py_self,
+    PyObject* args);
+
+static const char* sharedstructures_RoaringBitmap_compute_size_doc =
+"Returns the number of values in the result of a set operation.\n\
+\n\
+RoaringBitmap.compute_size(other, op) -> int\n\
+\n\
+This is faster than len(self.compute(other, op)).";
+
+static PyObject* sharedstructures_RoaringBitmap_compute_size(PyObject* py_self,
+    PyObject* args);
+
+static const char* sharedstructures_RoaringBitmap_assign_doc =
+"Replaces the contents of this bitmap with the result of a set operation.\n\
+\n\
+RoaringBitmap.assign(a, b, op)\n\
+\n\
+op must be 'and', 'or', or 'andnot'. Either or both of a and b may be this\n\
+bitmap.";
+
+static PyObject* sharedstructures_RoaringBitmap_assign(PyObject* py_self,
+    PyObject* args);
+
+static PyMethodDef sharedstructures_RoaringBitmap_methods[] = {
+  {"add", (PyCFunction)sharedstructures_RoaringBitmap_add, METH_VARARGS,
+      sharedstructures_RoaringBitmap_add_doc},
+  {"remove", (PyCFunction)sharedstructures_RoaringBitmap_remove, METH_VARARGS,
+      sharedstructures_RoaringBitmap_remove_doc},
+  {"values", (PyCFunction)sharedstructures_RoaringBitmap_values, METH_NOARGS,
+      sharedstructures_RoaringBitmap_values_doc},
+  {"clear", (PyCFunction)sharedstructures_RoaringBitmap_clear, METH_NOARGS,
+      sharedstructures_RoaringBitmap_clear_doc},
+  {"run_optimize", (PyCFunction)sharedstructures_RoaringBitmap_run_optimize, METH_NOARGS,
+      sharedstructures_RoaringBitmap_run_optimize_doc},
+  {"compute", (PyCFunction)sharedstructures_RoaringBitmap_compute, METH_VARARGS,
+      sharedstructures_RoaringBitmap_compute_doc},
+  {"compute_size", (PyCFunction)sharedstructures_RoaringBitmap_compute_size, METH_VARARGS,
+      sharedstructures_RoaringBitmap_compute_size_doc},
+  {"assign", (PyCFunction)sharedstructures_RoaringBitmap_assign, METH_VARARGS,
+      sharedstructures_RoaringBitmap_assign_doc},
+  {NULL},
+};
+
+static PySequenceMethods sharedstructures_RoaringBitmap_sequencemethods = {
+  sharedstructures_RoaringBitmap_Len, // sq_length
+  0, // sq_concat
+  0, // sq_repeat
+  0, // sq_item
+  0, // sq_slice
+  0, // sq_ass_item
+  0, // sq_ass_slice
+  sharedstructures_RoaringBitmap_In, // sq_contains
+  0, // sq_inplace_concat
+  0, // sq_inplace_repeat
+};
+
+static PyTypeObject sharedstructures_RoaringBitmapType = {
+   PyVarObject_HEAD_INIT(NULL, 0)
+   "sharedstructures.RoaringBitmap",                // tp_name
+   sizeof(sharedstructures_RoaringBitmap),          // tp_basicsize
+   0,                                               // tp_itemsize
+   (destructor)sharedstructures_RoaringBitmap_Dealloc, // tp_dealloc
+   0,                                               // tp_print
+   0,                                               // tp_getattr
+   0,                                               // tp_setattr
+   0,                                               // tp_compare
+   sharedstructures_RoaringBitmap_Repr,             // tp_repr
+   0,                                               // tp_as_number
+   &sharedstructures_RoaringBitmap_sequencemethods, // tp_as_sequence
+   0,                                               // tp_as_mapping
+   0,                                               // tp_hash
+   0,                                               // tp_call
+   0,                                               // tp_str
+   0,                                               // tp_getattro
+   0,                                               // tp_setattro
+   0,                                               // tp_as_buffer
+   Py_TPFLAGS_DEFAULT,                              // tp_flag
+   sharedstructures_RoaringBitmap_doc,              // tp_doc
+   0,                                               // tp_traverse
+   0,                                               // tp_clear
+   0,                                               // tp_richcompare
+   0,                                               // tp_weaklistoffset
+   0,                                               // tp_iter
+   0,                                               // tp_iternext
+   sharedstructures_RoaringBitmap_methods,          // tp_methods
+   0,                                               // tp_members
+   0,                                               // tp_getset
+   0,                                               // tp_base
+   0,                                               // tp_dict
+   0,                                               // tp_descr_get
+   0,                                               // tp_descr_set
+   0,                                               // tp_dictoffset
+   0,                                               // tp_init
+   0,                                               // tp_alloc
+   sharedstructures_RoaringBitmap_New,              // tp_new
+};
+
+// these are defined after the type object so they can check their arguments'
+// types
+static PyObject* sharedstructures_RoaringBitmap_compute(PyObject* py_self,
+    PyObject* args) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)py_self;
+
+  sharedstructures_RoaringBitmap* other;
+  const char* op_name;
+  sharedstructures::RoaringBitmap::Operation op;
+  if (!PyArg_ParseTuple(args, "O!s", &sharedstructures_RoaringBitmapType,
+      &other, &op_name) ||
+      !sharedstructures_internal_get_bitmap_operation(op_name, &op)) {
+    return NULL;
+  }
+
+  return sharedstructures_internal_get_bitmap_values(
+      self->bitmap->compute(*other->bitmap, op));
+}
+
+static PyObject* sharedstructures_RoaringBitmap_compute_size(PyObject* py_self,
+    PyObject* args) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)py_self;
+
+  sharedstructures_RoaringBitmap* other;
+  const char* op_name;
+  sharedstructures::RoaringBitmap::Operation op;
+  if (!PyArg_ParseTuple(args, "O!s", &sharedstructures_RoaringBitmapType,
+      &other, &op_name) ||
+      !sharedstructures_internal_get_bitmap_operation(op_name, &op)) {
+    return NULL;
+  }
+
+  return PyLong_FromSize_t(self->bitmap->compute_size(*other->bitmap, op));
+}
+
+static PyObject* sharedstructures_RoaringBitmap_assign(PyObject* py_self,
+    PyObject* args) {
+  sharedstructures_RoaringBitmap* self = (sharedstructures_RoaringBitmap*)py_self;
+
+  sharedstructures_RoaringBitmap* a;
+  sharedstructures_RoaringBitmap* b;
+  const char* op_name;
+  sharedstructures::RoaringBitmap::Operation op;
+  if (!PyArg_ParseTuple(args, "O!O!s", &sharedstructures_RoaringBitmapType,
+      &a, &sharedstructures_RoaringBitmapType, &b, &op_name) ||
+      !sharedstructures_internal_get_bitmap_operation(op_name, &op)) {
+    return NULL;
+  }
+
+  self->bitmap->assign(*a->bitmap, *b->bitmap, op);
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+
+
+
 // module-level names
 
 static PyObject* sharedstructures_delete_pool(PyObject* self, PyObject* args) {
@@ -1795,6 +2737,15 @@ static PyObject* sharedstructures_module_init() {
   if (PyType_Ready(&sharedstructures_PrefixTreeIteratorType) < 0) {
     return NULL;
   }
+  if (PyType_Ready(&sharedstructures_HyperLogLogType) < 0) {
+    return NULL;
+  }
+  if (PyType_Ready(&sharedstructures_CountMinSketchType) < 0) {
+    return NULL;
+  }
+  if (PyType_Ready(&sharedstructures_RoaringBitmapType) < 0) {
+    return NULL;
+  }
 
 #if PY_MAJOR_VERSION >= 3
   PyObject* m = PyModule_Create(&sharedstructures_module_def);
@@ -1811,6 +2762,12 @@ static PyObject* sharedstructures_module_init() {
   PyModule_AddObject(m, "PrefixTree", (PyObject*)&sharedstructures_PrefixTreeType);
   Py_INCREF(&sharedstructures_PrefixTreeIteratorType);
   PyModule_AddObject(m, "PrefixTreeIterator", (PyObject*)&sharedstructures_PrefixTreeIteratorType);
+  Py_INCREF(&sharedstructures_HyperLogLogType);
+  PyModule_AddObject(m, "HyperLogLog", (PyObject*)&sharedstructures_HyperLogLogType);
+  Py_INCREF(&sharedstructures_CountMinSketchType);
+  PyModule_AddObject(m, "CountMinSketch", (PyObject*)&sharedstructures_CountMinSketchType);
+  Py_INCREF(&sharedstructures_RoaringBitmapType);
+  PyModule_AddObject(m, "RoaringBitmap", (PyObject*)&sharedstructures_RoaringBitmapType);
 
   return m;
 }
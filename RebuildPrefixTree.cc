@@ -0,0 +1,193 @@
+#define __STDC_FORMAT_MACROS
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Pool.hh"
+#include "LogarithmicAllocator.hh"
+#include "SimpleAllocator.hh"
+#include "PrefixTree.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+
+// returns the average time for looking up each of the given keys, in
+// nanoseconds
+double measure_lookup_nsecs(const PrefixTree& tree, const vector<string>& keys,
+    size_t passes) {
+  uint64_t start = now();
+  for (size_t pass = 0; pass < passes; pass++) {
+    for (const string& key : keys) {
+      tree.at(key);
+    }
+  }
+  uint64_t end = now();
+  return (double)(end - start) * 1000.0 / (keys.size() * passes);
+}
+
+void print_tree_stats(const char* title, const PrefixTree& tree,
+    const vector<string>& sample_keys, size_t passes) {
+  auto alloc = tree.get_allocator();
+  fprintf(stdout, "%s: keys=%zu nodes=%zu tree_bytes=%zu pool_bytes=%zu "
+      "allocated_bytes=%zu", title, tree.size(), tree.node_size(),
+      tree.bytes_for_prefix(string()), alloc->get_pool()->size(),
+      alloc->bytes_allocated());
+  if (!sample_keys.empty()) {
+    fprintf(stdout, " lookup_nsecs=%lg", measure_lookup_nsecs(tree,
+        sample_keys, passes));
+  }
+  fputc('\n', stdout);
+}
+
+
+void print_usage(const char* argv0) {
+  fprintf(stderr,
+    "usage: %s -X<allocator-type> [options] source-pool dest-pool\n"
+    "rewrites a PrefixTree into a new pool in depth-first order, with each\n"
+    "node's range trimmed to its nonempty slots, and reports the node count,\n"
+    "bytes and lookup latency before and after. no process may modify the\n"
+    "tree while this runs. dest-pool must not exist.\n"
+    "  options:\n"
+    "    -Y<allocator-type> : allocator type for the new pool (default: same\n"
+    "        as the source pool)\n"
+    "    -B<base-offset> : base offset of the tree (default: the source pool's\n"
+    "        base object)\n"
+    "    -n<count> : number of keys to sample for measuring lookups (default\n"
+    "        1000; 0 to skip)\n"
+    "    -p<count> : number of times to look up each sampled key (default 10)\n"
+    "    -R : after rebuilding, rename dest-pool over source-pool, so processes\n"
+    "        that open source-pool afterward get the new tree. only for\n"
+    "        file-backed pools in which the tree is the base object; the\n"
+    "        rebuilt pool contains only the tree. processes that already have\n"
+    "        source-pool open keep using the old tree.\n", argv0);
+}
+
+
+int main(int argc, char** argv) {
+  string allocator_type;
+  string dest_allocator_type;
+  uint64_t base_offset = 0;
+  size_t sample_count = 1000;
+  size_t passes = 10;
+  bool replace = false;
+  vector<string> pool_names;
+  for (int x = 1; x < argc; x++) {
+    if (argv[x][0] == '-') {
+      if (argv[x][1] == 'X') {
+        allocator_type = &argv[x][2];
+      } else if (argv[x][1] == 'Y') {
+        dest_allocator_type = &argv[x][2];
+      } else if (argv[x][1] == 'B') {
+        base_offset = strtoull(&argv[x][2], NULL, 0);
+      } else if (argv[x][1] == 'n') {
+        sample_count = strtoull(&argv[x][2], NULL, 0);
+      } else if (argv[x][1] == 'p') {
+        passes = strtoull(&argv[x][2], NULL, 0);
+      } else if (argv[x][1] == 'R') {
+        replace = true;
+      } else {
+        fprintf(stderr, "unknown argument: %s\n", argv[x]);
+        print_usage(argv[0]);
+        return 1;
+      }
+    } else {
+      pool_names.emplace_back(argv[x]);
+    }
+  }
+
+  if (allocator_type.empty() || (pool_names.size() != 2) || !passes) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if (dest_allocator_type.empty()) {
+    dest_allocator_type = allocator_type;
+  }
+  if (replace && base_offset) {
+    fprintf(stderr, "-R can only be used when the tree is the base object\n");
+    return 1;
+  }
+
+  try {
+    shared_ptr<Pool> source_pool(new Pool(pool_names[0], 0, true, false));
+    shared_ptr<Allocator> source_alloc = create_allocator(source_pool,
+        allocator_type);
+    // opening the tree with base offset 0 would create one if there's no
+    // base object, so check first
+    if (!base_offset && !source_alloc->base_object_offset()) {
+      throw runtime_error("source pool does not contain a tree");
+    }
+    PrefixTree source(source_alloc, base_offset);
+
+    // sample keys evenly across the tree
+    vector<string> sample_keys;
+    if (sample_count) {
+      size_t stride = max<size_t>(source.size() / sample_count, 1);
+      size_t index = 0;
+      for (const auto& it : source) {
+        if ((index % stride) == 0) {
+          sample_keys.emplace_back(it.first);
+        }
+        index++;
+      }
+    }
+
+    try {
+      Pool existing_pool(pool_names[1], 0, true, false);
+      throw runtime_error("destination pool already exists");
+    } catch (const cannot_open_file& e) { }
+
+    shared_ptr<Pool> dest_pool(new Pool(pool_names[1]));
+    shared_ptr<Allocator> dest_alloc = create_allocator(dest_pool,
+        dest_allocator_type);
+    uint64_t start = now();
+    uint64_t dest_base_offset = source.rebuild_into(dest_alloc);
+    uint64_t end = now();
+    PrefixTree dest(dest_alloc, dest_base_offset);
+    fprintf(stderr, "rebuilt %zu keys in %" PRIu64 " usecs\n", dest.size(),
+        end - start);
+
+    print_tree_stats("before", source, sample_keys, passes);
+    print_tree_stats("after", dest, sample_keys, passes);
+
+    if (replace) {
+      if (!source_pool->is_file()) {
+        throw runtime_error("-R can only be used with file-backed pools");
+      }
+      if (rename(pool_names[1].c_str(), pool_names[0].c_str())) {
+        throw runtime_error("can\'t replace source pool: " +
+            string_for_error(errno));
+      }
+      fprintf(stderr, "replaced %s with the rebuilt tree\n",
+          pool_names[0].c_str());
+    }
+
+  } catch (const exception& e) {
+    fprintf(stderr, "failure: %s\n", e.what());
+    return 2;
+  }
+
+  return 0;
+}
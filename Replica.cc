@@ -0,0 +1,208 @@
+#include "Replica.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+#include "FileUtils.hh"
+#include "HashTable.hh"
+#include "PrefixTree.hh"
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+// data is read from the stream or log file in chunks of this many bytes
+static const size_t READ_SIZE = 1024 * 1024;
+
+
+Replica::Replica(shared_ptr<Allocator> allocator, uint64_t log_base_offset) :
+    allocator(allocator), log_base_offset(log_base_offset), applier(allocator),
+    last_timestamp(0), missing_records(false), log_offset(0),
+    log_first_sequence(0) { }
+
+
+shared_ptr<Allocator> Replica::get_allocator() const {
+  return this->allocator;
+}
+
+
+void Replica::attach_cold_tier(uint64_t tree_base,
+    shared_ptr<PrefixTree> cold_tier) {
+  this->applier.attach_cold_tier(tree_base, cold_tier);
+}
+
+
+size_t Replica::apply(int fd) {
+  size_t num_applied = 0;
+  string buffer(READ_SIZE, '\0');
+  while (!this->missing_records) {
+    ssize_t bytes_read = read(fd, &buffer[0], buffer.size());
+    if (bytes_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        break;
+      }
+      throw runtime_error("can\'t read replication stream: " +
+          string_for_error(errno));
+    }
+    if (bytes_read == 0) {
+      break;
+    }
+
+    this->pending_data.append(buffer.data(), bytes_read);
+    size_t bytes_applied = this->apply_records(this->pending_data,
+        &num_applied, false);
+    this->pending_data.erase(0, bytes_applied);
+  }
+  return num_applied;
+}
+
+size_t Replica::apply_log(const string& log_filename) {
+  scoped_fd fd = open(log_filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw cannot_open_file(log_filename);
+  }
+
+  // a checkpoint empties the log, after which the leader appends new records
+  // from the beginning again. if that happened since the last call, the first
+  // record is different (or the log is shorter than our position), so start
+  // over from the beginning. records we already have are skipped
+  uint64_t file_size = fstat(fd).st_size;
+  WriteAheadLog::RecordHeader first_header;
+  uint64_t first_sequence = 0;
+  if (pread_all(fd, &first_header, sizeof(first_header), 0, log_filename)) {
+    first_sequence = first_header.sequence;
+  }
+  if ((first_sequence != this->log_first_sequence) ||
+      (file_size < this->log_offset)) {
+    this->log_offset = 0;
+    this->log_first_sequence = first_sequence;
+  }
+
+  // the leader may be in the middle of appending the last record, so
+  // incomplete or corrupt records at the end aren't errors; we just stop there
+  // and try again next time
+  size_t num_applied = 0;
+  size_t read_size = READ_SIZE;
+  string data;
+  while (!this->missing_records && (this->log_offset < file_size)) {
+    data.resize(min<uint64_t>(read_size, file_size - this->log_offset));
+    if (!pread_all(fd, &data[0], data.size(), this->log_offset,
+        log_filename)) {
+      break;
+    }
+
+    size_t bytes_applied = this->apply_records(data, &num_applied, true);
+    this->log_offset += bytes_applied;
+    if (bytes_applied == 0) {
+      // the next record may just be larger than what we read
+      if (data.size() < sizeof(WriteAheadLog::RecordHeader)) {
+        break;
+      }
+      uint32_t record_size = reinterpret_cast<
+          const WriteAheadLog::RecordHeader*>(data.data())->size;
+      if ((record_size <= data.size()) ||
+          (record_size > file_size - this->log_offset)) {
+        break;
+      }
+      read_size = record_size;
+    }
+  }
+  return num_applied;
+}
+
+
+uint64_t Replica::next_sequence() const {
+  return this->allocator->get_pool()->at<WriteAheadLog::WriteAheadLogBase>(
+      this->log_base_offset)->next_sequence.load();
+}
+
+uint64_t Replica::lag(uint64_t leader_next_sequence) const {
+  uint64_t next_sequence = this->next_sequence();
+  return (leader_next_sequence > next_sequence) ?
+      (leader_next_sequence - next_sequence) : 0;
+}
+
+uint64_t Replica::last_applied_timestamp() const {
+  return this->last_timestamp;
+}
+
+bool Replica::needs_snapshot() const {
+  return this->missing_records;
+}
+
+
+size_t Replica::apply_records(const string& data, size_t* num_applied,
+    bool corrupt_is_incomplete) {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+
+  size_t offset = 0;
+  string record_data;
+  while (data.size() - offset >= sizeof(WriteAheadLog::RecordHeader)) {
+    // records aren't aligned in the stream, so copy each one before using it
+    WriteAheadLog::RecordHeader header;
+    memcpy(&header, data.data() + offset, sizeof(header));
+    bool corrupt = (header.size < sizeof(WriteAheadLog::RecordHeader)) ||
+        (header.key_size > header.size - sizeof(WriteAheadLog::RecordHeader));
+    if (!corrupt) {
+      if (header.size > data.size() - offset) {
+        break;
+      }
+      record_data.assign(data, offset, header.size);
+      corrupt = (header.checksum != WriteAheadLog::checksum_for_record(
+          reinterpret_cast<const WriteAheadLog::RecordHeader*>(
+              record_data.data())));
+    }
+    if (corrupt) {
+      if (corrupt_is_incomplete) {
+        break;
+      }
+      throw runtime_error("replication stream contains a corrupt record");
+    }
+
+    // skip records the follower already has. if there's a gap, the records in
+    // it are gone from the stream, so we can't continue
+    uint64_t next_sequence = p->at<WriteAheadLog::WriteAheadLogBase>(
+        this->log_base_offset)->next_sequence.load();
+    if (header.sequence < next_sequence) {
+      offset += header.size;
+      continue;
+    }
+    if (header.sequence > next_sequence) {
+      this->missing_records = true;
+      break;
+    }
+
+    // the structure advances next_sequence while its pool is still locked
+    // for the change, so the follower's position never falls behind its
+    // contents. records that didn't change anything don't advance it, so it's
+    // done here for them; applying those again would be harmless
+    uint64_t sequence_offset = this->log_base_offset +
+        offsetof(WriteAheadLog::WriteAheadLogBase, next_sequence);
+    this->applier.apply(reinterpret_cast<const WriteAheadLog::RecordHeader*>(
+        record_data.data()), sequence_offset);
+    auto* position = p->at<atomic<uint64_t>>(sequence_offset);
+    if (position->load() == next_sequence) {
+      position->store(next_sequence + 1);
+    }
+    this->last_timestamp = header.timestamp;
+    offset += header.size;
+    (*num_applied)++;
+  }
+  return offset;
+}
+
+} // namespace sharedstructures
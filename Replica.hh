@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "Allocator.hh"
+#include "WriteAheadLog.hh"
+
+namespace sharedstructures {
+
+
+// Replica keeps a follower pool up to date with a leader pool by applying the
+// leader's WriteAheadLog records to it. the log is the replication stream: a
+// follower on the same machine can follow the leader's log file directly with
+// apply_log(), and a follower anywhere else can read it from any file, pipe or
+// socket it's shipped through with apply(). readers of the follower pool never
+// contend with the leader's lock.
+//
+// the follower pool must start as a snapshot of the leader pool that includes
+// the leader's WriteAheadLog (for example, a checkpoint restored with
+// WriteAheadLog::restore_checkpoint or IncrementalCheckpoint::restore, or a
+// copy made with Allocator::clone_to). the follower's position in the stream is
+// kept in its copy of the log's state, so it survives reopening the follower.
+// records the follower already has are skipped, so it's safe to send the same
+// records more than once (e.g. by shipping the whole log file every time).
+//
+// the position is advanced in the same critical section (under the follower
+// pool's write lock) as the change a record makes, so if the replicating
+// process is killed, the follower's contents and position still agree when
+// it's reopened, and no record is applied twice. this is only as strong as the
+// changes themselves: a process killed partway through a change leaves the
+// structure as inconsistent as any interrupted write would. the follower pool
+// isn't synced, so after the machine crashes it must be recreated from a
+// snapshot.
+//
+// like replay(), only changes to PrefixTrees and HashTables are replicated,
+// and only to structures that existed when the snapshot was taken. if the
+// follower falls behind a checkpoint (which empties the leader's log), the
+// records it needs are gone; needs_snapshot() becomes true, and the follower
+// must be recreated from a newer snapshot. no other process may modify the
+// follower pool while it's replicating.
+
+class Replica {
+public:
+  Replica() = delete;
+  Replica(const Replica&) = delete;
+  Replica(Replica&&) = delete;
+
+  // opens a follower pool. log_base_offset is the leader's
+  // WriteAheadLog::base() (it's the same in the follower).
+  Replica(std::shared_ptr<Allocator> allocator, uint64_t log_base_offset);
+  ~Replica() = default;
+
+  // returns the allocator for the follower pool
+  std::shared_ptr<Allocator> get_allocator() const;
+
+  // reads records from fd and applies them in order, until the end of the
+  // stream (or, if fd is nonblocking, until no more data is available). fd can
+  // be a file, pipe or socket; it's read from its current position. a record
+  // that's cut off at the end is kept and completed by the next call. returns
+  // the number of records applied. throws runtime_error if the stream contains
+  // a corrupt record.
+  size_t apply(int fd);
+
+  // applies new records from the leader's log file, which may still be in use
+  // by the leader. this remembers its position in the file and notices when a
+  // checkpoint empties the log. returns the number of records applied.
+  size_t apply_log(const std::string& log_filename);
+
+  // attaches a cold tier to the follower's PrefixTree at tree_base, as
+  // WriteAheadLog::attach_cold_tier does for replay(). the follower needs its
+  // own cold tier, which must start as a snapshot of the leader's cold tier
+  // taken along with the follower pool's snapshot.
+  void attach_cold_tier(uint64_t tree_base,
+      std::shared_ptr<PrefixTree> cold_tier);
+
+  // inspection methods.
+  // the sequence number of the next record the follower needs
+  uint64_t next_sequence() const;
+  // the number of records the follower is behind a leader whose
+  // WriteAheadLog::next_sequence() is given
+  uint64_t lag(uint64_t leader_next_sequence) const;
+  // when the leader appended the last record this object applied (usecs since
+  // epoch), or 0 if it hasn't applied any
+  uint64_t last_applied_timestamp() const;
+  // true if records were skipped between the follower's position and the
+  // stream, so the follower can't catch up without a new snapshot
+  bool needs_snapshot() const;
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t log_base_offset;
+  WriteAheadLog::RecordApplier applier;
+
+  uint64_t last_timestamp;
+  bool missing_records;
+
+  // data read by apply() that doesn't form a complete record yet
+  std::string pending_data;
+
+  // apply_log()'s position in the log file, and the sequence number of the
+  // log's first record when it was last read
+  uint64_t log_offset;
+  uint64_t log_first_sequence;
+
+  // applies the complete records at the beginning of data, and returns the
+  // number of bytes they occupy. stops at the first incomplete record, or at
+  // the first corrupt record if corrupt_is_incomplete is true (otherwise,
+  // throws runtime_error).
+  size_t apply_records(const std::string& data, size_t* num_applied,
+      bool corrupt_is_incomplete);
+};
+
+} // namespace sharedstructures
@@ -0,0 +1,376 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <map>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "HashTable.hh"
+#include "PrefixTree.hh"
+#include "Replica.hh"
+#include "WriteAheadLog.hh"
+#include "TestUtils.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+string read_file(const string& filename) {
+  scoped_fd fd = open(filename.c_str(), O_RDONLY);
+  expect_ne(-1, fd);
+  string data(fstat(fd).st_size, '\0');
+  expect_eq(data.size(), read(fd, &data[0], data.size()));
+  return data;
+}
+
+void write_file(const string& filename, const string& data) {
+  scoped_fd fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  expect_ne(-1, fd);
+  expect_eq(data.size(), write(fd, data.data(), data.size()));
+}
+
+void delete_files() {
+  Pool::delete_pool("test-replica-leader");
+  Pool::delete_pool("test-replica-follower");
+  Pool::delete_pool("test-replica-follower2");
+  unlink("test-replica.log");
+  unlink("test-replica.checkpoint");
+  unlink("test-replica.stream");
+}
+
+
+void run_log_file_test(const string& allocator_type) {
+  printf("-- [%s] log file\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-replica-leader"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  shared_ptr<WriteAheadLog> wal(new WriteAheadLog(alloc, "test-replica.log"));
+  PrefixTree tree(alloc);
+  HashTable table(alloc, 6);
+  tree.attach_write_ahead_log(wal);
+  table.attach_write_ahead_log(wal);
+  tree.insert(string("before-snapshot"), string("value"));
+  wal->checkpoint("test-replica.checkpoint");
+  WriteAheadLog::restore_checkpoint("test-replica.checkpoint",
+      "test-replica-follower");
+
+  shared_ptr<Pool> follower_pool(new Pool("test-replica-follower"));
+  shared_ptr<Allocator> follower_alloc = create_allocator(follower_pool,
+      allocator_type);
+  PrefixTree follower_tree(follower_alloc, tree.base());
+  HashTable follower_table(follower_alloc, table.base(), 0);
+  {
+    Replica replica(follower_alloc, wal->base());
+    expect_eq(wal->next_sequence(), replica.next_sequence());
+    expect_eq(0, replica.lag(wal->next_sequence()));
+    expect_eq(0, replica.apply_log("test-replica.log"));
+    expect_eq(0, replica.last_applied_timestamp());
+
+    // the follower picks up changes in batches, without the leader committing
+    uint64_t start_time = now();
+    for (size_t x = 0; x < 100; x++) {
+      tree.insert(string_printf("key%zu", x), (int64_t)x);
+      table.insert(string_printf("key%zu", x), string_printf("value%zu", x));
+    }
+    expect_eq(200, replica.lag(wal->next_sequence()));
+    expect_eq(200, replica.apply_log("test-replica.log"));
+    expect_eq(0, replica.lag(wal->next_sequence()));
+    expect_le(start_time, replica.last_applied_timestamp());
+    expect_eq(tree_contents(tree), tree_contents(follower_tree));
+    expect_eq(table_contents(table), table_contents(follower_table));
+
+    tree.incr("key7", (int64_t)10);
+    tree.erase("key8");
+    table.erase("key9");
+    table.incr("counter", 2.5);
+    expect_eq(4, replica.apply_log("test-replica.log"));
+    expect_eq(PrefixTree::LookupResult((int64_t)17), follower_tree.at("key7"));
+    expect_eq(tree_contents(tree), tree_contents(follower_tree));
+    expect_eq(table_contents(table), table_contents(follower_table));
+  }
+
+  // the follower's position is kept in its pool, so a new object doesn't
+  // apply anything twice
+  uint64_t follower_next_sequence;
+  {
+    Replica replica(follower_alloc, wal->base());
+    expect_eq(wal->next_sequence(), replica.next_sequence());
+    expect_eq(0, replica.apply_log("test-replica.log"));
+    follower_next_sequence = replica.next_sequence();
+  }
+
+  // a checkpoint empties the log. a follower that was caught up continues
+  // from the new log, but one that wasn't can't
+  {
+    Replica replica(follower_alloc, wal->base());
+    expect_eq(0, replica.apply_log("test-replica.log"));
+    wal->checkpoint("test-replica.checkpoint");
+    tree.insert(string("after-checkpoint"), string("value"));
+    expect_eq(1, replica.apply_log("test-replica.log"));
+    expect_eq(follower_next_sequence + 1, replica.next_sequence());
+    expect_eq(false, replica.needs_snapshot());
+
+    tree.insert(string("before-checkpoint"), string("value"));
+    wal->checkpoint("test-replica.checkpoint");
+    tree.insert(string("after-checkpoint2"), string("value"));
+    expect_eq(0, replica.apply_log("test-replica.log"));
+    expect_eq(true, replica.needs_snapshot());
+    expect_eq(follower_next_sequence + 1, replica.next_sequence());
+    expect_eq(2, replica.lag(wal->next_sequence()));
+  }
+}
+
+
+void run_stream_test(const string& allocator_type) {
+  printf("-- [%s] stream\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-replica-leader"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  shared_ptr<WriteAheadLog> wal(new WriteAheadLog(alloc, "test-replica.log"));
+  PrefixTree tree(alloc);
+  tree.attach_write_ahead_log(wal);
+  wal->checkpoint("test-replica.checkpoint");
+  WriteAheadLog::restore_checkpoint("test-replica.checkpoint",
+      "test-replica-follower");
+  WriteAheadLog::restore_checkpoint("test-replica.checkpoint",
+      "test-replica-follower2");
+
+  for (size_t x = 0; x < 1000; x++) {
+    tree.insert(string_printf("key%zu", x), string_printf("value%zu", x));
+  }
+  wal->commit();
+  string log_data = read_file("test-replica.log");
+
+  // a shipped file can end in the middle of a record; the rest of the record
+  // comes with the next file
+  {
+    shared_ptr<Pool> follower_pool(new Pool("test-replica-follower"));
+    shared_ptr<Allocator> follower_alloc = create_allocator(follower_pool,
+        allocator_type);
+    PrefixTree follower_tree(follower_alloc, tree.base());
+    Replica replica(follower_alloc, wal->base());
+
+    size_t split_offset = log_data.size() / 2 + 7;
+    write_file("test-replica.stream", log_data.substr(0, split_offset));
+    size_t num_applied;
+    {
+      scoped_fd fd = open("test-replica.stream", O_RDONLY);
+      num_applied = replica.apply(fd);
+    }
+    expect_lt(0, num_applied);
+    expect_lt(num_applied, 1000);
+    expect_eq(num_applied, follower_tree.size());
+
+    write_file("test-replica.stream", log_data.substr(split_offset));
+    {
+      scoped_fd fd = open("test-replica.stream", O_RDONLY);
+      expect_eq(1000 - num_applied, replica.apply(fd));
+    }
+    expect_eq(tree_contents(tree), tree_contents(follower_tree));
+
+    // corrupt data in a stream is an error
+    write_file("test-replica.stream", string(100, 'x'));
+    {
+      scoped_fd fd = open("test-replica.stream", O_RDONLY);
+      try {
+        replica.apply(fd);
+        expect(false);
+      } catch (const runtime_error& e) { }
+    }
+  }
+
+  // the log can also be shipped through a pipe (here, from another process)
+  int fds[2];
+  expect_eq(0, pipe(fds));
+  pid_t child_pid = fork();
+  if (!child_pid) {
+    close(fds[0]);
+    // write in small pieces that don't line up with the records
+    for (size_t offset = 0; offset < log_data.size(); offset += 333) {
+      size_t size = min<size_t>(333, log_data.size() - offset);
+      if (write(fds[1], log_data.data() + offset, size) != (ssize_t)size) {
+        _exit(1);
+      }
+      usleep(10);
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+  {
+    shared_ptr<Pool> follower_pool(new Pool("test-replica-follower2"));
+    shared_ptr<Allocator> follower_alloc = create_allocator(follower_pool,
+        allocator_type);
+    PrefixTree follower_tree(follower_alloc, tree.base());
+    Replica replica(follower_alloc, wal->base());
+    expect_eq(1000, replica.apply(fds[0]));
+    expect_eq(tree_contents(tree), tree_contents(follower_tree));
+    expect_eq(0, replica.lag(wal->next_sequence()));
+  }
+  close(fds[0]);
+
+  int exit_status;
+  expect_eq(child_pid, waitpid(child_pid, &exit_status, 0));
+  expect_eq(true, WIFEXITED(exit_status));
+  expect_eq(0, WEXITSTATUS(exit_status));
+}
+
+
+void run_killed_follower_test(const string& allocator_type) {
+  printf("-- [%s] killed follower\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-replica-leader"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  shared_ptr<WriteAheadLog> wal(new WriteAheadLog(alloc, "test-replica.log"));
+  PrefixTree tree(alloc);
+  tree.attach_write_ahead_log(wal);
+  wal->checkpoint("test-replica.checkpoint");
+  WriteAheadLog::restore_checkpoint("test-replica.checkpoint",
+      "test-replica-follower");
+
+  // incrs aren't idempotent, so a record that's applied twice shows up in the
+  // follower's counter
+  for (size_t x = 0; x < 20000; x++) {
+    tree.incr("counter", (int64_t)1);
+  }
+  wal->commit();
+
+  // kill followers at different points while they apply the log. each one
+  // continues from where the last one's position says it stopped
+  for (size_t x = 0; x < 5; x++) {
+    pid_t child_pid = fork();
+    if (!child_pid) {
+      shared_ptr<Pool> follower_pool(new Pool("test-replica-follower"));
+      shared_ptr<Allocator> follower_alloc = create_allocator(follower_pool,
+          allocator_type);
+      Replica replica(follower_alloc, wal->base());
+      replica.apply_log("test-replica.log");
+      _exit(0);
+    }
+    usleep(1000 * (x + 1));
+    kill(child_pid, SIGKILL);
+    int exit_status;
+    expect_eq(child_pid, waitpid(child_pid, &exit_status, 0));
+  }
+
+  shared_ptr<Pool> follower_pool(new Pool("test-replica-follower"));
+  shared_ptr<Allocator> follower_alloc = create_allocator(follower_pool,
+      allocator_type);
+  PrefixTree follower_tree(follower_alloc, tree.base());
+  Replica replica(follower_alloc, wal->base());
+  replica.apply_log("test-replica.log");
+  expect_eq(0, replica.lag(wal->next_sequence()));
+  expect_eq(PrefixTree::LookupResult((int64_t)20000),
+      follower_tree.at("counter"));
+}
+
+
+void run_snapshot_catch_up_test(const string& allocator_type) {
+  printf("-- [%s] snapshot catch-up\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-replica-leader"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  shared_ptr<WriteAheadLog> wal(new WriteAheadLog(alloc, "test-replica.log"));
+  PrefixTree tree(alloc);
+  tree.attach_write_ahead_log(wal);
+  wal->checkpoint("test-replica.checkpoint");
+  WriteAheadLog::restore_checkpoint("test-replica.checkpoint",
+      "test-replica-follower");
+
+  // the follower falls behind while the leader checkpoints
+  for (size_t x = 0; x < 10; x++) {
+    tree.insert(string_printf("key%zu", x), (int64_t)x);
+  }
+  wal->checkpoint("test-replica.checkpoint");
+  for (size_t x = 10; x < 15; x++) {
+    tree.insert(string_printf("key%zu", x), (int64_t)x);
+  }
+  {
+    shared_ptr<Pool> follower_pool(new Pool("test-replica-follower"));
+    shared_ptr<Allocator> follower_alloc = create_allocator(follower_pool,
+        allocator_type);
+    Replica replica(follower_alloc, wal->base());
+    expect_eq(0, replica.apply_log("test-replica.log"));
+    expect_eq(true, replica.needs_snapshot());
+    expect_eq(15, replica.lag(wal->next_sequence()));
+  }
+
+  // after restoring the latest checkpoint, it catches up from the log
+  WriteAheadLog::restore_checkpoint("test-replica.checkpoint",
+      "test-replica-follower");
+  {
+    shared_ptr<Pool> follower_pool(new Pool("test-replica-follower"));
+    shared_ptr<Allocator> follower_alloc = create_allocator(follower_pool,
+        allocator_type);
+    PrefixTree follower_tree(follower_alloc, tree.base());
+    Replica replica(follower_alloc, wal->base());
+    expect_eq(5, replica.lag(wal->next_sequence()));
+    expect_eq(5, replica.apply_log("test-replica.log"));
+    expect_eq(false, replica.needs_snapshot());
+    expect_eq(tree_contents(tree), tree_contents(follower_tree));
+  }
+
+  // a clone of the leader works as a snapshot too
+  Pool::delete_pool("test-replica-follower");
+  alloc->clone_to("test-replica-follower");
+  tree.insert(string("after-clone"), string("value"));
+  {
+    shared_ptr<Pool> follower_pool(new Pool("test-replica-follower"));
+    shared_ptr<Allocator> follower_alloc = create_allocator(follower_pool,
+        allocator_type);
+    PrefixTree follower_tree(follower_alloc, tree.base());
+    Replica replica(follower_alloc, wal->base());
+    expect_eq(1, replica.apply_log("test-replica.log"));
+    expect_eq(tree_contents(tree), tree_contents(follower_tree));
+  }
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      delete_files();
+      run_log_file_test(allocator_type);
+      delete_files();
+      run_stream_test(allocator_type);
+      delete_files();
+      run_killed_follower_test(allocator_type);
+      delete_files();
+      run_snapshot_catch_up_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  delete_files();
+
+  return retcode;
+}
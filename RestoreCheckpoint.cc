@@ -0,0 +1,31 @@
+#include <stdio.h>
+
+#include <stdexcept>
+#include <string>
+
+#include "IncrementalCheckpoint.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s checkpoint-prefix pool-name\n", argv[0]);
+    fprintf(stderr, "rebuilds a file-backed pool from an incremental checkpoint\n");
+    fprintf(stderr, "chain (checkpoint-prefix.0, checkpoint-prefix.1, ...). no\n");
+    fprintf(stderr, "process may have the pool open while this runs.\n");
+    return 1;
+  }
+
+  try {
+    size_t num_files = IncrementalCheckpoint::restore(argv[1], argv[2]);
+    fprintf(stderr, "restored %s from snapshot and %zu delta(s)\n", argv[2],
+        num_files - 1);
+  } catch (const exception& e) {
+    fprintf(stderr, "failure: %s\n", e.what());
+    return 2;
+  }
+
+  return 0;
+}
@@ -0,0 +1,1121 @@
+#include "RoaringBitmap.hh"
+
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+// containers with more values than this are stored as bitmaps
+static const size_t ARRAY_MAX_SIZE = 4096;
+static const size_t BITMAP_WORDS = 1024;
+static const size_t BITMAP_BYTES = BITMAP_WORDS * sizeof(uint64_t);
+
+
+struct RoaringBitmap::LocalContainer {
+  uint16_t key;
+  uint32_t cardinality;
+  vector<uint16_t> array; // used if bitmap is empty
+  vector<uint64_t> bitmap; // BITMAP_WORDS words, or empty
+};
+
+// a read-only view of a container in the pool. array and bitmap point into the
+// pool, except for run containers, which are expanded into the local container
+struct RoaringBitmap::ContainerView {
+  bool is_bitmap;
+  uint32_t cardinality;
+  const uint16_t* array;
+  const uint64_t* bitmap;
+  LocalContainer expanded;
+};
+
+
+// bitmap kernels. on x86 these operate on 128 bits at a time with SSE2 (which
+// every x86-64 processor supports); elsewhere they fall back to 64-bit words
+
+struct AndWords {
+#ifdef __SSE2__
+  static __m128i combine(__m128i a, __m128i b) {
+    return _mm_and_si128(a, b);
+  }
+#endif
+  static uint64_t combine(uint64_t a, uint64_t b) {
+    return a & b;
+  }
+};
+
+struct OrWords {
+#ifdef __SSE2__
+  static __m128i combine(__m128i a, __m128i b) {
+    return _mm_or_si128(a, b);
+  }
+#endif
+  static uint64_t combine(uint64_t a, uint64_t b) {
+    return a | b;
+  }
+};
+
+struct AndNotWords {
+#ifdef __SSE2__
+  static __m128i combine(__m128i a, __m128i b) {
+    return _mm_andnot_si128(b, a);
+  }
+#endif
+  static uint64_t combine(uint64_t a, uint64_t b) {
+    return a & ~b;
+  }
+};
+
+#ifdef __SSE2__
+// returns the population counts of the two 64-bit halves of v
+static inline __m128i popcount_epi64(__m128i v) {
+  const __m128i m1 = _mm_set1_epi8(0x55);
+  const __m128i m2 = _mm_set1_epi8(0x33);
+  const __m128i m4 = _mm_set1_epi8(0x0F);
+  v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi64(v, 1), m1));
+  v = _mm_add_epi8(_mm_and_si128(v, m2),
+      _mm_and_si128(_mm_srli_epi64(v, 2), m2));
+  v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi64(v, 4)), m4);
+  return _mm_sad_epu8(v, _mm_setzero_si128());
+}
+#endif
+
+// combines two bitmaps and returns the number of bits set in the result. if
+// out is NULL, only counts the bits.
+template <typename Combiner>
+static uint32_t combine_bitmaps(uint64_t* out, const uint64_t* a,
+    const uint64_t* b) {
+#ifdef __SSE2__
+  __m128i total = _mm_setzero_si128();
+  for (size_t x = 0; x < BITMAP_WORDS; x += 2) {
+    __m128i r = Combiner::combine(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + x)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x)));
+    if (out) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), r);
+    }
+    total = _mm_add_epi64(total, popcount_epi64(r));
+  }
+  uint64_t totals[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(totals), total);
+  return totals[0] + totals[1];
+
+#else
+  uint32_t total = 0;
+  for (size_t x = 0; x < BITMAP_WORDS; x++) {
+    uint64_t r = Combiner::combine(a[x], b[x]);
+    if (out) {
+      out[x] = r;
+    }
+    total += __builtin_popcountll(r);
+  }
+  return total;
+#endif
+}
+
+static uint32_t combine_bitmaps(uint64_t* out, const uint64_t* a,
+    const uint64_t* b, RoaringBitmap::Operation op) {
+  switch (op) {
+    case RoaringBitmap::Operation::And:
+      return combine_bitmaps<AndWords>(out, a, b);
+    case RoaringBitmap::Operation::Or:
+      return combine_bitmaps<OrWords>(out, a, b);
+    case RoaringBitmap::Operation::AndNot:
+      return combine_bitmaps<AndNotWords>(out, a, b);
+  }
+  throw invalid_argument("unknown operation");
+}
+
+static uint32_t bitmap_cardinality(const uint64_t* words) {
+  // a | a == a, so this just counts the bits
+  return combine_bitmaps<OrWords>(NULL, words, words);
+}
+
+static inline bool bitmap_contains(const uint64_t* words, uint16_t v) {
+  return (words[v >> 6] >> (v & 63)) & 1;
+}
+
+static inline void bitmap_set(uint64_t* words, uint16_t v) {
+  words[v >> 6] |= (1ULL << (v & 63));
+}
+
+static inline void bitmap_clear(uint64_t* words, uint16_t v) {
+  words[v >> 6] &= ~(1ULL << (v & 63));
+}
+
+// sets all bits in [start, end]
+static void bitmap_set_range(uint64_t* words, uint32_t start, uint32_t end) {
+  uint32_t first_word = start >> 6, last_word = end >> 6;
+  uint64_t first_mask = ~0ULL << (start & 63);
+  uint64_t last_mask = ~0ULL >> (63 - (end & 63));
+  if (first_word == last_word) {
+    words[first_word] |= (first_mask & last_mask);
+    return;
+  }
+  words[first_word] |= first_mask;
+  for (uint32_t x = first_word + 1; x < last_word; x++) {
+    words[x] = ~0ULL;
+  }
+  words[last_word] |= last_mask;
+}
+
+static size_t bitmap_run_count(const uint64_t* words) {
+  // a run starts at each set bit whose preceding bit is clear
+  size_t ret = 0;
+  uint64_t carry = 0;
+  for (size_t x = 0; x < BITMAP_WORDS; x++) {
+    ret += __builtin_popcountll(words[x] & ~((words[x] << 1) | carry));
+    carry = words[x] >> 63;
+  }
+  return ret;
+}
+
+static size_t array_run_count(const uint16_t* values, size_t count) {
+  size_t ret = (count != 0);
+  for (size_t x = 1; x < count; x++) {
+    ret += (values[x] != values[x - 1] + 1);
+  }
+  return ret;
+}
+
+static void bitmap_to_array(vector<uint16_t>& out, const uint64_t* words) {
+  for (size_t x = 0; x < BITMAP_WORDS; x++) {
+    for (uint64_t w = words[x]; w; w &= (w - 1)) {
+      out.emplace_back((x << 6) | __builtin_ctzll(w));
+    }
+  }
+}
+
+static void array_to_bitmap(vector<uint64_t>& out, const uint16_t* values,
+    size_t count) {
+  out.assign(BITMAP_WORDS, 0);
+  for (size_t x = 0; x < count; x++) {
+    bitmap_set(out.data(), values[x]);
+  }
+}
+
+static void intersect_arrays(vector<uint16_t>& out, const uint16_t* a,
+    size_t a_count, const uint16_t* b, size_t b_count) {
+  if (a_count > b_count) {
+    swap(a, b);
+    swap(a_count, b_count);
+  }
+
+  // if one array is much larger than the other, binary-search the large one
+  // for each value in the small one instead of scanning both
+  if (b_count > 64 * a_count) {
+    const uint16_t* b_end = b + b_count;
+    for (size_t x = 0; x < a_count; x++) {
+      b = lower_bound(b, b_end, a[x]);
+      if (b == b_end) {
+        break;
+      }
+      if (*b == a[x]) {
+        out.emplace_back(a[x]);
+      }
+    }
+    return;
+  }
+
+  size_t ia = 0, ib = 0;
+  while ((ia < a_count) && (ib < b_count)) {
+    if (a[ia] < b[ib]) {
+      ia++;
+    } else if (a[ia] > b[ib]) {
+      ib++;
+    } else {
+      out.emplace_back(a[ia]);
+      ia++;
+      ib++;
+    }
+  }
+}
+
+
+RoaringBitmap::RoaringBitmap(shared_ptr<Allocator> allocator) :
+    allocator(allocator) {
+  auto g = this->allocator->lock(true);
+  this->base_offset = this->create_bitmap_base();
+}
+
+RoaringBitmap::RoaringBitmap(shared_ptr<Allocator> allocator,
+    uint64_t base_offset) : allocator(allocator), base_offset(base_offset) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->create_bitmap_base();
+      this->allocator->set_base_object_offset(this->base_offset);
+    }
+  }
+}
+
+
+shared_ptr<Allocator> RoaringBitmap::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t RoaringBitmap::base() const {
+  return this->base_offset;
+}
+
+
+bool RoaringBitmap::add(uint32_t v) {
+  uint16_t key = v >> 16;
+  uint16_t low = v & 0xFFFF;
+
+  // if the value is already present or belongs in an existing bitmap
+  // container, we don't need the write lock
+  {
+    auto g = this->allocator->lock(false);
+    ssize_t index = this->find_container(key);
+    if (index >= 0) {
+      auto p = this->allocator->get_pool();
+      ContainerEntry* e = this->entry(index);
+      if (e->type == Bitmap) {
+        uint64_t mask = 1ULL << (low & 63);
+        auto* words = p->at<atomic<uint64_t>>(e->data_offset);
+        if (words[low >> 6].fetch_or(mask) & mask) {
+          return false;
+        }
+        e->cardinality++;
+        p->at<RoaringBitmapBase>(this->base_offset)->cardinality++;
+        return true;
+      }
+      if (this->container_contains(p.get(), *e, low)) {
+        return false;
+      }
+    }
+  }
+
+  auto g = this->allocator->lock(true);
+  return this->add_locked(key, low);
+}
+
+bool RoaringBitmap::remove(uint32_t v) {
+  uint16_t key = v >> 16;
+  uint16_t low = v & 0xFFFF;
+
+  // if the value isn't present or is in a bitmap container, we don't need the
+  // write lock. bitmap containers aren't deleted or converted to arrays here
+  // when they become small; run_optimize() does that
+  {
+    auto g = this->allocator->lock(false);
+    ssize_t index = this->find_container(key);
+    if (index < 0) {
+      return false;
+    }
+    auto p = this->allocator->get_pool();
+    ContainerEntry* e = this->entry(index);
+    if (e->type == Bitmap) {
+      uint64_t mask = 1ULL << (low & 63);
+      auto* words = p->at<atomic<uint64_t>>(e->data_offset);
+      if (!(words[low >> 6].fetch_and(~mask) & mask)) {
+        return false;
+      }
+      e->cardinality--;
+      p->at<RoaringBitmapBase>(this->base_offset)->cardinality--;
+      return true;
+    }
+    if (!this->container_contains(p.get(), *e, low)) {
+      return false;
+    }
+  }
+
+  auto g = this->allocator->lock(true);
+  return this->remove_locked(key, low);
+}
+
+bool RoaringBitmap::contains(uint32_t v) const {
+  auto g = this->allocator->lock(false);
+  ssize_t index = this->find_container(v >> 16);
+  if (index < 0) {
+    return false;
+  }
+  return this->container_contains(this->allocator->get_pool().get(),
+      *this->entry(index), v & 0xFFFF);
+}
+
+void RoaringBitmap::clear() {
+  auto g = this->allocator->lock(true);
+  this->free_container_data();
+  auto* base = this->allocator->get_pool()->at<RoaringBitmapBase>(
+      this->base_offset);
+  base->container_count = 0;
+  base->cardinality = 0;
+}
+
+
+vector<uint32_t> RoaringBitmap::values() const {
+  auto g = this->allocator->lock(false);
+  auto p = this->allocator->get_pool();
+  const auto* base = p->at<RoaringBitmapBase>(this->base_offset);
+
+  vector<uint32_t> ret;
+  ret.reserve(base->cardinality);
+  for (size_t x = 0; x < base->container_count; x++) {
+    const ContainerEntry* e = this->entry(x);
+    uint32_t high = static_cast<uint32_t>(e->key) << 16;
+
+    ContainerView view;
+    this->load_view(view, p.get(), *e);
+    if (view.is_bitmap) {
+      for (size_t y = 0; y < BITMAP_WORDS; y++) {
+        for (uint64_t w = view.bitmap[y]; w; w &= (w - 1)) {
+          ret.emplace_back(high | (y << 6) | __builtin_ctzll(w));
+        }
+      }
+    } else {
+      for (size_t y = 0; y < view.cardinality; y++) {
+        ret.emplace_back(high | view.array[y]);
+      }
+    }
+  }
+  return ret;
+}
+
+
+void RoaringBitmap::run_optimize() {
+  auto g = this->allocator->lock(true);
+  auto p = this->allocator->get_pool();
+
+  size_t count = p->at<RoaringBitmapBase>(this->base_offset)->container_count;
+  for (size_t x = count; x > 0; x--) {
+    size_t index = x - 1;
+    ContainerEntry* e = this->entry(index);
+    if (e->cardinality == 0) {
+      this->delete_container(index);
+      continue;
+    }
+
+    size_t run_count;
+    if (e->type == Run) {
+      run_count = e->run_count;
+    } else if (e->type == Bitmap) {
+      run_count = bitmap_run_count(p->at<uint64_t>(e->data_offset));
+    } else {
+      run_count = array_run_count(p->at<uint16_t>(e->data_offset),
+          e->cardinality);
+    }
+
+    // arrays use 2 bytes per value, bitmaps use 8KB, and runs use 4 bytes per
+    // run. runs are used only if they're strictly smaller than the alternative
+    ContainerType best_type = (e->cardinality <= ARRAY_MAX_SIZE) ? Array : Bitmap;
+    size_t best_size = (best_type == Array) ? (e->cardinality * 2) : BITMAP_BYTES;
+    if (run_count * 4 < best_size) {
+      best_type = Run;
+    }
+    if (best_type != e->type) {
+      this->convert_container(index, best_type);
+    }
+  }
+}
+
+
+vector<uint32_t> RoaringBitmap::compute(const RoaringBitmap& other,
+    Operation op) const {
+  vector<LocalContainer> result = this->combine(other, op, false);
+
+  size_t total = 0;
+  for (const auto& c : result) {
+    total += c.cardinality;
+  }
+
+  vector<uint32_t> ret;
+  ret.reserve(total);
+  for (const auto& c : result) {
+    uint32_t high = static_cast<uint32_t>(c.key) << 16;
+    if (!c.bitmap.empty()) {
+      for (size_t y = 0; y < BITMAP_WORDS; y++) {
+        for (uint64_t w = c.bitmap[y]; w; w &= (w - 1)) {
+          ret.emplace_back(high | (y << 6) | __builtin_ctzll(w));
+        }
+      }
+    } else {
+      for (uint16_t low : c.array) {
+        ret.emplace_back(high | low);
+      }
+    }
+  }
+  return ret;
+}
+
+size_t RoaringBitmap::compute_size(const RoaringBitmap& other,
+    Operation op) const {
+  size_t ret = 0;
+  for (const auto& c : this->combine(other, op, true)) {
+    ret += c.cardinality;
+  }
+  return ret;
+}
+
+void RoaringBitmap::assign(const RoaringBitmap& a, const RoaringBitmap& b,
+    Operation op) {
+  // if a and b are both in this bitmap's pool, compute the result under the
+  // write lock, so no other process can change them before it's written.
+  // otherwise, compute it before taking the write lock, since we never hold a
+  // read lock and a write lock at the same time
+  vector<LocalContainer> result;
+  unique_ptr<ProcessReadWriteLockGuard> g;
+  if (this->shares_pool_with(a) && this->shares_pool_with(b)) {
+    g.reset(new ProcessReadWriteLockGuard(this->allocator->lock(true)));
+    a.allocator->get_pool()->check_size_and_remap();
+    b.allocator->get_pool()->check_size_and_remap();
+    result = a.combine_locked(b, op, false);
+  } else {
+    result = a.combine(b, op, false);
+    g.reset(new ProcessReadWriteLockGuard(this->allocator->lock(true)));
+  }
+
+  auto p = this->allocator->get_pool();
+  this->free_container_data();
+
+  auto* base = p->at<RoaringBitmapBase>(this->base_offset);
+  base->container_count = 0;
+  base->cardinality = 0;
+  if (base->container_capacity < result.size()) {
+    uint64_t old_offset = base->containers_offset;
+    uint64_t new_offset = this->allocator->allocate(
+        result.size() * sizeof(ContainerEntry));
+    if (old_offset) {
+      this->allocator->free(old_offset);
+    }
+    base = p->at<RoaringBitmapBase>(this->base_offset);
+    base->containers_offset = new_offset;
+    base->container_capacity = result.size();
+  }
+
+  for (const auto& c : result) {
+    ContainerType type = c.bitmap.empty() ? Array : Bitmap;
+    uint32_t run_count = 0;
+    uint64_t data_offset = this->write_container_data(c, type, &run_count);
+
+    base = p->at<RoaringBitmapBase>(this->base_offset);
+    ContainerEntry* e = this->entry(base->container_count);
+    e->key = c.key;
+    e->type = type;
+    e->unused = 0;
+    e->cardinality = c.cardinality;
+    e->run_count = run_count;
+    e->unused2 = 0;
+    e->data_offset = data_offset;
+    base->container_count++;
+    base->cardinality += c.cardinality;
+  }
+}
+
+
+size_t RoaringBitmap::size() const {
+  return this->allocator->get_pool()->at<RoaringBitmapBase>(
+      this->base_offset)->cardinality;
+}
+
+RoaringBitmap::ContainerCounts RoaringBitmap::container_counts() const {
+  auto g = this->allocator->lock(false);
+  const auto* base = this->allocator->get_pool()->at<RoaringBitmapBase>(
+      this->base_offset);
+
+  ContainerCounts ret = {0, 0, 0};
+  for (size_t x = 0; x < base->container_count; x++) {
+    uint8_t type = this->entry(x)->type;
+    if (type == Array) {
+      ret.array_count++;
+    } else if (type == Bitmap) {
+      ret.bitmap_count++;
+    } else {
+      ret.run_count++;
+    }
+  }
+  return ret;
+}
+
+
+uint64_t RoaringBitmap::create_bitmap_base() {
+  uint64_t base_offset = this->allocator->allocate(sizeof(RoaringBitmapBase));
+  auto* base = this->allocator->get_pool()->at<RoaringBitmapBase>(base_offset);
+  base->cardinality = 0;
+  base->container_count = 0;
+  base->container_capacity = 0;
+  base->containers_offset = 0;
+  return base_offset;
+}
+
+
+ssize_t RoaringBitmap::find_container(uint16_t key) const {
+  const auto* base = this->allocator->get_pool()->at<RoaringBitmapBase>(
+      this->base_offset);
+
+  ssize_t low = 0, high = base->container_count;
+  while (low < high) {
+    ssize_t mid = (low + high) / 2;
+    uint16_t mid_key = this->entry(mid)->key;
+    if (mid_key == key) {
+      return mid;
+    } else if (mid_key < key) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return -low - 1;
+}
+
+RoaringBitmap::ContainerEntry* RoaringBitmap::entry(size_t index) const {
+  auto p = this->allocator->get_pool();
+  return p->at<ContainerEntry>(
+      p->at<RoaringBitmapBase>(this->base_offset)->containers_offset +
+      index * sizeof(ContainerEntry));
+}
+
+size_t RoaringBitmap::insert_container(size_t index, uint16_t key) {
+  auto p = this->allocator->get_pool();
+  auto* base = p->at<RoaringBitmapBase>(this->base_offset);
+
+  if (base->container_count == base->container_capacity) {
+    uint64_t new_capacity = base->container_capacity ?
+        (base->container_capacity * 2) : 4;
+    uint64_t new_offset = this->allocator->allocate(
+        new_capacity * sizeof(ContainerEntry));
+    base = p->at<RoaringBitmapBase>(this->base_offset);
+    if (base->containers_offset) {
+      memcpy(p->at<uint8_t>(new_offset),
+          p->at<uint8_t>(base->containers_offset),
+          base->container_count * sizeof(ContainerEntry));
+      this->allocator->free(base->containers_offset);
+    }
+    base->containers_offset = new_offset;
+    base->container_capacity = new_capacity;
+  }
+
+  uint8_t* entries = p->at<uint8_t>(base->containers_offset);
+  memmove(entries + (index + 1) * sizeof(ContainerEntry),
+      entries + index * sizeof(ContainerEntry),
+      (base->container_count - index) * sizeof(ContainerEntry));
+  base->container_count++;
+
+  ContainerEntry* e = this->entry(index);
+  e->key = key;
+  e->type = Array;
+  e->unused = 0;
+  e->cardinality = 0;
+  e->run_count = 0;
+  e->unused2 = 0;
+  e->data_offset = 0;
+  return index;
+}
+
+void RoaringBitmap::delete_container(size_t index) {
+  auto p = this->allocator->get_pool();
+  uint64_t data_offset = this->entry(index)->data_offset;
+  if (data_offset) {
+    this->allocator->free(data_offset);
+  }
+
+  auto* base = p->at<RoaringBitmapBase>(this->base_offset);
+  uint8_t* entries = p->at<uint8_t>(base->containers_offset);
+  memmove(entries + index * sizeof(ContainerEntry),
+      entries + (index + 1) * sizeof(ContainerEntry),
+      (base->container_count - index - 1) * sizeof(ContainerEntry));
+  base->container_count--;
+}
+
+void RoaringBitmap::convert_container(size_t index, ContainerType type) {
+  auto p = this->allocator->get_pool();
+
+  // copy the contents out of the pool, since allocating the new container may
+  // remap it
+  LocalContainer c;
+  {
+    ContainerView view;
+    this->load_view(view, p.get(), *this->entry(index));
+    c.cardinality = view.cardinality;
+    if (view.is_bitmap) {
+      c.bitmap.assign(view.bitmap, view.bitmap + BITMAP_WORDS);
+    } else {
+      c.array.assign(view.array, view.array + view.cardinality);
+    }
+  }
+
+  uint32_t run_count = 0;
+  uint64_t data_offset = this->write_container_data(c, type, &run_count);
+
+  ContainerEntry* e = this->entry(index);
+  if (e->data_offset) {
+    this->allocator->free(e->data_offset);
+  }
+  e = this->entry(index);
+  e->type = type;
+  e->run_count = run_count;
+  e->data_offset = data_offset;
+}
+
+void RoaringBitmap::free_container_data() {
+  auto p = this->allocator->get_pool();
+  size_t count = p->at<RoaringBitmapBase>(this->base_offset)->container_count;
+  for (size_t x = 0; x < count; x++) {
+    uint64_t data_offset = this->entry(x)->data_offset;
+    if (data_offset) {
+      this->allocator->free(data_offset);
+    }
+  }
+}
+
+bool RoaringBitmap::add_locked(uint16_t key, uint16_t low) {
+  auto p = this->allocator->get_pool();
+
+  ssize_t index = this->find_container(key);
+  if (index < 0) {
+    index = this->insert_container(-index - 1, key);
+  }
+
+  for (;;) {
+    ContainerEntry* e = this->entry(index);
+
+    if (e->type == Run) {
+      if (this->container_contains(p.get(), *e, low)) {
+        return false;
+      }
+      this->convert_container(index,
+          (e->cardinality < ARRAY_MAX_SIZE) ? Array : Bitmap);
+      continue;
+    }
+
+    if (e->type == Bitmap) {
+      uint64_t mask = 1ULL << (low & 63);
+      auto* words = p->at<atomic<uint64_t>>(e->data_offset);
+      if (words[low >> 6].fetch_or(mask) & mask) {
+        return false;
+      }
+      e->cardinality++;
+      break;
+    }
+
+    // array container
+    uint32_t cardinality = e->cardinality;
+    const uint16_t* values = e->data_offset ?
+        p->at<uint16_t>(e->data_offset) : NULL;
+    size_t pos = values ?
+        (lower_bound(values, values + cardinality, low) - values) : 0;
+    if ((pos < cardinality) && (values[pos] == low)) {
+      return false;
+    }
+
+    if (cardinality == ARRAY_MAX_SIZE) {
+      this->convert_container(index, Bitmap);
+      continue;
+    }
+
+    size_t capacity = e->data_offset ?
+        (this->allocator->block_size(e->data_offset) / sizeof(uint16_t)) : 0;
+    if (cardinality == capacity) {
+      size_t new_capacity = min<size_t>(capacity ? (capacity * 2) : 4,
+          ARRAY_MAX_SIZE);
+      uint64_t new_offset = this->allocator->allocate(
+          new_capacity * sizeof(uint16_t));
+      e = this->entry(index);
+      if (e->data_offset) {
+        memcpy(p->at<uint16_t>(new_offset), p->at<uint16_t>(e->data_offset),
+            cardinality * sizeof(uint16_t));
+        this->allocator->free(e->data_offset);
+      }
+      e = this->entry(index);
+      e->data_offset = new_offset;
+    }
+
+    uint16_t* data = p->at<uint16_t>(e->data_offset);
+    memmove(&data[pos + 1], &data[pos],
+        (cardinality - pos) * sizeof(uint16_t));
+    data[pos] = low;
+    e->cardinality++;
+    break;
+  }
+
+  p->at<RoaringBitmapBase>(this->base_offset)->cardinality++;
+  return true;
+}
+
+bool RoaringBitmap::remove_locked(uint16_t key, uint16_t low) {
+  auto p = this->allocator->get_pool();
+
+  ssize_t index = this->find_container(key);
+  if (index < 0) {
+    return false;
+  }
+
+  for (;;) {
+    ContainerEntry* e = this->entry(index);
+
+    if (e->type == Run) {
+      if (!this->container_contains(p.get(), *e, low)) {
+        return false;
+      }
+      this->convert_container(index,
+          (e->cardinality <= ARRAY_MAX_SIZE) ? Array : Bitmap);
+      continue;
+    }
+
+    if (e->type == Bitmap) {
+      uint64_t mask = 1ULL << (low & 63);
+      auto* words = p->at<atomic<uint64_t>>(e->data_offset);
+      if (!(words[low >> 6].fetch_and(~mask) & mask)) {
+        return false;
+      }
+      e->cardinality--;
+      break;
+    }
+
+    // array container
+    uint32_t cardinality = e->cardinality;
+    uint16_t* data = p->at<uint16_t>(e->data_offset);
+    size_t pos = lower_bound(data, data + cardinality, low) - data;
+    if ((pos == cardinality) || (data[pos] != low)) {
+      return false;
+    }
+    memmove(&data[pos], &data[pos + 1],
+        (cardinality - pos - 1) * sizeof(uint16_t));
+    e->cardinality--;
+    break;
+  }
+
+  if (this->entry(index)->cardinality == 0) {
+    this->delete_container(index);
+  }
+  p->at<RoaringBitmapBase>(this->base_offset)->cardinality--;
+  return true;
+}
+
+
+bool RoaringBitmap::container_contains(const Pool* pool,
+    const ContainerEntry& e, uint16_t low) {
+  if (e.type == Bitmap) {
+    return bitmap_contains(pool->at<uint64_t>(e.data_offset), low);
+  }
+
+  if (e.type == Run) {
+    // find the last run that starts at or before low
+    const uint16_t* runs = pool->at<uint16_t>(e.data_offset);
+    size_t begin = 0, end = e.run_count;
+    while (begin < end) {
+      size_t mid = (begin + end) / 2;
+      if (runs[mid * 2] <= low) {
+        begin = mid + 1;
+      } else {
+        end = mid;
+      }
+    }
+    if (begin == 0) {
+      return false;
+    }
+    const uint16_t* run = &runs[(begin - 1) * 2];
+    return (low - run[0]) <= run[1];
+  }
+
+  if (e.cardinality == 0) {
+    return false;
+  }
+  const uint16_t* values = pool->at<uint16_t>(e.data_offset);
+  return binary_search(values, values + e.cardinality, low);
+}
+
+void RoaringBitmap::load_view(ContainerView& view, const Pool* pool,
+    const ContainerEntry& e) {
+  view.cardinality = e.cardinality;
+
+  if (e.type == Array) {
+    view.is_bitmap = false;
+    view.array = e.data_offset ? pool->at<uint16_t>(e.data_offset) : NULL;
+    view.bitmap = NULL;
+
+  } else if (e.type == Bitmap) {
+    view.is_bitmap = true;
+    view.array = NULL;
+    view.bitmap = pool->at<uint64_t>(e.data_offset);
+
+  } else {
+    const uint16_t* runs = pool->at<uint16_t>(e.data_offset);
+    view.is_bitmap = (view.cardinality > ARRAY_MAX_SIZE);
+    if (view.is_bitmap) {
+      view.expanded.bitmap.assign(BITMAP_WORDS, 0);
+      for (size_t x = 0; x < e.run_count; x++) {
+        bitmap_set_range(view.expanded.bitmap.data(), runs[x * 2],
+            runs[x * 2] + runs[x * 2 + 1]);
+      }
+      view.array = NULL;
+      view.bitmap = view.expanded.bitmap.data();
+    } else {
+      view.expanded.array.reserve(view.cardinality);
+      for (size_t x = 0; x < e.run_count; x++) {
+        uint32_t end = runs[x * 2] + runs[x * 2 + 1];
+        for (uint32_t v = runs[x * 2]; v <= end; v++) {
+          view.expanded.array.emplace_back(v);
+        }
+      }
+      view.array = view.expanded.array.data();
+      view.bitmap = NULL;
+    }
+  }
+}
+
+uint64_t RoaringBitmap::write_container_data(const LocalContainer& c,
+    ContainerType type, uint32_t* run_count) {
+  auto p = this->allocator->get_pool();
+  *run_count = 0;
+
+  if (type == Bitmap) {
+    uint64_t data_offset = this->allocator->allocate(BITMAP_BYTES);
+    if (!c.bitmap.empty()) {
+      memcpy(p->at<uint64_t>(data_offset), c.bitmap.data(), BITMAP_BYTES);
+    } else {
+      vector<uint64_t> words;
+      array_to_bitmap(words, c.array.data(), c.array.size());
+      memcpy(p->at<uint64_t>(data_offset), words.data(), BITMAP_BYTES);
+    }
+    return data_offset;
+  }
+
+  vector<uint16_t> expanded;
+  const vector<uint16_t>* values = &c.array;
+  if (!c.bitmap.empty()) {
+    bitmap_to_array(expanded, c.bitmap.data());
+    values = &expanded;
+  }
+
+  if (type == Array) {
+    uint64_t data_offset = this->allocator->allocate(
+        max<size_t>(values->size(), 1) * sizeof(uint16_t));
+    memcpy(p->at<uint16_t>(data_offset), values->data(),
+        values->size() * sizeof(uint16_t));
+    return data_offset;
+  }
+
+  // run container: (start, length - 1) pairs
+  vector<uint16_t> runs;
+  for (size_t x = 0; x < values->size(); x++) {
+    if (x && ((*values)[x] == (*values)[x - 1] + 1)) {
+      runs.back()++;
+    } else {
+      runs.emplace_back((*values)[x]);
+      runs.emplace_back(0);
+    }
+  }
+  uint64_t data_offset = this->allocator->allocate(
+      max<size_t>(runs.size(), 1) * sizeof(uint16_t));
+  memcpy(p->at<uint16_t>(data_offset), runs.data(),
+      runs.size() * sizeof(uint16_t));
+  *run_count = runs.size() / 2;
+  return data_offset;
+}
+
+
+// computes (a op b) for a single pair of containers
+static void combine_containers(vector<uint16_t>& out_array,
+    vector<uint64_t>& out_bitmap, uint32_t& cardinality, bool a_is_bitmap,
+    const uint16_t* a_array, const uint64_t* a_bitmap, uint32_t a_count,
+    bool b_is_bitmap, const uint16_t* b_array, const uint64_t* b_bitmap,
+    uint32_t b_count, RoaringBitmap::Operation op, bool count_only) {
+  typedef RoaringBitmap::Operation Operation;
+
+  if (a_is_bitmap && b_is_bitmap) {
+    if (!count_only) {
+      out_bitmap.resize(BITMAP_WORDS);
+    }
+    cardinality = combine_bitmaps(count_only ? NULL : out_bitmap.data(),
+        a_bitmap, b_bitmap, op);
+    return;
+  }
+
+  if (!a_is_bitmap && !b_is_bitmap) {
+    if (op == Operation::And) {
+      intersect_arrays(out_array, a_array, a_count, b_array, b_count);
+    } else if (op == Operation::Or) {
+      set_union(a_array, a_array + a_count, b_array, b_array + b_count,
+          back_inserter(out_array));
+    } else {
+      set_difference(a_array, a_array + a_count, b_array, b_array + b_count,
+          back_inserter(out_array));
+    }
+    cardinality = out_array.size();
+    return;
+  }
+
+  // one array and one bitmap
+  if (op == Operation::And) {
+    const uint16_t* values = a_is_bitmap ? b_array : a_array;
+    size_t count = a_is_bitmap ? b_count : a_count;
+    const uint64_t* words = a_is_bitmap ? a_bitmap : b_bitmap;
+    for (size_t x = 0; x < count; x++) {
+      if (bitmap_contains(words, values[x])) {
+        out_array.emplace_back(values[x]);
+      }
+    }
+    cardinality = out_array.size();
+
+  } else if (op == Operation::Or) {
+    const uint16_t* values = a_is_bitmap ? b_array : a_array;
+    size_t count = a_is_bitmap ? b_count : a_count;
+    const uint64_t* words = a_is_bitmap ? a_bitmap : b_bitmap;
+    out_bitmap.assign(words, words + BITMAP_WORDS);
+    for (size_t x = 0; x < count; x++) {
+      bitmap_set(out_bitmap.data(), values[x]);
+    }
+    cardinality = bitmap_cardinality(out_bitmap.data());
+
+  } else if (a_is_bitmap) {
+    out_bitmap.assign(a_bitmap, a_bitmap + BITMAP_WORDS);
+    for (size_t x = 0; x < b_count; x++) {
+      bitmap_clear(out_bitmap.data(), b_array[x]);
+    }
+    cardinality = bitmap_cardinality(out_bitmap.data());
+
+  } else {
+    for (size_t x = 0; x < a_count; x++) {
+      if (!bitmap_contains(b_bitmap, a_array[x])) {
+        out_array.emplace_back(a_array[x]);
+      }
+    }
+    cardinality = out_array.size();
+  }
+
+  if (count_only) {
+    out_array.clear();
+    out_bitmap.clear();
+  }
+}
+
+bool RoaringBitmap::shares_pool_with(const RoaringBitmap& other) const {
+  auto pa = this->allocator->get_pool();
+  auto pb = other.allocator->get_pool();
+  return (pa == pb) || pa->shares_data_with(*pb);
+}
+
+vector<RoaringBitmap::LocalContainer> RoaringBitmap::combine(
+    const RoaringBitmap& other, Operation op, bool count_only) const {
+  auto pa = this->allocator->get_pool();
+  auto pb = other.allocator->get_pool();
+
+  // lock both pools for reading. if they're different pools, lock them in a
+  // consistent order so two processes combining the same pair of bitmaps
+  // can't deadlock if a writer is waiting on one of them. if they're the same
+  // pool, it must be locked only once, since a second read lock would wait
+  // behind a waiting writer, which waits for the first
+  bool same_pool = this->shares_pool_with(other);
+  const RoaringBitmap* first = this;
+  const RoaringBitmap* second = &other;
+  if (!same_pool && (pb->get_name() < pa->get_name())) {
+    swap(first, second);
+  }
+  auto g = first->allocator->lock(false);
+  unique_ptr<ProcessReadWriteLockGuard> g2;
+  if (!same_pool) {
+    g2.reset(new ProcessReadWriteLockGuard(second->allocator->lock(false)));
+  } else if (pa != pb) {
+    // the same pool opened twice; only the locked object was remapped
+    second->allocator->get_pool()->check_size_and_remap();
+  }
+
+  return this->combine_locked(other, op, count_only);
+}
+
+vector<RoaringBitmap::LocalContainer> RoaringBitmap::combine_locked(
+    const RoaringBitmap& other, Operation op, bool count_only) const {
+  auto pa = this->allocator->get_pool();
+  auto pb = other.allocator->get_pool();
+
+  size_t a_count = pa->at<RoaringBitmapBase>(this->base_offset)->container_count;
+  size_t b_count = pb->at<RoaringBitmapBase>(other.base_offset)->container_count;
+
+  vector<LocalContainer> ret;
+  size_t ia = 0, ib = 0;
+  while ((ia < a_count) || (ib < b_count)) {
+    const ContainerEntry* ea = (ia < a_count) ? this->entry(ia) : NULL;
+    const ContainerEntry* eb = (ib < b_count) ? other.entry(ib) : NULL;
+    if (ea && eb && (ea->key != eb->key)) {
+      if (ea->key < eb->key) {
+        eb = NULL;
+      } else {
+        ea = NULL;
+      }
+    }
+    ia += (ea != NULL);
+    ib += (eb != NULL);
+
+    // containers that exist on only one side are dropped or copied as-is
+    const ContainerEntry* only = NULL;
+    const Pool* only_pool = NULL;
+    if (!eb) {
+      if (op == Operation::And) {
+        continue;
+      }
+      only = ea;
+      only_pool = pa.get();
+    } else if (!ea) {
+      if (op != Operation::Or) {
+        continue;
+      }
+      only = eb;
+      only_pool = pb.get();
+    }
+
+    ret.emplace_back();
+    LocalContainer& c = ret.back();
+    if (only) {
+      c.key = only->key;
+      ContainerView view;
+      this->load_view(view, only_pool, *only);
+      if (view.is_bitmap) {
+        c.cardinality = bitmap_cardinality(view.bitmap);
+        if (!count_only) {
+          c.bitmap.assign(view.bitmap, view.bitmap + BITMAP_WORDS);
+        }
+      } else {
+        c.cardinality = view.cardinality;
+        if (!count_only) {
+          c.array.assign(view.array, view.array + view.cardinality);
+        }
+      }
+
+    } else {
+      c.key = ea->key;
+      ContainerView va, vb;
+      this->load_view(va, pa.get(), *ea);
+      this->load_view(vb, pb.get(), *eb);
+      combine_containers(c.array, c.bitmap, c.cardinality, va.is_bitmap,
+          va.array, va.bitmap, va.cardinality, vb.is_bitmap, vb.array,
+          vb.bitmap, vb.cardinality, op, count_only);
+    }
+
+    if (c.cardinality == 0) {
+      ret.pop_back();
+      continue;
+    }
+
+    // keep each result container in its smallest non-run encoding
+    if (!count_only) {
+      if (!c.bitmap.empty() && (c.cardinality <= ARRAY_MAX_SIZE)) {
+        bitmap_to_array(c.array, c.bitmap.data());
+        c.bitmap.clear();
+      } else if (c.bitmap.empty() && (c.cardinality > ARRAY_MAX_SIZE)) {
+        array_to_bitmap(c.bitmap, c.array.data(), c.array.size());
+        c.array.clear();
+      }
+    }
+  }
+
+  return ret;
+}
+
+} // namespace sharedstructures
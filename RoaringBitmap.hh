@@ -0,0 +1,164 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "Allocator.hh"
+
+namespace sharedstructures {
+
+
+// RoaringBitmap is a compressed set of 32-bit integers. the integers are
+// grouped by their high 16 bits into containers, and each container uses
+// whichever encoding is smallest for its contents:
+// - array containers store up to 4096 sorted 16-bit values.
+// - bitmap containers store a 65536-bit bitmap (8KB).
+// - run containers store sorted (start, length) pairs. these are only created
+//   by run_optimize().
+//
+// the container list is protected by the pool lock. adds and removes that only
+// flip a bit in an existing bitmap container use atomic operations under the
+// read lock, so they can run concurrently with each other and with reads; all
+// other adds and removes take the write lock. set operations (and, or, and-not)
+// between bitmaps hold the read lock on both bitmaps' pools while computing the
+// result, and never hold a write lock at the same time as a read lock. bitmaps
+// are in the same pool if their pools share data (see Pool::shares_data_with),
+// even if they were opened separately; a pool is locked only once.
+//
+// set operations can produce either a process-local result (a sorted vector of
+// integers, or just its size) or replace the contents of a shared bitmap.
+
+class RoaringBitmap {
+public:
+  RoaringBitmap() = delete;
+  RoaringBitmap(const RoaringBitmap&) = delete;
+  RoaringBitmap(RoaringBitmap&&) = delete;
+
+  // create constructor - allocates a new empty bitmap.
+  explicit RoaringBitmap(std::shared_ptr<Allocator> allocator);
+  // (conditional) create constructor.
+  // opens an existing RoaringBitmap using the given allocator. if base_offset
+  // is 0, opens the RoaringBitmap at the allocator's base offset. if the
+  // allocator's base offset is also 0, creates a new RoaringBitmap and sets the
+  // allocator's base offset to the new bitmap's base offset.
+  RoaringBitmap(std::shared_ptr<Allocator> allocator, uint64_t base_offset);
+  ~RoaringBitmap() = default;
+
+  // returns the allocator for this bitmap
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this bitmap
+  uint64_t base() const;
+
+  // adds a value. returns true if it was added, or false if it was already
+  // present.
+  bool add(uint32_t v);
+  // removes a value. returns true if it was removed, or false if it wasn't
+  // present.
+  bool remove(uint32_t v);
+  // returns true if the value is present.
+  bool contains(uint32_t v) const;
+  // removes all values.
+  void clear();
+
+  // returns all values in increasing order.
+  std::vector<uint32_t> values() const;
+
+  // converts each container to the smallest of the three encodings (including
+  // run containers, which are never created otherwise) and deletes empty
+  // containers. adding or removing a value in a run container converts it back
+  // to an array or bitmap container.
+  void run_optimize();
+
+  enum class Operation {
+    And = 0,
+    Or,
+    AndNot,
+  };
+
+  // computes (this op other) and returns the result in increasing order.
+  // the two bitmaps don't have to be in the same pool.
+  std::vector<uint32_t> compute(const RoaringBitmap& other, Operation op) const;
+  // returns the number of values in (this op other), without building the
+  // result.
+  size_t compute_size(const RoaringBitmap& other, Operation op) const;
+  // replaces the contents of this bitmap with (a op b). either or both of a and
+  // b may be this bitmap. if a and b are both in this bitmap's pool, the result
+  // is computed and written under one write lock, so the assignment is atomic;
+  // otherwise a and b are read under their read locks first.
+  void assign(const RoaringBitmap& a, const RoaringBitmap& b, Operation op);
+
+  // inspection methods.
+  size_t size() const; // value count
+  struct ContainerCounts {
+    size_t array_count;
+    size_t bitmap_count;
+    size_t run_count;
+  };
+  ContainerCounts container_counts() const;
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+
+  enum ContainerType {
+    Array = 0,
+    Bitmap = 1,
+    Run = 2,
+  };
+
+  struct ContainerEntry {
+    uint16_t key; // high 16 bits of all values in the container
+    uint8_t type; // ContainerType
+    uint8_t unused;
+    std::atomic<uint32_t> cardinality;
+    uint32_t run_count; // number of (start, length) pairs in a run container
+    uint32_t unused2;
+    uint64_t data_offset;
+  };
+
+  struct RoaringBitmapBase {
+    std::atomic<uint64_t> cardinality;
+    uint64_t container_count;
+    uint64_t container_capacity;
+    uint64_t containers_offset; // ContainerEntry array sorted by key
+  };
+
+  struct LocalContainer;
+  struct ContainerView;
+
+  uint64_t create_bitmap_base();
+
+  // all of these must be called with the pool locked (for reading or writing
+  // as appropriate). find_container returns the container's index, or
+  // (-insert_index - 1) if there's no container for the key.
+  ssize_t find_container(uint16_t key) const;
+  ContainerEntry* entry(size_t index) const;
+  size_t insert_container(size_t index, uint16_t key);
+  void delete_container(size_t index);
+  void convert_container(size_t index, ContainerType type);
+  void free_container_data();
+  bool add_locked(uint16_t key, uint16_t low);
+  bool remove_locked(uint16_t key, uint16_t low);
+
+  static bool container_contains(const Pool* pool, const ContainerEntry& e,
+      uint16_t low);
+  static void load_view(ContainerView& view, const Pool* pool,
+      const ContainerEntry& e);
+  uint64_t write_container_data(const LocalContainer& c, ContainerType type,
+      uint32_t* run_count);
+
+  // returns true if other is in the same pool as this bitmap
+  bool shares_pool_with(const RoaringBitmap& other) const;
+  // combine locks both bitmaps' pools for reading; combine_locked must be
+  // called with them locked (for reading or writing).
+  std::vector<LocalContainer> combine(const RoaringBitmap& other,
+      Operation op, bool count_only) const;
+  std::vector<LocalContainer> combine_locked(const RoaringBitmap& other,
+      Operation op, bool count_only) const;
+};
+
+} // namespace sharedstructures
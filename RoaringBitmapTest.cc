@@ -0,0 +1,422 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+#include <phosg/UnitTest.hh>
+#include <set>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "RoaringBitmap.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+
+void expect_contents(const set<uint32_t>& expected, const RoaringBitmap& b) {
+  expect_eq(expected.size(), b.size());
+  vector<uint32_t> expected_values(expected.begin(), expected.end());
+  expect_eq(expected_values, b.values());
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-roaring"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  RoaringBitmap b(alloc, 0);
+
+  expect_eq(0, b.size());
+  expect_eq(false, b.contains(0));
+  expect_eq(false, b.remove(0));
+
+  set<uint32_t> expected;
+  vector<uint32_t> values({7, 0, 3, 0x10000, 0xFFFFFFFF, 0x7FFF0001});
+  for (uint32_t v : values) {
+    expect_eq(true, b.add(v));
+    expected.emplace(v);
+  }
+  expect_eq(false, b.add(3));
+  expect_contents(expected, b);
+  expect_eq(true, b.contains(0x10000));
+  expect_eq(false, b.contains(0x10001));
+
+  auto counts = b.container_counts();
+  expect_eq(4, counts.array_count);
+  expect_eq(0, counts.bitmap_count);
+
+  // filling a container past 4096 values converts it to a bitmap
+  for (uint32_t v = 0; v < 10000; v += 2) {
+    b.add(0x20000 + v);
+    expected.emplace(0x20000 + v);
+  }
+  counts = b.container_counts();
+  expect_eq(4, counts.array_count);
+  expect_eq(1, counts.bitmap_count);
+  expect_contents(expected, b);
+
+  expect_eq(true, b.remove(0x20002));
+  expect_eq(false, b.remove(0x20003));
+  expect_eq(true, b.remove(7));
+  expect_eq(true, b.remove(0x10000));
+  expected.erase(0x20002);
+  expected.erase(7);
+  expected.erase(0x10000);
+  expect_contents(expected, b);
+
+  // removing the last value in an array container deletes it
+  counts = b.container_counts();
+  expect_eq(3, counts.array_count);
+
+  // another instance sees the same values
+  {
+    RoaringBitmap b2(alloc, b.base());
+    expect_contents(expected, b2);
+  }
+
+  b.clear();
+  expect_eq(0, b.size());
+  expect_eq(false, b.contains(0));
+  expect_eq(true, b.add(0));
+  expect_eq(1, b.size());
+}
+
+
+void run_run_optimize_test(const string& allocator_type) {
+  printf("-- [%s] run optimize\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-roaring"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  RoaringBitmap b(alloc, 0);
+
+  // container 0 is a long run (bitmap before optimizing); container 1 is a few
+  // short runs (array before optimizing); container 2 is sparse and stays an
+  // array; container 3 becomes empty
+  set<uint32_t> expected;
+  for (uint32_t v = 100; v < 60000; v++) {
+    b.add(v);
+    expected.emplace(v);
+  }
+  for (uint32_t v = 0x10000; v < 0x10000 + 300; v++) {
+    if ((v & 0x3F) < 50) {
+      b.add(v);
+      expected.emplace(v);
+    }
+  }
+  for (uint32_t v = 0x20000; v < 0x30000; v += 1000) {
+    b.add(v);
+    expected.emplace(v);
+  }
+  for (uint32_t v = 0x30000; v < 0x30000 + 5000; v++) {
+    b.add(v);
+  }
+  for (uint32_t v = 0x30000; v < 0x30000 + 5000; v++) {
+    b.remove(v);
+  }
+  expect_contents(expected, b);
+
+  auto counts = b.container_counts();
+  expect_eq(2, counts.array_count);
+  expect_eq(2, counts.bitmap_count);
+  expect_eq(0, counts.run_count);
+
+  b.run_optimize();
+  counts = b.container_counts();
+  expect_eq(1, counts.array_count);
+  expect_eq(0, counts.bitmap_count);
+  expect_eq(2, counts.run_count);
+  expect_contents(expected, b);
+  expect_eq(true, b.contains(100));
+  expect_eq(true, b.contains(59999));
+  expect_eq(false, b.contains(99));
+  expect_eq(false, b.contains(60000));
+  expect_eq(true, b.contains(0x10000 + 49));
+  expect_eq(false, b.contains(0x10000 + 50));
+
+  // modifying a run container converts it back
+  expect_eq(false, b.add(200));
+  expect_eq(true, b.remove(200));
+  expected.erase(200);
+  expect_eq(true, b.add(0x10000 + 50));
+  expected.emplace(0x10000 + 50);
+  counts = b.container_counts();
+  expect_eq(2, counts.array_count);
+  expect_eq(1, counts.bitmap_count);
+  expect_eq(0, counts.run_count);
+  expect_contents(expected, b);
+}
+
+
+void add_values(RoaringBitmap& b, set<uint32_t>& expected, uint32_t start,
+    uint32_t end, uint32_t step) {
+  for (uint32_t v = start; v < end; v += step) {
+    b.add(v);
+    expected.emplace(v);
+  }
+}
+
+void run_operations_test(const string& allocator_type,
+    bool separate_pools) {
+  printf("-- [%s] operations (%s)\n", allocator_type.c_str(),
+      separate_pools ? "separate pools" : "same pool");
+
+  shared_ptr<Pool> pool(new Pool("test-roaring"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  shared_ptr<Pool> pool2(separate_pools ? new Pool("test-roaring2") : NULL);
+  shared_ptr<Allocator> alloc2 = separate_pools ?
+      create_allocator(pool2, allocator_type) : alloc;
+
+  RoaringBitmap a(alloc);
+  RoaringBitmap b(alloc2);
+
+  // build containers of every type on both sides, including containers that
+  // exist on only one side
+  set<uint32_t> ea, eb;
+  add_values(a, ea, 0x00000, 0x10000, 3); // bitmap & bitmap
+  add_values(b, eb, 0x00000, 0x10000, 5);
+  add_values(a, ea, 0x10000, 0x20000, 2); // bitmap & array
+  add_values(b, eb, 0x10000, 0x20000, 97);
+  add_values(a, ea, 0x20000, 0x20000 + 2000, 7); // array & bitmap
+  add_values(b, eb, 0x20000, 0x30000, 4);
+  add_values(a, ea, 0x30000, 0x30000 + 3000, 3); // array & array
+  add_values(b, eb, 0x30000 + 1000, 0x30000 + 9000, 2);
+  add_values(a, ea, 0x40000, 0x40000 + 100, 1); // a only
+  add_values(b, eb, 0x50000, 0x50000 + 5000, 1); // b only
+  add_values(a, ea, 0x60000, 0x60000 + 20000, 1); // run & array
+  add_values(b, eb, 0x60000, 0x70000, 301);
+  a.run_optimize();
+  b.run_optimize();
+  expect_contents(ea, a);
+  expect_contents(eb, b);
+
+  vector<uint32_t> expected_and, expected_or, expected_andnot, expected_bnota;
+  set_intersection(ea.begin(), ea.end(), eb.begin(), eb.end(),
+      back_inserter(expected_and));
+  set_union(ea.begin(), ea.end(), eb.begin(), eb.end(),
+      back_inserter(expected_or));
+  set_difference(ea.begin(), ea.end(), eb.begin(), eb.end(),
+      back_inserter(expected_andnot));
+  set_difference(eb.begin(), eb.end(), ea.begin(), ea.end(),
+      back_inserter(expected_bnota));
+
+  typedef RoaringBitmap::Operation Operation;
+  expect_eq(expected_and, a.compute(b, Operation::And));
+  expect_eq(expected_and, b.compute(a, Operation::And));
+  expect_eq(expected_or, a.compute(b, Operation::Or));
+  expect_eq(expected_andnot, a.compute(b, Operation::AndNot));
+  expect_eq(expected_bnota, b.compute(a, Operation::AndNot));
+  expect_eq(expected_and.size(), a.compute_size(b, Operation::And));
+  expect_eq(expected_or.size(), a.compute_size(b, Operation::Or));
+  expect_eq(expected_andnot.size(), a.compute_size(b, Operation::AndNot));
+
+  // operations with itself
+  vector<uint32_t> a_values(ea.begin(), ea.end());
+  expect_eq(a_values, a.compute(a, Operation::And));
+  expect_eq(a_values, a.compute(a, Operation::Or));
+  expect_eq(0, a.compute_size(a, Operation::AndNot));
+
+  // results can be written to a shared bitmap, which can be one of the inputs
+  RoaringBitmap c(alloc);
+  c.assign(a, b, Operation::Or);
+  expect_eq(expected_or.size(), c.size());
+  expect_eq(expected_or, c.values());
+  c.assign(c, b, Operation::AndNot);
+  expect_eq(expected_andnot, c.values());
+  c.add(0x90000);
+  expect_eq(true, c.contains(0x90000));
+  a.assign(a, b, Operation::And);
+  expect_eq(expected_and.size(), a.size());
+  expect_eq(expected_and, a.values());
+}
+
+
+void run_pool_identity_test(const string& allocator_type) {
+  printf("-- [%s] pool identity\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-roaring"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  RoaringBitmap a(alloc);
+  RoaringBitmap b(alloc);
+  set<uint32_t> ea, eb;
+  add_values(a, ea, 0x00000, 0x10000, 3);
+  add_values(b, eb, 0x00000, 0x10000, 5);
+
+  // a second Pool object on the same pool shares its data and its lock
+  shared_ptr<Pool> pool_again(new Pool("test-roaring"));
+  shared_ptr<Allocator> alloc_again = create_allocator(pool_again,
+      allocator_type);
+  RoaringBitmap a_again(alloc_again, a.base());
+  expect(pool->shares_data_with(*pool_again));
+
+  // grow the pool through the first object, so the second one's mapping is
+  // stale until it's remapped
+  size_t old_size = pool->size();
+  add_values(b, eb, 0x10000, 0x90000, 2);
+  expect_lt(old_size, pool->size());
+
+  typedef RoaringBitmap::Operation Operation;
+  vector<uint32_t> expected_and, expected_or;
+  set_intersection(ea.begin(), ea.end(), eb.begin(), eb.end(),
+      back_inserter(expected_and));
+  set_union(ea.begin(), ea.end(), eb.begin(), eb.end(),
+      back_inserter(expected_or));
+  expect_eq(expected_and, a_again.compute(b, Operation::And));
+  expect_eq(expected_or.size(), b.compute_size(a_again, Operation::Or));
+
+  RoaringBitmap c(alloc_again);
+  c.assign(a, b, Operation::Or);
+  expect_eq(expected_or, c.values());
+
+  // a private view has the same name as its source, but it's a different pool
+  shared_ptr<Pool> view = alloc->private_view();
+  shared_ptr<Allocator> view_alloc = create_allocator(view, allocator_type);
+  expect_eq(pool->get_name(), view->get_name());
+  expect(!pool->shares_data_with(*view));
+  RoaringBitmap a_view(view_alloc, a.base());
+  a_view.add(0xA0000);
+  expect_eq(false, a.contains(0xA0000));
+  set<uint32_t> ea_view = ea;
+  ea_view.emplace(0xA0000);
+  vector<uint32_t> expected_view_andnot;
+  set_difference(ea_view.begin(), ea_view.end(), ea.begin(), ea.end(),
+      back_inserter(expected_view_andnot));
+  expect_eq(expected_view_andnot, a_view.compute(a, Operation::AndNot));
+  expect_eq(0, a.compute_size(a_view, Operation::AndNot));
+}
+
+
+void run_concurrent_add_test(const string& allocator_type) {
+  printf("-- [%s] concurrent add\n", allocator_type.c_str());
+
+  uint64_t base_offset;
+  {
+    shared_ptr<Pool> pool(new Pool("test-roaring"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    RoaringBitmap b(alloc, 0);
+    base_offset = b.base();
+
+    // make container 0 a bitmap, so adds to it use the read lock
+    for (uint32_t v = 0; v < 10000; v += 2) {
+      b.add(v);
+    }
+  }
+
+  unordered_set<pid_t> child_pids;
+  size_t child_index = 0;
+  while ((child_pids.size() < 8) && !child_pids.count(0)) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      break;
+    } else if (pid == 0) {
+      child_pids.emplace(pid);
+    } else {
+      child_pids.emplace(pid);
+      child_index++;
+    }
+  }
+
+  if (child_pids.count(0)) {
+    // each child adds odd values to the bitmap container and its own values to
+    // other containers; some of the children's values overlap
+    shared_ptr<Pool> pool(new Pool("test-roaring"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    RoaringBitmap b(alloc, base_offset);
+    for (uint32_t v = 1; v < 10000; v += 2) {
+      if ((v / 2) % 8 == child_index) {
+        b.add(v);
+      }
+    }
+    for (uint32_t v = 0; v < 2000; v++) {
+      b.add(((child_index + 1) << 16) | v);
+      b.add((10 << 16) | (v * 8 + child_index));
+      b.add((11 << 16) | v);
+    }
+    _exit(0);
+
+  } else {
+    int num_failures = 0;
+    int exit_status;
+    pid_t exited_pid;
+    while ((exited_pid = wait(&exit_status)) != -1) {
+      child_pids.erase(exited_pid);
+      if (!WIFEXITED(exit_status) || (WEXITSTATUS(exit_status) != 0)) {
+        printf("-- [%s]   child %d failed (%d)\n", allocator_type.c_str(),
+            exited_pid, exit_status);
+        num_failures++;
+      }
+    }
+    expect_eq(true, child_pids.empty());
+    expect_eq(0, num_failures);
+
+    shared_ptr<Pool> pool(new Pool("test-roaring"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    RoaringBitmap b(alloc, base_offset);
+
+    set<uint32_t> expected;
+    for (uint32_t v = 0; v < 10000; v++) {
+      expected.emplace(v);
+    }
+    for (uint32_t child = 0; child < 8; child++) {
+      for (uint32_t v = 0; v < 2000; v++) {
+        expected.emplace(((child + 1) << 16) | v);
+        expected.emplace((10 << 16) | (v * 8 + child));
+        expected.emplace((11 << 16) | v);
+      }
+    }
+    expect_contents(expected, b);
+  }
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      Pool::delete_pool("test-roaring");
+      run_basic_test(allocator_type);
+      Pool::delete_pool("test-roaring");
+      run_run_optimize_test(allocator_type);
+      Pool::delete_pool("test-roaring");
+      run_operations_test(allocator_type, false);
+      Pool::delete_pool("test-roaring");
+      Pool::delete_pool("test-roaring2");
+      run_operations_test(allocator_type, true);
+      Pool::delete_pool("test-roaring");
+      run_pool_identity_test(allocator_type);
+      Pool::delete_pool("test-roaring");
+      run_concurrent_add_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  Pool::delete_pool("test-roaring");
+  Pool::delete_pool("test-roaring2");
+
+  return retcode;
+}
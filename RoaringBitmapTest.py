@@ -0,0 +1,108 @@
+from __future__ import unicode_literals
+
+import sys
+
+import sharedstructures
+
+
+def run_basic_test(allocator_type):
+  print('-- [%s] basic' % allocator_type)
+
+  b = sharedstructures.RoaringBitmap('test-roaring', allocator_type)
+  assert 0 == len(b)
+  assert 3 not in b
+
+  expected = set()
+  for v in (7, 0, 3, 0x10000, 0xFFFFFFFF):
+    assert b.add(v)
+    expected.add(v)
+  assert not b.add(3)
+  for v in range(0x20000, 0x20000 + 10000, 2):
+    b.add(v)
+    expected.add(v)
+  assert len(expected) == len(b)
+  assert sorted(expected) == b.values()
+  assert 0xFFFFFFFF in b
+  assert 0x20001 not in b
+
+  assert b.remove(7)
+  assert not b.remove(7)
+  expected.remove(7)
+  assert sorted(expected) == b.values()
+
+  b.run_optimize()
+  assert sorted(expected) == b.values()
+
+  for bad_value in (-1, 0x100000000):
+    try:
+      b.add(bad_value)
+      assert False, 'add(%d) did not raise OverflowError' % bad_value
+    except OverflowError:
+      pass
+  try:
+    b.add('7')
+    assert False, 'add(str) did not raise TypeError'
+  except TypeError:
+    pass
+
+  b.clear()
+  assert 0 == len(b)
+  assert [] == b.values()
+
+
+def run_operations_test(allocator_type):
+  print('-- [%s] operations' % allocator_type)
+
+  a = sharedstructures.RoaringBitmap('test-roaring', allocator_type)
+  b = sharedstructures.RoaringBitmap('test-roaring2', allocator_type)
+  c = sharedstructures.RoaringBitmap('test-roaring3', allocator_type)
+
+  ea = set(range(0, 100000, 3)) | set(range(200000, 210000))
+  eb = set(range(0, 100000, 5)) | set(range(300000, 300100))
+  for v in ea:
+    a.add(v)
+  for v in eb:
+    b.add(v)
+  a.run_optimize()
+
+  assert sorted(ea & eb) == a.compute(b, 'and')
+  assert sorted(ea | eb) == a.compute(b, 'or')
+  assert sorted(ea - eb) == a.compute(b, 'andnot')
+  assert sorted(eb - ea) == b.compute(a, 'andnot')
+  assert len(ea & eb) == a.compute_size(b, 'and')
+  assert len(ea | eb) == a.compute_size(b, 'or')
+
+  c.assign(a, b, 'or')
+  assert sorted(ea | eb) == c.values()
+  c.assign(c, a, 'andnot')
+  assert sorted(eb - ea) == c.values()
+
+  try:
+    a.compute(b, 'xor')
+    assert False, 'compute() with an invalid operation did not raise ValueError'
+  except ValueError:
+    pass
+
+
+def delete_pools():
+  sharedstructures.delete_pool('test-roaring')
+  sharedstructures.delete_pool('test-roaring2')
+  sharedstructures.delete_pool('test-roaring3')
+
+
+def main():
+  try:
+    for allocator_type in ('simple', 'logarithmic'):
+      delete_pools()
+      run_basic_test(allocator_type)
+      delete_pools()
+      run_operations_test(allocator_type)
+    print('all tests passed')
+    return 0
+
+  finally:
+    delete_pools()
+
+
+if __name__ == '__main__':
+  sys.exit(main())
@@ -1,6 +1,7 @@
 #include "SimpleAllocator.hh"
 
 #include <stddef.h>
+#include <string.h>
 
 using namespace std;
 
@@ -115,39 +116,7 @@ uint64_t SimpleAllocator::allocate(size_t size) {
     candidate_link_location = data->tail;
   }
 
-  // create the block and link it. there are 3 cases:
-  // 1. link location is 0 - the block is before the head block
-  // 2. link location == tail - the block is after the tail block
-  // 3. anything else - the block is at neither the head nor tail
-  // we always set next before prev and fill in new_block before changing
-  // existing pointers because the pool is repaired (after a crash) by walking
-  // from the head along the next pointers, so those should always be consistent
-  AllocatedBlock* new_block = this->pool->at<AllocatedBlock>(candidate_offset);
-  new_block->size = size;
-  if (candidate_link_location == 0) {
-    new_block->next = data->head;
-    new_block->prev = 0;
-    data->head = candidate_offset;
-    this->pool->at<AllocatedBlock>(new_block->next)->prev = candidate_offset;
-  } else if (candidate_link_location == data->tail) {
-    new_block->next = 0;
-    new_block->prev = data->tail;
-    this->pool->at<AllocatedBlock>(new_block->prev)->next = candidate_offset;
-    data->tail = candidate_offset;
-  } else {
-    AllocatedBlock* prev = this->pool->at<AllocatedBlock>(
-        candidate_link_location);
-    AllocatedBlock* next = this->pool->at<AllocatedBlock>(prev->next);
-    new_block->next = prev->next;
-    new_block->prev = candidate_link_location;
-    prev->next = candidate_offset;
-    next->prev = candidate_offset;
-  }
-  data->bytes_allocated += size;
-  data->bytes_committed += new_block->effective_size() + sizeof(AllocatedBlock);
-
-  // don't spend it all in once place...
-  return candidate_offset + sizeof(AllocatedBlock);
+  return this->link_block(candidate_offset, candidate_link_location, size);
 }
 
 void SimpleAllocator::free(uint64_t offset) {
@@ -181,6 +150,98 @@ size_t SimpleAllocator::block_size(uint64_t offset) const {
   return b->size;
 }
 
+uint64_t SimpleAllocator::relocate(uint64_t offset, uint64_t limit) {
+  auto data = this->data();
+
+  uint64_t block_offset = offset - sizeof(AllocatedBlock);
+  AllocatedBlock* block = this->pool->at<AllocatedBlock>(block_offset);
+  size_t size = block->size;
+  size_t needed_size = block->effective_size() + sizeof(AllocatedBlock);
+  if (offset + block->effective_size() <= limit) {
+    return offset;
+  }
+
+  // unlike allocate(), use the first space that fits instead of the smallest
+  // one, so blocks are packed toward the beginning of the pool. the block being
+  // moved is after limit, so the space after the tail block is never used.
+  uint64_t candidate_offset = (uint8_t*)&data->arena[0] - (uint8_t*)data;
+  uint64_t candidate_link_location = 0;
+  uint64_t next_block = data->head;
+  while (candidate_offset + needed_size <= limit) {
+    if (next_block - candidate_offset >= needed_size) {
+      break;
+    }
+    AllocatedBlock* b = this->pool->at<AllocatedBlock>(next_block);
+    candidate_offset = next_block + sizeof(AllocatedBlock) +
+        b->effective_size();
+    candidate_link_location = next_block;
+    next_block = b->next;
+    if (!next_block) {
+      return offset;
+    }
+  }
+  if (candidate_offset + needed_size > limit) {
+    return offset;
+  }
+
+  uint64_t new_offset = this->link_block(candidate_offset,
+      candidate_link_location, size);
+  memcpy(this->pool->at<void>(new_offset), this->pool->at<void>(offset), size);
+  this->free(offset);
+  return new_offset;
+}
+
+size_t SimpleAllocator::truncate() {
+  auto data = this->data();
+
+  uint64_t end_offset = sizeof(Data);
+  if (data->tail) {
+    AllocatedBlock* tail = this->pool->at<AllocatedBlock>(data->tail);
+    end_offset = data->tail + sizeof(AllocatedBlock) + tail->effective_size();
+  }
+  this->pool->truncate(end_offset);
+  return this->pool->size();
+}
+
+
+uint64_t SimpleAllocator::link_block(uint64_t block_offset,
+    uint64_t link_location, size_t size) {
+  auto data = this->data();
+
+  // create the block and link it. there are 3 cases:
+  // 1. link location is 0 - the block is before the head block
+  // 2. link location == tail - the block is after the tail block
+  // 3. anything else - the block is at neither the head nor tail
+  // we always set next before prev and fill in new_block before changing
+  // existing pointers because the pool is repaired (after a crash) by walking
+  // from the head along the next pointers, so those should always be consistent
+  AllocatedBlock* new_block = this->pool->at<AllocatedBlock>(block_offset);
+  new_block->size = size;
+  if (link_location == 0) {
+    new_block->next = data->head;
+    new_block->prev = 0;
+    data->head = block_offset;
+    this->pool->at<AllocatedBlock>(new_block->next)->prev = block_offset;
+  } else if (link_location == data->tail) {
+    new_block->next = 0;
+    new_block->prev = data->tail;
+    this->pool->at<AllocatedBlock>(new_block->prev)->next = block_offset;
+    data->tail = block_offset;
+  } else {
+    AllocatedBlock* prev = this->pool->at<AllocatedBlock>(link_location);
+    AllocatedBlock* next = this->pool->at<AllocatedBlock>(prev->next);
+    new_block->next = prev->next;
+    new_block->prev = link_location;
+    prev->next = block_offset;
+    next->prev = block_offset;
+  }
+  data->bytes_allocated += size;
+  data->bytes_committed += new_block->effective_size() + sizeof(AllocatedBlock);
+
+  // don't spend it all in once place...
+  return block_offset + sizeof(AllocatedBlock);
+}
+
 
 void SimpleAllocator::set_base_object_offset(uint64_t offset) {
   this->data()->base_object_offset = offset;
@@ -216,6 +277,10 @@ bool SimpleAllocator::is_locked(bool writing) const {
   return this->pool->at<ProcessReadWriteLock>(offsetof(Data, data_lock))->is_locked(writing);
 }
 
+uint64_t SimpleAllocator::lock_offset() const {
+  return offsetof(Data, data_lock);
+}
+
 
 void SimpleAllocator::verify() const {
   // TODO
@@ -28,6 +28,11 @@ public:
 
   virtual size_t block_size(uint64_t offset) const;
 
+  // moves blocks into the first free space before limit that fits them, so
+  // compaction packs blocks toward the beginning of the pool
+  virtual uint64_t relocate(uint64_t offset, uint64_t limit);
+  virtual size_t truncate();
+
   virtual void set_base_object_offset(uint64_t offset);
   virtual uint64_t base_object_offset() const;
 
@@ -37,6 +42,7 @@ public:
   // locks the entire pool
   virtual ProcessReadWriteLockGuard lock(bool writing) const;
   virtual bool is_locked(bool writing) const;
+  virtual uint64_t lock_offset() const;
 
   virtual void verify() const;
 
@@ -75,6 +81,12 @@ private:
     uint64_t effective_size();
   };
 
+  // creates a block at block_offset and links it after the block at
+  // link_location (or before the head block, if link_location is 0). returns
+  // the offset of the block's data.
+  uint64_t link_block(uint64_t block_offset, uint64_t link_location,
+      size_t size);
+
   virtual void repair();
 };
 
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+#include "HashTable.hh"
+#include "PrefixTree.hh"
+
+// helpers shared by the tests; this header isn't installed with the library.
+
+namespace sharedstructures {
+
+// returns all of a structure's keys and values, collected by iterating over it
+inline std::map<std::string, PrefixTree::LookupResult> tree_contents(
+    const PrefixTree& tree) {
+  std::map<std::string, PrefixTree::LookupResult> ret;
+  for (const auto& it : tree) {
+    ret.emplace(it.first, it.second);
+  }
+  return ret;
+}
+
+inline std::map<std::string, std::string> table_contents(
+    const HashTable& table) {
+  std::map<std::string, std::string> ret;
+  for (const auto& it : table) {
+    ret.emplace(it.first, it.second);
+  }
+  return ret;
+}
+
+} // namespace sharedstructures
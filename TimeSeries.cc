@@ -0,0 +1,287 @@
+#include "TimeSeries.hh"
+
+#include <sched.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
+#include <phosg/Time.hh>
+#include <stdexcept>
+
+#include "ProcessLock.hh"
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+TimeSeries::TimeSeries(shared_ptr<Allocator> allocator, size_t max_series,
+    size_t bucket_count, uint64_t bucket_width) : allocator(allocator) {
+  auto g = this->allocator->lock(true);
+  this->base_offset = this->create_time_series_base(max_series, bucket_count,
+      bucket_width);
+  this->open_name_index();
+}
+
+TimeSeries::TimeSeries(shared_ptr<Allocator> allocator, uint64_t base_offset,
+    size_t max_series, size_t bucket_count, uint64_t bucket_width) :
+    allocator(allocator), base_offset(base_offset) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->create_time_series_base(max_series,
+          bucket_count, bucket_width);
+      this->allocator->set_base_object_offset(this->base_offset);
+    }
+  }
+  this->open_name_index();
+}
+
+
+shared_ptr<Allocator> TimeSeries::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t TimeSeries::base() const {
+  return this->base_offset;
+}
+
+
+size_t TimeSeries::index_for_name(const string& name, bool create) {
+  return this->names->index_for_name(name, create);
+}
+
+vector<string> TimeSeries::all_series() const {
+  return this->names->all_names();
+}
+
+
+bool TimeSeries::add(const string& name, int64_t value) {
+  return this->add(this->index_for_name(name), value, now());
+}
+
+bool TimeSeries::add(const string& name, int64_t value, uint64_t timestamp) {
+  return this->add(this->index_for_name(name), value, timestamp);
+}
+
+bool TimeSeries::add(size_t index, int64_t value) {
+  return this->add(index, value, now());
+}
+
+bool TimeSeries::add(size_t index, int64_t value, uint64_t timestamp) {
+  // we don't lock the pool, so it's not remapped for us if another process
+  // expanded it
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  const TimeSeriesBase* base = p->at<TimeSeriesBase>(this->base_offset);
+  if (index >= base->series_count) {
+    throw out_of_range("series index out of range");
+  }
+
+  uint64_t period = timestamp / base->bucket_width;
+  uint64_t target = period + 1;
+  Bucket* b = this->bucket(index, period);
+
+  // make sure the bucket holds this sample's period, resetting it if it holds
+  // an older one. only one writer can win the compare-exchange, so only one
+  // writer resets the bucket; the others wait until it's done. while the bucket
+  // is being reset, its period holds the resetting process' token instead, so
+  // if that process dies before finishing, a waiting writer can take over the
+  // reset (for its own period - the dead writer's sample was never added).
+  //
+  // the reset isn't atomic with respect to writers that already checked the
+  // bucket's period for the old period and haven't updated it yet. if the
+  // bucket is reset between those two steps, the old sample is counted in the
+  // new period. this can only happen when samples for periods bucket_count
+  // apart are added at the same time.
+  uint64_t resetting_value = RESETTING | (uint32_t)this_process_token();
+  size_t wait_count = 0;
+  for (;;) {
+    uint64_t current = b->period.load(memory_order_acquire);
+    if (current & RESETTING) {
+      // checking whether a process is running is expensive, so only do it
+      // after the reset has taken a while
+      if ((++wait_count % RESET_WAIT_CHECK_INTERVAL) ||
+          (current == resetting_value) ||
+          process_for_token_is_running(current & 0xFFFFFFFF) ||
+          !b->period.compare_exchange_strong(current, resetting_value,
+              memory_order_acquire)) {
+        sched_yield();
+        continue;
+      }
+    } else if (current == target) {
+      break;
+    } else if (current > target) {
+      return false; // this sample's bucket has already expired
+    } else if (!b->period.compare_exchange_weak(current, resetting_value,
+        memory_order_acquire)) {
+      continue;
+    }
+
+    b->count.store(0, memory_order_relaxed);
+    b->sum.store(0, memory_order_relaxed);
+    b->min.store(INT64_MAX, memory_order_relaxed);
+    b->max.store(INT64_MIN, memory_order_relaxed);
+    b->period.store(target, memory_order_release);
+    break;
+  }
+
+  b->sum.fetch_add(value, memory_order_relaxed);
+  int64_t current_min = b->min.load(memory_order_relaxed);
+  while ((value < current_min) &&
+      !b->min.compare_exchange_weak(current_min, value,
+          memory_order_relaxed));
+  int64_t current_max = b->max.load(memory_order_relaxed);
+  while ((value > current_max) &&
+      !b->max.compare_exchange_weak(current_max, value,
+          memory_order_relaxed));
+  // count is updated last, so a reader that sees the sample counted also sees
+  // its effect on min and max
+  b->count.fetch_add(1, memory_order_release);
+  return true;
+}
+
+
+TimeSeries::Window TimeSeries::window(const string& name,
+    size_t num_buckets) const {
+  return this->window(name, num_buckets, now());
+}
+
+TimeSeries::Window TimeSeries::window(const string& name, size_t num_buckets,
+    uint64_t timestamp) const {
+  return this->window(const_cast<TimeSeries*>(this)->index_for_name(name,
+      false), num_buckets, timestamp);
+}
+
+TimeSeries::Window TimeSeries::window(size_t index, size_t num_buckets) const {
+  return this->window(index, num_buckets, now());
+}
+
+TimeSeries::Window TimeSeries::window(size_t index, size_t num_buckets,
+    uint64_t timestamp) const {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  const TimeSeriesBase* base = p->at<TimeSeriesBase>(this->base_offset);
+  if (index >= base->series_count) {
+    throw out_of_range("series index out of range");
+  }
+  if (num_buckets > base->bucket_count) {
+    throw invalid_argument("window is larger than the series");
+  }
+
+  Window ret = {0, 0, INT64_MAX, INT64_MIN};
+  uint64_t end_period = timestamp / base->bucket_width;
+  for (size_t x = 0; (x < num_buckets) && (x <= end_period); x++) {
+    uint64_t period = end_period - x;
+    const Bucket* b = this->bucket(index, period);
+
+    // if the bucket is reset for a newer period while we're reading it, its
+    // contents are no longer part of this window
+    if (b->period.load(memory_order_acquire) != period + 1) {
+      continue;
+    }
+    uint64_t count = b->count.load(memory_order_acquire);
+    int64_t sum = b->sum.load(memory_order_relaxed);
+    int64_t min_value = b->min.load(memory_order_relaxed);
+    int64_t max_value = b->max.load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (!count || (b->period.load(memory_order_relaxed) != period + 1)) {
+      continue;
+    }
+
+    ret.count += count;
+    ret.sum += sum;
+    ret.min = min(ret.min, min_value);
+    ret.max = max(ret.max, max_value);
+  }
+
+  if (!ret.count) {
+    ret.min = 0;
+    ret.max = 0;
+  }
+  return ret;
+}
+
+
+size_t TimeSeries::size() const {
+  return this->allocator->get_pool()->at<TimeSeriesBase>(
+      this->base_offset)->series_count;
+}
+
+size_t TimeSeries::max_series() const {
+  return this->allocator->get_pool()->at<TimeSeriesBase>(
+      this->base_offset)->max_series;
+}
+
+size_t TimeSeries::bucket_count() const {
+  return this->allocator->get_pool()->at<TimeSeriesBase>(
+      this->base_offset)->bucket_count;
+}
+
+uint64_t TimeSeries::bucket_width() const {
+  return this->allocator->get_pool()->at<TimeSeriesBase>(
+      this->base_offset)->bucket_width;
+}
+
+
+void TimeSeries::open_name_index() {
+  // the set may have been created by another process after we mapped the pool
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  const TimeSeriesBase* base = p->at<TimeSeriesBase>(this->base_offset);
+  this->names.reset(new NameIndex(this->allocator,
+      this->base_offset + offsetof(TimeSeriesBase, series_count),
+      base->names_offset, base->max_series, "time series set is full"));
+}
+
+uint64_t TimeSeries::create_time_series_base(size_t max_series,
+    size_t bucket_count, uint64_t bucket_width) {
+  if (max_series == 0) {
+    throw invalid_argument("max_series must be nonzero");
+  }
+  if (bucket_count == 0) {
+    throw invalid_argument("bucket_count must be nonzero");
+  }
+  if (bucket_width == 0) {
+    throw invalid_argument("bucket_width must be nonzero");
+  }
+
+  auto p = this->allocator->get_pool();
+
+  uint64_t base_offset = this->allocator->allocate(sizeof(TimeSeriesBase));
+  uint64_t names_offset = this->allocator->allocate(
+      max_series * sizeof(uint64_t));
+  uint64_t buckets_offset = this->allocator->allocate(
+      max_series * bucket_count * sizeof(Bucket));
+
+  TimeSeriesBase* base = p->at<TimeSeriesBase>(base_offset);
+  base->max_series = max_series;
+  base->bucket_count = bucket_count;
+  base->bucket_width = bucket_width;
+  base->series_count = 0;
+  base->names_offset = names_offset;
+  base->buckets_offset = buckets_offset;
+
+  // all-zero buckets have never been used, so their other fields don't matter
+  memset(p->at<uint8_t>(names_offset), 0, max_series * sizeof(uint64_t));
+  memset(p->at<uint8_t>(buckets_offset), 0,
+      max_series * bucket_count * sizeof(Bucket));
+
+  return base_offset;
+}
+
+
+TimeSeries::Bucket* TimeSeries::bucket(size_t index, uint64_t period) const {
+  auto p = this->allocator->get_pool();
+  const TimeSeriesBase* base = p->at<TimeSeriesBase>(this->base_offset);
+  return p->at<Bucket>(base->buckets_offset) +
+      (index * base->bucket_count + (period % base->bucket_count));
+}
+
+} // namespace sharedstructures
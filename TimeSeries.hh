@@ -0,0 +1,146 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Allocator.hh"
+#include "NameIndex.hh"
+
+namespace sharedstructures {
+
+
+// TimeSeries is a fixed-capacity set of named series of integer samples, each
+// summarized over fixed-width time buckets. each series is a ring of
+// bucket_count buckets; a sample with timestamp t goes in bucket period
+// t / bucket_width, which lives in ring slot period % bucket_count. each bucket
+// keeps the count, sum, min and max of its samples.
+//
+// adding a sample and reading a window don't take the pool lock. the current
+// bucket is updated in place with atomic operations, so concurrent writers
+// don't serialize. when a sample belongs to a newer period than the one in its
+// slot, the slot is reset and reused for the new period, so old buckets expire
+// automatically as time advances; samples older than the period in their slot
+// are dropped.
+//
+// timestamps are in arbitrary units, as long as all callers agree (and agree
+// with bucket_width). the overloads that don't take a timestamp use the
+// current time in microseconds.
+//
+// series are created the first time they're referenced by name, which takes
+// the pool lock once per series. series can't be deleted. like CounterSet,
+// each process caches the name -> index mapping.
+
+class TimeSeries {
+public:
+  TimeSeries() = delete;
+  TimeSeries(const TimeSeries&) = delete;
+  TimeSeries(TimeSeries&&) = delete;
+
+  // create constructor - allocates a new set that can hold up to max_series
+  // series, each with bucket_count buckets of bucket_width time units.
+  TimeSeries(std::shared_ptr<Allocator> allocator, size_t max_series,
+      size_t bucket_count, uint64_t bucket_width);
+  // (conditional) create constructor.
+  // opens an existing TimeSeries using the given allocator. if base_offset is
+  // 0, opens the TimeSeries at the allocator's base offset. if the allocator's
+  // base offset is also 0, creates a new TimeSeries and sets the allocator's
+  // base offset to the new set's base offset. max_series, bucket_count and
+  // bucket_width are ignored if the set already exists.
+  TimeSeries(std::shared_ptr<Allocator> allocator, uint64_t base_offset,
+      size_t max_series, size_t bucket_count, uint64_t bucket_width);
+  ~TimeSeries() = default;
+
+  // returns the allocator for this set
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this set
+  uint64_t base() const;
+
+  // returns the index of the named series. if it doesn't exist, creates it if
+  // create is true, or throws std::out_of_range if not. throws
+  // std::runtime_error if the set is full.
+  size_t index_for_name(const std::string& name, bool create = true);
+  // returns the names of all series, in index order.
+  std::vector<std::string> all_series() const;
+
+  // adds a sample to a series. the series is created if it doesn't exist.
+  // returns false if the sample was dropped because its bucket has already
+  // expired.
+  bool add(const std::string& name, int64_t value);
+  bool add(const std::string& name, int64_t value, uint64_t timestamp);
+  bool add(size_t index, int64_t value);
+  bool add(size_t index, int64_t value, uint64_t timestamp);
+
+  struct Window {
+    uint64_t count;
+    int64_t sum;
+    int64_t min; // 0 if count is 0
+    int64_t max; // 0 if count is 0
+  };
+
+  // aggregates the samples in the last num_buckets buckets of a series, ending
+  // with the bucket that contains the given timestamp. num_buckets may not be
+  // more than bucket_count. buckets that haven't been written since they last
+  // expired are skipped. this doesn't lock the pool, so samples added during
+  // the read may or may not be included.
+  Window window(const std::string& name, size_t num_buckets) const;
+  Window window(const std::string& name, size_t num_buckets,
+      uint64_t timestamp) const;
+  Window window(size_t index, size_t num_buckets) const;
+  Window window(size_t index, size_t num_buckets, uint64_t timestamp) const;
+
+  // inspection methods.
+  size_t size() const; // series count
+  size_t max_series() const;
+  size_t bucket_count() const;
+  uint64_t bucket_width() const;
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+
+  // maps series names to indexes; see NameIndex
+  std::unique_ptr<NameIndex> names;
+
+  struct TimeSeriesBase {
+    uint64_t max_series;
+    uint64_t bucket_count;
+    uint64_t bucket_width;
+    // the number of series that have names. this is incremented after the name
+    // is written, so readers can look up names without locking.
+    std::atomic<uint64_t> series_count;
+    // array of max_series offsets of name strings
+    uint64_t names_offset;
+    // max_series * bucket_count buckets; each series' ring is contiguous
+    uint64_t buckets_offset;
+  };
+
+  struct Bucket {
+    // the period this bucket holds, plus 1 (so 0 means the bucket has never
+    // been used). while the bucket is being reset for a new period, this is
+    // RESETTING | the resetting process' token instead; writers wait until
+    // the reset is done, or take it over if the resetting process died.
+    std::atomic<uint64_t> period;
+    std::atomic<uint64_t> count;
+    std::atomic<int64_t> sum;
+    std::atomic<int64_t> min;
+    std::atomic<int64_t> max;
+  };
+
+  static const uint64_t RESETTING = 0x8000000000000000;
+  // how many times a writer yields while waiting for a reset between checks
+  // that the resetting process is still running
+  static const size_t RESET_WAIT_CHECK_INTERVAL = 1000;
+
+  void open_name_index();
+  uint64_t create_time_series_base(size_t max_series, size_t bucket_count,
+      uint64_t bucket_width);
+
+  // the caller must have called check_size_and_remap
+  Bucket* bucket(size_t index, uint64_t period) const;
+};
+
+} // namespace sharedstructures
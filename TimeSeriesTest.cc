@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <phosg/Process.hh>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "TimeSeries.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+void expect_window(const TimeSeries::Window& w, uint64_t count, int64_t sum,
+    int64_t min_value, int64_t max_value) {
+  expect_eq(count, w.count);
+  expect_eq(sum, w.sum);
+  expect_eq(min_value, w.min);
+  expect_eq(max_value, w.max);
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-timeseries"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  TimeSeries ts(alloc, 0, 3, 4, 10);
+
+  expect_eq(0, ts.size());
+  expect_eq(3, ts.max_series());
+  expect_eq(4, ts.bucket_count());
+  expect_eq(10, ts.bucket_width());
+
+  try {
+    ts.window("latency", 1, 0);
+    expect(false);
+  } catch (const out_of_range& e) { }
+
+  // periods 0, 1 and 3 (timestamps 0-9, 10-19, 30-39)
+  expect_eq(true, ts.add("latency", 5, 0));
+  expect_eq(true, ts.add("latency", -2, 9));
+  expect_eq(true, ts.add("latency", 8, 15));
+  expect_eq(true, ts.add("latency", 1, 35));
+  expect_eq(1, ts.size());
+
+  expect_window(ts.window("latency", 1, 9), 2, 3, -2, 5);
+  expect_window(ts.window("latency", 2, 19), 3, 11, -2, 8);
+  expect_window(ts.window("latency", 1, 25), 0, 0, 0, 0);
+  expect_window(ts.window("latency", 4, 39), 4, 12, -2, 8);
+  expect_window(ts.window("latency", 2, 39), 1, 1, 1, 1);
+  try {
+    ts.window("latency", 5, 39);
+    expect(false);
+  } catch (const invalid_argument& e) { }
+
+  // period 4 reuses period 0's slot, so period 0 expires
+  expect_eq(true, ts.add("latency", 100, 40));
+  expect_window(ts.window("latency", 4, 49), 3, 109, 1, 100);
+  expect_window(ts.window("latency", 4, 39), 2, 9, 1, 8);
+
+  // samples for expired periods are dropped
+  expect_eq(false, ts.add("latency", 7, 3));
+  expect_window(ts.window("latency", 4, 49), 3, 109, 1, 100);
+
+  // after a gap longer than the ring, recent windows don't include any of the
+  // old buckets. windows ending earlier still see the ones that haven't been
+  // reused yet
+  expect_eq(true, ts.add("latency", 4, 1000));
+  expect_window(ts.window("latency", 4, 1009), 1, 4, 4, 4);
+  expect_window(ts.window("latency", 4, 49), 2, 9, 1, 8);
+
+  // series are independent
+  size_t errors_index = ts.index_for_name("errors");
+  expect_eq(1, errors_index);
+  ts.add(errors_index, 1, 1000);
+  ts.add(errors_index, 1, 1001);
+  expect_window(ts.window(errors_index, 1, 1005), 2, 2, 1, 1);
+  expect_window(ts.window("latency", 1, 1005), 1, 4, 4, 4);
+
+  // another instance sees the same series
+  {
+    TimeSeries ts2(alloc, ts.base(), 0, 0, 0);
+    expect_eq(2, ts2.size());
+    ts2.add("errors", 3, 1002);
+    expect_window(ts2.window("latency", 1, 1005), 1, 4, 4, 4);
+  }
+  expect_window(ts.window("errors", 1, 1005), 3, 5, 1, 3);
+
+  vector<string> expected_names({"latency", "errors"});
+  expect_eq(expected_names, ts.all_series());
+
+  // the set has a fixed capacity
+  ts.index_for_name("");
+  try {
+    ts.add("one too many", 1, 1000);
+    expect(false);
+  } catch (const runtime_error& e) { }
+  try {
+    ts.add(3, 1, 1000);
+    expect(false);
+  } catch (const out_of_range& e) { }
+
+  // the overloads without timestamps use the current time
+  TimeSeries live(alloc, 1, 60, 1000000);
+  live.add("requests", 1);
+  live.add("requests", 1);
+  expect_eq(2, live.window("requests", 2).count);
+}
+
+
+void run_concurrent_test(const string& allocator_type) {
+  printf("-- [%s] concurrent adds\n", allocator_type.c_str());
+
+  uint64_t base_offset;
+  {
+    shared_ptr<Pool> pool(new Pool("test-timeseries"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    TimeSeries ts(alloc, 4, 128, 10);
+    base_offset = ts.base();
+  }
+
+  // each child adds the same samples to a shared series (advancing through
+  // the periods), and its index to a series shared with half the children
+  const size_t num_children = 8;
+  const size_t num_periods = 100;
+  const size_t samples_per_period = 50;
+  unordered_set<pid_t> child_pids;
+  size_t child_index = 0;
+  while ((child_pids.size() < num_children) && !child_pids.count(0)) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      break;
+    } else {
+      child_pids.emplace(pid);
+      if (pid) {
+        child_index++;
+      }
+    }
+  }
+
+  if (child_pids.count(0)) {
+    shared_ptr<Pool> pool(new Pool("test-timeseries"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    TimeSeries ts(alloc, base_offset, 0, 0, 0);
+    for (size_t x = 0; x < num_periods; x++) {
+      for (size_t y = 0; y < samples_per_period; y++) {
+        if (!ts.add("shared", y, x * 10 + (y % 10))) {
+          _exit(1);
+        }
+        ts.add(string_printf("child%zu", child_index % 2), child_index, x * 10);
+      }
+    }
+    _exit(0);
+
+  } else {
+    int num_failures = 0;
+    int exit_status;
+    pid_t exited_pid;
+    while ((exited_pid = wait(&exit_status)) != -1) {
+      child_pids.erase(exited_pid);
+      if (!WIFEXITED(exit_status) || (WEXITSTATUS(exit_status) != 0)) {
+        printf("-- [%s]   child %d failed (%d)\n", allocator_type.c_str(),
+            exited_pid, exit_status);
+        num_failures++;
+      }
+    }
+    expect_eq(true, child_pids.empty());
+    expect_eq(0, num_failures);
+
+    shared_ptr<Pool> pool(new Pool("test-timeseries"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    TimeSeries ts(alloc, base_offset, 0, 0, 0);
+    expect_eq(3, ts.size());
+
+    int64_t period_sum = samples_per_period * (samples_per_period - 1) / 2;
+    uint64_t end_timestamp = num_periods * 10 - 1;
+    for (size_t x = 0; x < num_periods; x++) {
+      expect_window(ts.window("shared", 1, x * 10), num_children *
+          samples_per_period, num_children * period_sum, 0,
+          samples_per_period - 1);
+    }
+    expect_window(ts.window("shared", num_periods, end_timestamp),
+        num_children * samples_per_period * num_periods,
+        num_children * period_sum * num_periods, 0, samples_per_period - 1);
+
+    // children 0, 2, 4, 6 wrote to child0; 1, 3, 5, 7 wrote to child1
+    auto w0 = ts.window("child0", num_periods, end_timestamp);
+    expect_window(w0, (num_children / 2) * num_periods * samples_per_period,
+        12 * num_periods * samples_per_period, 0, 6);
+    auto w1 = ts.window("child1", num_periods, end_timestamp);
+    expect_window(w1, (num_children / 2) * num_periods * samples_per_period,
+        16 * num_periods * samples_per_period, 1, 7);
+  }
+}
+
+
+void run_crashed_reset_test(const string& allocator_type) {
+  printf("-- [%s] crashed reset\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-timeseries"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  TimeSeries ts(alloc, 0, 1, 4, 10);
+  expect_eq(true, ts.add("latency", 5, 0));
+
+  // simulate a writer that crashed while resetting the bucket for period 4:
+  // the child marks the bucket as being reset by itself, then exits. the
+  // bucket is the first one in the first series' ring (buckets_offset is the
+  // last field of the set's base)
+  pid_t child_pid = fork();
+  if (!child_pid) {
+    uint64_t buckets_offset = pool->at<uint64_t>(ts.base())[5];
+    pool->at<atomic<uint64_t>>(buckets_offset)->store(
+        0x8000000000000000 | (uint32_t)this_process_token());
+    _exit(0);
+  }
+  int exit_status;
+  expect_eq(child_pid, waitpid(child_pid, &exit_status, 0));
+  while (start_time_for_pid(child_pid) != 0) {
+    sched_yield();
+  }
+
+  // the next writer takes over the reset instead of waiting forever
+  expect_eq(true, ts.add("latency", 7, 40));
+  expect_window(ts.window("latency", 1, 40), 1, 7, 7, 7);
+  expect_window(ts.window("latency", 1, 0), 0, 0, 0, 0);
+  expect_eq(true, ts.add("latency", 9, 41));
+  expect_window(ts.window("latency", 1, 40), 2, 16, 7, 9);
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      Pool::delete_pool("test-timeseries");
+      run_basic_test(allocator_type);
+      Pool::delete_pool("test-timeseries");
+      run_concurrent_test(allocator_type);
+      Pool::delete_pool("test-timeseries");
+      run_crashed_reset_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  Pool::delete_pool("test-timeseries");
+
+  return retcode;
+}
@@ -0,0 +1,197 @@
+#include "WatchTable.hh"
+
+#include <string.h>
+
+#include <algorithm>
+#include <phosg/Time.hh>
+#include <stdexcept>
+
+#include "Hash.hh"
+#include "ProcessLock.hh"
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+// fnv1a64's initial value, for hashing prefixes one byte at a time
+static const uint64_t FNV1A64_INITIAL_HASH = 0xCBF29CE484222325;
+
+
+WatchTable::WatchTable(shared_ptr<Allocator> allocator, uint8_t bits,
+    size_t max_prefix_length) : allocator(allocator) {
+  auto g = this->allocator->lock(true);
+  this->base_offset = this->create_table_base(bits, max_prefix_length);
+}
+
+WatchTable::WatchTable(shared_ptr<Allocator> allocator, uint64_t base_offset,
+    uint8_t bits, size_t max_prefix_length) : allocator(allocator),
+    base_offset(base_offset) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->create_table_base(bits, max_prefix_length);
+      this->allocator->set_base_object_offset(this->base_offset);
+    }
+  }
+}
+
+
+shared_ptr<Allocator> WatchTable::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t WatchTable::base() const {
+  return this->base_offset;
+}
+
+
+void WatchTable::notify(const void* k, size_t k_size) {
+  // we don't lock the pool, so it's not remapped for us if another process
+  // expanded it
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  size_t max_prefix_length = p->at<WatchTableBase>(
+      this->base_offset)->max_prefix_length;
+
+  // fnv1a64 hashes one byte at a time, so we can compute the hashes of all the
+  // prefixes in one pass over the key
+  uint64_t hash = FNV1A64_INITIAL_HASH;
+  this->increment_stripe(this->stripe_for_hash(hash));
+  size_t end = min(k_size, max_prefix_length);
+  for (size_t x = 0; x < end; x++) {
+    hash = fnv1a64(reinterpret_cast<const uint8_t*>(k) + x, 1, hash);
+    this->increment_stripe(this->stripe_for_hash(hash));
+  }
+}
+
+void WatchTable::notify(const string& k) {
+  this->notify(k.data(), k.size());
+}
+
+void WatchTable::notify_all() {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  const WatchTableBase* base = p->at<WatchTableBase>(this->base_offset);
+  Stripe* stripes = p->at<Stripe>(base->stripes_offset);
+  for (size_t x = 0; x < (1ULL << base->bits); x++) {
+    this->increment_stripe(&stripes[x]);
+  }
+}
+
+
+uint32_t WatchTable::sequence(const void* prefix, size_t p_size) const {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  size_t max_prefix_length = p->at<WatchTableBase>(
+      this->base_offset)->max_prefix_length;
+  const Stripe* stripe = this->stripe_for_hash(fnv1a64(prefix,
+      min(p_size, max_prefix_length)));
+  return stripe->sequence.load();
+}
+
+uint32_t WatchTable::sequence(const string& prefix) const {
+  return this->sequence(prefix.data(), prefix.size());
+}
+
+uint32_t WatchTable::watch(const void* prefix, size_t p_size,
+    uint32_t last_sequence, uint64_t timeout_usecs) const {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  size_t max_prefix_length = p->at<WatchTableBase>(
+      this->base_offset)->max_prefix_length;
+  Stripe* stripe = this->stripe_for_hash(fnv1a64(prefix,
+      min(p_size, max_prefix_length)));
+
+  uint64_t end_time = now() + timeout_usecs;
+  for (;;) {
+    uint32_t current = stripe->sequence.load();
+    if (current != last_sequence) {
+      return current;
+    }
+    uint64_t current_time = now();
+    if (current_time >= end_time) {
+      return current;
+    }
+
+    // waiter_count is incremented before the futex wait, so a notify either
+    // sees it and wakes us, or runs before the wait and changes the sequence
+    // (so the wait doesn't block). the pool isn't remapped while we wait, so
+    // the stripe pointer remains valid
+    uint64_t remaining = end_time - current_time;
+    struct timespec timeout = {static_cast<time_t>(remaining / 1000000),
+        static_cast<long>((remaining % 1000000) * 1000)};
+    stripe->waiter_count++;
+    futex_wait(&stripe->sequence, static_cast<int32_t>(last_sequence),
+        &timeout);
+    stripe->waiter_count--;
+  }
+}
+
+uint32_t WatchTable::watch(const string& prefix, uint32_t last_sequence,
+    uint64_t timeout_usecs) const {
+  return this->watch(prefix.data(), prefix.size(), last_sequence,
+      timeout_usecs);
+}
+
+
+uint8_t WatchTable::bits() const {
+  return this->allocator->get_pool()->at<WatchTableBase>(
+      this->base_offset)->bits;
+}
+
+size_t WatchTable::max_prefix_length() const {
+  return this->allocator->get_pool()->at<WatchTableBase>(
+      this->base_offset)->max_prefix_length;
+}
+
+
+uint64_t WatchTable::create_table_base(uint8_t bits,
+    size_t max_prefix_length) {
+  if (bits > 24) {
+    throw invalid_argument("bits must be 24 or less");
+  }
+
+  auto p = this->allocator->get_pool();
+
+  size_t stripes_size = (1ULL << bits) * sizeof(Stripe);
+  uint64_t base_offset = this->allocator->allocate(sizeof(WatchTableBase));
+  uint64_t allocated_offset = this->allocator->allocate(stripes_size + 56);
+
+  // the pool is always mapped at a page boundary, so aligning the offset also
+  // aligns the address
+  uint64_t stripes_offset = (allocated_offset + 63) & ~63;
+
+  WatchTableBase* base = p->at<WatchTableBase>(base_offset);
+  base->bits = bits;
+  base->max_prefix_length = max_prefix_length;
+  base->allocated_offset = allocated_offset;
+  base->stripes_offset = stripes_offset;
+
+  memset(p->at<uint8_t>(stripes_offset), 0, stripes_size);
+
+  return base_offset;
+}
+
+
+WatchTable::Stripe* WatchTable::stripe_for_hash(uint64_t hash) const {
+  auto p = this->allocator->get_pool();
+  const WatchTableBase* base = p->at<WatchTableBase>(this->base_offset);
+  return p->at<Stripe>(base->stripes_offset) +
+      (mix64(hash) & ((1ULL << base->bits) - 1));
+}
+
+void WatchTable::increment_stripe(Stripe* stripe) {
+  stripe->sequence++;
+  if (stripe->waiter_count.load()) {
+    futex_wake(&stripe->sequence, 0x7FFFFFFF);
+  }
+}
+
+} // namespace sharedstructures
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "Allocator.hh"
+
+namespace sharedstructures {
+
+
+// WatchTable lets processes block until keys under a given prefix change,
+// instead of polling. it's a fixed array of sequence numbers (stripes); a key
+// or prefix maps to a stripe by its hash. when a key changes, notify()
+// increments the stripes for every prefix of the key (from the empty prefix up
+// to max_prefix_length bytes of the key), and watch() blocks on a futex until
+// the stripe for the watched prefix changes. prefixes longer than
+// max_prefix_length are truncated, so watching one may return for changes to
+// other keys that share the truncated prefix.
+//
+// unrelated prefixes can share a stripe, so watch() may return when nothing
+// under the watched prefix changed; watchers should check whether what they're
+// interested in actually changed. neither notify() nor watch() takes the pool
+// lock, so notify() can be called while holding it.
+//
+// a WatchTable can be attached to a PrefixTree, which then notifies it of all
+// changes; see PrefixTree::attach_watch_table.
+
+class WatchTable {
+public:
+  WatchTable() = delete;
+  WatchTable(const WatchTable&) = delete;
+  WatchTable(WatchTable&&) = delete;
+
+  // create constructor - allocates a new table with 2^bits stripes (each uses
+  // a 64-byte cache line).
+  WatchTable(std::shared_ptr<Allocator> allocator, uint8_t bits,
+      size_t max_prefix_length);
+  // (conditional) create constructor.
+  // opens an existing WatchTable using the given allocator. if base_offset is
+  // 0, opens the WatchTable at the allocator's base offset. if the allocator's
+  // base offset is also 0, creates a new WatchTable and sets the allocator's
+  // base offset to the new table's base offset. bits and max_prefix_length are
+  // ignored if the table already exists.
+  WatchTable(std::shared_ptr<Allocator> allocator, uint64_t base_offset,
+      uint8_t bits, size_t max_prefix_length);
+  ~WatchTable() = default;
+
+  // returns the allocator for this table
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this table
+  uint64_t base() const;
+
+  // records a change to a key, waking up processes watching any prefix of it.
+  void notify(const void* k, size_t k_size);
+  void notify(const std::string& k);
+  // records a change to every key (e.g. after clearing a tree), waking up all
+  // watchers.
+  void notify_all();
+
+  // returns the current sequence number for a prefix.
+  uint32_t sequence(const void* prefix, size_t p_size) const;
+  uint32_t sequence(const std::string& prefix) const;
+
+  // blocks until the sequence number for a prefix isn't last_sequence, or
+  // until timeout_usecs microseconds have passed, and returns the current
+  // sequence number. if it's still last_sequence, the wait timed out. if
+  // timeout_usecs is 0, returns immediately.
+  uint32_t watch(const void* prefix, size_t p_size, uint32_t last_sequence,
+      uint64_t timeout_usecs) const;
+  uint32_t watch(const std::string& prefix, uint32_t last_sequence,
+      uint64_t timeout_usecs) const;
+
+  // inspection methods.
+  uint8_t bits() const; // stripe count factor
+  size_t max_prefix_length() const;
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+
+  struct Stripe {
+    std::atomic<int32_t> sequence;
+    std::atomic<int32_t> waiter_count;
+    uint8_t unused[56];
+  };
+
+  struct WatchTableBase {
+    uint8_t bits;
+    uint8_t unused[7];
+    uint64_t max_prefix_length;
+    // the stripes must be aligned to cache lines, but the allocator only
+    // guarantees 8-byte alignment, so we allocate extra space and align the
+    // stripes within it
+    uint64_t allocated_offset;
+    uint64_t stripes_offset;
+  };
+
+  uint64_t create_table_base(uint8_t bits, size_t max_prefix_length);
+
+  // the caller must have called check_size_and_remap
+  Stripe* stripe_for_hash(uint64_t hash) const;
+  void increment_stripe(Stripe* stripe);
+};
+
+} // namespace sharedstructures
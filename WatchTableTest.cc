@@ -0,0 +1,187 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <phosg/Time.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "PrefixTree.hh"
+#include "WatchTable.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-watch"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  WatchTable table(alloc, 0, 12, 6);
+
+  expect_eq(12, table.bits());
+  expect_eq(6, table.max_prefix_length());
+
+  // a change to a key changes the sequence for every prefix of it
+  uint32_t empty_seq = table.sequence("");
+  uint32_t user_seq = table.sequence("user:");
+  uint32_t key_seq = table.sequence("user:1");
+  uint32_t other_seq = table.sequence("order:");
+  table.notify("user:1");
+  expect_ne(empty_seq, table.sequence(""));
+  expect_ne(user_seq, table.sequence("user:"));
+  expect_ne(key_seq, table.sequence("user:1"));
+  expect_eq(other_seq, table.sequence("order:"));
+
+  // prefixes longer than max_prefix_length are truncated, so these share a
+  // sequence number
+  expect_eq(table.sequence("user:1"), table.sequence("user:123"));
+  uint32_t long_seq = table.sequence("user:123");
+  table.notify("user:145");
+  expect_ne(long_seq, table.sequence("user:123"));
+
+  // watch returns immediately if the sequence already changed
+  user_seq = table.sequence("user:");
+  table.notify("user:2");
+  expect_ne(user_seq, table.watch("user:", user_seq, 1000000));
+
+  // a watch with no changes times out and returns the same sequence
+  user_seq = table.sequence("user:");
+  uint64_t start_time = now();
+  expect_eq(user_seq, table.watch("user:", user_seq, 50000));
+  expect_le(50000, now() - start_time);
+  expect_eq(user_seq, table.watch("user:", user_seq, 0));
+
+  // notify_all changes every sequence
+  other_seq = table.sequence("order:");
+  user_seq = table.sequence("user:");
+  table.notify_all();
+  expect_ne(other_seq, table.sequence("order:"));
+  expect_ne(user_seq, table.sequence("user:"));
+
+  // another instance sees the same table
+  WatchTable table2(alloc, table.base(), 0, 0);
+  expect_eq(table.sequence("user:"), table2.sequence("user:"));
+  table2.notify("user:3");
+  expect_ne(user_seq, table.sequence("user:"));
+}
+
+
+void run_prefix_tree_test(const string& allocator_type) {
+  printf("-- [%s] prefix tree\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-watch"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  shared_ptr<WatchTable> table(new WatchTable(alloc, 12, 16));
+  PrefixTree tree(alloc, 0);
+  tree.attach_watch_table(table);
+  expect_eq(table, tree.get_watch_table());
+
+  // every kind of change notifies the table
+  uint32_t seq = table->sequence("jobs/");
+  auto jobs_changed = [&]() -> bool {
+    uint32_t prev_seq = seq;
+    seq = table->sequence("jobs/");
+    return seq != prev_seq;
+  };
+  tree.insert(string("jobs/1"), string("pending"));
+  expect(jobs_changed());
+  tree.insert(string("jobs/2"), (int64_t)7);
+  expect(jobs_changed());
+  tree.incr("jobs/2", (int64_t)1);
+  expect(jobs_changed());
+  tree.erase("jobs/2");
+  expect(jobs_changed());
+  tree.clear();
+  expect(jobs_changed());
+
+  // changes that don't happen don't notify
+  tree.erase("jobs/2");
+  expect_eq(seq, table->sequence("jobs/"));
+  PrefixTree::CheckRequest check("jobs/1", 6, string("done"));
+  tree.insert(string("jobs/1"), string("pending"), &check);
+  expect_eq(seq, table->sequence("jobs/"));
+
+  // changes under other prefixes don't notify
+  tree.insert(string("users/1"), string("someone"));
+  expect_eq(seq, table->sequence("jobs/"));
+
+  // a watcher in another process wakes up when a key under its prefix changes
+  // (and not before)
+  pid_t pid = fork();
+  if (!pid) {
+    shared_ptr<Pool> child_pool(new Pool("test-watch"));
+    shared_ptr<Allocator> child_alloc = create_allocator(child_pool,
+        allocator_type);
+    WatchTable child_table(child_alloc, table->base(), 0, 0);
+    PrefixTree child_tree(child_alloc, 0);
+    uint32_t new_seq = child_table.watch("jobs/", seq, 10000000);
+    if (new_seq == seq) {
+      _exit(1);
+    }
+    if (!child_tree.exists("jobs/3")) {
+      _exit(2);
+    }
+    _exit(0);
+  }
+
+  usleep(100000);
+  uint64_t start_time = now();
+  tree.insert(string("users/2"), string("someone else"));
+  tree.insert(string("jobs/3"), string("pending"));
+
+  int exit_status;
+  expect_eq(pid, waitpid(pid, &exit_status, 0));
+  expect_eq(true, WIFEXITED(exit_status));
+  expect_eq(0, WEXITSTATUS(exit_status));
+  expect_lt(now() - start_time, 2000000);
+
+  // detaching the table stops notifications
+  tree.attach_watch_table(nullptr);
+  seq = table->sequence("jobs/");
+  tree.insert(string("jobs/4"), string("pending"));
+  expect_eq(seq, table->sequence("jobs/"));
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      Pool::delete_pool("test-watch");
+      run_basic_test(allocator_type);
+      Pool::delete_pool("test-watch");
+      run_prefix_tree_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  Pool::delete_pool("test-watch");
+
+  return retcode;
+}
@@ -0,0 +1,535 @@
+#include "WriteAheadLog.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <stdexcept>
+
+#include "FileUtils.hh"
+#include "Hash.hh"
+#include "HashTable.hh"
+#include "PrefixTree.hh"
+
+using namespace std;
+
+namespace sharedstructures {
+
+
+WriteAheadLog::WriteAheadLog(shared_ptr<Allocator> allocator,
+    const string& filename) : allocator(allocator), filename(filename),
+    last_sequence(0) {
+  auto g = this->allocator->lock(true);
+  this->base_offset = this->create_log_base();
+  this->open_file(true);
+}
+
+WriteAheadLog::WriteAheadLog(shared_ptr<Allocator> allocator,
+    uint64_t base_offset, const string& filename) : allocator(allocator),
+    base_offset(base_offset), filename(filename), last_sequence(0) {
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(false);
+    this->base_offset = this->allocator->base_object_offset();
+  }
+
+  bool created = false;
+  if (!this->base_offset) {
+    auto g = this->allocator->lock(true);
+    this->base_offset = this->allocator->base_object_offset();
+    if (!this->base_offset) {
+      this->base_offset = this->create_log_base();
+      this->allocator->set_base_object_offset(this->base_offset);
+      created = true;
+    }
+  }
+
+  this->open_file(created);
+}
+
+
+shared_ptr<Allocator> WriteAheadLog::get_allocator() const {
+  return this->allocator;
+}
+
+uint64_t WriteAheadLog::base() const {
+  return this->base_offset;
+}
+
+const string& WriteAheadLog::get_filename() const {
+  return this->filename;
+}
+
+
+uint64_t WriteAheadLog::append(StructureType structure_type,
+    uint64_t structure_base, Operation op, ValueType value_type, const void* k,
+    size_t k_size, const void* v, size_t v_size) {
+  size_t size = sizeof(RecordHeader) + k_size + v_size;
+  if (size > 0xFFFFFFFF) {
+    throw invalid_argument("record is too large");
+  }
+
+  auto p = this->allocator->get_pool();
+  WriteAheadLogBase* base = p->at<WriteAheadLogBase>(this->base_offset);
+
+  string data(size, '\0');
+  RecordHeader* header = reinterpret_cast<RecordHeader*>(&data[0]);
+  header->size = size;
+  header->sequence = base->next_sequence.load();
+  header->timestamp = now();
+  header->structure_base = structure_base;
+  header->structure_type = structure_type;
+  header->op = op;
+  header->value_type = value_type;
+  header->key_size = k_size;
+  memcpy(&data[sizeof(RecordHeader)], k, k_size);
+  memcpy(&data[sizeof(RecordHeader) + k_size], v, v_size);
+  header->checksum = this->checksum_for_record(header);
+
+  // the record is written before the sequence number is advanced, so a process
+  // that sees the new sequence number and syncs the file also syncs the record
+  uint64_t end_offset = base->end_offset.load();
+  pwrite_all(this->fd, data.data(), data.size(), end_offset, this->filename);
+  base->end_offset.store(end_offset + size);
+  base->next_sequence.store(header->sequence + 1, memory_order_release);
+
+  this->last_sequence = header->sequence;
+  return header->sequence;
+}
+
+
+void WriteAheadLog::commit() {
+  this->commit(this->last_sequence);
+}
+
+void WriteAheadLog::commit(uint64_t sequence) {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  if (p->at<WriteAheadLogBase>(this->base_offset)->synced_sequence.load() >
+      sequence) {
+    return;
+  }
+
+  // only one process syncs at a time. processes that arrive while a sync is in
+  // progress wait here, then find that it covered their records (if their
+  // records were appended before it started), or do the next sync on behalf of
+  // everyone else who's waiting
+  ProcessLockGuard g(p.get(),
+      this->base_offset + offsetof(WriteAheadLogBase, sync_lock));
+  WriteAheadLogBase* base = p->at<WriteAheadLogBase>(this->base_offset);
+  if (base->synced_sequence.load() > sequence) {
+    return;
+  }
+
+  uint64_t target = base->next_sequence.load(memory_order_acquire);
+  sync_file(this->fd, this->filename);
+  base->sync_count++;
+
+  // a checkpoint may have advanced synced_sequence while we were syncing
+  uint64_t current = base->synced_sequence.load();
+  while ((current < target) &&
+      !base->synced_sequence.compare_exchange_weak(current, target));
+}
+
+
+void WriteAheadLog::checkpoint(const string& checkpoint_filename) {
+  string temp_filename = checkpoint_filename + ".tmp";
+
+  auto g = this->allocator->lock(true);
+  auto p = this->allocator->get_pool();
+  uint64_t checkpoint_sequence = p->at<WriteAheadLogBase>(
+      this->base_offset)->next_sequence.load();
+
+  {
+    scoped_fd out_fd = open(temp_filename.c_str(),
+        O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd == -1) {
+      throw cannot_open_file(temp_filename);
+    }
+    pwrite_all(out_fd, p->at<uint8_t>(0), p->size(), 0, temp_filename);
+
+    // the copy is made while we hold the pool's lock, but it shouldn't be
+    // locked when it's restored
+    string zero_lock(sizeof(ProcessReadWriteLock), '\0');
+    pwrite_all(out_fd, zero_lock.data(), zero_lock.size(),
+        this->allocator->lock_offset(), temp_filename);
+    string base_data = this->checkpoint_base_data(checkpoint_sequence);
+    pwrite_all(out_fd, base_data.data(), base_data.size(), this->base_offset,
+        temp_filename);
+
+    sync_file(out_fd, temp_filename);
+  }
+  replace_file(temp_filename, checkpoint_filename);
+
+  this->empty_log(checkpoint_sequence);
+}
+
+void WriteAheadLog::checkpoint(IncrementalCheckpoint& checkpoint, bool full) {
+  if (checkpoint.get_allocator()->get_pool() !=
+      this->allocator->get_pool()) {
+    throw invalid_argument("checkpoint must be for the same pool");
+  }
+
+  auto g = this->allocator->lock(true);
+  uint64_t checkpoint_sequence = this->allocator->get_pool()->at<
+      WriteAheadLogBase>(this->base_offset)->next_sequence.load();
+  checkpoint.write_locked(full, {make_pair(this->base_offset,
+      this->checkpoint_base_data(checkpoint_sequence))});
+  this->empty_log(checkpoint_sequence);
+}
+
+void WriteAheadLog::restore_checkpoint(const string& checkpoint_filename,
+    const string& pool_name) {
+  scoped_fd in_fd = open(checkpoint_filename.c_str(), O_RDONLY);
+  if (in_fd == -1) {
+    throw cannot_open_file(checkpoint_filename);
+  }
+
+  string temp_filename = pool_name + ".tmp";
+  {
+    scoped_fd out_fd = open(temp_filename.c_str(),
+        O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd == -1) {
+      throw cannot_open_file(temp_filename);
+    }
+
+    string buffer(1024 * 1024, '\0');
+    off_t offset = 0;
+    for (;;) {
+      ssize_t bytes_read = read(in_fd, &buffer[0], buffer.size());
+      if (bytes_read < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw runtime_error("can\'t read from " + checkpoint_filename + ": " +
+            string_for_error(errno));
+      }
+      if (bytes_read == 0) {
+        break;
+      }
+      pwrite_all(out_fd, buffer.data(), bytes_read, offset, temp_filename);
+      offset += bytes_read;
+    }
+    sync_file(out_fd, temp_filename);
+  }
+  replace_file(temp_filename, pool_name);
+}
+
+
+void WriteAheadLog::attach_cold_tier(uint64_t tree_base,
+    shared_ptr<PrefixTree> cold_tier) {
+  this->cold_tiers[tree_base] = cold_tier;
+}
+
+size_t WriteAheadLog::replay() {
+  auto p = this->allocator->get_pool();
+  p->check_size_and_remap();
+  uint64_t next_sequence = p->at<WriteAheadLogBase>(
+      this->base_offset)->checkpoint_sequence.load();
+
+  RecordApplier applier(this->allocator);
+  for (const auto& it : this->cold_tiers) {
+    applier.attach_cold_tier(it.first, it.second);
+  }
+  size_t num_applied = 0;
+  uint64_t offset = 0;
+  string data;
+  for (;;) {
+    // stop at the first record that's incomplete or corrupt; it (and
+    // everything after it) was never committed
+    RecordHeader header;
+    if (!pread_all(this->fd, &header, sizeof(header), offset,
+        this->filename)) {
+      break;
+    }
+    if ((header.size < sizeof(RecordHeader)) ||
+        (header.key_size > header.size - sizeof(RecordHeader))) {
+      break;
+    }
+    data.resize(header.size);
+    if (!pread_all(this->fd, &data[0], data.size(), offset, this->filename)) {
+      break;
+    }
+    const RecordHeader* record = reinterpret_cast<const RecordHeader*>(
+        data.data());
+    if (record->checksum != this->checksum_for_record(record)) {
+      break;
+    }
+
+    // records from before the checkpoint are already in the pool. after
+    // those, records must be consecutive
+    if (record->sequence < next_sequence) {
+      offset += record->size;
+      continue;
+    }
+    if (record->sequence != next_sequence) {
+      break;
+    }
+
+    applier.apply(record);
+
+    offset += record->size;
+    next_sequence++;
+    num_applied++;
+  }
+
+  // discard anything after the last valid record, so new records aren't
+  // written after garbage that would stop the next replay
+  if (ftruncate(this->fd, offset)) {
+    throw runtime_error("can\'t truncate " + this->filename + ": " +
+        string_for_error(errno));
+  }
+  sync_file(this->fd, this->filename);
+
+  auto g = this->allocator->lock(true);
+  WriteAheadLogBase* base = p->at<WriteAheadLogBase>(this->base_offset);
+  base->next_sequence.store(next_sequence);
+  base->synced_sequence.store(next_sequence);
+  base->end_offset.store(offset);
+  return num_applied;
+}
+
+
+WriteAheadLog::RecordApplier::RecordApplier(shared_ptr<Allocator> allocator)
+    : allocator(allocator) { }
+
+WriteAheadLog::RecordApplier::~RecordApplier() { }
+
+void WriteAheadLog::RecordApplier::attach_cold_tier(uint64_t tree_base,
+    shared_ptr<PrefixTree> cold_tier) {
+  this->cold_tiers[tree_base] = cold_tier;
+  auto tree_it = this->trees.find(tree_base);
+  if (tree_it != this->trees.end()) {
+    tree_it->second->attach_cold_tier(cold_tier);
+  }
+}
+
+void WriteAheadLog::RecordApplier::apply(const RecordHeader* record,
+    uint64_t sequence_offset) {
+  const uint8_t* k = reinterpret_cast<const uint8_t*>(record) +
+      sizeof(RecordHeader);
+  size_t k_size = record->key_size;
+  const uint8_t* v = k + k_size;
+  size_t v_size = record->size - sizeof(RecordHeader) - k_size;
+  int64_t int_value = 0;
+  double double_value = 0.0;
+  if ((record->value_type == ValueType::Int) && (v_size == sizeof(int64_t))) {
+    memcpy(&int_value, v, sizeof(int64_t));
+  } else if ((record->value_type == ValueType::Double) &&
+      (v_size == sizeof(double))) {
+    memcpy(&double_value, v, sizeof(double));
+  }
+
+  // incrs that failed originally fail again here; they didn't change
+  // anything, so we just skip them
+  try {
+    if (record->structure_type == StructureType::PrefixTree) {
+      auto& tree = this->trees[record->structure_base];
+      if (!tree.get()) {
+        // the log mustn't be appended to while it's replayed, so the tree is
+        // opened without its attachments. this means records applied here
+        // don't update the tree's filter, watch table or expiry index
+        tree.reset(new PrefixTree(this->allocator, record->structure_base));
+        tree->attachments_required = false;
+        auto cold_tier_it = this->cold_tiers.find(record->structure_base);
+        if (cold_tier_it != this->cold_tiers.end()) {
+          tree->attach_cold_tier(cold_tier_it->second);
+        }
+      }
+      tree->applied_sequence_offset = sequence_offset;
+      tree->applied_sequence = record->sequence + 1;
+      switch (record->op) {
+        case Operation::Insert:
+          switch (record->value_type) {
+            case ValueType::String:
+              tree->insert(k, k_size, v, v_size);
+              break;
+            case ValueType::Int:
+              tree->insert(k, k_size, int_value);
+              break;
+            case ValueType::Double:
+              tree->insert(k, k_size, double_value);
+              break;
+            case ValueType::Bool:
+              tree->insert(k, k_size,
+                  (bool)(v_size && *reinterpret_cast<const uint8_t*>(v)));
+              break;
+            case ValueType::Null:
+              tree->insert(k, k_size);
+              break;
+            default:
+              throw runtime_error("log contains insert of unknown type");
+          }
+          break;
+        case Operation::Incr:
+          if (record->value_type == ValueType::Int) {
+            tree->incr(k, k_size, int_value);
+          } else {
+            tree->incr(k, k_size, double_value);
+          }
+          break;
+        case Operation::Erase:
+          tree->erase(k, k_size);
+          break;
+        case Operation::Clear:
+          tree->clear();
+          break;
+        case Operation::MovePrefix:
+          tree->move_prefix(k, k_size, v, v_size);
+          break;
+        case Operation::SwapPrefixes:
+          tree->swap_prefixes(k, k_size, v, v_size);
+          break;
+        case Operation::SetExpiration:
+          tree->set_expiration(k, k_size, (uint64_t)int_value);
+          break;
+        case Operation::DemotePrefix:
+          tree->demote_prefix(k, k_size);
+          break;
+        case Operation::PromotePrefix:
+          tree->promote_prefix(k, k_size);
+          break;
+        default:
+          throw runtime_error("log contains unknown operation");
+      }
+
+    } else if (record->structure_type == StructureType::HashTable) {
+      auto& table = this->tables[record->structure_base];
+      if (!table.get()) {
+        // cache-mode evictions were logged as erases, so the table mustn't
+        // evict anything on its own while the log is applied
+        table.reset(new HashTable(this->allocator, record->structure_base,
+            0));
+        table->set_eviction_enabled(false);
+      }
+      table->applied_sequence_offset = sequence_offset;
+      table->applied_sequence = record->sequence + 1;
+      switch (record->op) {
+        case Operation::Insert:
+          table->insert(k, k_size, v, v_size);
+          break;
+        case Operation::Incr:
+          if (record->value_type == ValueType::Int) {
+            table->incr(k, k_size, int_value);
+          } else {
+            table->incr(k, k_size, double_value);
+          }
+          break;
+        case Operation::Erase:
+          table->erase(k, k_size);
+          break;
+        case Operation::Clear:
+          table->clear();
+          break;
+        default:
+          throw runtime_error("log contains unknown operation");
+      }
+
+    } else {
+      throw runtime_error("log contains unknown structure type");
+    }
+  } catch (const out_of_range& e) {
+    if (record->op != Operation::Incr) {
+      throw;
+    }
+  }
+}
+
+
+uint64_t WriteAheadLog::next_sequence() const {
+  return this->allocator->get_pool()->at<WriteAheadLogBase>(
+      this->base_offset)->next_sequence.load();
+}
+
+uint64_t WriteAheadLog::synced_sequence() const {
+  return this->allocator->get_pool()->at<WriteAheadLogBase>(
+      this->base_offset)->synced_sequence.load();
+}
+
+uint64_t WriteAheadLog::checkpoint_sequence() const {
+  return this->allocator->get_pool()->at<WriteAheadLogBase>(
+      this->base_offset)->checkpoint_sequence.load();
+}
+
+uint64_t WriteAheadLog::log_size() const {
+  return this->allocator->get_pool()->at<WriteAheadLogBase>(
+      this->base_offset)->end_offset.load();
+}
+
+uint64_t WriteAheadLog::sync_count() const {
+  return this->allocator->get_pool()->at<WriteAheadLogBase>(
+      this->base_offset)->sync_count.load();
+}
+
+
+uint64_t WriteAheadLog::create_log_base() {
+  auto p = this->allocator->get_pool();
+
+  uint64_t base_offset = this->allocator->allocate(sizeof(WriteAheadLogBase));
+  WriteAheadLogBase* base = p->at<WriteAheadLogBase>(base_offset);
+  base->sync_lock.lock = 0;
+  // sequence numbers start at 1, so commit() returns immediately for objects
+  // that haven't appended anything
+  base->next_sequence = 1;
+  base->synced_sequence = 1;
+  base->checkpoint_sequence = 1;
+  base->end_offset = 0;
+  base->sync_count = 0;
+
+  return base_offset;
+}
+
+void WriteAheadLog::open_file(bool truncate) {
+  this->fd = open(this->filename.c_str(),
+      O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0666);
+  if (this->fd == -1) {
+    throw cannot_open_file(this->filename);
+  }
+}
+
+
+string WriteAheadLog::checkpoint_base_data(uint64_t checkpoint_sequence) const {
+  // the checkpoint's log state should be as it will be after the log is emptied
+  auto p = this->allocator->get_pool();
+  string data(reinterpret_cast<const char*>(
+      p->at<WriteAheadLogBase>(this->base_offset)), sizeof(WriteAheadLogBase));
+  WriteAheadLogBase* base = reinterpret_cast<WriteAheadLogBase*>(&data[0]);
+  base->sync_lock.lock.store(0);
+  base->synced_sequence.store(checkpoint_sequence);
+  base->checkpoint_sequence.store(checkpoint_sequence);
+  base->end_offset.store(0);
+  return data;
+}
+
+void WriteAheadLog::empty_log(uint64_t checkpoint_sequence) {
+  // the checkpoint contains every record in the log, so we can empty it. if we
+  // crash before the log is emptied, replay skips the records since they're
+  // older than the checkpoint
+  if (ftruncate(this->fd, 0)) {
+    throw runtime_error("can\'t truncate " + this->filename + ": " +
+        string_for_error(errno));
+  }
+  sync_file(this->fd, this->filename);
+
+  WriteAheadLogBase* base = this->allocator->get_pool()->at<WriteAheadLogBase>(
+      this->base_offset);
+  base->checkpoint_sequence.store(checkpoint_sequence);
+  base->end_offset.store(0);
+  uint64_t current = base->synced_sequence.load();
+  while ((current < checkpoint_sequence) &&
+      !base->synced_sequence.compare_exchange_weak(current,
+          checkpoint_sequence));
+}
+
+
+uint32_t WriteAheadLog::checksum_for_record(const RecordHeader* header) {
+  uint64_t hash = fnv1a64(&header->sequence,
+      header->size - offsetof(RecordHeader, sequence));
+  return hash ^ (hash >> 32);
+}
+
+} // namespace sharedstructures
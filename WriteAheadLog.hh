@@ -0,0 +1,233 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "Allocator.hh"
+#include "IncrementalCheckpoint.hh"
+#include "ProcessLock.hh"
+
+namespace sharedstructures {
+
+class HashTable;
+class PrefixTree;
+
+
+// WriteAheadLog makes changes to file-backed pools durable without syncing the
+// pool itself. it's a sequential file of logical mutations (inserts, incrs,
+// erases and clears) made to PrefixTrees and HashTables in a pool, along with a
+// small header in the pool that tracks the log's state. a structure with an
+// attached log appends a record for each change while the pool is locked, so
+// the records are in the same order as the changes. appending only writes to
+// the page cache; commit() makes records durable.
+//
+// commit() uses group commit: the process that syncs the log file syncs
+// everything appended so far, so processes that commit at the same time share
+// a single fdatasync. a process that finds a sync in progress waits for it to
+// finish, and returns without syncing if it covered its records.
+//
+// checkpoint() writes a consistent copy of the pool to a checkpoint file and
+// empties the log. to recover after a crash, restore the checkpoint with
+// restore_checkpoint(), open the restored pool and the log, and call replay(),
+// which applies all the committed records made after the checkpoint. replay
+// stops at the first incomplete or corrupt record, so a crash in the middle of
+// an append loses only uncommitted records. creating a structure isn't logged,
+// so only structures that existed at the last checkpoint can be recovered;
+// after creating a new structure, call checkpoint() before relying on the log.
+//
+// records are logged after a change's checks pass but before it's made, so a
+// change that fails partway through (e.g. because the pool can't be expanded)
+// may be applied during replay anyway. incrs against keys of the wrong type
+// fail the same way during replay, so they're skipped.
+//
+// a PrefixTree's cold tier is in another pool, which this log doesn't cover;
+// replay repeats the changes the tree made to it (including demotions and
+// promotions), so it needs the cold tier attached with attach_cold_tier(), and
+// the cold tier's pool must be restored to the state it was in when this
+// pool's checkpoint was made. replay doesn't update a PrefixTree's other
+// attached structures (its filter, watch table or expiry index), even though
+// the tree records that they're attached; after replaying, attach the tree's
+// filter again with populate = true so it contains the replayed keys.
+
+class WriteAheadLog {
+public:
+  WriteAheadLog() = delete;
+  WriteAheadLog(const WriteAheadLog&) = delete;
+  WriteAheadLog(WriteAheadLog&&) = delete;
+
+  // create constructor - allocates the log's state in the pool and creates (or
+  // truncates) the log file.
+  WriteAheadLog(std::shared_ptr<Allocator> allocator,
+      const std::string& filename);
+  // (conditional) create constructor.
+  // opens an existing WriteAheadLog using the given allocator. if base_offset
+  // is 0, opens the log at the allocator's base offset. if the allocator's base
+  // offset is also 0, creates a new log and sets the allocator's base offset to
+  // the new log's base offset. every process must open the same filename.
+  WriteAheadLog(std::shared_ptr<Allocator> allocator, uint64_t base_offset,
+      const std::string& filename);
+  ~WriteAheadLog() = default;
+
+  // returns the allocator for this log
+  std::shared_ptr<Allocator> get_allocator() const;
+  // returns the base offset for this log
+  uint64_t base() const;
+  // returns the log file's name
+  const std::string& get_filename() const;
+
+  enum class StructureType : uint8_t {
+    PrefixTree = 0,
+    HashTable  = 1,
+  };
+
+  enum class Operation : uint8_t {
+    Insert = 0,
+    Incr   = 1,
+    Erase  = 2,
+    Clear  = 3,
+    // for these, the key is the source prefix and the value (a String) is the
+    // destination prefix. they're only logged by PrefixTree.
+    MovePrefix   = 4,
+    SwapPrefixes = 5,
+    // the value (an Int) is the key's new expiration time. only logged by
+    // PrefixTree.
+    SetExpiration = 6,
+    // the key is the prefix, and there's no value. only logged by PrefixTree.
+    DemotePrefix  = 7,
+    PromotePrefix = 8,
+  };
+
+  // the format of a record's value. Int and Double values are 8 bytes, Bool
+  // values are 1 byte, and None and Null values are empty.
+  enum class ValueType : uint8_t {
+    None   = 0, // for erase and clear
+    String = 1,
+    Int    = 2,
+    Double = 3,
+    Bool   = 4,
+    Null   = 5,
+  };
+
+  // appends a record to the log and returns its sequence number. the pool must
+  // be locked for writing. PrefixTree and HashTable call this for you when the
+  // log is attached to them.
+  uint64_t append(StructureType structure_type, uint64_t structure_base,
+      Operation op, ValueType value_type, const void* k, size_t k_size,
+      const void* v, size_t v_size);
+
+  // blocks until all records appended through this object (or all records up
+  // to the given sequence number) are durable. the pool must not be locked.
+  void commit();
+  void commit(uint64_t sequence);
+
+  // writes a copy of the pool to the given file (replacing it atomically), then
+  // empties the log. locks the pool for writing while copying.
+  void checkpoint(const std::string& checkpoint_filename);
+  // same as above, but writes the copy as part of an incremental checkpoint
+  // chain, so only the pages changed since the last checkpoint are written.
+  // the checkpoint must be for this log's pool. restore the chain with
+  // IncrementalCheckpoint::restore() before calling replay().
+  void checkpoint(IncrementalCheckpoint& checkpoint, bool full = false);
+
+  // replaces a file-backed pool with a checkpoint. no process may have the pool
+  // open while this is called.
+  static void restore_checkpoint(const std::string& checkpoint_filename,
+      const std::string& pool_name);
+
+  // applies the log's records that were made after the checkpoint the pool was
+  // restored from, then discards any incomplete records at the end of the log.
+  // returns the number of records applied. no other process may use the pool
+  // while this is called.
+  size_t replay();
+
+  // attaches a cold tier to the PrefixTree at tree_base while replay() applies
+  // its records. this is required if the tree has demoted prefixes or the log
+  // demotes any; otherwise replay() throws when it reaches a record that needs
+  // the cold tier.
+  void attach_cold_tier(uint64_t tree_base,
+      std::shared_ptr<PrefixTree> cold_tier);
+
+  // inspection methods.
+  uint64_t next_sequence() const; // sequence number of the next record
+  uint64_t synced_sequence() const; // all records before this are durable
+  uint64_t checkpoint_sequence() const; // records before this are checkpointed
+  uint64_t log_size() const; // bytes in the log file
+  uint64_t sync_count() const; // fdatasync calls since the log was created
+
+private:
+  std::shared_ptr<Allocator> allocator;
+  uint64_t base_offset;
+  std::string filename;
+  scoped_fd fd;
+
+  // the sequence number of the last record appended through this object
+  uint64_t last_sequence;
+
+  // cold tiers for replay(), by tree base offset
+  std::map<uint64_t, std::shared_ptr<PrefixTree>> cold_tiers;
+
+  struct WriteAheadLogBase {
+    // held by the process that's syncing the log file
+    ProcessLock sync_lock;
+
+    // these are only modified while the pool is locked for writing, except
+    // synced_sequence and sync_count, which are modified by the process
+    // holding sync_lock
+    std::atomic<uint64_t> next_sequence;
+    std::atomic<uint64_t> synced_sequence;
+    std::atomic<uint64_t> checkpoint_sequence;
+    std::atomic<uint64_t> end_offset;
+    std::atomic<uint64_t> sync_count;
+  };
+
+  struct RecordHeader {
+    // the checksum covers everything after this field, including the key and
+    // value. size is the size of the entire record, including this header.
+    uint32_t checksum;
+    uint32_t size;
+    uint64_t sequence;
+    uint64_t timestamp; // when the record was appended (usecs since epoch)
+    uint64_t structure_base;
+    StructureType structure_type;
+    Operation op;
+    ValueType value_type;
+    uint8_t unused;
+    uint32_t key_size;
+  };
+
+  // applies records to the structures they refer to, opening each structure
+  // the first time it's used. used by replay() and Replica.
+  class RecordApplier {
+  public:
+    explicit RecordApplier(std::shared_ptr<Allocator> allocator);
+    ~RecordApplier();
+
+    void attach_cold_tier(uint64_t tree_base,
+        std::shared_ptr<PrefixTree> cold_tier);
+    // if sequence_offset isn't 0, the std::atomic<uint64_t> at that offset is
+    // set to the record's sequence + 1 while the structure's pool is locked
+    // for the change, so the change and the new position are visible
+    // together. records that don't change anything don't set it.
+    void apply(const RecordHeader* record, uint64_t sequence_offset = 0);
+
+  private:
+    std::shared_ptr<Allocator> allocator;
+    std::map<uint64_t, std::shared_ptr<PrefixTree>> cold_tiers;
+    std::map<uint64_t, std::unique_ptr<PrefixTree>> trees;
+    std::map<uint64_t, std::unique_ptr<HashTable>> tables;
+  };
+  friend class Replica;
+
+  uint64_t create_log_base();
+  std::string checkpoint_base_data(uint64_t checkpoint_sequence) const;
+  void empty_log(uint64_t checkpoint_sequence);
+  void open_file(bool truncate);
+
+  static uint32_t checksum_for_record(const RecordHeader* header);
+};
+
+} // namespace sharedstructures
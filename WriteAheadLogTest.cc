@@ -0,0 +1,415 @@
+#define __STDC_FORMAT_MACROS
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <map>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/UnitTest.hh>
+#include <string>
+
+#include "Pool.hh"
+#include "SimpleAllocator.hh"
+#include "LogarithmicAllocator.hh"
+#include "HashTable.hh"
+#include "PrefixTree.hh"
+#include "WriteAheadLog.hh"
+#include "TestUtils.hh"
+
+using namespace std;
+using namespace sharedstructures;
+
+
+shared_ptr<Allocator> create_allocator(shared_ptr<Pool> pool,
+    const string& allocator_type) {
+  if (allocator_type == "simple") {
+    return shared_ptr<Allocator>(new SimpleAllocator(pool));
+  }
+  if (allocator_type == "logarithmic") {
+    return shared_ptr<Allocator>(new LogarithmicAllocator(pool));
+  }
+  throw invalid_argument("unknown allocator type: " + allocator_type);
+}
+
+void delete_files() {
+  Pool::delete_pool("test-wal");
+  Pool::delete_pool("test-wal-restored");
+  Pool::delete_pool("test-wal-cold");
+  Pool::delete_pool("test-wal-cold-restored");
+  unlink("test-wal.log");
+  unlink("test-wal.checkpoint");
+}
+
+
+void run_basic_test(const string& allocator_type) {
+  printf("-- [%s] basic\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-wal"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  shared_ptr<WriteAheadLog> wal(new WriteAheadLog(alloc, "test-wal.log"));
+  PrefixTree tree(alloc);
+  PrefixTree cleared_tree(alloc);
+  HashTable table(alloc, 6);
+  tree.attach_write_ahead_log(wal);
+  cleared_tree.attach_write_ahead_log(wal);
+  table.attach_write_ahead_log(wal);
+  expect_eq(wal, tree.get_write_ahead_log());
+  expect_eq(wal, table.get_write_ahead_log());
+
+  // the log must be in the same pool as the structure
+  {
+    shared_ptr<Pool> other_pool(new Pool("test-wal-restored"));
+    shared_ptr<Allocator> other_alloc = create_allocator(other_pool,
+        allocator_type);
+    PrefixTree other_tree(other_alloc);
+    try {
+      other_tree.attach_write_ahead_log(wal);
+      expect(false);
+    } catch (const invalid_argument& e) { }
+  }
+  Pool::delete_pool("test-wal-restored");
+
+  expect_eq(1, wal->next_sequence());
+  expect_eq(1, wal->synced_sequence());
+  expect_eq(0, wal->log_size());
+
+  // changes are appended, but aren't synced until commit()
+  tree.insert(string("short"), string("abc"));
+  tree.insert(string("long"), string("this value has its own buffer"));
+  tree.insert(string("int"), (int64_t)7);
+  table.insert(string("table-key"), string("table-value"));
+  expect_eq(5, wal->next_sequence());
+  expect_eq(1, wal->synced_sequence());
+  expect_lt(0, wal->log_size());
+  wal->commit();
+  expect_eq(5, wal->synced_sequence());
+  expect_eq(1, wal->sync_count());
+
+  // committing again doesn't sync, since there's nothing new
+  wal->commit();
+  expect_eq(1, wal->sync_count());
+
+  // changes that don't happen aren't logged
+  PrefixTree::CheckRequest check("short", 5, string("xyz"));
+  expect_eq(false, tree.insert(string("short"), string("def"), &check));
+  expect_eq(false, tree.erase("missing"));
+  expect_eq(false, table.erase("missing"));
+  expect_eq(5, wal->next_sequence());
+
+  // the checkpoint contains everything so far, so the log is emptied
+  wal->checkpoint("test-wal.checkpoint");
+  expect_eq(5, wal->checkpoint_sequence());
+  expect_eq(5, wal->synced_sequence());
+  expect_eq(0, wal->log_size());
+  auto checkpoint_tree_contents = tree_contents(tree);
+  auto checkpoint_table_contents = table_contents(table);
+
+  // make one change of every kind after the checkpoint
+  tree.insert(string("short"), string("def"));
+  tree.insert(string("long-int"), (int64_t)0x7FFFFFFFFFFFFFFF);
+  tree.insert(string("double"), 2.5);
+  tree.insert(string("bool"), true);
+  tree.insert(string("null"));
+  struct iovec iov[2] = {{(void*)"hello ", 6}, {(void*)"world", 5}};
+  tree.insert(string("iov"), iov, 2);
+  expect_eq(8, tree.incr("int", (int64_t)1));
+  expect_eq(1.0, tree.incr("float-counter", 1.0));
+  try {
+    tree.incr("short", (int64_t)1);
+    expect(false);
+  } catch (const out_of_range& e) { }
+  expect_eq(true, tree.erase("long"));
+  tree.insert(string("staging/a"), (int64_t)1);
+  tree.insert(string("staging/b"), string("staged"));
+  expect_eq(true, tree.move_prefix(string("staging/"), string("live/")));
+  expect_eq(true, tree.swap_prefixes(string("live/"), string("previous/")));
+  tree.insert(string("expiring"), string("later"));
+  expect_eq(true, tree.set_expiration(string("expiring"), 4000000000000000));
+  tree.insert(string("expired"), string("already"));
+  expect_eq(true, tree.set_expiration(string("expired"), 1));
+  table.insert(string("table-key2"), string("table-value2"));
+  expect_eq(3, table.incr("table-counter", (int64_t)3));
+  expect_eq(true, table.erase("table-key"));
+  wal->commit();
+
+  cleared_tree.insert(string("key"), string("value"));
+  cleared_tree.clear();
+  cleared_tree.insert(string("key2"), string("value2"));
+  wal->commit();
+  uint64_t next_sequence = wal->next_sequence();
+  expect_eq(next_sequence, wal->synced_sequence());
+
+  // a crash in the middle of an append leaves an incomplete record at the end
+  // of the log
+  {
+    scoped_fd fd = open("test-wal.log", O_WRONLY | O_APPEND);
+    expect_ne(-1, fd);
+    expect_eq(20, write(fd, "incomplete record...", 20));
+  }
+
+  // restore the checkpoint to another pool and replay the log onto it
+  WriteAheadLog::restore_checkpoint("test-wal.checkpoint", "test-wal-restored");
+  shared_ptr<Pool> restored_pool(new Pool("test-wal-restored"));
+  shared_ptr<Allocator> restored_alloc = create_allocator(restored_pool,
+      allocator_type);
+  shared_ptr<WriteAheadLog> restored_wal(new WriteAheadLog(restored_alloc,
+      wal->base(), "test-wal.log"));
+  PrefixTree restored_tree(restored_alloc, tree.base());
+  HashTable restored_table(restored_alloc, table.base(), 0);
+  PrefixTree restored_cleared_tree(restored_alloc, cleared_tree.base());
+  expect_eq(checkpoint_tree_contents, tree_contents(restored_tree));
+  expect_eq(checkpoint_table_contents, table_contents(restored_table));
+
+  // the failed incr is replayed (and fails again), but the failed check isn't
+  expect_eq(next_sequence - 5, restored_wal->replay());
+  expect_eq(tree_contents(tree), tree_contents(restored_tree));
+  expect_eq(table_contents(table), table_contents(restored_table));
+  expect_eq(tree_contents(cleared_tree), tree_contents(restored_cleared_tree));
+  expect_eq(PrefixTree::LookupResult("hello world"), restored_tree.at("iov"));
+  expect_eq(4000000000000000, restored_tree.expiration("expiring"));
+  expect_eq(false, restored_tree.exists("expired"));
+
+  // the incomplete record is discarded, so new records can be appended
+  expect_eq(next_sequence, restored_wal->next_sequence());
+  struct stat st;
+  expect_eq(0, stat("test-wal.log", &st));
+  expect_eq(restored_wal->log_size(), st.st_size);
+  restored_tree.attach_write_ahead_log(restored_wal);
+  restored_tree.insert(string("after-replay"), (int64_t)1);
+  restored_wal->commit();
+  expect_eq(next_sequence + 1, restored_wal->synced_sequence());
+}
+
+
+void run_group_commit_test(const string& allocator_type) {
+  printf("-- [%s] group commit\n", allocator_type.c_str());
+
+  uint64_t wal_base;
+  uint64_t tree_base;
+  {
+    shared_ptr<Pool> pool(new Pool("test-wal"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    WriteAheadLog wal(alloc, "test-wal.log");
+    PrefixTree tree(alloc);
+    wal.checkpoint("test-wal.checkpoint");
+    wal_base = wal.base();
+    tree_base = tree.base();
+  }
+
+  // each child commits after every insert; concurrent commits share syncs
+  const size_t num_children = 8;
+  const size_t num_inserts = 100;
+  unordered_set<pid_t> child_pids;
+  size_t child_index = 0;
+  while ((child_pids.size() < num_children) && !child_pids.count(0)) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      break;
+    } else {
+      child_pids.emplace(pid);
+      if (pid) {
+        child_index++;
+      }
+    }
+  }
+
+  if (child_pids.count(0)) {
+    shared_ptr<Pool> pool(new Pool("test-wal"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    shared_ptr<WriteAheadLog> wal(new WriteAheadLog(alloc, wal_base,
+        "test-wal.log"));
+    PrefixTree tree(alloc, tree_base);
+    tree.attach_write_ahead_log(wal);
+    for (size_t x = 0; x < num_inserts; x++) {
+      tree.insert(string_printf("%zu-%zu", child_index, x), (int64_t)x);
+      wal->commit();
+    }
+    _exit(0);
+
+  } else {
+    int num_failures = 0;
+    int exit_status;
+    pid_t exited_pid;
+    while ((exited_pid = wait(&exit_status)) != -1) {
+      child_pids.erase(exited_pid);
+      if (!WIFEXITED(exit_status) || (WEXITSTATUS(exit_status) != 0)) {
+        printf("-- [%s]   child %d failed (%d)\n", allocator_type.c_str(),
+            exited_pid, exit_status);
+        num_failures++;
+      }
+    }
+    expect_eq(true, child_pids.empty());
+    expect_eq(0, num_failures);
+
+    shared_ptr<Pool> pool(new Pool("test-wal"));
+    shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+    WriteAheadLog wal(alloc, wal_base, "test-wal.log");
+    PrefixTree tree(alloc, tree_base);
+    expect_eq(num_children * num_inserts, tree.size());
+    expect_eq(num_children * num_inserts + 1, wal.next_sequence());
+    expect_eq(wal.next_sequence(), wal.synced_sequence());
+    expect_le(wal.sync_count(), num_children * num_inserts);
+    printf("-- [%s]   %zu commits used %" PRIu64 " syncs\n",
+        allocator_type.c_str(), num_children * num_inserts, wal.sync_count());
+
+    // all the children's inserts are recovered
+    WriteAheadLog::restore_checkpoint("test-wal.checkpoint",
+        "test-wal-restored");
+    shared_ptr<Pool> restored_pool(new Pool("test-wal-restored"));
+    shared_ptr<Allocator> restored_alloc = create_allocator(restored_pool,
+        allocator_type);
+    WriteAheadLog restored_wal(restored_alloc, wal_base, "test-wal.log");
+    PrefixTree restored_tree(restored_alloc, tree_base);
+    expect_eq(0, restored_tree.size());
+    expect_eq(num_children * num_inserts, restored_wal.replay());
+    expect_eq(tree_contents(tree), tree_contents(restored_tree));
+  }
+}
+
+
+void run_cache_replay_test(const string& allocator_type) {
+  printf("-- [%s] cache replay\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-wal"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  shared_ptr<WriteAheadLog> wal(new WriteAheadLog(alloc, "test-wal.log"));
+  HashTable table(alloc, 6);
+  table.attach_write_ahead_log(wal);
+  table.set_cache_budget(5000);
+  wal->checkpoint("test-wal.checkpoint");
+
+  // values are 92 bytes, so each pair uses 100 bytes of the budget. the hot
+  // keys are read after every insert, so they survive while the others are
+  // evicted
+  string value(92, 'v');
+  for (size_t x = 0; x < 500; x++) {
+    table.insert(string_printf("key%05zu", x), value);
+    for (size_t y = 0; (y < 10) && (y <= x); y++) {
+      table.at(string_printf("key%05zu", y));
+    }
+  }
+  wal->commit();
+  expect_lt(0, table.eviction_count());
+  expect_le(table.cache_bytes(), 5000);
+
+  // the restored table's reference bits come from the checkpoint, and reading
+  // keys in it doesn't affect what's evicted during replay: only the logged
+  // evictions are replayed, so the result matches the original
+  WriteAheadLog::restore_checkpoint("test-wal.checkpoint", "test-wal-restored");
+  shared_ptr<Pool> restored_pool(new Pool("test-wal-restored"));
+  shared_ptr<Allocator> restored_alloc = create_allocator(restored_pool,
+      allocator_type);
+  WriteAheadLog restored_wal(restored_alloc, wal->base(), "test-wal.log");
+  HashTable restored_table(restored_alloc, table.base(), 0);
+  expect_eq(0, restored_table.size());
+  expect_lt(0, restored_wal.replay());
+  expect_eq(table_contents(table), table_contents(restored_table));
+  expect_eq(table.cache_bytes(), restored_table.cache_bytes());
+}
+
+void run_cold_tier_replay_test(const string& allocator_type) {
+  printf("-- [%s] cold tier replay\n", allocator_type.c_str());
+
+  shared_ptr<Pool> pool(new Pool("test-wal"));
+  shared_ptr<Allocator> alloc = create_allocator(pool, allocator_type);
+  shared_ptr<WriteAheadLog> wal(new WriteAheadLog(alloc, "test-wal.log"));
+  shared_ptr<Pool> cold_pool(new Pool("test-wal-cold"));
+  shared_ptr<Allocator> cold_alloc = create_allocator(cold_pool,
+      allocator_type);
+  shared_ptr<PrefixTree> cold_tier(new PrefixTree(cold_alloc));
+  PrefixTree tree(alloc);
+  tree.attach_write_ahead_log(wal);
+  tree.attach_cold_tier(cold_tier);
+
+  // the cold tier is snapshotted along with the checkpoint
+  tree.insert("user:0:a", "zero");
+  tree.insert("user:1:a", "one");
+  tree.insert(string("user:1:b"), (int64_t)1);
+  tree.insert("user:2:a", "two");
+  tree.insert("other", "value");
+  expect_eq(1, tree.demote_prefix("user:0:"));
+  wal->checkpoint("test-wal.checkpoint");
+  cold_alloc->clone_to("test-wal-cold-restored");
+
+  tree.insert("user:0:b", "zero");
+  expect_eq(2, tree.demote_prefix("user:1:"));
+  expect_eq(2, tree.incr(string("user:1:b"), (int64_t)1));
+  tree.insert("user:1:c", "one");
+  expect_eq(1, tree.demote_prefix("user:2:"));
+  expect_eq(1, tree.promote_prefix("user:2:"));
+  tree.erase("user:0:a");
+  wal->commit();
+
+  auto expected = tree_contents(tree);
+  expect_eq(6, expected.size());
+  expect_eq(4, cold_tier->size());
+
+  // replaying with the restored cold tier attached produces the same tiers
+  WriteAheadLog::restore_checkpoint("test-wal.checkpoint", "test-wal-restored");
+  {
+    shared_ptr<Pool> restored_pool(new Pool("test-wal-restored"));
+    shared_ptr<Allocator> restored_alloc = create_allocator(restored_pool,
+        allocator_type);
+    shared_ptr<Pool> restored_cold_pool(new Pool("test-wal-cold-restored"));
+    shared_ptr<PrefixTree> restored_cold_tier(new PrefixTree(
+        create_allocator(restored_cold_pool, allocator_type), cold_tier->base()));
+    WriteAheadLog restored_wal(restored_alloc, wal->base(), "test-wal.log");
+    restored_wal.attach_cold_tier(tree.base(), restored_cold_tier);
+    expect_eq(7, restored_wal.replay());
+
+    PrefixTree restored_tree(restored_alloc, tree.base());
+    restored_tree.attach_cold_tier(restored_cold_tier);
+    expect_eq(expected, tree_contents(restored_tree));
+    expect_eq(tree_contents(*cold_tier), tree_contents(*restored_cold_tier));
+    expect_eq(6, restored_tree.size());
+  }
+
+  // without the cold tier, replay fails instead of losing the demoted keys
+  WriteAheadLog::restore_checkpoint("test-wal.checkpoint", "test-wal-restored");
+  {
+    shared_ptr<Pool> restored_pool(new Pool("test-wal-restored"));
+    shared_ptr<Allocator> restored_alloc = create_allocator(restored_pool,
+        allocator_type);
+    WriteAheadLog restored_wal(restored_alloc, wal->base(), "test-wal.log");
+    try {
+      restored_wal.replay();
+      expect(false);
+    } catch (const runtime_error& e) { }
+  }
+}
+
+
+int main(int argc, char* argv[]) {
+  int retcode = 0;
+
+  vector<string> allocator_types({"simple", "logarithmic"});
+  try {
+    for (const string& allocator_type : allocator_types) {
+      delete_files();
+      run_basic_test(allocator_type);
+      delete_files();
+      run_group_commit_test(allocator_type);
+      delete_files();
+      run_cache_replay_test(allocator_type);
+      delete_files();
+      run_cold_tier_replay_test(allocator_type);
+    }
+    printf("all tests passed\n");
+
+  } catch (const exception& e) {
+    printf("failure: %s\n", e.what());
+    retcode = 1;
+  }
+  delete_files();
+
+  return retcode;
+}